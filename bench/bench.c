@@ -0,0 +1,728 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "synth.h"
+#include "libigdo/claim.h"
+#include "libigdo/decompress.h"
+#include "libigdo/jigdo.h"
+#include "libigdo/jigdo-md5.h"
+#include "libigdo/jigdo-template.h"
+#include "libigdo/metrics.h"
+#include "libigdo/util.h"
+
+/**
+ * @brief Default seconds each benchmark is run for, at least
+ */
+#define defaultMinTime 1.0
+
+/**
+ * @brief Most threads the claim benchmark defaults to
+ */
+#define maxDefaultThreads 8
+
+/**
+ * @brief Parts listed in the synthetic .jigdo and .template files
+ */
+#define tableParts 100000
+
+/**
+ * @brief Size of the buffers which are decompressed and hashed
+ */
+#define bufferSize (1 << 20)
+
+/**
+ * @brief Size of the file hashed by md5Fd()
+ */
+#define fileSize (64 << 20)
+
+/**
+ * @brief Number of distinct checksums decoded by deBase64MD5Sum()
+ */
+#define numSums 1024
+
+/**
+ * @brief Settings shared by all of the benchmarks
+ */
+typedef struct {
+    double minTime;           ///< Seconds each benchmark runs for, at least
+    int threads;              ///< Threads contending for claims
+    char * const *filters;    ///< Only benchmarks whose names contain one of
+                              ///< these are run, unless there are none
+    int numFilters;           ///< Number of elements in @c filters
+    char *dir;                ///< Scratch directory for files
+    char *jigdoPath;          ///< Synthetic .jigdo file, once written
+    char *templatePath;       ///< Synthetic .template file, once written
+} benchOptions;
+
+/**
+ * @brief Run an operation @p iterations times on @p ctx
+ *
+ * @return @c true on success; @c false if the operation failed
+ */
+typedef bool (*benchFunc)(void *ctx, uint64_t iterations);
+
+/*
+ * @brief print a usage message and exit
+ */
+static void usage(const char *progName)
+{
+    fprintf(stderr,
+            "Usage: %s [-t seconds] [-j threads] [benchmark ...]\n\n"
+            "Run microbenchmarks of libigdo, printing a JSON object for\n"
+            "each on its own line. Only the benchmarks whose names contain\n"
+            "one of the given strings are run, if any are given.\n\n"
+            "-t | --time:     seconds to run each benchmark for, at least,\n"
+            "                 default: %g\n\n"
+            "-j | --threads:  threads contending for claims, default: the\n"
+            "                 number of CPUs, up to %d\n",
+            progName, defaultMinTime, maxDefaultThreads);
+    exit(1);
+}
+
+/**
+ * @brief Check whether the benchmark named @p name was asked for
+ */
+static bool selected(const benchOptions *opts, const char *name)
+{
+    int i;
+
+    for (i = 0; i < opts->numFilters; i++) {
+        if (strstr(name, opts->filters[i])) {
+            return true;
+        }
+    }
+
+    return opts->numFilters == 0;
+}
+
+/**
+ * @brief Time @p run on @p ctx, with as many iterations as it takes to run
+ *        for opts->minTime, and print the result
+ *
+ * @param param What the benchmark was run on, e.g. the size of a buffer
+ * @param bytes Bytes processed by each iteration, or 0 if throughput doesn't
+ *              apply
+ * @param items Items, e.g. parts, processed by each iteration, or 0
+ *
+ * @return @c true on success; @c false if @p run failed
+ */
+static bool measure(const benchOptions *opts, const char *name,
+                    const char *param, uint64_t bytes, uint64_t items,
+                    benchFunc run, void *ctx)
+{
+    uint64_t iterations = 1, start, ns;
+    double target = opts->minTime * 1e9, perOp;
+
+    /* Warm up the caches and the allocator */
+    if (!run(ctx, 1)) {
+        return false;
+    }
+
+    while (true) {
+        uint64_t more;
+
+        start = metricsNow();
+        if (!run(ctx, iterations)) {
+            return false;
+        }
+        ns = metricsNow() - start;
+
+        if (ns >= target) {
+            break;
+        }
+
+        /* Aim a little past the target, growing at least twofold */
+        more = ns > 0 ? iterations * (target * 1.2 / ns) : iterations * 100;
+        iterations = more > 2 * iterations ? more : 2 * iterations;
+    }
+
+    perOp = (double) ns / iterations;
+
+    printf("{\"benchmark\": ");
+    writeJSONString(stdout, name);
+    printf(", \"param\": ");
+    writeJSONString(stdout, param);
+    printf(", \"iterations\": %"PRIu64", \"ns_per_op\": %.3f", iterations,
+           perOp);
+    if (items > 0) {
+        printf(", \"ns_per_item\": %.3f", perOp / items);
+    }
+    if (bytes > 0) {
+        printf(", \"gb_per_s\": %.6f", bytes / perOp);
+    }
+    printf("}\n");
+    fflush(stdout);
+
+    return true;
+}
+
+/**
+ * @brief Write the synthetic .jigdo and .template files, unless they were
+ *        written for another benchmark already
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeTables(benchOptions *opts)
+{
+    synthSpec spec = {
+        .numParts = tableParts,
+        .minSize = 512,
+        .maxSize = 4096,
+        .dataFraction = 0.05,
+        .dupRate = 0.01,
+        .compression = COMPRESSED_DATA_ZLIB,
+        .chunkSize = bufferSize,
+        .seed = 1,
+    };
+    synthImage *image;
+    FILE *fp = NULL;
+    bool ret = false;
+
+    if (opts->jigdoPath) {
+        return true;
+    }
+
+    opts->jigdoPath = dircat(opts->dir, "bench.jigdo");
+    opts->templatePath = dircat(opts->dir, "bench.template");
+    image = synthPlan(&spec);
+    if (!opts->jigdoPath || !opts->templatePath || !image) {
+        goto done;
+    }
+
+    fp = fopen(opts->templatePath, "w");
+    if (!fp || !synthWriteTemplate(image, fp) || fclose(fp) != 0) {
+        goto done;
+    }
+
+    fp = fopen(opts->jigdoPath, "w");
+    if (!fp || !synthWriteJigdo(image, fp, "bench.iso", "bench.template",
+                                NULL, "http://localhost/") ||
+        fclose(fp) != 0) {
+        goto done;
+    }
+    fp = NULL;
+
+    ret = true;
+
+done:
+    if (fp) {
+        fclose(fp);
+    }
+    synthFree(image);
+
+    /* Leave them to be written again by the next benchmark to need them */
+    if (!ret) {
+        free(opts->jigdoPath);
+        free(opts->templatePath);
+        opts->jigdoPath = opts->templatePath = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Get the size of the file at @p path, or 0 on failure
+ */
+static uint64_t sizeOfFile(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    off_t size = -1;
+
+    if (fp && fseeko(fp, 0, SEEK_END) == 0) {
+        size = ftello(fp);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+
+    return size > 0 ? size : 0;
+}
+
+static bool runReadJigdo(void *ctx, uint64_t iterations)
+{
+    const char *path = ctx;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        jigdoData *data = jigdoReadJigdoFile(path);
+
+        if (!data) {
+            return false;
+        }
+        freeJigdoData(data);
+    }
+
+    return true;
+}
+
+static bool benchReadJigdo(benchOptions *opts)
+{
+    if (!writeTables(opts)) {
+        return false;
+    }
+
+    return measure(opts, "jigdoReadJigdoFile", "100000 parts",
+                   sizeOfFile(opts->jigdoPath), tableParts, runReadJigdo,
+                   opts->jigdoPath);
+}
+
+static bool runReadTemplate(void *ctx, uint64_t iterations)
+{
+    const char *path = ctx;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        FILE *fp = fopen(path, "r");
+        templateDescTable *table = fp ? jigdoReadTemplateFile(fp) : NULL;
+
+        if (fp) {
+            fclose(fp);
+        }
+        if (!table) {
+            return false;
+        }
+        freeTemplateDescTable(table);
+    }
+
+    return true;
+}
+
+static bool benchReadTemplate(benchOptions *opts)
+{
+    if (!writeTables(opts)) {
+        return false;
+    }
+
+    return measure(opts, "jigdoReadTemplateFile", "100000 parts", 0,
+                   tableParts, runReadTemplate, opts->templatePath);
+}
+
+/**
+ * @brief Data to decompress, and somewhere to decompress it to
+ */
+typedef struct {
+    compressType type;
+    void *in;
+    size_t inBytes;
+    void *out;
+} decompressCtx;
+
+static bool runDecompress(void *ctx, uint64_t iterations)
+{
+    decompressCtx *d = ctx;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        if (decompressMemToMem(d->type, d->in, d->inBytes, d->out,
+                               bufferSize) != bufferSize) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Benchmark decompressMemToMem() on a chunk of template data
+ *        compressed with @p type
+ */
+static bool benchDecompress(benchOptions *opts, compressType type,
+                            const char *param)
+{
+    synthSpec spec = { .numParts = 0, .minSize = 1, .maxSize = 1,
+                       .dataFraction = 0, .chunkSize = bufferSize };
+    synthImage image = { .spec = spec };
+    synthRegion region = { .type = SYNTH_REGION_DATA, .size = bufferSize };
+    decompressCtx d = { .type = type };
+    void *data = malloc(bufferSize);
+    bool ret = false;
+
+    d.out = malloc(bufferSize);
+    if (!data || !d.out) {
+        goto done;
+    }
+
+    synthFill(&image, &region, 0, data, bufferSize);
+    d.in = synthCompress(type, data, bufferSize, &d.inBytes);
+    if (!d.in) {
+        goto done;
+    }
+
+    ret = measure(opts, "decompressMemToMem", param, bufferSize, 0,
+                  runDecompress, &d);
+
+done:
+    free(data);
+    free(d.in);
+    free(d.out);
+
+    return ret;
+}
+
+static bool benchDecompressZlib(benchOptions *opts)
+{
+    return benchDecompress(opts, COMPRESSED_DATA_ZLIB, "zlib 1MiB");
+}
+
+static bool benchDecompressBzip2(benchOptions *opts)
+{
+    return benchDecompress(opts, COMPRESSED_DATA_BZIP2, "bzip2 1MiB");
+}
+
+/**
+ * @brief A buffer to hash
+ */
+typedef struct {
+    const void *buf;
+    size_t size;
+} hashCtx;
+
+static bool runMD5Mem(void *ctx, uint64_t iterations)
+{
+    hashCtx *h = ctx;
+    volatile uint32_t sink = 0;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        md5Checksum md5 = md5MemOneShot(h->buf, h->size);
+
+        sink ^= md5.sum[0];
+    }
+    (void) sink;
+
+    return true;
+}
+
+static bool benchMD5Mem(benchOptions *opts)
+{
+    synthImage image = { .spec = { .seed = 1 } };
+    synthRegion region = { .type = SYNTH_REGION_FILE, .size = bufferSize };
+    void *buf = malloc(bufferSize);
+    hashCtx h = { buf, 4096 };
+    bool ret;
+
+    if (!buf) {
+        return false;
+    }
+
+    synthFill(&image, &region, 0, buf, bufferSize);
+
+    ret = measure(opts, "md5MemOneShot", "4KiB", h.size, 0, runMD5Mem, &h);
+
+    h.size = bufferSize;
+    ret = ret &&
+          measure(opts, "md5MemOneShot", "1MiB", h.size, 0, runMD5Mem, &h);
+
+    free(buf);
+
+    return ret;
+}
+
+static bool runMD5Fd(void *ctx, uint64_t iterations)
+{
+    int fd = *(int *) ctx;
+    md5Checksum error;
+    uint64_t i;
+
+    memset(&error, 0xff, sizeof(error));
+
+    for (i = 0; i < iterations; i++) {
+        md5Checksum md5 = md5Fd(fd);
+
+        if (md5Cmp(&md5, &error) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool benchMD5Fd(benchOptions *opts)
+{
+    synthImage image = { .spec = { .seed = 2 } };
+    synthRegion region = { .type = SYNTH_REGION_FILE, .size = fileSize };
+    char *path = dircat(opts->dir, "md5fd.bin");
+    void *buf = malloc(bufferSize);
+    bool ret = false;
+    int fd = -1;
+    uint64_t done;
+
+    if (!path || !buf) {
+        goto done;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        goto done;
+    }
+
+    for (done = 0; done < fileSize; done += bufferSize) {
+        synthFill(&image, &region, done, buf, bufferSize);
+        if (write(fd, buf, bufferSize) != bufferSize) {
+            goto done;
+        }
+    }
+
+    /* From the page cache, so as to time the hashing rather than the disk */
+    ret = measure(opts, "md5Fd", "64MiB cached", fileSize, 0, runMD5Fd, &fd);
+
+done:
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    free(path);
+    free(buf);
+
+    return ret;
+}
+
+static bool runDeBase64(void *ctx, uint64_t iterations)
+{
+    char (*sums)[23] = ctx;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        md5Checksum md5;
+
+        if (!deBase64MD5Sum(sums[i % numSums], &md5)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool benchDeBase64(benchOptions *opts)
+{
+    char (*sums)[23] = malloc(numSums * sizeof(sums[0]));
+    uint64_t state = 3;
+    bool ret;
+    int i;
+
+    if (!sums) {
+        return false;
+    }
+
+    for (i = 0; i < numSums; i++) {
+        synthImage image = { .spec = { .seed = state++ } };
+        synthRegion region = { .type = SYNTH_REGION_FILE, .size = 16 };
+        md5Checksum md5;
+
+        synthFill(&image, &region, 0, &md5, sizeof(md5));
+        synthBase64MD5(&md5, sums[i]);
+    }
+
+    ret = measure(opts, "deBase64MD5Sum", "22 characters", 0, 0,
+                  runDeBase64, sums);
+
+    free(sums);
+
+    return ret;
+}
+
+/**
+ * @brief Claims shared by the threads of the claim benchmark
+ */
+typedef struct {
+    partClaims *claims;
+    int threads;              ///< Threads claiming parts
+    uint64_t next;            ///< Next part to be claimed
+    uint64_t end;             ///< Part at which the threads stop
+    bool failed;              ///< Set if a claim failed
+} claimCtx;
+
+/**
+ * @brief Claim and complete parts, as workers sharing a claim file do, until
+ *        there are none left
+ */
+static void *claimThread(void *arg)
+{
+    claimCtx *c = arg;
+    uint64_t part;
+
+    while ((part = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED)) <
+           c->end) {
+        if (claimRange(c->claims, part, 1, false) != CLAIM_ACQUIRED ||
+            !claimRelease(c->claims, part, 1, true)) {
+            c->failed = true;
+        }
+    }
+
+    return NULL;
+}
+
+static bool runClaims(void *ctx, uint64_t iterations)
+{
+    claimCtx *c = ctx;
+    pthread_t *tids = calloc(c->threads, sizeof(tids[0]));
+    int i, started;
+
+    if (!tids) {
+        return false;
+    }
+
+    /* Parts are never claimed twice, so every claim is acquired */
+    c->end = c->next + iterations;
+
+    for (started = 0; started < c->threads; started++) {
+        if (pthread_create(tids + started, NULL, claimThread, c) != 0) {
+            c->failed = true;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    free(tids);
+
+    return !c->failed;
+}
+
+/**
+ * @brief Benchmark claiming and completing parts with @p threads threads
+ */
+static bool benchClaimThreads(benchOptions *opts, int threads)
+{
+    char *path = dircat(opts->dir, "claims");
+    claimCtx c = { .threads = threads };
+    char param[32];
+    bool ret = false;
+
+    if (!path) {
+        return false;
+    }
+
+    c.claims = claimsOpen(path);
+    if (c.claims) {
+        snprintf(param, sizeof(param), "%d thread%s", threads,
+                 threads == 1 ? "" : "s");
+        ret = measure(opts, "claimRange+claimRelease", param, 0, 0,
+                      runClaims, &c);
+        claimsClose(c.claims);
+    }
+
+    unlink(path);
+    free(path);
+
+    return ret;
+}
+
+static bool benchClaims(benchOptions *opts)
+{
+    return benchClaimThreads(opts, 1) &&
+           (opts->threads == 1 || benchClaimThreads(opts, opts->threads));
+}
+
+/**
+ * @brief The benchmarks, in the order they are run
+ */
+static const struct {
+    const char *name;
+    bool (*run)(benchOptions *opts);
+} benchmarks[] = {
+    { "jigdoReadJigdoFile", benchReadJigdo },
+    { "jigdoReadTemplateFile", benchReadTemplate },
+    { "decompressMemToMem zlib", benchDecompressZlib },
+    { "decompressMemToMem bzip2", benchDecompressBzip2 },
+    { "md5MemOneShot", benchMD5Mem },
+    { "md5Fd", benchMD5Fd },
+    { "deBase64MD5Sum", benchDeBase64 },
+    { "claimRange+claimRelease", benchClaims },
+};
+
+int main(int argc, char * const * argv)
+{
+    const char *progName = argv[0];
+    const char *tmpDir = getenv("TMPDIR");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    benchOptions opts = {
+        .minTime = defaultMinTime,
+        .threads = cpus < 1 ? 1 :
+                   cpus > maxDefaultThreads ? maxDefaultThreads : cpus,
+    };
+    int opt, ret = 0, i;
+
+    static struct option longOpts[] = {
+        {"time",        required_argument, NULL, 't'},
+        {"threads",     required_argument, NULL, 'j'},
+        {NULL,          0,                 NULL,  0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "t:j:", longOpts, NULL)) != -1) {
+        switch(opt) {
+            case 't':
+                if (sscanf(optarg, "%lf", &opts.minTime) != 1 ||
+                    opts.minTime <= 0) {
+                    usage(progName);
+                }
+                break;
+            case 'j':
+                if (sscanf(optarg, "%d", &opts.threads) != 1 ||
+                    opts.threads < 1) {
+                    usage(progName);
+                }
+                break;
+            default:
+                usage(progName);
+        }
+    }
+
+    opts.filters = argv + optind;
+    opts.numFilters = argc - optind;
+
+    opts.dir = dircat(tmpDir && *tmpDir ? tmpDir : "/tmp",
+                      "pigdo-bench.XXXXXX");
+    if (!opts.dir || !mkdtemp(opts.dir)) {
+        fprintf(stderr, "Failed to create a scratch directory\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (selected(&opts, benchmarks[i].name) &&
+            !benchmarks[i].run(&opts)) {
+            fprintf(stderr, "Benchmark %s failed\n", benchmarks[i].name);
+            ret = 1;
+        }
+    }
+
+    if (opts.jigdoPath) {
+        unlink(opts.jigdoPath);
+        unlink(opts.templatePath);
+    }
+    free(opts.jigdoPath);
+    free(opts.templatePath);
+    rmdir(opts.dir);
+    free(opts.dir);
+
+    return ret;
+}
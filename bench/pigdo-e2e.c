@@ -0,0 +1,754 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // for asprintf()
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "httpd.h"
+#include "libigdo/output.h"
+#include "libigdo/util.h"
+
+/**
+ * @brief Names of the files written by pigdo-synth, and by this program, in
+ *        the directory being benchmarked
+ */
+#define jigdoName "synth.jigdo"
+#define mirrorName "mirror"
+#define outputName "e2e.iso"
+#define logName "e2e.log"
+
+/**
+ * @brief Name of the server which the files are listed under in jigdoName
+ */
+#define serverName "Synth"
+
+/**
+ * @brief Defaults for the options
+ */
+#define defaultPigdo "./pigdo"
+#define defaultThreads "1,4,16"
+#define defaultEngines "pwrite"
+#define defaultSyncs "end"
+#define defaultTransports "file,http"
+#define defaultRepeat 3
+#define defaultTolerance 10.0
+
+/**
+ * @brief A list of names given as a comma-separated option
+ */
+typedef struct {
+    char **names;             ///< The names, pointing into the option
+    int count;                ///< Number of elements in @c names
+} nameList;
+
+/**
+ * @brief What was measured for one configuration, or read from a baseline
+ */
+typedef struct {
+    char *config;             ///< Transport, threads, engine and sync policy
+    double wall;              ///< Median wall time of the runs, in seconds
+    double cpu;               ///< Median user and system time, in seconds
+    long maxRSS;              ///< Largest peak RSS of the runs, in KiB
+    bool ok;                  ///< Whether every run succeeded
+} e2eResult;
+
+/**
+ * @brief Settings shared by all of the runs
+ */
+typedef struct {
+    const char *pigdo;        ///< The pigdo executable to benchmark
+    const char *dir;          ///< Directory written by pigdo-synth
+    int repeat;               ///< Runs of each configuration
+    int logFd;                ///< Where the output of pigdo goes
+} e2eOptions;
+
+/*
+ * @brief print a usage message and exit
+ */
+static void usage(const char *progName)
+{
+    fprintf(stderr,
+            "Usage: %s [options] directory\n\n"
+            "Benchmark pigdo from end to end, reconstructing the image\n"
+            "written to directory by pigdo-synth with each combination of\n"
+            "the given transports, thread counts, output engines and sync\n"
+            "policies. The median wall and CPU time and the peak RSS of\n"
+            "each combination are printed, tab-separated, and may be\n"
+            "compared with a baseline saved from an earlier run.\n\n"
+            "-p | --pigdo:        pigdo executable, default: %s\n\n"
+            "-x | --transports:   'file' (a local mirror) and/or 'http' (a\n"
+            "                     mirror served on the loopback), default:\n"
+            "                     %s\n\n"
+            "-j | --threads:      thread counts, default: %s\n\n"
+            "-e | --engines:      output engines, default: %s\n\n"
+            "-s | --sync:         sync policies, default: %s\n\n"
+            "-r | --repeat:       runs of each combination, default: %d\n\n"
+            "-o | --results:      also save the results to this file\n\n"
+            "-b | --baseline:     results to compare with; exits with 2 if\n"
+            "                     any combination got worse\n\n"
+            "-T | --tolerance:    percentage by which a result may exceed\n"
+            "                     the baseline, default: %g\n\n"
+            "Lists are comma-separated.\n",
+            progName, defaultPigdo, defaultTransports, defaultThreads,
+            defaultEngines, defaultSyncs, defaultRepeat, defaultTolerance);
+    exit(1);
+}
+
+/**
+ * @brief Split @p str at each comma, in place, into @p list
+ *
+ * @return @c true on success; @c false if a name is empty, or on failure
+ */
+static bool parseList(char *str, nameList *list)
+{
+    char *save = NULL, *name;
+
+    free(list->names);
+    list->names = NULL;
+    list->count = 0;
+
+    for (name = strtok_r(str, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        char **names = realloc(list->names,
+                               sizeof(names[0]) * (list->count + 1));
+
+        if (!names) {
+            return false;
+        }
+        list->names = names;
+        list->names[list->count++] = name;
+    }
+
+    return list->count > 0;
+}
+
+/**
+ * @brief Serve the files of the mirror directory given as @p data
+ */
+static void handleRequest(const httpRequest *request, void *data)
+{
+    static const char type[] = "application/octet-stream";
+    const char *mirror = data;
+    uint64_t start, end;
+    struct stat st;
+    char *path;
+    int fd, status;
+
+    if (strstr(request->path, "..")) {
+        httpSendStatus(request, 403);
+        return;
+    }
+
+    path = dircat(mirror, request->path);
+    fd = path ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        httpSendStatus(request, 404);
+        goto done;
+    }
+
+    status = httpParseRange(request, st.st_size, &start, &end);
+    if (status == 416) {
+        httpSendHeaders(request, status, type, 0, 0, st.st_size);
+        goto done;
+    }
+
+    if (httpSendHeaders(request, status, type, end - start, start,
+                        st.st_size) && !request->head) {
+        httpSendFile(request, fd, start, end - start);
+    }
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/**
+ * @brief Copy the .jigdo file written by pigdo-synth to one which lists its
+ *        files on @p server, named after @p transport
+ *
+ * @return The path of the copy, to be freed by the caller; or NULL on failure
+ */
+static char *writeJigdo(const char *dir, const char *transport,
+                        const char *server)
+{
+    char *inPath = dircat(dir, jigdoName), *outPath = NULL, *name = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *in = NULL, *out = NULL;
+    bool ok = false;
+
+    if (!inPath || asprintf(&name, "e2e-%s.jigdo", transport) < 0) {
+        name = NULL;
+        goto done;
+    }
+
+    outPath = dircat(dir, name);
+    in = fopen(inPath, "r");
+    out = outPath ? fopen(outPath, "w") : NULL;
+    if (!in || !out) {
+        goto done;
+    }
+
+    while (getline(&line, &len, in) >= 0) {
+        if (strncmp(line, serverName "=", strlen(serverName "=")) == 0) {
+            fprintf(out, "%s=%s\n", serverName, server);
+        } else {
+            fputs(line, out);
+        }
+    }
+
+    ok = !ferror(in) && !ferror(out);
+
+done:
+    if (in) {
+        fclose(in);
+    }
+    if (out && fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to write a .jigdo file for %s in %s\n",
+                transport, dir);
+        free(outPath);
+        outPath = NULL;
+    }
+    free(inPath);
+    free(name);
+    free(line);
+
+    return outPath;
+}
+
+/**
+ * @brief Get the time of @p clock in seconds
+ */
+static double seconds(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Run pigdo once on @p jigdo with the given settings
+ *
+ * @param wall Where the wall time of the run is stored, in seconds
+ * @param cpu Where the user and system time of the run is stored, in seconds
+ * @param maxRSS Where the peak RSS of the run is stored, in KiB
+ *
+ * @return @c true if pigdo reconstructed the image; @c false otherwise
+ */
+static bool runPigdo(const e2eOptions *opts, const char *jigdo,
+                     const char *output, int threads, const char *engine,
+                     const char *sync, double *wall, double *cpu,
+                     long *maxRSS)
+{
+    struct rusage usage;
+    char threadArg[16];
+    double start;
+    pid_t pid;
+    int status;
+
+    /* pigdo picks up where it left off in an existing output file */
+    if (unlink(output) != 0 && errno != ENOENT) {
+        return false;
+    }
+
+    snprintf(threadArg, sizeof(threadArg), "%d", threads);
+    dprintf(opts->logFd, "--- %s -j %s --output-engine %s --sync %s %s\n",
+            opts->pigdo, threadArg, engine, sync, jigdo);
+
+    start = seconds(CLOCK_MONOTONIC);
+    pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+
+    if (pid == 0) {
+        dup2(opts->logFd, STDOUT_FILENO);
+        dup2(opts->logFd, STDERR_FILENO);
+        execl(opts->pigdo, opts->pigdo, "-o", output, "-j", threadArg,
+              "--output-engine", engine, "--sync", sync, jigdo,
+              (char *) NULL);
+        dprintf(STDERR_FILENO, "Failed to run %s\n", opts->pigdo);
+        _exit(127);
+    }
+
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        return false;
+    }
+
+    *wall = seconds(CLOCK_MONOTONIC) - start;
+    *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    *maxRSS = usage.ru_maxrss;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Get the median of the @p count elements of @p values, sorting them
+ */
+static double median(double *values, int count)
+{
+    qsort(values, count, sizeof(values[0]), compareDoubles);
+
+    return count % 2 ? values[count / 2] :
+                       (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ * @brief Run pigdo opts->repeat times for one configuration, and print what
+ *        was measured to @p out and @p save
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool measure(const e2eOptions *opts, const char *transport,
+                    const char *jigdo, const char *output, int threads,
+                    const char *engine, const char *sync, e2eResult *result,
+                    FILE *save)
+{
+    double *walls = calloc(opts->repeat, sizeof(walls[0]));
+    double *cpus = calloc(opts->repeat, sizeof(cpus[0]));
+    int i;
+
+    memset(result, 0, sizeof(*result));
+    if (!walls || !cpus ||
+        asprintf(&result->config, "%s/j%d/%s/%s", transport, threads,
+                 engine, sync) < 0) {
+        result->config = NULL;
+        free(walls);
+        free(cpus);
+        return false;
+    }
+
+    result->ok = true;
+    for (i = 0; i < opts->repeat; i++) {
+        long rss = 0;
+
+        if (!runPigdo(opts, jigdo, output, threads, engine, sync, walls + i,
+                      cpus + i, &rss)) {
+            result->ok = false;
+        }
+        if (rss > result->maxRSS) {
+            result->maxRSS = rss;
+        }
+    }
+
+    result->wall = median(walls, opts->repeat);
+    result->cpu = median(cpus, opts->repeat);
+    free(walls);
+    free(cpus);
+
+    printf("%s\t%.3f\t%.3f\t%ld\t%s\n", result->config, result->wall,
+           result->cpu, result->maxRSS, result->ok ? "ok" : "failed");
+    fflush(stdout);
+    if (save) {
+        fprintf(save, "%s\t%.3f\t%.3f\t%ld\t%s\n", result->config,
+                result->wall, result->cpu, result->maxRSS,
+                result->ok ? "ok" : "failed");
+    }
+
+    return result->ok;
+}
+
+/**
+ * @brief Read the results saved with --results to @p path
+ *
+ * @param count Where the number of results read is stored
+ *
+ * @return The results, to be freed with freeResults(); or NULL on failure
+ */
+static e2eResult *readResults(const char *path, int *count)
+{
+    FILE *fp = fopen(path, "r");
+    e2eResult *results = NULL;
+    char *line = NULL;
+    size_t len = 0;
+
+    *count = 0;
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return NULL;
+    }
+
+    while (getline(&line, &len, fp) >= 0) {
+        e2eResult result = { 0 }, *grown;
+        char config[256], status[16];
+
+        if (line[0] == '#' ||
+            sscanf(line, "%255[^\t]\t%lf\t%lf\t%ld\t%15s", config,
+                   &result.wall, &result.cpu, &result.maxRSS, status) != 5) {
+            continue;
+        }
+
+        result.ok = strcmp(status, "ok") == 0;
+        result.config = strdup(config);
+        grown = realloc(results, sizeof(results[0]) * (*count + 1));
+        if (!result.config || !grown) {
+            free(result.config);
+            break;
+        }
+        results = grown;
+        results[(*count)++] = result;
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (!results) {
+        fprintf(stderr, "No results found in %s\n", path);
+    }
+
+    return results;
+}
+
+static void freeResults(e2eResult *results, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(results[i].config);
+    }
+    free(results);
+}
+
+/**
+ * @brief Report a regression of @p what from @p base to @p value, if it is
+ *        more than @p tolerance percent
+ *
+ * @return @c true if there was a regression; @c false otherwise
+ */
+static bool regressed(const char *config, const char *what, double value,
+                      double base, double tolerance)
+{
+    if (value <= base * (1 + tolerance / 100)) {
+        return false;
+    }
+
+    fprintf(stderr, "REGRESSION %s: %s %.3f vs. %.3f (%+.1f%%)\n", config,
+            what, value, base, base > 0 ? (value / base - 1) * 100 : 100);
+
+    return true;
+}
+
+/**
+ * @brief Compare @p results with those in @p baseline of the same
+ *        configurations
+ *
+ * @return The number of configurations which regressed
+ */
+static int compare(const e2eResult *results, int count,
+                   const e2eResult *baseline, int baseCount, double tolerance)
+{
+    int i, j, regressions = 0;
+
+    for (i = 0; i < count; i++) {
+        const e2eResult *r = results + i;
+
+        for (j = 0; j < baseCount; j++) {
+            const e2eResult *b = baseline + j;
+            bool worse = false;
+
+            if (!r->ok || !b->ok || strcmp(r->config, b->config) != 0) {
+                continue;
+            }
+
+            /* Evaluate all three, so that each is reported */
+            worse |= regressed(r->config, "wall_s", r->wall, b->wall,
+                               tolerance);
+            worse |= regressed(r->config, "cpu_s", r->cpu, b->cpu,
+                               tolerance);
+            worse |= regressed(r->config, "max_rss_kib", r->maxRSS,
+                               b->maxRSS, tolerance);
+            regressions += worse;
+            break;
+        }
+    }
+
+    return regressions;
+}
+
+int main(int argc, char * const * argv)
+{
+    const char *progName = argv[0];
+    const char *resultsPath = NULL, *baselinePath = NULL;
+    char threadsDefault[] = defaultThreads, enginesDefault[] = defaultEngines;
+    char syncsDefault[] = defaultSyncs;
+    char transportsDefault[] = defaultTransports;
+    nameList threads = { 0 }, engines = { 0 }, syncs = { 0 };
+    nameList transports = { 0 };
+    e2eOptions opts = {
+        .pigdo = defaultPigdo,
+        .repeat = defaultRepeat,
+        .logFd = -1,
+    };
+    double tolerance = defaultTolerance;
+    e2eResult *results = NULL, *baseline = NULL;
+    int numResults = 0, maxResults, baseCount = 0;
+    char *mirror = NULL, *output = NULL, *logPath = NULL;
+    char realMirror[PATH_MAX];
+    httpServer *server = NULL;
+    FILE *save = NULL;
+    int opt, ret = 1, t, j, e, s, failures = 0;
+
+    static struct option longOpts[] = {
+        {"pigdo",       required_argument, NULL, 'p'},
+        {"transports",  required_argument, NULL, 'x'},
+        {"threads",     required_argument, NULL, 'j'},
+        {"engines",     required_argument, NULL, 'e'},
+        {"sync",        required_argument, NULL, 's'},
+        {"repeat",      required_argument, NULL, 'r'},
+        {"results",     required_argument, NULL, 'o'},
+        {"baseline",    required_argument, NULL, 'b'},
+        {"tolerance",   required_argument, NULL, 'T'},
+        {NULL,          0,                 NULL,  0 }
+    };
+
+    if (!parseList(threadsDefault, &threads) ||
+        !parseList(enginesDefault, &engines) ||
+        !parseList(syncsDefault, &syncs) ||
+        !parseList(transportsDefault, &transports)) {
+        goto done;
+    }
+
+    while ((opt = getopt_long(argc, argv, "p:x:j:e:s:r:o:b:T:", longOpts,
+                              NULL)) != -1) {
+        switch(opt) {
+            case 'p':
+                opts.pigdo = optarg;
+                break;
+            case 'x':
+                if (!parseList(optarg, &transports)) {
+                    usage(progName);
+                }
+                break;
+            case 'j':
+                if (!parseList(optarg, &threads)) {
+                    usage(progName);
+                }
+                break;
+            case 'e':
+                if (!parseList(optarg, &engines)) {
+                    usage(progName);
+                }
+                break;
+            case 's':
+                if (!parseList(optarg, &syncs)) {
+                    usage(progName);
+                }
+                break;
+            case 'r':
+                if (sscanf(optarg, "%d", &opts.repeat) != 1 ||
+                    opts.repeat < 1) {
+                    usage(progName);
+                }
+                break;
+            case 'o':
+                resultsPath = optarg;
+                break;
+            case 'b':
+                baselinePath = optarg;
+                break;
+            case 'T':
+                if (sscanf(optarg, "%lf", &tolerance) != 1 ||
+                    tolerance < 0) {
+                    usage(progName);
+                }
+                break;
+            default:
+                usage(progName);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(progName);
+    }
+    opts.dir = argv[optind];
+
+    /* Check the lists before running anything */
+    for (t = 0; t < transports.count; t++) {
+        if (strcmp(transports.names[t], "file") != 0 &&
+            strcmp(transports.names[t], "http") != 0) {
+            usage(progName);
+        }
+    }
+    for (j = 0; j < threads.count; j++) {
+        if (atoi(threads.names[j]) < 1) {
+            usage(progName);
+        }
+    }
+    for (e = 0; e < engines.count; e++) {
+        if (outputEngineFromName(engines.names[e]) == OUTPUT_ENGINE_COUNT) {
+            usage(progName);
+        }
+    }
+    for (s = 0; s < syncs.count; s++) {
+        if (outputSyncPolicyFromName(syncs.names[s]) == OUTPUT_SYNC_COUNT) {
+            usage(progName);
+        }
+    }
+
+    if (baselinePath) {
+        baseline = readResults(baselinePath, &baseCount);
+        if (!baseline) {
+            goto done;
+        }
+    }
+
+    mirror = dircat(opts.dir, mirrorName);
+    output = dircat(opts.dir, outputName);
+    logPath = dircat(opts.dir, logName);
+    if (!mirror || !output || !logPath || !realpath(mirror, realMirror)) {
+        fprintf(stderr, "Failed to find the mirror in %s; was it written "
+                "by pigdo-synth?\n", opts.dir);
+        goto done;
+    }
+
+    opts.logFd = open(logPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+    if (opts.logFd < 0) {
+        fprintf(stderr, "Failed to open %s\n", logPath);
+        goto done;
+    }
+
+    if (resultsPath) {
+        save = fopen(resultsPath, "w");
+        if (!save) {
+            fprintf(stderr, "Failed to open %s\n", resultsPath);
+            goto done;
+        }
+    }
+
+    maxResults = transports.count * threads.count * engines.count *
+                 syncs.count;
+    results = calloc(maxResults, sizeof(results[0]));
+    if (!results) {
+        goto done;
+    }
+
+    printf("# config\twall_s\tcpu_s\tmax_rss_kib\tstatus\n");
+    if (save) {
+        fprintf(save, "# config\twall_s\tcpu_s\tmax_rss_kib\tstatus\n");
+    }
+
+    for (t = 0; t < transports.count; t++) {
+        const char *transport = transports.names[t];
+        char *uri = NULL, *jigdo = NULL;
+
+        if (strcmp(transport, "http") == 0) {
+            server = httpStart("127.0.0.1:0", handleRequest, realMirror);
+            if (!server || asprintf(&uri, "http://127.0.0.1:%d/",
+                                    httpGetPort(server)) < 0) {
+                fprintf(stderr, "Failed to serve %s over HTTP\n", mirror);
+                uri = NULL;
+                goto done;
+            }
+        } else if (asprintf(&uri, "file://%s/", realMirror) < 0) {
+            goto done;
+        }
+
+        jigdo = writeJigdo(opts.dir, transport, uri);
+        free(uri);
+        if (!jigdo) {
+            goto done;
+        }
+
+        for (j = 0; j < threads.count; j++) {
+            for (e = 0; e < engines.count; e++) {
+                for (s = 0; s < syncs.count; s++) {
+                    if (!measure(&opts, transport, jigdo, output,
+                                 atoi(threads.names[j]), engines.names[e],
+                                 syncs.names[s], results + numResults,
+                                 save)) {
+                        fprintf(stderr, "pigdo failed for %s; see %s\n",
+                                results[numResults].config, logPath);
+                        failures++;
+                    }
+                    if (results[numResults].config) {
+                        numResults++;
+                    }
+                }
+            }
+        }
+
+        free(jigdo);
+        if (server) {
+            httpStop(server);
+            server = NULL;
+        }
+    }
+
+    ret = failures ? 1 : 0;
+    if (!failures && baseline &&
+        compare(results, numResults, baseline, baseCount, tolerance) > 0) {
+        ret = 2;
+    }
+
+done:
+    if (server) {
+        httpStop(server);
+    }
+    if (save && fclose(save) != 0) {
+        fprintf(stderr, "Failed to write %s\n", resultsPath);
+        ret = 1;
+    }
+    if (output) {
+        unlink(output);
+    }
+    if (opts.logFd >= 0) {
+        close(opts.logFd);
+    }
+    freeResults(results, numResults);
+    freeResults(baseline, baseCount);
+    free(threads.names);
+    free(engines.names);
+    free(syncs.names);
+    free(transports.names);
+    free(mirror);
+    free(output);
+    free(logPath);
+
+    return ret;
+}
@@ -0,0 +1,356 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // for asprintf()
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "synth.h"
+#include "libigdo/jigdo-md5.h"
+#include "libigdo/util.h"
+
+/**
+ * @brief Names of the files written to the output directory
+ */
+#define imageName "synth.iso"
+#define templateName "synth.template"
+#define jigdoName "synth.jigdo"
+#define mirrorName "mirror"
+
+/*
+ * @brief print a usage message and exit
+ */
+static void usage(const char *progName)
+{
+    fprintf(stderr,
+            "Usage: %s [options] directory\n\n"
+            "Generate a synthetic image in directory, along with its .jigdo\n"
+            "and .template files, and a mirror holding its files, for\n"
+            "benchmarking pigdo from end to end.\n\n"
+            "-n | --parts:          number of parts matched by files,\n"
+            "                       default: 1000\n\n"
+            "--min-size SIZE:       smallest size of a file, default: 4K\n\n"
+            "--max-size SIZE:       largest size of a file, default: 4M;\n"
+            "                       sizes are spread log-uniformly between\n"
+            "                       the two\n\n"
+            "--data-fraction F:     fraction of the image stored in the\n"
+            "                       template, default: 0.05\n\n"
+            "--dup-rate F:          fraction of parts repeating an earlier\n"
+            "                       file, default: 0\n\n"
+            "-c | --compression:    'zlib' or 'bzip2', default: zlib\n\n"
+            "--chunk-size SIZE:     size of the compressed chunks of the\n"
+            "                       template data, default: 1M\n\n"
+            "--seed N:              seed everything is generated from,\n"
+            "                       default: 1\n\n"
+            "--server URI:          where the .jigdo file says the mirror\n"
+            "                       is, default: a file:// URI of its\n"
+            "                       directory\n",
+            progName);
+    exit(1);
+}
+
+/**
+ * @brief Parse a size with an optional suffix, as parseSize() does, which
+ *        must make up all of @p str
+ */
+static bool parseWholeSize(const char *str, uint64_t *size)
+{
+    char *end;
+
+    return parseSize(str, &end, size) && *end == '\0';
+}
+
+/**
+ * @brief Create the directory @p path, unless it already exists
+ */
+static bool makeDir(const char *path)
+{
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/**
+ * @brief Write @p image to the file @p name within @p dir with @p write
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeFile(const char *dir, const char *name,
+                      const synthImage *image,
+                      bool (*write)(const synthImage *, FILE *))
+{
+    char *path = dircat(dir, name);
+    FILE *fp = path ? fopen(path, "w") : NULL;
+    bool ret = false;
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s\n", path ? path : name);
+        goto done;
+    }
+
+    ret = write(image, fp);
+    if (fclose(fp) != 0) {
+        ret = false;
+    }
+    if (!ret) {
+        fprintf(stderr, "Failed to write %s\n", path);
+    }
+
+done:
+    free(path);
+
+    return ret;
+}
+
+/**
+ * @brief Write each of the files of @p image to @p pool, named as the .jigdo
+ *        file lists them
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeMirror(const synthImage *image, const char *pool)
+{
+    int i;
+
+    for (i = 0; i < image->numFiles; i++) {
+        char name[32];
+        char *path;
+        FILE *fp;
+        bool ok;
+
+        snprintf(name, sizeof(name), "f%d.bin", i);
+        path = dircat(pool, name);
+        fp = path ? fopen(path, "w") : NULL;
+        ok = fp && synthWriteFile(image, i, fp);
+        if (fp && fclose(fp) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Failed to write %s\n", path ? path : name);
+        }
+        free(path);
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Write the .jigdo file of @p image to @p dir, naming @p server as
+ *        the location of its files
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeJigdo(const synthImage *image, const char *dir,
+                       const char *server)
+{
+    char *templatePath = dircat(dir, templateName);
+    char *path = dircat(dir, jigdoName);
+    md5Checksum md5, invalid;
+    FILE *fp = NULL;
+    bool ret = false;
+
+    if (!templatePath || !path) {
+        goto done;
+    }
+
+    memset(&invalid, 0xff, sizeof(invalid));
+    md5 = md5Path(templatePath);
+    if (memcmp(&md5, &invalid, sizeof(md5)) == 0) {
+        fprintf(stderr, "Failed to checksum %s\n", templatePath);
+        goto done;
+    }
+
+    fp = fopen(path, "w");
+    if (!fp || !synthWriteJigdo(image, fp, imageName, templateName, &md5,
+                                server)) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        goto done;
+    }
+
+    ret = true;
+
+done:
+    if (fp && fclose(fp) != 0 && ret) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        ret = false;
+    }
+    free(templatePath);
+    free(path);
+
+    return ret;
+}
+
+int main(int argc, char * const * argv)
+{
+    const char *progName = argv[0];
+    synthSpec spec = {
+        .numParts = 1000,
+        .minSize = 4 << 10,
+        .maxSize = 4 << 20,
+        .dataFraction = 0.05,
+        .dupRate = 0,
+        .compression = COMPRESSED_DATA_ZLIB,
+        .chunkSize = 1 << 20,
+        .seed = 1,
+    };
+    const char *server = NULL, *dir;
+    char *mirror = NULL, *pool = NULL, *defaultServer = NULL;
+    char realMirror[PATH_MAX];
+    synthImage *image = NULL;
+    char md5[23];
+    int opt, ret = 1;
+
+    enum {
+        OPT_MIN_SIZE = 256,
+        OPT_MAX_SIZE,
+        OPT_DATA_FRACTION,
+        OPT_DUP_RATE,
+        OPT_CHUNK_SIZE,
+        OPT_SEED,
+        OPT_SERVER,
+    };
+
+    static struct option longOpts[] = {
+        {"parts",         required_argument, NULL, 'n'},
+        {"min-size",      required_argument, NULL, OPT_MIN_SIZE},
+        {"max-size",      required_argument, NULL, OPT_MAX_SIZE},
+        {"data-fraction", required_argument, NULL, OPT_DATA_FRACTION},
+        {"dup-rate",      required_argument, NULL, OPT_DUP_RATE},
+        {"compression",   required_argument, NULL, 'c'},
+        {"chunk-size",    required_argument, NULL, OPT_CHUNK_SIZE},
+        {"seed",          required_argument, NULL, OPT_SEED},
+        {"server",        required_argument, NULL, OPT_SERVER},
+        {NULL,            0,                 NULL,  0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "n:c:", longOpts, NULL)) != -1) {
+        switch(opt) {
+            case 'n':
+                if (sscanf(optarg, "%d", &spec.numParts) != 1 ||
+                    spec.numParts < 0) {
+                    usage(progName);
+                }
+                break;
+            case OPT_MIN_SIZE:
+                if (!parseWholeSize(optarg, &spec.minSize)) {
+                    usage(progName);
+                }
+                break;
+            case OPT_MAX_SIZE:
+                if (!parseWholeSize(optarg, &spec.maxSize)) {
+                    usage(progName);
+                }
+                break;
+            case OPT_DATA_FRACTION:
+                if (sscanf(optarg, "%lf", &spec.dataFraction) != 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_DUP_RATE:
+                if (sscanf(optarg, "%lf", &spec.dupRate) != 1 ||
+                    spec.dupRate < 0 || spec.dupRate > 1) {
+                    usage(progName);
+                }
+                break;
+            case 'c':
+                if (strcmp(optarg, "zlib") == 0) {
+                    spec.compression = COMPRESSED_DATA_ZLIB;
+                } else if (strcmp(optarg, "bzip2") == 0) {
+                    spec.compression = COMPRESSED_DATA_BZIP2;
+                } else {
+                    usage(progName);
+                }
+                break;
+            case OPT_CHUNK_SIZE:
+                if (!parseWholeSize(optarg, &spec.chunkSize)) {
+                    usage(progName);
+                }
+                break;
+            case OPT_SEED:
+                if (sscanf(optarg, "%"SCNu64, &spec.seed) != 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_SERVER:
+                server = optarg;
+                break;
+            default:
+                usage(progName);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(progName);
+    }
+    dir = argv[optind];
+
+    image = synthPlan(&spec);
+    if (!image) {
+        fprintf(stderr, "Invalid parameters for the image\n");
+        goto done;
+    }
+
+    mirror = dircat(dir, mirrorName);
+    pool = mirror ? dircat(mirror, "pool") : NULL;
+    if (!pool || !makeDir(dir) || !makeDir(mirror) || !makeDir(pool)) {
+        fprintf(stderr, "Failed to create the directories in %s\n", dir);
+        goto done;
+    }
+
+    if (!server) {
+        if (!realpath(mirror, realMirror) ||
+            asprintf(&defaultServer, "file://%s/", realMirror) < 0) {
+            defaultServer = NULL;
+            fprintf(stderr, "Failed to resolve %s\n", mirror);
+            goto done;
+        }
+        server = defaultServer;
+    }
+
+    if (!writeFile(dir, imageName, image, synthWriteImage) ||
+        !writeFile(dir, templateName, image, synthWriteTemplate) ||
+        !writeJigdo(image, dir, server) || !writeMirror(image, pool)) {
+        goto done;
+    }
+
+    synthBase64MD5(&image->md5, md5);
+    printf("%s: %"PRIu64" bytes, %d parts of %d files, "
+           "%"PRIu64" bytes of data, MD5 %s\n", imageName, image->size,
+           spec.numParts, image->numFiles, image->dataSize, md5);
+
+    ret = 0;
+
+done:
+    synthFree(image);
+    free(defaultServer);
+    free(mirror);
+    free(pool);
+
+    return ret;
+}
@@ -0,0 +1,583 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+#include <bzlib.h>
+
+#include "synth.h"
+#include "libigdo/jigdo-template.h"
+#include "libigdo/md5.h"
+
+/**
+ * @brief Size of the buffers regions are generated into, e.g. for hashing
+ */
+#define synthBufferSize (1 << 20)
+
+/**
+ * @brief Scramble @p x; this is the finalizer of SplitMix64
+ */
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Get the next number from the generator at @p state
+ */
+static uint64_t next(uint64_t *state)
+{
+    return mix((*state)++);
+}
+
+/**
+ * @brief Get a number from the generator at @p state, uniformly distributed
+ *        in [0, 1)
+ */
+static double uniform(uint64_t *state)
+{
+    return (next(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/**
+ * @brief Get word @p i of @p region of @p image
+ *
+ * Files are incompressible, like the packages which make up most real
+ * images. Data compresses to around a third of its size, with runs of
+ * zeroes, like the filesystem metadata and padding between packages.
+ */
+static uint64_t regionWord(const synthImage *image, const synthRegion *region,
+                           uint64_t i)
+{
+    uint64_t key;
+
+    if (region->type == SYNTH_REGION_FILE) {
+        key = mix(image->spec.seed ^ mix(region->file));
+        return mix(key ^ i);
+    }
+
+    /* Every other 4 KiB of data is zeroes */
+    if ((i / 512) % 2) {
+        return 0;
+    }
+
+    key = mix(~image->spec.seed ^ mix(region->offset));
+    return mix(key ^ i) & 0x0707070707070707ULL;
+}
+
+void synthFill(const synthImage *image, const synthRegion *region,
+               uint64_t offset, void *buf, size_t size)
+{
+    uint8_t *out = buf;
+    size_t j;
+
+    while (size > 0) {
+        uint64_t word = regionWord(image, region, offset / 8);
+        int skip = offset % 8;
+        size_t len = 8 - skip < size ? 8 - skip : size;
+
+        /* Little endian, whatever the host */
+        word >>= 8 * skip;
+        for (j = 0; j < len; j++) {
+            out[j] = word >> (8 * j);
+        }
+
+        out += len;
+        offset += len;
+        size -= len;
+    }
+}
+
+/**
+ * @brief Add @p region of @p image to @p ctx
+ */
+static void hashRegion(const synthImage *image, const synthRegion *region,
+                       struct MD5Context *ctx, void *buf)
+{
+    uint64_t done;
+
+    for (done = 0; done < region->size; done += synthBufferSize) {
+        size_t len = region->size - done < synthBufferSize ?
+                     region->size - done : synthBufferSize;
+
+        synthFill(image, region, done, buf, len);
+        MD5Update(ctx, buf, len);
+    }
+}
+
+/**
+ * @brief Work out the checksums of the files of @p image and of the image
+ *        itself
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool hashImage(synthImage *image)
+{
+    void *buf = malloc(synthBufferSize);
+    struct MD5Context ctx;
+    int i;
+
+    if (!buf) {
+        return false;
+    }
+
+    for (i = 0; i < image->numFiles; i++) {
+        synthRegion region = {
+            .type = SYNTH_REGION_FILE,
+            .size = image->files[i].size,
+            .file = i,
+        };
+
+        MD5Init(&ctx);
+        hashRegion(image, &region, &ctx, buf);
+        MD5Final(&image->files[i].md5, &ctx);
+    }
+
+    MD5Init(&ctx);
+    for (i = 0; i < image->numRegions; i++) {
+        hashRegion(image, image->regions + i, &ctx, buf);
+    }
+    MD5Final(&image->md5, &ctx);
+
+    free(buf);
+
+    return true;
+}
+
+/**
+ * @brief Append a region of @p size bytes to @p image
+ *
+ * Empty regions are left out.
+ */
+static void addRegion(synthImage *image, synthRegionType type, uint64_t size,
+                      int file)
+{
+    synthRegion *region = image->regions + image->numRegions;
+
+    if (size == 0) {
+        return;
+    }
+
+    region->type = type;
+    region->offset = image->size;
+    region->size = size;
+    region->file = file;
+
+    image->size += size;
+    image->numRegions++;
+}
+
+synthImage *synthPlan(const synthSpec *spec)
+{
+    synthImage *image = calloc(1, sizeof(*image));
+    uint64_t state = spec->seed, filesSize = 0, dataLeft;
+    int *parts = NULL;
+    double *gaps = NULL, gapTotal = 0;
+    int i;
+
+    if (!image || spec->numParts < 0 || spec->minSize < 1 ||
+        spec->maxSize < spec->minSize || spec->dataFraction < 0 ||
+        spec->dataFraction >= 1 || spec->chunkSize < 1) {
+        goto fail;
+    }
+
+    image->spec = *spec;
+    image->files = calloc(spec->numParts + 1, sizeof(image->files[0]));
+    image->regions = calloc(2 * spec->numParts + 1,
+                            sizeof(image->regions[0]));
+    parts = calloc(spec->numParts + 1, sizeof(parts[0]));
+    gaps = calloc(spec->numParts + 1, sizeof(gaps[0]));
+    if (!image->files || !image->regions || !parts || !gaps) {
+        goto fail;
+    }
+
+    /* Choose the file of each part, and the share of the data before it */
+    for (i = 0; i < spec->numParts; i++) {
+        if (image->numFiles > 0 && uniform(&state) < spec->dupRate) {
+            parts[i] = next(&state) % image->numFiles;
+        } else {
+            double logMin = log(spec->minSize), logMax = log(spec->maxSize);
+
+            parts[i] = image->numFiles++;
+            image->files[parts[i]].size =
+                exp(logMin + (logMax - logMin) * uniform(&state));
+        }
+
+        filesSize += image->files[parts[i]].size;
+        gaps[i] = uniform(&state);
+        gapTotal += gaps[i];
+    }
+    gaps[spec->numParts] = uniform(&state);
+    gapTotal += gaps[spec->numParts];
+
+    dataLeft = filesSize * spec->dataFraction / (1 - spec->dataFraction);
+    image->dataSize = dataLeft;
+
+    for (i = 0; i < spec->numParts; i++) {
+        uint64_t gap = dataLeft * (gaps[i] / gapTotal);
+
+        gapTotal -= gaps[i];
+        dataLeft -= gap;
+        addRegion(image, SYNTH_REGION_DATA, gap, -1);
+        addRegion(image, SYNTH_REGION_FILE, image->files[parts[i]].size,
+                  parts[i]);
+    }
+    addRegion(image, SYNTH_REGION_DATA, dataLeft, -1);
+
+    if (!hashImage(image)) {
+        goto fail;
+    }
+
+    free(parts);
+    free(gaps);
+
+    return image;
+
+fail:
+    free(parts);
+    free(gaps);
+    synthFree(image);
+
+    return NULL;
+}
+
+void synthFree(synthImage *image)
+{
+    if (image) {
+        free(image->regions);
+        free(image->files);
+        free(image);
+    }
+}
+
+void synthBase64MD5(const md5Checksum *md5, char out[23])
+{
+    static const char symbols[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const uint8_t *in = (const uint8_t *) md5;
+    uint32_t bits = 0;
+    int i, numBits = 0;
+
+    for (i = 0; i < sizeof(*md5); i++) {
+        bits = bits << 8 | in[i];
+        numBits += 8;
+
+        while (numBits >= 6) {
+            numBits -= 6;
+            *out++ = symbols[(bits >> numBits) & 63];
+        }
+    }
+
+    /* Unpadded: the last symbol holds the remaining bits, shifted up */
+    if (numBits > 0) {
+        *out++ = symbols[(bits << (6 - numBits)) & 63];
+    }
+
+    *out = '\0';
+}
+
+/**
+ * @brief Store @p value in @p buf as a 6-byte little endian integer, as used
+ *        in .template files
+ *
+ * @return The address just past it
+ */
+static uint8_t *putU48(uint8_t *buf, uint64_t value)
+{
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        buf[i] = value >> (8 * i);
+    }
+
+    return buf + 6;
+}
+
+void *synthCompress(compressType type, const void *data, size_t size,
+                    size_t *outSize)
+{
+    size_t bound = size + size / 100 + 1024;
+    void *out = malloc(bound);
+
+    if (!out) {
+        return NULL;
+    }
+
+    switch (type) {
+        case COMPRESSED_DATA_ZLIB: {
+#if defined HAVE_LIBZ
+            uLongf len = bound;
+
+            if (compress2(out, &len, data, size, Z_BEST_COMPRESSION) == Z_OK) {
+                *outSize = len;
+                return out;
+            }
+#endif
+            break;
+        }
+
+        case COMPRESSED_DATA_BZIP2: {
+#if defined HAVE_LIBBZ2
+            unsigned len = bound;
+
+            if (BZ2_bzBuffToBuffCompress(out, &len, (char *) data, size, 9, 0,
+                                         0) == BZ_OK) {
+                *outSize = len;
+                return out;
+            }
+#endif
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    free(out);
+
+    return NULL;
+}
+
+/**
+ * @brief Compress the @p size bytes at @p data into a chunk of the template
+ *        data stream, and write it to @p fp
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeChunk(const synthImage *image, FILE *fp, const void *data,
+                       size_t size)
+{
+    compressType type = image->spec.compression;
+    uint8_t header[16];
+    size_t outSize;
+    void *out;
+    bool ret;
+
+    out = synthCompress(type, data, size, &outSize);
+    if (!out) {
+        return false;
+    }
+
+    memcpy(header, type == COMPRESSED_DATA_BZIP2 ? "BZIP" : "DATA", 4);
+    putU48(putU48(header + 4, outSize + sizeof(header)), size);
+
+    ret = fwrite(header, sizeof(header), 1, fp) == 1 &&
+          fwrite(out, outSize, 1, fp) == 1;
+
+    free(out);
+
+    return ret;
+}
+
+/**
+ * @brief Write the data regions of @p image to @p fp, as the compressed data
+ *        stream of its template
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeData(const synthImage *image, FILE *fp)
+{
+    size_t chunkSize = image->spec.chunkSize, filled = 0;
+    uint8_t *chunk = malloc(chunkSize);
+    bool ret = false;
+    int i;
+
+    if (!chunk) {
+        return false;
+    }
+
+    for (i = 0; i < image->numRegions; i++) {
+        const synthRegion *region = image->regions + i;
+        uint64_t done = 0;
+
+        if (region->type != SYNTH_REGION_DATA) {
+            continue;
+        }
+
+        while (done < region->size) {
+            size_t len = region->size - done < chunkSize - filled ?
+                         region->size - done : chunkSize - filled;
+
+            synthFill(image, region, done, chunk + filled, len);
+            done += len;
+            filled += len;
+
+            if (filled == chunkSize) {
+                if (!writeChunk(image, fp, chunk, filled)) {
+                    goto done;
+                }
+                filled = 0;
+            }
+        }
+    }
+
+    if (filled > 0 && !writeChunk(image, fp, chunk, filled)) {
+        goto done;
+    }
+
+    ret = true;
+
+done:
+    free(chunk);
+
+    return ret;
+}
+
+bool synthWriteTemplate(const synthImage *image, FILE *fp)
+{
+    /* Each entry takes at most 31 bytes, and the image info 27 */
+    size_t descSize = 16 + 31 * image->numRegions + 27;
+    uint8_t *desc = malloc(descSize), *p;
+    bool ret = false;
+    int i;
+
+    if (!desc) {
+        return false;
+    }
+
+    if (fputs("JigsawDownload template 1.1 pigdo-synth\r\n"
+              "Synthetic template\r\n\r\n", fp) == EOF ||
+        !writeData(image, fp)) {
+        goto done;
+    }
+
+    p = desc + 10;
+    for (i = 0; i < image->numRegions; i++) {
+        const synthRegion *region = image->regions + i;
+
+        if (region->type == SYNTH_REGION_DATA) {
+            *p++ = TEMPLATE_ENTRY_TYPE_DATA;
+            p = putU48(p, region->size);
+        } else {
+            *p++ = TEMPLATE_ENTRY_TYPE_FILE;
+            p = putU48(p, region->size);
+            memset(p, 0, 8); // No rsync64 checksum
+            p += 8;
+            memcpy(p, &image->files[region->file].md5, 16);
+            p += 16;
+        }
+    }
+
+    *p++ = TEMPLATE_ENTRY_TYPE_IMAGE_INFO;
+    p = putU48(p, image->size);
+    memcpy(p, &image->md5, 16);
+    p += 16;
+    memcpy(p, "\0\4\0\0", 4); // rsync64 block length of 1024
+    p += 4;
+
+    /* The size of the table is both at its start and at its end */
+    descSize = p - desc + 6;
+    memcpy(desc, "DESC", 4);
+    putU48(desc + 4, descSize);
+    putU48(p, descSize);
+
+    ret = fwrite(desc, descSize, 1, fp) == 1;
+
+done:
+    free(desc);
+
+    return ret;
+}
+
+/**
+ * @brief Write @p region of @p image to @p fp
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeRegion(const synthImage *image, const synthRegion *region,
+                        FILE *fp, void *buf)
+{
+    uint64_t done;
+
+    for (done = 0; done < region->size; done += synthBufferSize) {
+        size_t len = region->size - done < synthBufferSize ?
+                     region->size - done : synthBufferSize;
+
+        synthFill(image, region, done, buf, len);
+        if (fwrite(buf, len, 1, fp) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool synthWriteImage(const synthImage *image, FILE *fp)
+{
+    void *buf = malloc(synthBufferSize);
+    bool ret = buf != NULL;
+    int i;
+
+    for (i = 0; ret && i < image->numRegions; i++) {
+        ret = writeRegion(image, image->regions + i, fp, buf);
+    }
+
+    free(buf);
+
+    return ret;
+}
+
+bool synthWriteFile(const synthImage *image, int file, FILE *fp)
+{
+    synthRegion region = {
+        .type = SYNTH_REGION_FILE,
+        .size = image->files[file].size,
+        .file = file,
+    };
+    void *buf = malloc(synthBufferSize);
+    bool ret = buf && writeRegion(image, &region, fp, buf);
+
+    free(buf);
+
+    return ret;
+}
+
+bool synthWriteJigdo(const synthImage *image, FILE *fp, const char *imageName,
+                     const char *templateName, const md5Checksum *templateMD5,
+                     const char *server)
+{
+    char md5[23];
+    int i;
+
+    fprintf(fp, "[Jigdo]\nVersion=1.1\nGenerator=pigdo-synth\n\n"
+                "[Image]\nFilename=%s\nTemplate=%s\n", imageName,
+                templateName);
+
+    if (templateMD5) {
+        synthBase64MD5(templateMD5, md5);
+        fprintf(fp, "Template-MD5Sum=%s\n", md5);
+    }
+
+    fputs("\n[Parts]\n", fp);
+    for (i = 0; i < image->numFiles; i++) {
+        synthBase64MD5(&image->files[i].md5, md5);
+        fprintf(fp, "%s=Synth:pool/f%d.bin\n", md5, i);
+    }
+
+    fprintf(fp, "\n[Servers]\nSynth=%s\n", server);
+
+    return !ferror(fp);
+}
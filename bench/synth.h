@@ -0,0 +1,171 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_BENCH_SYNTH_H
+#define PIGDO_BENCH_SYNTH_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libigdo/decompress.h"
+#include "libigdo/jigdo-md5.h"
+#include "libigdo/jigdo-md5-private.h"
+
+/**
+ * @brief Parameters of a synthetic image
+ */
+typedef struct {
+    int numParts;             ///< Parts matched by files, duplicates included
+    uint64_t minSize;         ///< Smallest size of a file
+    uint64_t maxSize;         ///< Largest size of a file; sizes are spread
+                              ///< log-uniformly between the two, so that
+                              ///< small files are the most common
+    double dataFraction;      ///< Fraction of the image not matched by any
+                              ///< file, which is stored in the template
+    double dupRate;           ///< Fraction of parts which repeat the contents
+                              ///< of an earlier part
+    compressType compression; ///< COMPRESSED_DATA_ZLIB or
+                              ///< COMPRESSED_DATA_BZIP2
+    uint64_t chunkSize;       ///< Size of the chunks the template data is
+                              ///< compressed in
+    uint64_t seed;            ///< Seed from which everything is generated
+} synthSpec;
+
+/**
+ * @brief Kinds of regions of a synthetic image
+ */
+typedef enum {
+    SYNTH_REGION_DATA = 0,    ///< Data stored in the template
+    SYNTH_REGION_FILE,        ///< The contents of a file
+} synthRegionType;
+
+/**
+ * @brief A region of a synthetic image
+ */
+typedef struct {
+    synthRegionType type;     ///< What the region holds
+    uint64_t offset;          ///< Where the region is within the image
+    uint64_t size;            ///< Size of the region
+    int file;                 ///< For SYNTH_REGION_FILE, the index of the file
+                              ///< in synthImage::files
+} synthRegion;
+
+/**
+ * @brief A file whose contents appear in a synthetic image
+ */
+typedef struct {
+    uint64_t size;            ///< Size of the file
+    md5Checksum md5;          ///< MD5 checksum of the file
+} synthFile;
+
+/**
+ * @brief The layout of a synthetic image, from which the image, its .jigdo
+ *        and .template files can all be written
+ *
+ * The contents of every region are generated from the seed on demand, so they
+ * are never held in memory all at once.
+ */
+typedef struct {
+    synthSpec spec;           ///< What the image was planned from
+    synthRegion *regions;     ///< Regions of the image, in order of offset
+    int numRegions;           ///< Number of elements in @c regions
+    synthFile *files;         ///< Distinct files in the image
+    int numFiles;             ///< Number of elements in @c files
+    uint64_t size;            ///< Size of the image
+    uint64_t dataSize;        ///< Total size of the data regions
+    md5Checksum md5;          ///< MD5 checksum of the image
+} synthImage;
+
+/**
+ * @brief Lay out an image as described by @p spec, and work out the
+ *        checksums of its files and of the image itself
+ *
+ * @return The layout, to be freed with synthFree(), or NULL on failure
+ */
+synthImage *synthPlan(const synthSpec *spec);
+
+/**
+ * @brief Free a layout made by synthPlan()
+ */
+void synthFree(synthImage *image);
+
+/**
+ * @brief Generate @p size bytes of @p region of @p image, from @p offset
+ *        within the region, into @p buf
+ */
+void synthFill(const synthImage *image, const synthRegion *region,
+               uint64_t offset, void *buf, size_t size);
+
+/**
+ * @brief Encode @p md5 in the unpadded base64 variant used by .jigdo files
+ *
+ * @param out Where the 22 characters and a terminating NUL are stored
+ */
+void synthBase64MD5(const md5Checksum *md5, char out[23]);
+
+/**
+ * @brief Compress the @p size bytes at @p data as a chunk of template data,
+ *        with @p type, which is COMPRESSED_DATA_ZLIB or COMPRESSED_DATA_BZIP2
+ *
+ * @param outSize Where the size of the compressed data is stored
+ *
+ * @return The compressed data, to be freed by the caller; or NULL on failure
+ */
+void *synthCompress(compressType type, const void *data, size_t size,
+                    size_t *outSize);
+
+/**
+ * @brief Write the .template file of @p image to @p fp
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool synthWriteTemplate(const synthImage *image, FILE *fp);
+
+/**
+ * @brief Write @p image itself to @p fp
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool synthWriteImage(const synthImage *image, FILE *fp);
+
+/**
+ * @brief Write file number @p file of @p image to @p fp, as a mirror would
+ *        hold it
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool synthWriteFile(const synthImage *image, int file, FILE *fp);
+
+/**
+ * @brief Write the .jigdo file of @p image to @p fp
+ *
+ * File number N of the image is listed as pool/fN.bin on server "Synth".
+ *
+ * @param imageName Name of the image file
+ * @param templateName Location of the .template file
+ * @param templateMD5 Checksum of the .template file, or NULL to leave it out
+ * @param server URI of the mirror, ending with a '/'
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool synthWriteJigdo(const synthImage *image, FILE *fp, const char *imageName,
+                     const char *templateName, const md5Checksum *templateMD5,
+                     const char *server);
+
+#endif
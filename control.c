@@ -0,0 +1,310 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "libigdo/util.h"
+
+#include "control.h"
+#include "daemon.h"
+
+/**
+ * @brief Longest command accepted, in bytes
+ */
+#define maxCommandSize 4096
+
+/**
+ * @brief Milliseconds a client may stay idle before it is disconnected, so
+ *        that others get a turn
+ */
+#define clientTimeout 60000
+
+struct _controlServer {
+    int listenSock;
+    char *path;               ///< Where @c listenSock is bound
+    igdoSession *session;     ///< The session being tuned
+    pthread_t thread;
+    int stopPipe[2];          ///< Readable once controlStop() has been called
+};
+
+/**
+ * @brief Send @p reply to the client on @p sock, followed by a newline
+ *
+ * @return @c true on success; @c false if the client is gone
+ */
+static bool sendReply(int sock, const char *reply)
+{
+    size_t len = strlen(reply);
+
+    return send(sock, reply, len, MSG_NOSIGNAL) == (ssize_t) len &&
+           send(sock, "\n", 1, MSG_NOSIGNAL) == 1;
+}
+
+static const char helpText[] =
+    "ok: commands:\n"
+    "  threads N          keep at most N workers busy, up to -j\n"
+    "  bandwidth RATE     limit transfers to RATE bytes per second, with\n"
+    "                     an optional K, M or G suffix; 'off' for none\n"
+    "  weight PREFIX W    fetch W times as often from the mirrors whose\n"
+    "                     URIs start with PREFIX as from others\n"
+    "  disable PREFIX     stop fetching from those mirrors (weight 0)\n"
+    "  enable PREFIX      fetch from them as usual again (weight 1)\n"
+    "  pause              start no further parts, and hold transfers\n"
+    "  resume             carry on after pause\n"
+    "  hedge              race each transfer in progress with another,\n"
+    "                     from a different mirror";
+
+/**
+ * @brief Carry out the command in @p line, and answer it
+ *
+ * @return @c true on success; @c false if the client is gone
+ */
+static bool runCommand(controlServer *server, int sock, char *line)
+{
+    igdoSession *session = server->session;
+    char *save, *command, *arg, *extra, *end, reply[64];
+    double weight;
+    uint64_t rate;
+    long threads;
+
+    command = strtok_r(line, " \t\r", &save);
+    arg = command ? strtok_r(NULL, " \t\r", &save) : NULL;
+    extra = arg ? strtok_r(NULL, " \t\r", &save) : NULL;
+
+    /* Blank lines are ignored */
+    if (!command) {
+        return true;
+    }
+
+    if (strcmp(command, "help") == 0) {
+        return sendReply(sock, helpText);
+    }
+
+    if (strcmp(command, "pause") == 0 || strcmp(command, "resume") == 0) {
+        sessionPause(session, strcmp(command, "pause") == 0);
+        return sendReply(sock, "ok");
+    }
+
+    if (strcmp(command, "hedge") == 0) {
+        snprintf(reply, sizeof(reply), "ok: racing %d transfers",
+                 sessionHedge(session));
+        return sendReply(sock, reply);
+    }
+
+    if (!arg) {
+        return sendReply(sock, "error: unknown command, or missing argument");
+    }
+
+    if (strcmp(command, "threads") == 0) {
+        threads = strtol(arg, &end, 10);
+        if (*end || threads < 1) {
+            return sendReply(sock, "error: invalid number of threads");
+        }
+
+        sessionSetWorkers(session, threads > INT32_MAX ? INT32_MAX : threads);
+        return sendReply(sock, "ok");
+    }
+
+    if (strcmp(command, "bandwidth") == 0) {
+        if (strcmp(arg, "off") == 0) {
+            rate = 0;
+        } else if (!parseSize(arg, &end, &rate) || *end) {
+            return sendReply(sock, "error: invalid rate");
+        }
+
+        sessionSetBandwidth(session, rate);
+        return sendReply(sock, "ok");
+    }
+
+    if (strcmp(command, "weight") == 0) {
+        weight = extra ? strtod(extra, &end) : -1;
+        if (!extra || *end || !(weight >= 0)) {
+            return sendReply(sock, "error: invalid weight");
+        }
+    } else if (strcmp(command, "disable") == 0) {
+        weight = 0;
+    } else if (strcmp(command, "enable") == 0) {
+        weight = defaultMirrorWeight;
+    } else {
+        return sendReply(sock, "error: unknown command");
+    }
+
+    return sendReply(sock, sessionSetMirrorWeight(session, arg, weight) ?
+                           "ok" : "error: out of memory");
+}
+
+/**
+ * @brief Wait until @p sock is readable, or the server is stopped
+ *
+ * @return @c true if @p sock is readable; @c false if the server is stopped,
+ *         or the wait timed out
+ */
+static bool waitReadable(controlServer *server, int sock, int timeout)
+{
+    struct pollfd pfds[2] = {
+        { .fd = sock, .events = POLLIN },
+        { .fd = server->stopPipe[0], .events = POLLIN },
+    };
+    int ready;
+
+    do {
+        ready = poll(pfds, 2, timeout);
+    } while (ready < 0 && errno == EINTR);
+
+    return ready > 0 && !pfds[1].revents;
+}
+
+/**
+ * @brief Carry out the commands of the client on @p sock until it hangs up
+ */
+static void serveClient(controlServer *server, int sock)
+{
+    char buf[maxCommandSize + 1];
+    size_t len = 0;
+
+    while (waitReadable(server, sock, clientTimeout)) {
+        char *line, *newline;
+        ssize_t got = recv(sock, buf + len, maxCommandSize - len, 0);
+
+        if (got <= 0) {
+            return;
+        }
+        len += got;
+        buf[len] = '\0';
+
+        for (line = buf; (newline = strchr(line, '\n')); line = newline + 1) {
+            *newline = '\0';
+            if (!runCommand(server, sock, line)) {
+                return;
+            }
+        }
+
+        /* Keep what's left of an incomplete line for the next read */
+        len -= line - buf;
+        memmove(buf, line, len);
+
+        if (len == maxCommandSize) {
+            sendReply(sock, "error: command too long");
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Accept clients until the server is stopped
+ */
+static void *controlThread(void *arg)
+{
+    controlServer *server = arg;
+
+    while (waitReadable(server, server->listenSock, -1)) {
+        int sock = accept(server->listenSock, NULL, NULL);
+
+        if (sock < 0) {
+            continue;
+        }
+
+        if (daemonCheckPeer(sock)) {
+            serveClient(server, sock);
+        }
+        close(sock);
+    }
+
+    return NULL;
+}
+
+controlServer *controlStart(const char *path, igdoSession *session)
+{
+    controlServer *server = calloc(1, sizeof(*server));
+    sigset_t all, old;
+    bool started;
+
+    if (!server) {
+        return NULL;
+    }
+
+    server->session = session;
+    server->stopPipe[0] = server->stopPipe[1] = -1;
+
+    server->path = strdup(path);
+    if (!server->path) {
+        goto fail;
+    }
+
+    if (pipe(server->stopPipe) != 0) {
+        goto fail;
+    }
+
+    server->listenSock = daemonListen(path);
+    if (server->listenSock < 0) {
+        goto fail;
+    }
+
+    /* Leave signals to the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    started = pthread_create(&server->thread, NULL, controlThread,
+                             server) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (started) {
+        return server;
+    }
+
+    close(server->listenSock);
+    unlink(path);
+
+fail:
+    if (server->stopPipe[0] >= 0) {
+        close(server->stopPipe[0]);
+        close(server->stopPipe[1]);
+    }
+    free(server->path);
+    free(server);
+
+    return NULL;
+}
+
+void controlStop(controlServer *server)
+{
+    if (!server) {
+        return;
+    }
+
+    /* This wakes up the control thread, whatever it's waiting for */
+    close(server->stopPipe[1]);
+    pthread_join(server->thread, NULL);
+
+    close(server->stopPipe[0]);
+    close(server->listenSock);
+    unlink(server->path);
+    free(server->path);
+    free(server);
+}
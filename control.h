@@ -0,0 +1,48 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_CONTROL_H
+#define PIGDO_CONTROL_H
+
+#include "libigdo/session.h"
+
+/**
+ * @brief A Unix socket through which a running session is tuned
+ *
+ * Clients send commands one per line, and each is answered with a single line
+ * starting with "ok" or "error"; "help" lists the commands. Clients are served
+ * one at a time, and only those running as the same user are accepted.
+ */
+typedef struct _controlServer controlServer;
+
+/**
+ * @brief Start taking commands for @p session on a socket at @p path
+ *
+ * A stale socket left at @p path by a process which is no longer running is
+ * replaced.
+ *
+ * @return The new server on success, or NULL on failure
+ */
+controlServer *controlStart(const char *path, igdoSession *session);
+
+/**
+ * @brief Stop taking commands, remove the socket and release @p server
+ */
+void controlStop(controlServer *server);
+
+#endif
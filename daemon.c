@@ -0,0 +1,577 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // for struct ucred
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "libigdo/fetch.h"
+#include "libigdo/util.h"
+
+#include "daemon.h"
+
+/**
+ * @brief Largest job accepted, in bytes
+ */
+#define maxJobSize (1024 * 1024)
+
+/**
+ * @brief Number of descriptors passed along with a job
+ */
+#define jobFds 2
+
+/**
+ * @brief Create @p dir private to this process's user, or check that it
+ *        already is
+ *
+ * Anyone may create a directory by that name in /tmp first; one which isn't
+ * this user's own, or which others may enter, is refused.
+ *
+ * @return @c true on success; @c false on failure, with @c errno set
+ */
+static bool privateDir(const char *dir)
+{
+    struct stat st;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    if (lstat(dir, &st) != 0) {
+        return false;
+    }
+
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 0077)) {
+        errno = EPERM;
+        return false;
+    }
+
+    return true;
+}
+
+char *daemonDefaultSocket(void)
+{
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+    char *dir, *path;
+
+    if (runtimeDir && *runtimeDir) {
+        return dircat(runtimeDir, "pigdod.sock");
+    }
+
+    if (asprintf(&dir, "/tmp/pigdod-%ju", (uintmax_t) geteuid()) < 0) {
+        return NULL;
+    }
+
+    path = privateDir(dir) ? dircat(dir, "pigdod.sock") : NULL;
+    free(dir);
+
+    return path;
+}
+
+/**
+ * @brief Fill in @p addr with @p path
+ *
+ * @return @c true on success; @c false if @p path is too long
+ */
+static bool socketAddress(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+
+    strcpy(addr->sun_path, path);
+
+    return true;
+}
+
+int daemonConnect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (!socketAddress(path, &addr)) {
+        return -1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int daemonListen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int sock, existing;
+    mode_t mask;
+
+    if (!socketAddress(path, &addr)) {
+        return -1;
+    }
+
+    /* A socket nobody answers on was left behind by a daemon which died */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        existing = daemonConnect(path);
+
+        if (existing >= 0) {
+            close(existing);
+            errno = EADDRINUSE;
+            return -1;
+        }
+
+        unlink(path);
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    /* Only the daemon's own user may submit jobs */
+    mask = umask(0077);
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(sock, SOMAXCONN) != 0) {
+        umask(mask);
+        close(sock);
+        return -1;
+    }
+
+    umask(mask);
+
+    return sock;
+}
+
+/**
+ * @brief Append @p key and @p value to the serialized job in @p buf
+ */
+static bool appendField(char **buf, size_t *len, const char *key,
+                        const char *value)
+{
+    size_t keyLen = strlen(key) + 1, valueLen = strlen(value) + 1;
+    char *grown = realloc(*buf, *len + keyLen + valueLen);
+
+    if (!grown) {
+        return false;
+    }
+
+    memcpy(grown + *len, key, keyLen);
+    memcpy(grown + *len + keyLen, value, valueLen);
+    *buf = grown;
+    *len += keyLen + valueLen;
+
+    return true;
+}
+
+/**
+ * @brief Append a local path to the serialized job in @p buf, resolved
+ *        against @p cwd if it is relative
+ */
+static bool appendPath(char **buf, size_t *len, const char *key,
+                       const char *path, const char *cwd)
+{
+    char *absolute;
+    bool ret;
+
+    if (isURI(path) || isAbsolute(path)) {
+        return appendField(buf, len, key, path);
+    }
+
+    absolute = dircat(cwd, path);
+    ret = absolute && appendField(buf, len, key, absolute);
+    free(absolute);
+
+    return ret;
+}
+
+/**
+ * @brief Append a mirror in 'mirror=path' format to the serialized job in
+ *        @p buf, resolving a relative local path against @p cwd
+ */
+static bool appendMirror(char **buf, size_t *len, const char *mirror,
+                         const char *cwd)
+{
+    const char *path = strchr(mirror, '=');
+    char *absolute, *resolved;
+    bool ret;
+
+    if (!path || isURI(path + 1) || isAbsolute(path + 1)) {
+        return appendField(buf, len, "mirror", mirror);
+    }
+
+    absolute = dircat(cwd, path + 1);
+    if (!absolute) {
+        return false;
+    }
+
+    ret = asprintf(&resolved, "%.*s=%s", (int) (path - mirror), mirror,
+                   absolute) >= 0;
+    free(absolute);
+
+    if (ret) {
+        ret = appendField(buf, len, "mirror", resolved);
+        free(resolved);
+    }
+
+    return ret;
+}
+
+bool daemonSendJob(int sock, const daemonJob *job)
+{
+    char *buf = NULL, range[64];
+    size_t len = 0;
+    uint32_t size;
+    int i, fds[jobFds] = { job->outFd, job->errFd };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov[2];
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    bool ret = false;
+
+    if (!appendField(&buf, &len, "cwd", job->cwd)) {
+        goto done;
+    }
+
+    for (i = 0; i < job->numJigdoFiles; i++) {
+        if (!appendPath(&buf, &len, "jigdo", job->jigdoFiles[i], job->cwd)) {
+            goto done;
+        }
+    }
+
+    for (i = 0; i < job->numOutputs; i++) {
+        if (!appendPath(&buf, &len, "output", job->outputs[i], job->cwd)) {
+            goto done;
+        }
+    }
+
+    if (job->templatePath &&
+        !appendPath(&buf, &len, "template", job->templatePath, job->cwd)) {
+        goto done;
+    }
+
+    for (i = 0; i < job->numMirrors; i++) {
+        if (!appendMirror(&buf, &len, job->mirrors[i], job->cwd)) {
+            goto done;
+        }
+    }
+
+    if (job->verbose && !appendField(&buf, &len, "verbose", "")) {
+        goto done;
+    }
+
+    if (job->verifyCopies && !appendField(&buf, &len, "verify-copies", "")) {
+        goto done;
+    }
+
+    if (job->range) {
+        snprintf(range, sizeof(range), "%"PRIu64"-%"PRIu64, job->rangeStart,
+                 job->rangeEnd);
+        if (!appendField(&buf, &len, "range", range)) {
+            goto done;
+        }
+    }
+
+    size = len;
+    iov[0].iov_base = &size;
+    iov[0].iov_len = sizeof(size);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+
+    memset(&control, 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    /* Jobs are small enough to go in one piece over a local socket, but
+     * don't count on it */
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent <= 0) {
+            goto done;
+        }
+
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+
+        while (msg.msg_iovlen > 0 && sent >= msg.msg_iov[0].iov_len) {
+            sent -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base += sent;
+            msg.msg_iov[0].iov_len -= sent;
+        }
+    }
+
+    ret = true;
+
+done:
+    free(buf);
+
+    return ret;
+}
+
+/**
+ * @brief Read all of @p len bytes from @p sock into @p data
+ */
+static bool recvAll(int sock, void *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t got = recv(sock, data, len, 0);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (got <= 0) {
+            return false;
+        }
+
+        data += got;
+        len -= got;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Append a copy of @p value to the list @p list of @p count strings
+ */
+static bool appendString(char ***list, int *count, const char *value)
+{
+    char **grown = realloc(*list, sizeof(grown[0]) * (*count + 1));
+
+    if (!grown) {
+        return false;
+    }
+
+    *list = grown;
+    grown[*count] = strdup(value);
+
+    return grown[(*count)++] != NULL;
+}
+
+bool daemonCheckPeer(int sock)
+{
+#if defined SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == geteuid();
+#else
+    /* The socket's permissions have to do */
+    return true;
+#endif
+}
+
+bool daemonReceiveJob(int sock, daemonJob *job)
+{
+    char *buf = NULL, *p, *end;
+    uint32_t size;
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int) * jobFds)];
+    } control;
+    struct iovec iov = { .iov_base = &size, .iov_len = sizeof(size) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t got;
+    bool ret = false;
+
+    memset(job, 0, sizeof(*job));
+    job->outFd = job->errFd = -1;
+
+    if (!daemonCheckPeer(sock)) {
+        return false;
+    }
+
+    do {
+        got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+
+    if (got <= 0) {
+        return false;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int) * jobFds)) {
+            int fds[jobFds];
+
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            job->outFd = fds[0];
+            job->errFd = fds[1];
+        }
+    }
+
+    if (job->outFd < 0 || (msg.msg_flags & MSG_CTRUNC) ||
+        !recvAll(sock, (void *) &size + got, sizeof(size) - got) ||
+        size == 0 || size > maxJobSize) {
+        goto done;
+    }
+
+    buf = malloc(size);
+    if (!buf || !recvAll(sock, buf, size) || buf[size - 1] != '\0') {
+        goto done;
+    }
+
+    for (p = buf, end = buf + size; p < end; p = strchr(p, '\0') + 1) {
+        const char *key = p, *value;
+
+        p = strchr(p, '\0') + 1;
+        if (p >= end) {
+            goto done;
+        }
+        value = p;
+
+        if (strcmp(key, "cwd") == 0) {
+            free(job->cwd);
+            job->cwd = strdup(value);
+            if (!job->cwd) {
+                goto done;
+            }
+        } else if (strcmp(key, "jigdo") == 0) {
+            if (!appendString(&job->jigdoFiles, &job->numJigdoFiles, value)) {
+                goto done;
+            }
+        } else if (strcmp(key, "output") == 0) {
+            if (!appendString(&job->outputs, &job->numOutputs, value)) {
+                goto done;
+            }
+        } else if (strcmp(key, "template") == 0) {
+            free(job->templatePath);
+            job->templatePath = strdup(value);
+            if (!job->templatePath) {
+                goto done;
+            }
+        } else if (strcmp(key, "mirror") == 0) {
+            if (!appendString(&job->mirrors, &job->numMirrors, value)) {
+                goto done;
+            }
+        } else if (strcmp(key, "verbose") == 0) {
+            job->verbose = true;
+        } else if (strcmp(key, "verify-copies") == 0) {
+            job->verifyCopies = true;
+        } else if (strcmp(key, "range") == 0) {
+            if (sscanf(value, "%"SCNu64"-%"SCNu64, &job->rangeStart,
+                       &job->rangeEnd) != 2) {
+                goto done;
+            }
+            job->range = true;
+        } else {
+            /* From a newer client, which needs a newer daemon */
+            goto done;
+        }
+    }
+
+    ret = job->cwd && job->numJigdoFiles > 0;
+
+done:
+    free(buf);
+
+    return ret;
+}
+
+bool daemonSendStatus(int sock, bool success)
+{
+    char status = success ? 0 : 1;
+
+    return send(sock, &status, sizeof(status), MSG_NOSIGNAL) == sizeof(status);
+}
+
+bool daemonReceiveStatus(int sock)
+{
+    char status;
+
+    return recvAll(sock, &status, sizeof(status)) && status == 0;
+}
+
+/**
+ * @brief Free the list @p list of @p count strings
+ */
+static void freeStrings(char **list, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(list[i]);
+    }
+    free(list);
+}
+
+void daemonFreeJob(daemonJob *job)
+{
+    freeStrings(job->jigdoFiles, job->numJigdoFiles);
+    freeStrings(job->outputs, job->numOutputs);
+    freeStrings(job->mirrors, job->numMirrors);
+    free(job->templatePath);
+    free(job->cwd);
+
+    if (job->outFd >= 0) {
+        close(job->outFd);
+    }
+
+    if (job->errFd >= 0) {
+        close(job->errFd);
+    }
+}
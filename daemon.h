@@ -0,0 +1,130 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_DAEMON_H
+#define PIGDO_DAEMON_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief A job submitted to pigdod by a pigdo client
+ *
+ * The client's standard output and error are passed along with the job, and
+ * the daemon reports on the job's progress to them directly. Once the job is
+ * done, the daemon answers with a single byte: 0 on success, or 1 on failure.
+ * A client which hangs up before then cancels its job.
+ */
+typedef struct {
+    char **jigdoFiles;    ///< Locations of the .jigdo files
+    int numJigdoFiles;    ///< Number of elements in @c jigdoFiles
+    char **outputs;       ///< Output locations given with -o, if any
+    int numOutputs;       ///< Number of elements in @c outputs
+    char *templatePath;   ///< Location of the .template file, or NULL
+    char **mirrors;       ///< Additional mirrors in 'mirror=path' format
+    int numMirrors;       ///< Number of elements in @c mirrors
+    char *cwd;            ///< The client's working directory, where output
+                          ///< files go when the .jigdo file is remote
+    bool verbose;         ///< Report on individual parts
+    bool verifyCopies;    ///< Read back each copy of the image
+    bool range;           ///< Only reconstruct part of the image
+    uint64_t rangeStart;  ///< Start of the range to reconstruct
+    uint64_t rangeEnd;    ///< End of the range to reconstruct, exclusive
+    int outFd;            ///< Where progress messages go
+    int errFd;            ///< Where error messages go
+} daemonJob;
+
+/**
+ * @brief Get the default location of pigdod's socket
+ *
+ * This is pigdod.sock in $XDG_RUNTIME_DIR if set, or else in a directory in
+ * /tmp named after the user's ID, which is created private to the user if it
+ * doesn't exist yet.
+ *
+ * @return A newly heap-allocated path, or NULL on failure, including when the
+ *         directory in /tmp exists but belongs to someone else or isn't
+ *         private
+ */
+char *daemonDefaultSocket(void);
+
+/**
+ * @brief Create a socket listening at @p path, replacing a stale socket left
+ *        there by a daemon which is no longer running
+ *
+ * @return The listening socket, or -1 on failure
+ */
+int daemonListen(const char *path);
+
+/**
+ * @brief Connect to the daemon listening at @p path
+ *
+ * @return The connected socket, or -1 on failure
+ */
+int daemonConnect(const char *path);
+
+/**
+ * @brief Check that the peer on @p sock runs as the same user as this process
+ *
+ * Where the peer's credentials aren't available, the permissions of the
+ * socket, which daemonListen() makes private to its user, have to do.
+ */
+bool daemonCheckPeer(int sock);
+
+/**
+ * @brief Send @p job, along with its output descriptors, over @p sock
+ *
+ * Relative paths are resolved against the client's working directory first.
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool daemonSendJob(int sock, const daemonJob *job);
+
+/**
+ * @brief Receive a job sent by daemonSendJob() from @p sock
+ *
+ * Only jobs from clients running as the same user as the daemon are accepted.
+ *
+ * @param job Where the job is stored; it must be released with
+ *            daemonFreeJob(), even on failure
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool daemonReceiveJob(int sock, daemonJob *job);
+
+/**
+ * @brief Tell the client on @p sock whether its job succeeded
+ *
+ * @return @c true on success; @c false if the client is gone
+ */
+bool daemonSendStatus(int sock, bool success);
+
+/**
+ * @brief Wait for the daemon on @p sock to say whether the job it was sent
+ *        succeeded
+ *
+ * @return @c true if the job succeeded; @c false if it failed, or the
+ *         connection was lost
+ */
+bool daemonReceiveStatus(int sock);
+
+/**
+ * @brief Release what daemonReceiveJob() allocated for @p job, and close its
+ *        output descriptors
+ */
+void daemonFreeJob(daemonJob *job);
+
+#endif
@@ -0,0 +1,663 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#if defined HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include "httpd.h"
+
+/**
+ * @brief Largest request header accepted, in bytes
+ */
+#define maxRequestSize 8192
+
+/**
+ * @brief Seconds a client may take to send its request, or to accept data
+ */
+#define socketTimeout 60
+
+/**
+ * @brief A connection being handled by an httpServer
+ */
+typedef struct _httpConnection {
+    int sock;
+    httpServer *server;
+    struct _httpConnection *next;
+} httpConnection;
+
+struct _httpServer {
+    int listenSock;
+    int port;
+    httpHandler handler;
+    void *data;
+    pthread_t acceptThread;
+    httpConnection *connections; ///< Connections being handled
+    bool stopping;               ///< Set once httpStop() has been called
+    pthread_mutex_t lock;        ///< Lock on @c connections and @c stopping
+    pthread_cond_t cond;         ///< Signaled as connections are closed
+};
+
+/**
+ * @brief Split @p address into a host and a port
+ *
+ * @return @c true on success; @c false if @p address is malformed
+ */
+static bool splitAddress(char *address, char **host, char **port)
+{
+    char *colon = strrchr(address, ':');
+
+    /* Getting the loopback address from getaddrinfo() may yield only ::1 */
+    if (!colon) {
+        *host = "127.0.0.1";
+        *port = address;
+        return *port[0] != '\0';
+    }
+
+    *colon = '\0';
+    *host = address;
+    *port = colon + 1;
+
+    /* IPv6 addresses are bracketed to tell them apart from the port */
+    if (**host == '[') {
+        size_t len = strlen(*host);
+
+        if (len < 2 || (*host)[len - 1] != ']') {
+            return false;
+        }
+        (*host)[len - 1] = '\0';
+        (*host)++;
+    }
+
+    return **host != '\0' && **port != '\0';
+}
+
+/**
+ * @brief Open a listening socket on @p address
+ *
+ * @param port Where the port which the socket is bound to is stored
+ *
+ * @return The socket on success, or -1 on failure
+ */
+static int listenOn(const char *address, int *port)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res, *ai;
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    char *copy, *host, *service, portString[NI_MAXSERV];
+    int sock = -1, one = 1;
+
+    copy = strdup(address);
+    if (!copy) {
+        return -1;
+    }
+
+    if (!splitAddress(copy, &host, &service) ||
+        getaddrinfo(host, service, &hints, &res) != 0) {
+        free(copy);
+        return -1;
+    }
+    free(copy);
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(sock, SOMAXCONN) == 0) {
+            break;
+        }
+
+        close(sock);
+        sock = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (sock >= 0 &&
+        (getsockname(sock, (struct sockaddr *) &bound, &boundLen) != 0 ||
+         getnameinfo((struct sockaddr *) &bound, boundLen, NULL, 0,
+                     portString, sizeof(portString), NI_NUMERICSERV) != 0)) {
+        close(sock);
+        return -1;
+    }
+
+    if (sock >= 0) {
+        *port = atoi(portString);
+    }
+
+    return sock;
+}
+
+/**
+ * @brief Send all of @p len bytes at @p data to @p sock
+ */
+static bool sendAll(int sock, const void *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent <= 0) {
+            return false;
+        }
+
+        data += sent;
+        len -= sent;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read a request header from @p sock into @p buf, up to and including
+ *        the blank line which ends it
+ *
+ * @return @c true on success; @c false on failure or if the header is too big
+ */
+static bool readRequest(int sock, char *buf, size_t size)
+{
+    size_t got = 0;
+
+    while (got < size - 1) {
+        ssize_t n = recv(sock, buf + got, size - 1 - got, 0);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        got += n;
+        buf[got] = '\0';
+
+        if (strstr(buf, "\r\n\r\n")) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Decode %XX escapes in @p path, in place
+ *
+ * @return @c true on success; @c false if @p path is malformed
+ */
+static bool decodePath(char *path)
+{
+    char *in, *out;
+
+    for (in = out = path; *in; in++, out++) {
+        unsigned hex;
+
+        if (*in != '%') {
+            *out = *in;
+            continue;
+        }
+
+        if (sscanf(in + 1, "%2x", &hex) != 1 || hex == 0 ||
+            !in[1] || !in[2]) {
+            return false;
+        }
+
+        *out = hex;
+        in += 2;
+    }
+
+    *out = '\0';
+
+    return true;
+}
+
+/**
+ * @brief Parse the request header in @p buf into @p request
+ *
+ * @return 0 on success, or the HTTP status to respond with on failure
+ */
+static int parseRequest(char *buf, httpRequest *request)
+{
+    char *line, *next, *method, *path, *version, *query;
+
+    next = strstr(buf, "\r\n");
+    *next = '\0';
+    next += 2;
+
+    method = strtok_r(buf, " ", &line);
+    path = strtok_r(NULL, " ", &line);
+    version = strtok_r(NULL, " ", &line);
+
+    if (!method || !path || !version || strncmp(version, "HTTP/1.", 7) != 0) {
+        return 400;
+    }
+
+    if (strcmp(method, "GET") == 0) {
+        request->head = false;
+    } else if (strcmp(method, "HEAD") == 0) {
+        request->head = true;
+    } else {
+        return 405;
+    }
+
+    query = strchr(path, '?');
+    if (query) {
+        *query = '\0';
+    }
+
+    if (path[0] != '/' || !decodePath(path)) {
+        return 400;
+    }
+    request->path = path;
+    request->range = NULL;
+
+    /* Of all the headers, only Range matters */
+    for (line = next; (next = strstr(line, "\r\n")) && next != line;
+         line = next + 2) {
+        *next = '\0';
+
+        if (strncasecmp(line, "Range:", 6) == 0) {
+            for (line += 6; *line == ' ' || *line == '\t'; line++);
+            request->range = line;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle the request on a connection, then close it
+ */
+static void *connectionThread(void *arg)
+{
+    httpConnection *conn = arg, **link;
+    httpServer *server = conn->server;
+    httpRequest request = { .sock = conn->sock };
+    struct timeval timeout = { .tv_sec = socketTimeout };
+    char *buf = malloc(maxRequestSize);
+    int status;
+
+    setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (buf && readRequest(conn->sock, buf, maxRequestSize)) {
+        status = parseRequest(buf, &request);
+
+        if (status == 0) {
+            server->handler(&request, server->data);
+        } else {
+            httpSendStatus(&request, status);
+        }
+    }
+
+    free(buf);
+
+    pthread_mutex_lock(&server->lock);
+
+    for (link = &server->connections; *link != conn; link = &(*link)->next);
+    *link = conn->next;
+
+    close(conn->sock);
+    free(conn);
+
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Accept connections until the server is stopped
+ */
+static void *acceptThread(void *arg)
+{
+    httpServer *server = arg;
+
+    while (true) {
+        httpConnection *conn;
+        pthread_t tid;
+        int sock = accept(server->listenSock, NULL, NULL);
+
+        pthread_mutex_lock(&server->lock);
+
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            if (sock >= 0) {
+                close(sock);
+            }
+            break;
+        }
+
+        if (sock < 0) {
+            pthread_mutex_unlock(&server->lock);
+
+            /* Out of file descriptors, or the like; back off a little */
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(100000);
+            }
+            continue;
+        }
+
+        conn = malloc(sizeof(*conn));
+
+        if (!conn) {
+            pthread_mutex_unlock(&server->lock);
+            close(sock);
+            continue;
+        }
+
+        conn->sock = sock;
+        conn->server = server;
+        conn->next = server->connections;
+        server->connections = conn;
+
+        if (pthread_create(&tid, NULL, connectionThread, conn) == 0) {
+            pthread_detach(tid);
+        } else {
+            server->connections = conn->next;
+            close(sock);
+            free(conn);
+        }
+
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    return NULL;
+}
+
+httpServer *httpStart(const char *address, httpHandler handler, void *data)
+{
+    httpServer *server = calloc(1, sizeof(*server));
+    sigset_t all, old;
+    bool started;
+
+    if (!server) {
+        return NULL;
+    }
+
+    server->handler = handler;
+    server->data = data;
+    server->listenSock = listenOn(address, &server->port);
+
+    if (server->listenSock < 0) {
+        free(server);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&server->lock, NULL) != 0) {
+        goto failMutex;
+    }
+
+    if (pthread_cond_init(&server->cond, NULL) != 0) {
+        goto failCond;
+    }
+
+    /* Leave signals to the main thread; connection threads inherit this */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    started = pthread_create(&server->acceptThread, NULL, acceptThread,
+                             server) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (started) {
+        return server;
+    }
+
+    pthread_cond_destroy(&server->cond);
+failCond:
+    pthread_mutex_destroy(&server->lock);
+failMutex:
+    close(server->listenSock);
+    free(server);
+
+    return NULL;
+}
+
+void httpStop(httpServer *server)
+{
+    httpConnection *conn;
+
+    if (!server) {
+        return;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->stopping = true;
+    pthread_mutex_unlock(&server->lock);
+
+    /* This wakes up the accept(2) call in acceptThread() */
+    shutdown(server->listenSock, SHUT_RDWR);
+    pthread_join(server->acceptThread, NULL);
+    close(server->listenSock);
+
+    pthread_mutex_lock(&server->lock);
+
+    for (conn = server->connections; conn; conn = conn->next) {
+        shutdown(conn->sock, SHUT_RDWR);
+    }
+
+    while (server->connections) {
+        pthread_cond_wait(&server->cond, &server->lock);
+    }
+
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_cond_destroy(&server->cond);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
+
+int httpGetPort(const httpServer *server)
+{
+    return server->port;
+}
+
+int httpParseRange(const httpRequest *request, uint64_t size,
+                   uint64_t *start, uint64_t *end)
+{
+    const char *spec = request->range;
+    uint64_t first, last;
+    int consumed = 0;
+
+    *start = 0;
+    *end = size;
+
+    /* Malformed ranges are ignored, as are requests for several ranges */
+    if (!spec || strncmp(spec, "bytes=", 6) != 0 || strchr(spec, ',')) {
+        return 200;
+    }
+    spec += 6;
+
+    if (sscanf(spec, "-%"SCNu64"%n", &last, &consumed) == 1 &&
+        !spec[consumed]) {
+        /* A suffix of the resource */
+        if (last == 0 || size == 0) {
+            return 416;
+        }
+
+        *start = last < size ? size - last : 0;
+        return 206;
+    }
+
+    if (sscanf(spec, "%"SCNu64"-%n", &first, &consumed) != 1 || !consumed) {
+        return 200;
+    }
+
+    if (spec[consumed]) {
+        int more = 0;
+
+        if (sscanf(spec + consumed, "%"SCNu64"%n", &last, &more) != 1 ||
+            spec[consumed + more] || last < first) {
+            return 200;
+        }
+    } else {
+        last = UINT64_MAX - 1;
+    }
+
+    if (first >= size) {
+        return 416;
+    }
+
+    *start = first;
+    *end = last < size - 1 ? last + 1 : size;
+
+    return 206;
+}
+
+/**
+ * @brief Get the reason phrase for HTTP status @p status
+ */
+static const char *reasonPhrase(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 416: return "Range Not Satisfiable";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default:  return "Unknown";
+    }
+}
+
+bool httpSendHeaders(const httpRequest *request, int status, const char *type,
+                     uint64_t length, uint64_t start, uint64_t size)
+{
+    char header[512], range[128] = "";
+    int len;
+
+    if (status == 206) {
+        snprintf(range, sizeof(range), "Content-Range: bytes %"PRIu64"-%"
+                 PRIu64"/%"PRIu64"\r\n", start, start + length - 1, size);
+    } else if (status == 416) {
+        snprintf(range, sizeof(range), "Content-Range: bytes */%"PRIu64"\r\n",
+                 size);
+    }
+
+    len = snprintf(header, sizeof(header),
+                   "HTTP/1.1 %d %s\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Length: %"PRIu64"\r\n"
+                   "Accept-Ranges: bytes\r\n"
+                   "%s"
+                   "Connection: close\r\n"
+                   "\r\n", status, reasonPhrase(status), type, length, range);
+
+    return len < sizeof(header) && sendAll(request->sock, header, len);
+}
+
+bool httpSendStatus(const httpRequest *request, int status)
+{
+    return httpSendHeaders(request, status, "text/plain", 0, 0, 0);
+}
+
+bool httpSendData(const httpRequest *request, const void *data, size_t len)
+{
+    return request->head || sendAll(request->sock, data, len);
+}
+
+bool httpSendFile(const httpRequest *request, int fd, uint64_t offset,
+                  uint64_t len)
+{
+    static const size_t bufSize = 1024 * 1024;
+    char *buf;
+    bool ret = false;
+
+    if (request->head) {
+        return true;
+    }
+
+#if defined HAVE_SYS_SENDFILE_H
+    while (len > 0) {
+        off_t off = offset;
+        ssize_t sent = sendfile(request->sock, fd, &off, len);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        /* Some files can't be sent from; copy those through a buffer */
+        if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+
+        if (sent <= 0) {
+            return false;
+        }
+
+        offset += sent;
+        len -= sent;
+    }
+
+    if (len == 0) {
+        return true;
+    }
+#endif
+
+    buf = malloc(bufSize);
+    if (!buf) {
+        return false;
+    }
+
+    while (len > 0) {
+        ssize_t got = pread(fd, buf, len < bufSize ? len : bufSize, offset);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (got <= 0 || !sendAll(request->sock, buf, got)) {
+            goto done;
+        }
+
+        offset += got;
+        len -= got;
+    }
+
+    ret = true;
+
+done:
+    free(buf);
+
+    return ret;
+}
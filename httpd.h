@@ -0,0 +1,125 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_HTTPD_H
+#define PIGDO_HTTPD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief A minimal HTTP/1.1 server, for GET and HEAD requests
+ *
+ * Each connection is handled on a thread of its own, and carries a single
+ * request; responses are always sent with "Connection: close".
+ */
+typedef struct _httpServer httpServer;
+
+/**
+ * @brief A request received by an httpServer
+ */
+typedef struct {
+    int sock;             ///< The connection the request arrived on
+    bool head;            ///< Set for HEAD requests, which get no body
+    const char *path;     ///< Decoded path, without any query string
+    const char *range;    ///< Value of the Range header, or NULL
+} httpRequest;
+
+/**
+ * @brief Respond to @p request
+ *
+ * Called on the connection's own thread, and may block for as long as it
+ * needs to.
+ */
+typedef void (*httpHandler)(const httpRequest *request, void *data);
+
+/**
+ * @brief Start serving HTTP on @p address
+ *
+ * @param address Where to listen, in '[host:]port' format; the host defaults
+ *                to 127.0.0.1. IPv6 hosts may be given in brackets.
+ * @param handler Called for each well-formed GET or HEAD request
+ * @param data Passed to @p handler
+ *
+ * @return The new server on success, or NULL on failure
+ */
+httpServer *httpStart(const char *address, httpHandler handler, void *data);
+
+/**
+ * @brief Stop accepting connections, shut down those in progress, and wait
+ *        for their handlers to return before releasing @p server
+ */
+void httpStop(httpServer *server);
+
+/**
+ * @brief Get the port which @p server is listening on
+ */
+int httpGetPort(const httpServer *server);
+
+/**
+ * @brief Work out which bytes of a resource of @p size bytes were requested
+ *
+ * Only single ranges are supported; requests for several ranges are treated
+ * like requests for the whole resource, which RFC 7233 permits.
+ *
+ * @param start Where the first requested byte is stored
+ * @param end Where the end of the requested range is stored, exclusive
+ *
+ * @return 206 for a range, 200 for the whole resource, or 416 if the range
+ *         can't be satisfied
+ */
+int httpParseRange(const httpRequest *request, uint64_t size,
+                   uint64_t *start, uint64_t *end);
+
+/**
+ * @brief Send the status line and headers of a response
+ *
+ * @param status The HTTP status code
+ * @param type The Content-Type of the body
+ * @param length The Content-Length of the body
+ * @param start,size If @p status is 206, the offset of the body within the
+ *                   resource and the size of the resource, for Content-Range
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool httpSendHeaders(const httpRequest *request, int status, const char *type,
+                     uint64_t length, uint64_t start, uint64_t size);
+
+/**
+ * @brief Send a response with an empty body, e.g. for an error
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool httpSendStatus(const httpRequest *request, int status);
+
+/**
+ * @brief Send @p len bytes of @p data as (part of) the body of a response
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool httpSendData(const httpRequest *request, const void *data, size_t len);
+
+/**
+ * @brief Send @p len bytes at @p offset of @p fd as (part of) the body of a
+ *        response, with sendfile(2) where possible
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool httpSendFile(const httpRequest *request, int fd, uint64_t offset,
+                  uint64_t len);
+
+#endif
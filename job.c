@@ -0,0 +1,892 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // for O_DIRECT
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <libgen.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#if defined HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "libigdo/jigdo.h"
+#include "libigdo/fetch.h"
+#include "libigdo/metrics.h"
+#include "libigdo/stats.h"
+#include "libigdo/trace.h"
+#include "libigdo/util.h"
+
+#include "job.h"
+
+/**
+ * @brief Alignment of O_DIRECT I/O to regular files
+ *
+ * This is the page size or filesystem block size on most systems, either of
+ * which satisfies the requirements of all common filesystems.
+ */
+#define directFileAlign 4096
+
+/**
+ * @brief Milliseconds between updates of the progress counts
+ */
+#define progressInterval 100
+
+/**
+ * @brief Account for a stage of reading an image, started at @p mark, which has
+ *        just finished, in the statistics and the trace
+ */
+static void endStage(const statsMark *mark, const char *stage,
+                     metricsWork work, const traceArgs *args)
+{
+    statsEnd(mark, stage, work);
+    traceSpan("image", stage, mark->start, metricsNow(), args);
+}
+
+/**
+ * @brief Check that the block device @p fd can hold the image, and get the
+ *        alignment required for O_DIRECT I/O to it
+ *
+ * Block devices are not preallocated, and whatever they contain is never
+ * considered to be partial output from an earlier run.
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool prepareBlockDevice(const jobReport *report, int fd,
+                               const char *path, uint64_t imageSize,
+                               size_t *align)
+{
+#if defined HAVE_LINUX_FS_H && defined BLKGETSIZE64 && defined BLKSSZGET
+    uint64_t deviceSize;
+    int sectorSize;
+
+    if (ioctl(fd, BLKGETSIZE64, &deviceSize) != 0 ||
+        ioctl(fd, BLKSSZGET, &sectorSize) != 0) {
+        fprintf(report->err, "Failed to query block device '%s'\n", path);
+        return false;
+    }
+
+    if (deviceSize < imageSize) {
+        fprintf(report->err, "Block device '%s' is too small for the image\n",
+                path);
+        return false;
+    }
+
+    *align = sectorSize;
+
+    return true;
+#else
+    fprintf(report->err, "Writing to block devices is not supported on this "
+            "platform\n");
+    return false;
+#endif
+}
+
+/**
+ * @brief Open the output of an image which is written in order, and queue the
+ *        data stored in the template on it
+ *
+ * @param imagePath Location of the output, or NULL for standard output
+ * @param fp The .template file, positioned anywhere
+ */
+static bool openStream(const jobReport *report, sessionImage *image,
+                       const char *imagePath, uint64_t imageSize, FILE *fp,
+                       const outputSettings *settings)
+{
+    traceArgs args = { .image = image->name };
+    struct stat st;
+    statsMark mark;
+    size_t align;
+    int flags = O_WRONLY | O_CREAT;
+
+    if (settings->direct) {
+        fprintf(report->err,
+                "Streamed output can't be written with O_DIRECT\n");
+        return false;
+    }
+
+    if (imagePath) {
+        /* A regular file can only be written from the start */
+        if (stat(imagePath, &st) != 0 || S_ISREG(st.st_mode)) {
+            flags |= O_TRUNC;
+        }
+
+        image->fd = open(imagePath, flags, 0644);
+        if (image->fd < 0) {
+            fprintf(report->err, "Failed to open image file '%s'\n",
+                    imagePath);
+            return false;
+        }
+
+        if (fstat(image->fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+            !prepareBlockDevice(report, image->fd, imagePath, imageSize,
+                                &align)) {
+            return false;
+        }
+    } else {
+        image->fd = settings->stdoutFd;
+    }
+
+    image->stream = streamOpen(image->fd, imageSize, settings->window);
+    if (!image->stream) {
+        return false;
+    }
+
+    statsBegin(&mark);
+    image->templateData = streamDataFromTemplate(fp, image->table,
+                                                 image->stream);
+    endStage(&mark, "template data", METRICS_WORK_DECOMPRESS, &args);
+
+    return image->templateData != NULL;
+}
+
+/**
+ * @brief Open a seekable output file, and make sure it can hold the image
+ *
+ * Block devices and files opened with O_DIRECT are declared to the output
+ * engine as such.
+ *
+ * @param existing Set if the file was already large enough to hold the image,
+ *                 in which case it may hold output from an earlier run
+ *
+ * @return The file descriptor on success, or -1 on failure
+ */
+static int openOutputFile(const jobReport *report, const char *imagePath,
+                          uint64_t imageSize, const outputSettings *settings,
+                          bool *existing)
+{
+    struct stat st;
+    bool resize, blockDevice, useDirect;
+    size_t align = directFileAlign;
+    int fd, flags = O_RDWR | O_CREAT;
+
+    *existing = false;
+
+    /* Block devices are written in place, bypassing the page cache */
+    blockDevice = stat(imagePath, &st) == 0 && S_ISBLK(st.st_mode);
+    useDirect = settings->direct || blockDevice;
+
+    /* Files can only be declared to an engine before it is first used */
+    if (useDirect && settings->sharedEngine) {
+        fprintf(report->err, "'%s' can't be written with O_DIRECT here\n",
+                imagePath);
+        return -1;
+    }
+
+    if (useDirect) {
+#if defined O_DIRECT
+        flags |= O_DIRECT;
+#else
+        fprintf(report->err, "O_DIRECT is not supported on this platform\n");
+        return -1;
+#endif
+    }
+
+    fd = open(imagePath, flags, 0644);
+
+    if (fd < 0) {
+        fprintf(report->err, "Failed to open image file '%s'\n", imagePath);
+        return -1;
+    }
+
+    if (blockDevice) {
+        if (!prepareBlockDevice(report, fd, imagePath, imageSize, &align)) {
+            goto fail;
+        }
+    } else if (lseek(fd, 0, SEEK_END) < imageSize) {
+#ifdef HAVE_POSIX_FALLOCATE
+        /* Only allocate what will be written of a partial image */
+        if (settings->range || settings->numShards) {
+            resize = (ftruncate(fd, imageSize) == 0);
+        } else {
+            resize = (posix_fallocate(fd, 0, imageSize) == 0);
+        }
+#else
+        /* Poor man's fallocate(2); much slower than the real thing */
+        resize = (ftruncate(fd, imageSize) == 0);
+#endif
+        if (!resize) {
+            fprintf(report->err,
+                    "Failed to allocate disk space for image file\n");
+            goto fail;
+        }
+    } else {
+        *existing = true;
+    }
+
+    if (useDirect && !outputAddDirectFd(settings->engine, fd, align)) {
+        fprintf(report->err, "The %s output engine can't write with O_DIRECT\n",
+                outputEngineName(outputGetType(settings->engine)));
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    close(fd);
+
+    return -1;
+}
+
+/**
+ * @brief Write the template data to an output file shared with other
+ *        processes, unless one of them has already
+ *
+ * The template data is claimed as a whole, as a single byte past the end of
+ * the image, where no part's claim can overlap it. A process which dies while
+ * writing it releases its claim, and another one writes it instead.
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeSharedData(const jobReport *report, FILE *fp,
+                            sessionImage *image,
+                            const outputSettings *settings)
+{
+    uint64_t claimOffset = jigdoGetImageSize(image->table);
+    traceArgs args = { .image = image->name };
+    statsMark mark;
+    bool written;
+
+    switch (claimRange(settings->claims, claimOffset, 1, true)) {
+        case CLAIM_ACQUIRED:
+            break;
+        case CLAIM_DONE:
+            return true;
+        default:
+            fprintf(report->err, "Failed to claim the template data\n");
+            return false;
+    }
+
+    statsBegin(&mark);
+    written = writeDataFromTemplate(fp, &image->fd, 1, image->table,
+                                    settings->engine);
+    endStage(&mark, "template data", METRICS_WORK_DECOMPRESS, &args);
+
+    return claimRelease(settings->claims, claimOffset, 1, written) && written;
+}
+
+bool jobOpenImage(const jobReport *report, sessionImage *image,
+                  const char *jigdoFile, const char *templatePath,
+                  const char *imagePath, char **copyPaths, int numCopies,
+                  const char *outDir, char **mirrors, int numMirrors,
+                  const outputSettings *settings)
+{
+    FILE *fp = NULL;
+    bool exists, existing, ret = false;
+    char *jigdoCopy = NULL, *tmpTemplatePath = NULL, *tmpImagePath = NULL;
+    const char *jigdoDir, *templateName;
+    uint64_t imageSize;
+    traceArgs args = { .uri = jigdoFile };
+    statsMark mark;
+    struct stat st;
+    int i, *fds = NULL;
+
+    statsBegin(&mark);
+    image->jigdo = jigdoReadJigdoFile(jigdoFile);
+    endStage(&mark, "read jigdo", METRICS_WORK_COUNT, &args);
+
+    if (image->jigdo) {
+            image->name = jigdoGetImageName(image->jigdo);
+            templateName = jigdoGetTemplateName(image->jigdo);
+
+            fprintf(report->out, "Successfully read jigdo file for '%s'\n",
+                    image->name);
+            fprintf(report->out, "Template filename is: %s\n", templateName);
+            fprintf(report->out, "Template MD5 sum is: %s\n",
+                    jigdoGetTemplateMD5(image->jigdo));
+    } else {
+            fprintf(report->err, "Failed to read jigdo file '%s'\n",
+                    jigdoFile);
+            goto done;
+    }
+
+    // dirname(3) may modify its argument
+    jigdoCopy = strdup(jigdoFile);
+    if (!jigdoCopy) {
+        goto done;
+    }
+    jigdoDir = dirname(jigdoCopy);
+
+    if (!templatePath) {
+        if (isURI(templateName) || isAbsolute(templateName)) {
+            tmpTemplatePath = strdup(templateName);
+        } else {
+            tmpTemplatePath = dircat(jigdoDir, templateName);
+        }
+        templatePath = tmpTemplatePath;
+    }
+
+    if (!templatePath) {
+        fprintf(report->err, "Failed to build the template path.\n");
+        goto done;
+    }
+
+    fp = fetchopen(templatePath);
+
+    if (!fp) {
+        fprintf(report->err, "Unable to open '%s' for reading\n",
+                templatePath);
+        goto done;
+    }
+
+    statsBegin(&mark);
+    image->table = jigdoReadTemplateFile(fp);
+    args.image = image->name;
+    args.uri = templatePath;
+    endStage(&mark, "read template", METRICS_WORK_COUNT, &args);
+
+    if (!image->table) {
+        fprintf(report->err, "Failed to read the template DESC table.\n");
+        goto done;
+    }
+
+    for (i = 0; i < numMirrors; i++) {
+        /* addServerMirror() modifies its argument, and mirrors are shared
+         * between all images. */
+        char *mirror = strdup(mirrors[i]);
+        bool added = mirror && addServerMirror(image->jigdo, mirror);
+
+        free(mirror);
+
+        if (!added) {
+            fprintf(report->err, "Invalid mirror specification '%s'\n",
+                    mirrors[i]);
+            goto done;
+        }
+    }
+
+    imageSize = jigdoGetImageSize(image->table);
+
+    fprintf(report->out, "Image size is: %"PRIu64" bytes\n", imageSize);
+    fprintf(report->out, "Image md5sum is: %s\n",
+            jigdoGetImageMD5(image->table));
+
+    if (settings->range) {
+        uint64_t start, end;
+
+        if (!jigdoSetRange(image->table, settings->rangeStart,
+                           settings->rangeEnd)) {
+            fprintf(report->err,
+                    "The range starts past the end of the image\n");
+            goto done;
+        }
+
+        jigdoGetRange(image->table, &start, &end);
+        fprintf(report->out,
+                "Reconstructing bytes %"PRIu64"-%"PRIu64" of the image\n",
+                start, end);
+    }
+
+    if (settings->numShards) {
+        if (!jigdoSetShard(image->table, settings->shard,
+                           settings->numShards)) {
+            fprintf(report->err, "Failed to divide the image into shards\n");
+            goto done;
+        }
+
+        fprintf(report->out, "Reconstructing shard %d of %d of the image\n",
+                settings->shard, settings->numShards);
+    }
+
+    if (settings->noOutput) {
+        ret = true;
+        goto done;
+    }
+
+    if (!imagePath) {
+        if (outDir) {
+            tmpImagePath = dircat(outDir, image->name);
+        } else if (isURI(jigdoFile)) {
+            tmpImagePath = strdup(image->name);
+        } else {
+            tmpImagePath = dircat(jigdoDir, image->name);
+        }
+        imagePath = tmpImagePath;
+    }
+
+    if (!imagePath) {
+        goto done;
+    }
+
+    if (strcmp(imagePath, "-") == 0 && numCopies == 0) {
+        ret = openStream(report, image, NULL, imageSize, fp, settings);
+        goto done;
+    }
+
+    /* Pipes and character devices can only be written in order */
+    exists = stat(imagePath, &st) == 0;
+    if (settings->stream ||
+        (exists && (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)))) {
+        if (numCopies > 0) {
+            fprintf(report->err, "Copies can't be streamed to '%s'\n",
+                    imagePath);
+            goto done;
+        }
+
+        if (settings->range) {
+            fprintf(report->err, "A range can't be streamed to '%s'\n",
+                    imagePath);
+            goto done;
+        }
+
+        ret = openStream(report, image, imagePath, imageSize, fp, settings);
+        goto done;
+    }
+
+    image->fd = openOutputFile(report, imagePath, imageSize, settings,
+                               &existing);
+    if (image->fd < 0) {
+        goto done;
+    }
+
+    /* Whatever several outputs held before can't be relied upon to match, and
+     * what is complete in a shared output is known from its claims */
+    if (existing && numCopies == 0 && !settings->claims) {
+        jigdoSetExistingFile(image->table, true);
+    }
+
+    /* The template data goes to the image and all of its copies alike */
+    fds = malloc(sizeof(fds[0]) * (numCopies + 1));
+    image->copyFds = malloc(sizeof(image->copyFds[0]) *
+                            (numCopies ? numCopies : 1));
+    if (!fds || !image->copyFds) {
+        goto done;
+    }
+    fds[0] = image->fd;
+
+    for (i = 0; i < numCopies; i++) {
+        if (stat(copyPaths[i], &st) == 0 &&
+            (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode))) {
+            fprintf(report->err, "Copies can't be streamed to '%s'\n",
+                    copyPaths[i]);
+            goto done;
+        }
+
+        image->copyFds[i] = openOutputFile(report, copyPaths[i], imageSize,
+                                           settings, &existing);
+        if (image->copyFds[i] < 0) {
+            goto done;
+        }
+        image->numCopies++;
+        fds[i + 1] = image->copyFds[i];
+    }
+
+    if (settings->claims) {
+        ret = writeSharedData(report, fp, image, settings);
+        goto done;
+    }
+
+    statsBegin(&mark);
+    ret = writeDataFromTemplate(fp, fds, numCopies + 1, image->table,
+                                settings->engine);
+    endStage(&mark, "template data", METRICS_WORK_DECOMPRESS, &args);
+
+done:
+    if (fp) {
+        fclose(fp);
+    }
+
+    free(fds);
+    free(jigdoCopy);
+    free(tmpTemplatePath);
+    free(tmpImagePath);
+
+    return ret;
+}
+
+/**
+ * @brief Get output file @p n of @p image: the output file itself for 0, or
+ *        one of its copies after that
+ */
+static int outputFd(const sessionImage *image, int n)
+{
+    return n == 0 ? image->fd : image->copyFds[n - 1];
+}
+
+bool jobCheckOutputs(const jobReport *report, const sessionImage *images,
+                     int numImages)
+{
+    struct stat st, other;
+    int i, j, m, n;
+
+    for (i = 0; i < numImages; i++) {
+        for (n = 0; n <= images[i].numCopies; n++) {
+            if (outputFd(images + i, n) < 0 ||
+                fstat(outputFd(images + i, n), &st) != 0) {
+                continue;
+            }
+
+            /* Compare with every output before this one */
+            for (j = 0; j <= i; j++) {
+                for (m = 0; m < (j < i ? images[j].numCopies + 1 : n); m++) {
+                    if (outputFd(images + j, m) < 0 ||
+                        fstat(outputFd(images + j, m), &other) != 0 ||
+                        other.st_dev != st.st_dev ||
+                        other.st_ino != st.st_ino) {
+                        continue;
+                    }
+
+                    if (j == i) {
+                        fprintf(report->err, "'%s' would be written to the "
+                                "same file more than once\n", images[i].name);
+                    } else {
+                        fprintf(report->err, "Images %d ('%s') and %d ('%s') "
+                                "would be written to the same file\n", j + 1,
+                                images[j].name, i + 1, images[i].name);
+                    }
+
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+void jobCloseImages(sessionImage *images, int numImages,
+                    const outputSettings *settings)
+{
+    int i, j;
+
+    for (i = 0; i < numImages; i++) {
+        streamClose(images[i].stream);
+        free(images[i].templateData);
+
+        for (j = 0; j < images[i].numCopies; j++) {
+            close(images[i].copyFds[j]);
+        }
+        free(images[i].copyFds);
+
+        if (images[i].fd >= 0 && images[i].fd != settings->stdoutFd) {
+            close(images[i].fd);
+        }
+
+        freeTemplateDescTable(images[i].table);
+        freeJigdoData(images[i].jigdo);
+    }
+}
+
+static const char *partSourceNames[] = {
+    [PART_SOURCE_MIRROR] = "fetched",
+    [PART_SOURCE_LOCAL] = "local",
+    [PART_SOURCE_CACHE] = "cached",
+    [PART_SOURCE_DUPLICATE] = "duplicate",
+    [PART_SOURCE_PEER] = "peer",
+    [PART_SOURCE_SHARED] = "shared",
+    [PART_SOURCE_IMPORT] = "imported",
+};
+
+/**
+ * @brief Count the parts from @p source which were completed, however they
+ *        were placed
+ */
+static int countPlaced(const sessionProgress *progress, partSource source)
+{
+    int method, total = 0;
+
+    for (method = 0; method < PLACE_METHOD_COUNT; method++) {
+        total += progress->placeCounts[source][method];
+    }
+
+    return total;
+}
+
+/**
+ * @brief Print a summary of how locally available files were placed, of how
+ *        many files were fetched from peers rather than mirrors, and of how
+ *        many were completed by other processes sharing the output
+ */
+static void printPlaceSummary(const jobReport *report,
+                              const sessionProgress *progress)
+{
+    int method, source;
+
+    for (source = PART_SOURCE_LOCAL; source < PART_SOURCE_COUNT; source++) {
+        int total = countPlaced(progress, source);
+        const char *sep = "";
+
+        /* Only parts from local sources are placed by some method */
+        if (total == 0 || source == PART_SOURCE_PEER ||
+            source == PART_SOURCE_SHARED) {
+            continue;
+        }
+
+        fprintf(report->out, "Placed %d %s files:", total,
+                partSourceNames[source]);
+
+        for (method = 0; method < PLACE_METHOD_COUNT; method++) {
+            if (progress->placeCounts[source][method]) {
+                fprintf(report->out, "%s %d via %s", sep,
+                        progress->placeCounts[source][method],
+                        placeMethodName(method));
+                sep = ",";
+            }
+        }
+
+        fprintf(report->out, "\n");
+    }
+
+    if (countPlaced(progress, PART_SOURCE_PEER) > 0) {
+        fprintf(report->out, "Fetched %d files from peers.\n",
+                countPlaced(progress, PART_SOURCE_PEER));
+    }
+
+    if (countPlaced(progress, PART_SOURCE_SHARED) > 0) {
+        fprintf(report->out, "%d files were completed by other processes "
+                "sharing the output.\n",
+                countPlaced(progress, PART_SOURCE_SHARED));
+    }
+}
+
+static void reportStage(igdoSession *session, const sessionStageEvent *event,
+                        void *data)
+{
+    jobReport *report = data;
+    const sessionProgress *progress = event->progress;
+
+    /* The last count of a partially downloaded file may not have been shown */
+    if (report->stage == SESSION_STAGE_VERIFY_PARTIAL) {
+        fprintf(report->out, "\r%d out of %d files OK\n", progress->checkedOK,
+                progress->checkFiles);
+    }
+
+    report->stage = event->stage;
+
+    switch (event->stage) {
+        case SESSION_STAGE_VERIFY_PARTIAL:
+            fprintf(report->out, "Verifying partially downloaded file '%s':\n",
+                    event->image->name);
+            break;
+        case SESSION_STAGE_FETCH:
+            if (progress->duplicateFiles > 0) {
+                fprintf(report->out, "%d files are duplicated within %s and "
+                        "will only be fetched once.\n",
+                        progress->duplicateFiles,
+                        report->numImages > 1 ? "the images" : "the image");
+            }
+
+            if (progress->localFiles > 0) {
+                fprintf(report->out, "%d files were found locally and do not "
+                        "need to be fetched.\n", progress->localFiles);
+            }
+
+            fprintf(report->out,
+                    "\nNeed to fetch %d files (%"PRIu64" kBytes total).\n",
+                    progress->fetchFiles, progress->fetchBytes / 1024);
+            break;
+        case SESSION_STAGE_VERIFY:
+            printPlaceSummary(report, progress);
+            fprintf(report->out, "\rAll parts assembled.\n");
+            break;
+        case SESSION_STAGE_DONE:
+            if (progress->harvestFiles > 0) {
+                fprintf(report->out,
+                        "Harvested %d of %d files into the cache.\n",
+                        progress->harvestedFiles, progress->harvestFiles);
+            }
+            break;
+        default:
+            break;
+    }
+
+    fflush(report->out);
+}
+
+static void reportPart(igdoSession *session, const sessionPartEvent *event,
+                       void *data)
+{
+    const jobReport *report = data;
+
+    if (report->verbose && event->source != PART_SOURCE_MIRROR &&
+        event->source != PART_SOURCE_PEER &&
+        event->source != PART_SOURCE_SHARED) {
+        fprintf(report->out,
+                "\rPlaced %"PRIu64" %s bytes at offset %jd via %s\n",
+                event->size, partSourceNames[event->source],
+                (intmax_t) event->offset, placeMethodName(event->method));
+    }
+}
+
+static void reportImage(igdoSession *session, const sessionImageEvent *event,
+                        void *data)
+{
+    const jobReport *report = data;
+    const sessionImage *image = event->image;
+    uint64_t start, end;
+    bool partial = jigdoGetRange(image->table, &start, &end);
+    int shard, numShards;
+
+    if (event->copy >= 0) {
+        fprintf(report->out, "%s copy %d of '%s'...",
+                report->verifyCopies && !partial ? "Verifying" : "Flushing",
+                event->copy + 1, image->name);
+    } else if (jigdoGetShard(image->table, &shard, &numShards)) {
+        fprintf(report->out, "\rFlushing shard %d of %d of '%s'...", shard,
+                numShards, image->name);
+    } else if (partial) {
+        fprintf(report->out,
+                "\rFlushing bytes %"PRIu64"-%"PRIu64" of '%s'...", start, end,
+                image->name);
+    } else {
+        fprintf(report->out,
+                "\rPerforming final MD5 verification check of '%s'...",
+                image->name);
+    }
+
+    switch (event->result) {
+        case IMAGE_RESULT_VERIFIED:
+        case IMAGE_RESULT_FLUSHED:
+            fprintf(report->out, " done!\n");
+
+            if (partial && event->copy < 0) {
+                fprintf(report->out, "Skipped the MD5 check of the whole "
+                        "image, which was only partially reconstructed\n");
+            }
+            break;
+        case IMAGE_RESULT_MISMATCH:
+            if (event->copy >= 0) {
+                fprintf(report->out, " error!\n");
+                fprintf(report->err,
+                        "Copy %d of '%s' does not match the image!\n",
+                        event->copy + 1, image->name);
+            } else {
+                fprintf(report->out, " error!\nExpected: %s; got %s\n",
+                        event->expected, event->md5);
+                fprintf(report->err, "MD5 checksum verification failed!\n");
+            }
+            break;
+        case IMAGE_RESULT_FAILED:
+            fprintf(report->out, " error!\n");
+            fprintf(report->err, "%s of '%s'\n", event->error, image->name);
+            break;
+    }
+
+    fflush(report->out);
+    fflush(report->err);
+}
+
+const sessionCallbacks jobCallbacks = { reportStage, reportPart, reportImage };
+
+/**
+ * @brief List the transfers which @p session has in progress
+ */
+static void printTransfers(const jobReport *report, igdoSession *session)
+{
+    sessionTransfer *transfers = calloc(report->maxTransfers,
+                                        sizeof(transfers[0]));
+    int i, count;
+
+    if (!transfers) {
+        return;
+    }
+
+    count = sessionGetTransfers(session, transfers, report->maxTransfers);
+
+    for (i = 0; i < count; i++) {
+        fprintf(report->out, "%s: %"PRIu64"/%"PRIu64" bytes\n",
+                transfers[i].uri, transfers[i].fetchedBytes,
+                transfers[i].size);
+        free(transfers[i].uri);
+    }
+
+    free(transfers);
+}
+
+bool jobRun(igdoSession *session, jobReport *report, int cancelFd)
+{
+    struct pollfd pfds[2] = {
+        { .fd = sessionGetFd(session), .events = POLLIN },
+        { .fd = cancelFd, .events = POLLIN },
+    };
+    sessionProgress progress, shown = { .stage = SESSION_STAGE_IDLE };
+
+    if (!sessionStart(session)) {
+        return false;
+    }
+
+    while (sessionDispatch(session)) {
+        sessionGetProgress(session, &progress);
+
+        /* Only print the counts if they've changed to avoid excessive spam
+         * in case \r doesn't work as intended; and only once the stage they
+         * belong to has been reported. */
+        if (progress.stage != report->stage) {
+            /* Nothing to show yet */
+        } else if (progress.stage == SESSION_STAGE_VERIFY_PARTIAL &&
+                   (shown.stage != progress.stage ||
+                    shown.checkedFiles != progress.checkedFiles)) {
+            fprintf(report->out, "\r%d out of %d files OK",
+                    progress.checkedOK, progress.checkFiles);
+            shown = progress;
+        } else if (progress.stage == SESSION_STAGE_FETCH &&
+                   (shown.stage != progress.stage ||
+                    shown.completedFiles != progress.completedFiles)) {
+            fprintf(report->out,
+                    "\r%d of %d files (%"PRIu64"/%"PRIu64" kB) done",
+                    progress.completedFiles, progress.numFiles,
+                    progress.completedBytes / 1024, progress.numBytes / 1024);
+            shown = progress;
+        }
+
+        if (report->transfersRequested && *report->transfersRequested) {
+            *report->transfersRequested = 0;
+            printTransfers(report, session);
+        }
+
+        fflush(report->out);
+
+        if (report->status) {
+            statusUpdate(report->status, session);
+        }
+
+        /* Failing to save the metrics isn't worth failing the job over */
+        if (report->metricsFile &&
+            time(NULL) - report->metricsSaved >= metricsInterval) {
+            metricsSave(report->metricsFile, session,
+                        METRICS_FORMAT_PROMETHEUS);
+            report->metricsSaved = time(NULL);
+        }
+
+        if (poll(pfds, cancelFd >= 0 ? 2 : 1, progressInterval) > 0 &&
+            pfds[1].revents) {
+            /* Whoever asked for the job is gone; stop polling for them */
+            sessionCancel(session);
+            pfds[1].fd = -1;
+        }
+    }
+
+    if (report->metricsFile) {
+        metricsSave(report->metricsFile, session, METRICS_FORMAT_PROMETHEUS);
+        report->metricsSaved = time(NULL);
+    }
+
+    if (report->status) {
+        statusUpdate(report->status, session);
+    }
+
+    return sessionWait(session);
+}
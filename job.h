@@ -0,0 +1,149 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_JOB_H
+#define PIGDO_JOB_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+#include "libigdo/output.h"
+#include "libigdo/session.h"
+#include "libigdo/status.h"
+
+/**
+ * @brief Where and how output files are written
+ */
+typedef struct {
+    outputEngine *engine; ///< Engine through which output files are written
+    bool sharedEngine;    ///< @c engine is already in use by other jobs, so
+                          ///< no files can be declared to it as O_DIRECT
+    bool direct;          ///< Open regular output files with O_DIRECT
+    bool stream;          ///< Write output files sequentially, in order
+    int stdoutFd;         ///< The original standard output, for output "-"
+    uint64_t window;      ///< How far ahead of a stream parts may be fetched
+    bool range;           ///< Only reconstruct part of the image
+    uint64_t rangeStart;  ///< Start of the range to reconstruct
+    uint64_t rangeEnd;    ///< End of the range to reconstruct, exclusive
+    int shard;            ///< Shard of the image to reconstruct, from 1
+    int numShards;        ///< Number of shards, or 0 for the whole image
+    partClaims *claims;   ///< If not NULL, the output file is shared with
+                          ///< other processes, which claim its parts here
+    bool noOutput;        ///< Only read the .jigdo and .template files, e.g.
+                          ///< to export the parts, without opening any
+                          ///< output file
+} outputSettings;
+
+/**
+ * @brief Seconds between saves of the metrics to jobReport::metricsFile
+ */
+#define metricsInterval 10
+
+/**
+ * @brief Where and how the progress of a job is reported
+ */
+typedef struct {
+    FILE *out;            ///< Stream for progress messages
+    FILE *err;            ///< Stream for error messages
+    bool verbose;         ///< Report every part placed from a local source
+    bool verifyCopies;    ///< The images' copies are read back and checked
+    int numImages;        ///< Number of images in the job
+    int maxTransfers;     ///< Most transfers the job may have in progress
+    volatile sig_atomic_t *transfersRequested;
+                          ///< If not NULL, the transfers in progress are
+                          ///< listed whenever this is set, and it is reset
+    sessionStage stage;   ///< The last stage reported
+    const char *metricsFile; ///< If not NULL, the metrics are saved here in
+                             ///< the Prometheus text format every
+                             ///< metricsInterval seconds, and once the job is
+                             ///< done; see metricsSave()
+    time_t metricsSaved;  ///< When the metrics were last saved
+    statusFile *status;   ///< If not NULL, the status of the job is
+                          ///< published here as it runs
+} jobReport;
+
+/**
+ * @brief Callbacks for a session, which report on it to a jobReport
+ *
+ * The @c data member must be set to the jobReport.
+ */
+extern const sessionCallbacks jobCallbacks;
+
+/**
+ * @brief Read the .jigdo and .template files for an image, and prepare its
+ *        output file with the data stored in the template
+ *
+ * @param report Where messages about the image are printed
+ * @param image Record to fill in for the image
+ * @param jigdoFile Location of the .jigdo file
+ * @param templatePath Location of the .template file, or NULL to use the
+ *                     location given in the .jigdo file
+ * @param imagePath Location of the output file, or NULL to use the name given
+ *                  in the .jigdo file
+ * @param copyPaths Locations of further output files, which receive a copy of
+ *                  everything written to the output file
+ * @param numCopies Number of elements in @p copyPaths
+ * @param outDir Directory where the output file will be written when
+ *               @p imagePath is NULL, or NULL to use the .jigdo file's
+ *               directory
+ * @param mirrors Additional mirrors in 'mirror=path' format
+ * @param numMirrors Number of elements in @p mirrors
+ * @param settings Where and how to write the output file
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool jobOpenImage(const jobReport *report, sessionImage *image,
+                  const char *jigdoFile, const char *templatePath,
+                  const char *imagePath, char **copyPaths, int numCopies,
+                  const char *outDir, char **mirrors, int numMirrors,
+                  const outputSettings *settings);
+
+/**
+ * @brief Check that no two output files of @p images, including their copies,
+ *        are the same file
+ *
+ * Images of several .jigdo files may have the same name, and so the same output
+ * file in a shared output directory, where they would overwrite each other.
+ *
+ * @return @c true if the output files are all distinct; @c false, after
+ *         printing which images clash, if not
+ */
+bool jobCheckOutputs(const jobReport *report, const sessionImage *images,
+                     int numImages);
+
+/**
+ * @brief Close the output files of @p images, and free what was read for them
+ *        by jobOpenImage()
+ */
+void jobCloseImages(sessionImage *images, int numImages,
+                    const outputSettings *settings);
+
+/**
+ * @brief Run @p session until it is done, reporting on its progress
+ *
+ * @param cancelFd If not -1, a descriptor which is polled alongside the
+ *                 session; the session is cancelled if it hangs up or becomes
+ *                 readable, e.g. when the client of a daemon disconnects
+ *
+ * @return @c true if all of the images were reconstructed; @c false otherwise
+ */
+bool jobRun(igdoSession *session, jobReport *report, int cancelFd);
+
+#endif
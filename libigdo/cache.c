@@ -0,0 +1,531 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 // for mkstemp(3), futimens(2) and friends
+#define _DEFAULT_SOURCE   // for flock(2)
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "place.h"
+#include "jigdo-md5-private.h"
+
+/**
+ * @brief Open cache directory and its accounting state
+ */
+struct _partCache {
+    char *dir;             ///< Root directory of the cache
+    uint64_t maxBytes;     ///< Size above which objects are evicted
+    int lockFd;            ///< flock(2)ed across processes; holds the usage
+    pthread_mutex_t lock;  ///< flock(2) does not exclude threads sharing lockFd
+};
+
+/**
+ * @brief A cache object considered for eviction
+ */
+typedef struct {
+    char *path;            ///< Path of the object
+    uint64_t size;         ///< Size of the object
+    struct timespec used;  ///< Last time the object was published or looked up
+} cacheObject;
+
+/* Once the cache grows above its limit, evict down to this fraction of it, so
+ * that the cost of scanning the cache isn't paid on every single publish. */
+static const int evictPercent = 90;
+
+/* Temporary files older than this were left behind by a process that died */
+static const time_t staleTempSeconds = 24 * 60 * 60;
+
+/**
+ * @brief Build the path of the object for @p md5, optionally creating its
+ *        parent directory
+ */
+static bool objectPath(const partCache *cache, md5Checksum md5, char *out,
+                       bool createDir)
+{
+    char hex[MD5SUM_STRING_LENGTH];
+
+    md5SumToString(md5, hex);
+
+    /* Fan out on the first byte to keep directories to a manageable size */
+    if (snprintf(out, PATH_MAX, "%s/objects/%.2s", cache->dir, hex)
+        >= PATH_MAX) {
+        return false;
+    }
+
+    if (createDir && mkdir(out, 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    return snprintf(out, PATH_MAX, "%s/objects/%.2s/%s", cache->dir, hex, hex)
+           < PATH_MAX;
+}
+
+/**
+ * @brief Take the process-wide and system-wide cache accounting locks
+ */
+static bool lockCache(partCache *cache)
+{
+    if (pthread_mutex_lock(&(cache->lock)) != 0) {
+        return false;
+    }
+
+    while (flock(cache->lockFd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            pthread_mutex_unlock(&(cache->lock));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void unlockCache(partCache *cache)
+{
+    flock(cache->lockFd, LOCK_UN);
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/**
+ * @brief Read the total size of the cache from the lock file
+ *
+ * @note The caller must hold the cache locks.
+ */
+static uint64_t readUsage(partCache *cache)
+{
+    char buf[32];
+    ssize_t len = pread(cache->lockFd, buf, sizeof(buf) - 1, 0);
+    uint64_t usage = 0;
+
+    if (len > 0) {
+        buf[len] = '\0';
+        sscanf(buf, "%"SCNu64, &usage);
+    }
+
+    return usage;
+}
+
+/**
+ * @brief Record the total size of the cache in the lock file
+ *
+ * @note The caller must hold the cache locks.
+ */
+static void writeUsage(partCache *cache, uint64_t usage)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%"PRIu64"\n", usage);
+
+    if (pwrite(cache->lockFd, buf, len, 0) == len) {
+        if (ftruncate(cache->lockFd, len) != 0) {
+            /* Trailing garbage is ignored by readUsage() anyway */
+        }
+    }
+}
+
+/**
+ * @brief Comparator for qsort(3) to sort cacheObject records, oldest first
+ */
+static int objectAgeCmp(const void *a, const void *b)
+{
+    const cacheObject *objA = a, *objB = b;
+
+    if (objA->used.tv_sec != objB->used.tv_sec) {
+        return objA->used.tv_sec < objB->used.tv_sec ? -1 : 1;
+    }
+
+    if (objA->used.tv_nsec != objB->used.tv_nsec) {
+        return objA->used.tv_nsec < objB->used.tv_nsec ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Append the objects found in @p dir to @p objects
+ *
+ * @return The total size of the objects that were found
+ */
+static uint64_t scanObjectDir(const char *dir, cacheObject **objects,
+                              int *numObjects)
+{
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    uint64_t total = 0;
+
+    if (!d) {
+        return 0;
+    }
+
+    while ((ent = readdir(d))) {
+        struct stat st;
+        char path[PATH_MAX];
+        cacheObject *grown;
+
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name)
+            >= sizeof(path) || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        grown = realloc(*objects, sizeof(**objects) * (*numObjects + 1));
+        if (!grown) {
+            break;
+        }
+        *objects = grown;
+
+        (*objects)[*numObjects].path = strdup(path);
+        (*objects)[*numObjects].size = st.st_size;
+        (*objects)[*numObjects].used = st.st_mtim;
+        (*numObjects)++;
+
+        total += st.st_size;
+    }
+
+    closedir(d);
+
+    return total;
+}
+
+/**
+ * @brief Delete temporary files abandoned by processes which died mid-publish
+ */
+static void removeStaleTemps(partCache *cache)
+{
+    char dir[PATH_MAX];
+    DIR *d;
+    struct dirent *ent;
+    time_t now = time(NULL);
+
+    if (snprintf(dir, sizeof(dir), "%s/tmp", cache->dir) >= sizeof(dir) ||
+        !(d = opendir(dir))) {
+        return;
+    }
+
+    while ((ent = readdir(d))) {
+        struct stat st;
+        char path[PATH_MAX];
+
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name)
+            < sizeof(path) && stat(path, &st) == 0 &&
+            now - st.st_mtime > staleTempSeconds) {
+            unlink(path);
+        }
+    }
+
+    closedir(d);
+}
+
+/**
+ * @brief Recompute the size of the cache, and evict the least recently used
+ *        objects until it is comfortably below the limit
+ *
+ * @note The caller must hold the cache locks.
+ *
+ * @return The total size of the objects remaining in the cache
+ */
+static uint64_t evict(partCache *cache)
+{
+    cacheObject *objects = NULL;
+    int numObjects = 0, i;
+    uint64_t usage = 0, target = cache->maxBytes / 100 * evictPercent;
+    char objectsDir[PATH_MAX];
+    DIR *d;
+    struct dirent *ent;
+
+    if (snprintf(objectsDir, sizeof(objectsDir), "%s/objects", cache->dir)
+        >= sizeof(objectsDir) || !(d = opendir(objectsDir))) {
+        return readUsage(cache);
+    }
+
+    while ((ent = readdir(d))) {
+        char subdir[PATH_MAX];
+
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        if (snprintf(subdir, sizeof(subdir), "%s/%s", objectsDir, ent->d_name)
+            < sizeof(subdir)) {
+            usage += scanObjectDir(subdir, &objects, &numObjects);
+        }
+    }
+
+    closedir(d);
+
+    qsort(objects, numObjects, sizeof(objects[0]), objectAgeCmp);
+
+    for (i = 0; i < numObjects; i++) {
+        if (usage > target && unlink(objects[i].path) == 0) {
+            usage -= objects[i].size;
+        }
+        free(objects[i].path);
+    }
+
+    free(objects);
+
+    removeStaleTemps(cache);
+
+    return usage;
+}
+
+partCache *cacheOpen(const char *dir, uint64_t maxBytes)
+{
+    partCache *cache = calloc(1, sizeof(*cache));
+    char path[PATH_MAX];
+    static const char *subdirs[] = { "", "/objects", "/tmp" };
+    int i;
+
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->lockFd = -1;
+    cache->maxBytes = maxBytes;
+    cache->dir = strdup(dir);
+
+    if (!cache->dir) {
+        goto fail;
+    }
+
+    for (i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+        if (snprintf(path, sizeof(path), "%s%s", dir, subdirs[i])
+            >= sizeof(path)) {
+            goto fail;
+        }
+
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            goto fail;
+        }
+    }
+
+    if (snprintf(path, sizeof(path), "%s/lock", dir) >= sizeof(path)) {
+        goto fail;
+    }
+
+    cache->lockFd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->lockFd < 0) {
+        goto fail;
+    }
+
+    if (pthread_mutex_init(&(cache->lock), NULL) != 0) {
+        goto fail;
+    }
+
+    return cache;
+
+fail:
+    if (cache->lockFd >= 0) {
+        close(cache->lockFd);
+    }
+    free(cache->dir);
+    free(cache);
+
+    return NULL;
+}
+
+void cacheClose(partCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    pthread_mutex_destroy(&(cache->lock));
+    close(cache->lockFd);
+    free(cache->dir);
+    free(cache);
+}
+
+int cacheLookup(partCache *cache, md5Checksum md5, uint64_t size)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    if (!objectPath(cache, md5, path, false)) {
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size != size) {
+        close(fd);
+        return -1;
+    }
+
+    /* atime is unreliable on noatime/relatime mounts, so the modification
+     * time doubles as the last use time for least recently used eviction. */
+    futimens(fd, NULL);
+
+    return fd;
+}
+
+/**
+ * @brief Write @p size bytes at @p data to the start of @p fd
+ */
+static bool writeAll(int fd, const void *data, uint64_t size)
+{
+    uint64_t done = 0;
+
+    while (done < size) {
+        ssize_t written = write(fd, data + done, size - done);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+
+        done += written;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Publish an object with the contents of either @p data, if not NULL, or
+ *        of the range @p offset to @p offset + @p size of @p fd
+ */
+static bool publish(partCache *cache, md5Checksum md5, const void *data,
+                    int fd, off_t offset, uint64_t size)
+{
+    char tmpPath[PATH_MAX], path[PATH_MAX];
+    int tmpFd;
+    bool ret = false, locked = false;
+    uint64_t usage;
+
+    if (!objectPath(cache, md5, path, true)) {
+        return false;
+    }
+
+    if (access(path, F_OK) == 0) {
+        return true;
+    }
+
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s/tmp/part.XXXXXX", cache->dir)
+        >= sizeof(tmpPath)) {
+        return false;
+    }
+
+    /* Assemble the object under a private name, so that other processes will
+     * never observe a partially written object. */
+    tmpFd = mkstemp(tmpPath);
+    if (tmpFd < 0) {
+        return false;
+    }
+
+    if (data) {
+        if (!writeAll(tmpFd, data, size)) {
+            goto done;
+        }
+    } else if (placeFileRange(fd, offset, tmpFd, 0, size) ==
+               PLACE_METHOD_NONE) {
+        goto done;
+    }
+
+    if (!lockCache(cache)) {
+        goto done;
+    }
+    locked = true;
+
+    /* Someone else may have published the same object in the meantime; don't
+     * count it twice. */
+    if (access(path, F_OK) == 0) {
+        ret = true;
+        goto done;
+    }
+
+    if (rename(tmpPath, path) != 0) {
+        goto done;
+    }
+    tmpPath[0] = '\0';
+
+    usage = readUsage(cache) + size;
+    if (usage > cache->maxBytes) {
+        usage = evict(cache);
+    }
+    writeUsage(cache, usage);
+
+    ret = true;
+
+done:
+    if (locked) {
+        unlockCache(cache);
+    }
+
+    close(tmpFd);
+
+    if (tmpPath[0]) {
+        unlink(tmpPath);
+    }
+
+    return ret;
+}
+
+bool cachePublishFd(partCache *cache, md5Checksum md5, int fd, off_t offset,
+                    uint64_t size)
+{
+    return publish(cache, md5, NULL, fd, offset, size);
+}
+
+bool cachePublishMem(partCache *cache, md5Checksum md5, const void *data,
+                     uint64_t size)
+{
+    return publish(cache, md5, data, -1, 0, size);
+}
+
+void cacheRemove(partCache *cache, md5Checksum md5)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!objectPath(cache, md5, path, false) || !lockCache(cache)) {
+        return;
+    }
+
+    if (stat(path, &st) == 0 && unlink(path) == 0) {
+        uint64_t usage = readUsage(cache);
+
+        writeUsage(cache, usage > st.st_size ? usage - st.st_size : 0);
+    }
+
+    unlockCache(cache);
+}
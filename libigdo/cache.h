@@ -0,0 +1,98 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_CACHE_H
+#define PIGDO_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "jigdo-md5.h"
+
+/**
+ * @brief A persistent, content-addressed store of component files
+ *
+ * Objects are named after their MD5 checksums, so the same cache directory may
+ * be shared between runs for different images, and between several processes
+ * running at the same time: objects are published atomically with rename(2),
+ * and the accounting of the total cache size is serialized with flock(2).
+ */
+typedef struct _partCache partCache;
+
+/**
+ * @brief Open the cache at @p dir, creating it if it does not exist yet
+ *
+ * @param dir The directory holding the cache
+ * @param maxBytes The total size of objects above which the least recently
+ *                 used objects will be evicted
+ *
+ * @return A handle to the cache on success, or NULL on error
+ */
+partCache *cacheOpen(const char *dir, uint64_t maxBytes);
+
+/**
+ * @brief Release the resources associated with @p cache
+ */
+void cacheClose(partCache *cache);
+
+/**
+ * @brief Look up an object in the cache
+ *
+ * A successful lookup counts as a use of the object for the purposes of least
+ * recently used eviction.
+ *
+ * @param cache The cache to search
+ * @param md5 The checksum of the object
+ * @param size The expected size of the object
+ *
+ * @return A read-only file descriptor to the object, which the caller must
+ *         close, or -1 if no object of the expected size was found. The object
+ *         contents are not verified; callers should check them against @p md5.
+ */
+int cacheLookup(partCache *cache, md5Checksum md5, uint64_t size);
+
+/**
+ * @brief Add the range @p offset to @p offset + @p size of @p fd to the cache
+ *
+ * The data is placed with placeFileRange(), so on filesystems supporting it,
+ * the cache object will share its extents with @p fd.
+ *
+ * @return @c true if the object was published, or was already present; @c
+ *         false on error
+ */
+bool cachePublishFd(partCache *cache, md5Checksum md5, int fd, off_t offset,
+                    uint64_t size);
+
+/**
+ * @brief Add the @p size bytes at @p data to the cache
+ *
+ * This is for data which can't be read back efficiently from where it was
+ * written, e.g. an output file opened with O_DIRECT.
+ *
+ * @return @c true if the object was published, or was already present; @c
+ *         false on error
+ */
+bool cachePublishMem(partCache *cache, md5Checksum md5, const void *data,
+                     uint64_t size);
+
+/**
+ * @brief Remove the object identified by @p md5, e.g. if it failed to verify
+ */
+void cacheRemove(partCache *cache, md5Checksum md5);
+
+#endif
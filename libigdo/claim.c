@@ -0,0 +1,127 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "claim.h"
+
+struct _partClaims {
+    int fd;                ///< The claim file. Closing any descriptor to it
+                           ///< would release all of the process's locks.
+};
+
+/**
+ * @brief Lock or unlock the @p size bytes at @p offset of the claim file
+ *
+ * @param type F_WRLCK or F_UNLCK
+ *
+ * @return 0 on success, or an errno value on failure
+ */
+static int lockRange(partClaims *claims, uint64_t offset, uint64_t size,
+                     short type, bool wait)
+{
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = offset,
+        .l_len = size,
+    };
+
+    while (fcntl(claims->fd, wait ? F_SETLKW : F_SETLK, &lock) != 0) {
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+partClaims *claimsOpen(const char *path)
+{
+    partClaims *claims = malloc(sizeof(*claims));
+
+    if (!claims) {
+        return NULL;
+    }
+
+    claims->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (claims->fd < 0) {
+        free(claims);
+        return NULL;
+    }
+
+    return claims;
+}
+
+void claimsClose(partClaims *claims)
+{
+    if (claims) {
+        close(claims->fd);
+        free(claims);
+    }
+}
+
+claimResult claimRange(partClaims *claims, uint64_t offset, uint64_t size,
+                       bool wait)
+{
+    char done = 0;
+    int err;
+
+    /* A zero length would lock everything up to the end of the file */
+    if (size == 0) {
+        return CLAIM_ERROR;
+    }
+
+    err = lockRange(claims, offset, size, F_WRLCK, wait);
+    if (err == EACCES || err == EAGAIN) {
+        return CLAIM_BUSY;
+    } else if (err != 0) {
+        return CLAIM_ERROR;
+    }
+
+    /* Past the end of the claim file, or in a hole, nothing is done yet */
+    if (pread(claims->fd, &done, 1, offset) < 0) {
+        lockRange(claims, offset, size, F_UNLCK, false);
+        return CLAIM_ERROR;
+    }
+
+    if (done) {
+        lockRange(claims, offset, size, F_UNLCK, false);
+        return CLAIM_DONE;
+    }
+
+    return CLAIM_ACQUIRED;
+}
+
+bool claimRelease(partClaims *claims, uint64_t offset, uint64_t size,
+                  bool done)
+{
+    static const char doneByte = 1;
+    bool ret = true;
+
+    if (done && pwrite(claims->fd, &doneByte, 1, offset) != 1) {
+        ret = false;
+    }
+
+    return lockRange(claims, offset, size, F_UNLCK, false) == 0 && ret;
+}
@@ -0,0 +1,82 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_CLAIM_H
+#define PIGDO_CLAIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Claims on ranges of an output file shared by several processes,
+ *        possibly on different machines
+ *
+ * Each range is claimed by locking the same range of a claim file with
+ * fcntl(2), which works across machines on filesystems such as NFS, and is
+ * released by the system if the process holding it dies. Once a range is
+ * complete, this is recorded by a byte at its start in the claim file, so
+ * that it is never claimed again.
+ */
+typedef struct _partClaims partClaims;
+
+/**
+ * @brief Outcomes of claiming a range
+ */
+typedef enum {
+    CLAIM_ACQUIRED = 0, ///< The range is claimed by this process
+    CLAIM_BUSY,         ///< Another process has claimed the range
+    CLAIM_DONE,         ///< The range was completed already
+    CLAIM_ERROR,        ///< The claim file couldn't be locked or read
+} claimResult;
+
+/**
+ * @brief Open the claim file at @p path, creating it if it does not exist yet
+ *
+ * @return A handle to the claims on success, or NULL on error
+ */
+partClaims *claimsOpen(const char *path);
+
+/**
+ * @brief Release the resources associated with @p claims, along with any
+ *        ranges still claimed
+ */
+void claimsClose(partClaims *claims);
+
+/**
+ * @brief Claim the @p size bytes at @p offset, which must not be empty
+ *
+ * Ranges are claimed per process: threads of a process must not claim
+ * overlapping ranges at the same time.
+ *
+ * @param wait Wait for another process's claim on the range to be released,
+ *             rather than returning CLAIM_BUSY
+ */
+claimResult claimRange(partClaims *claims, uint64_t offset, uint64_t size,
+                       bool wait);
+
+/**
+ * @brief Release a range claimed with claimRange()
+ *
+ * @param done Record the range as complete
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool claimRelease(partClaims *claims, uint64_t offset, uint64_t size,
+                  bool done);
+
+#endif
@@ -29,6 +29,8 @@
 #endif
 
 #include "decompress.h"
+#include "metrics.h"
+#include "trace.h"
 
 /**
  * @brief Decompress a bzip2 stream
@@ -93,18 +95,33 @@ done:
 int decompressMemToMem(compressType type, void *in, ssize_t inBytes,
                        void *out, size_t outBytes)
 {
+    uint64_t start = metricsNow();
+    int ret;
+
     switch (type) {
         case COMPRESSED_DATA_ZLIB:
-            return infl8(in, inBytes, out, outBytes);
+            ret = infl8(in, inBytes, out, outBytes);
+        break;
 
         case COMPRESSED_DATA_BZIP2:
-            return bunzip2MemToMem(in, inBytes, out, outBytes);
+            ret = bunzip2MemToMem(in, inBytes, out, outBytes);
+        break;
 
         case COMPRESSED_DATA_GZIP:    // Not implemented, try gunzopen() instead
         case COMPRESSED_DATA_UNKNOWN:
         default:
             return -1;
     }
+
+    if (ret > 0) {
+        traceArgs args = { .size = ret };
+        uint64_t end = metricsNow();
+
+        metricsAddWork(METRICS_WORK_DECOMPRESS, ret, end - start);
+        traceSpan("template", "decompress", start, end, &args);
+    }
+
+    return ret;
 }
 
 #if defined HAVE_LIBZ
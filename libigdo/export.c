@@ -0,0 +1,231 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <search.h>
+
+#include "export.h"
+#include "jigdo-md5-private.h"
+#include "jigdo-template-private.h"
+#include "util.h"
+
+static const char *formatNames[] = {
+    [EXPORT_FORMAT_JSON] = "json",
+    [EXPORT_FORMAT_ARIA2] = "aria2",
+};
+
+/**
+ * @brief Free the @p count URIs returned by md5ToURIs()
+ */
+static void freeURIs(char **uris, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(uris[i]);
+    }
+    free(uris);
+}
+
+/**
+ * @brief Write the parts of @p image as an element of the JSON "images" array
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool exportImageJSON(FILE *fp, const sessionImage *image)
+{
+    const templateDescTable *table = image->table;
+    const char *sep = "";
+    int i, j;
+
+    fprintf(fp, "    {\n      \"name\": ");
+    writeJSONString(fp, image->name);
+    fprintf(fp, ",\n      \"size\": %"PRIu64",\n      \"md5\": \"%s\",\n"
+            "      \"parts\": [", table->imageInfo.size,
+            table->imageInfo.md5String);
+
+    for (i = 0; i < table->numFiles; i++) {
+        const templateFileEntry *file = table->files + i;
+        char md5[MD5SUM_STRING_LENGTH];
+        char **uris;
+        int numURIs;
+
+        if (file->status == COMMIT_STATUS_SKIPPED) {
+            continue;
+        }
+
+        /* Files only found in local directories have no URIs to list, but
+         * are still part of the image */
+        uris = md5ToURIs(image->jigdo, file->md5Sum, &numURIs);
+
+        md5SumToString(file->md5Sum, md5);
+        fprintf(fp, "%s\n        {\"offset\": %jd, \"size\": %"PRIu64", "
+                "\"md5\": \"%s\", \"file\": \"%s\", \"uris\": [", sep,
+                (intmax_t) file->offset, file->size, md5, md5);
+
+        for (j = 0; j < numURIs; j++) {
+            fprintf(fp, "%s", j ? ", " : "");
+            writeJSONString(fp, uris[j]);
+        }
+        fprintf(fp, "]}");
+
+        freeURIs(uris, numURIs);
+        sep = ",";
+    }
+
+    fprintf(fp, "\n      ]\n    }");
+
+    return true;
+}
+
+/**
+ * @brief Comparator function for the tree of parts already exported to aria2
+ */
+static int md5TreeCmp(const void *a, const void *b)
+{
+    return md5Cmp(a, b);
+}
+
+/**
+ * @brief Write an aria2c(1) input file entry for each distinct part of
+ *        @p images
+ *
+ * @param numUnlisted Incremented for each distinct part left out, because no
+ *                    mirror has it
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool exportAria2(FILE *fp, const sessionImage *images, int numImages,
+                        int *numUnlisted)
+{
+    void *seen = NULL;
+    bool ret = false;
+    int i, j, k;
+
+    for (i = 0; i < numImages; i++) {
+        const templateDescTable *table = images[i].table;
+
+        for (j = 0; j < table->numFiles; j++) {
+            const templateFileEntry *file = table->files + j;
+            char md5[MD5SUM_STRING_LENGTH];
+            const md5Checksum **node;
+            char **uris;
+            int numURIs;
+
+            if (file->status == COMMIT_STATUS_SKIPPED) {
+                continue;
+            }
+
+            /* Identical parts only need to be downloaded once */
+            node = tsearch(&file->md5Sum, &seen, md5TreeCmp);
+            if (!node) {
+                goto done;
+            }
+            if (*node != &file->md5Sum) {
+                continue;
+            }
+
+            /* aria2 has nothing to download for files which are only found
+             * in local directories */
+            uris = md5ToURIs(images[i].jigdo, file->md5Sum, &numURIs);
+            if (!uris) {
+                (*numUnlisted)++;
+                continue;
+            }
+
+            /* aria2 takes the URIs of a single download on one line, separated
+             * by tabs, followed by its options on indented lines */
+            for (k = 0; k < numURIs; k++) {
+                fprintf(fp, "%s%s", k ? "\t" : "", uris[k]);
+            }
+
+            md5SumToString(file->md5Sum, md5);
+            fprintf(fp, "\n  out=%s\n  checksum=md5=%s\n", md5, md5);
+
+            freeURIs(uris, numURIs);
+        }
+    }
+
+    ret = true;
+
+done:
+    /* The tree only points into the tables */
+    while (seen) {
+        tdelete(*(const md5Checksum **) seen, &seen, md5TreeCmp);
+    }
+
+    return ret;
+}
+
+bool exportParts(FILE *fp, const sessionImage *images, int numImages,
+                 exportFormat format, int *numUnlisted)
+{
+    int i;
+
+    *numUnlisted = 0;
+
+    switch (format) {
+        case EXPORT_FORMAT_JSON:
+            fprintf(fp, "{\n  \"images\": [\n");
+
+            for (i = 0; i < numImages; i++) {
+                if (!exportImageJSON(fp, images + i)) {
+                    return false;
+                }
+                fprintf(fp, "%s\n", i + 1 < numImages ? "," : "");
+            }
+
+            fprintf(fp, "  ]\n}\n");
+            break;
+        case EXPORT_FORMAT_ARIA2:
+            if (!exportAria2(fp, images, numImages, numUnlisted)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+    }
+
+    return !ferror(fp);
+}
+
+const char *exportFormatName(exportFormat format)
+{
+    if (format < 0 || format >= EXPORT_FORMAT_COUNT) {
+        return "unknown";
+    }
+
+    return formatNames[format];
+}
+
+exportFormat exportFormatFromName(const char *name)
+{
+    exportFormat format;
+
+    for (format = 0; format < EXPORT_FORMAT_COUNT; format++) {
+        if (strcmp(name, formatNames[format]) == 0) {
+            break;
+        }
+    }
+
+    return format;
+}
@@ -0,0 +1,70 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_EXPORT_H
+#define PIGDO_EXPORT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "session.h"
+
+/**
+ * @brief Formats in which the parts of images can be exported
+ */
+typedef enum {
+    EXPORT_FORMAT_JSON = 0, ///< A JSON document listing every part
+    EXPORT_FORMAT_ARIA2,    ///< An input file for aria2c(1), with an entry
+                            ///< for each distinct part
+    EXPORT_FORMAT_COUNT,    ///< Number of formats, not a format
+} exportFormat;
+
+/**
+ * @brief Export the parts of @p images, so that they can be fetched by some
+ *        other download tool
+ *
+ * Each part is listed with its offset, size, MD5 checksum and the URIs it can
+ * be fetched from, as built by md5ToURIs(). Parts outside the range or shard
+ * being reconstructed are left out. Either format names the file each part
+ * should be downloaded to after its MD5 checksum in hexadecimal, which is
+ * what sessionOptions::importDir expects.
+ *
+ * A part which only occurs in local directories has no URIs. It is listed
+ * with an empty list of URIs in JSON, but left out of an aria2 input file,
+ * which has no use for it.
+ *
+ * @param numUnlisted Where the number of parts left out is stored
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool exportParts(FILE *fp, const sessionImage *images, int numImages,
+                 exportFormat format, int *numUnlisted);
+
+/**
+ * @brief Get the name of @p format, as accepted by exportFormatFromName()
+ */
+const char *exportFormatName(exportFormat format);
+
+/**
+ * @brief Look up an export format by name
+ *
+ * @return The format, or EXPORT_FORMAT_COUNT if @p name is not known
+ */
+exportFormat exportFormatFromName(const char *name);
+
+#endif
@@ -17,12 +17,324 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <curl/curl.h>
 
 #include "fetch.h"
+#include "metrics.h"
+#include "trace.h"
 
-static bool initialized = false;
+static pthread_mutex_t initLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned initialized = 0; ///< Number of fetch_init() calls outstanding
+
+/**
+ * @brief Data shared by all transfers in the process: resolved host names and
+ *        TLS sessions, which later transfers to the same mirror reuse rather
+ *        than setting up their own
+ *
+ * Open connections can't be shared this way by transfers running on several
+ * threads at once; they stay with the handles in @c idleHandles instead.
+ */
+static CURLSH *share;
+static pthread_mutex_t shareLocks[CURL_LOCK_DATA_LAST];
+
+static void lockShare(CURL *curl, curl_lock_data data, curl_lock_access access,
+                      void *private)
+{
+    pthread_mutex_lock(&shareLocks[data]);
+}
+
+static void unlockShare(CURL *curl, curl_lock_data data, void *private)
+{
+    pthread_mutex_unlock(&shareLocks[data]);
+}
+
+/**
+ * @brief Set up @c share; a transfer works just as well without it
+ */
+static void initShare(void)
+{
+    int i;
+
+    share = curl_share_init();
+    if (!share) {
+        return;
+    }
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&shareLocks[i], NULL);
+    }
+
+    if (curl_share_setopt(share, CURLSHOPT_LOCKFUNC,
+                          lockShare) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC,
+                          unlockShare) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK) {
+        curl_share_cleanup(share);
+        share = NULL;
+
+        for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&shareLocks[i]);
+        }
+        return;
+    }
+
+}
+
+/**
+ * @brief Most handles kept by releaseHandle() for later transfers
+ */
+#define maxIdleHandles 64
+
+/**
+ * @brief A handle which is not in use, along with the open connections in its
+ *        own connection cache
+ */
+typedef struct {
+    CURL *curl;
+    char *origin;         ///< Scheme and host of the handle's last transfer
+} idleHandle;
+
+static pthread_mutex_t handleLock = PTHREAD_MUTEX_INITIALIZER;
+static idleHandle idleHandles[maxIdleHandles];
+static int numIdleHandles = 0;
+
+/**
+ * @brief Get the scheme and host of @p uri, e.g. "http://example.com"
+ *
+ * @return A newly heap-allocated string, or NULL on failure
+ */
+static char *uriOrigin(const char *uri)
+{
+    const char *host = strstr(uri, "://");
+    size_t len = host ? strcspn(host + strlen("://"), "/") : 0;
+
+    return host ? strndup(uri, host + strlen("://") - uri + len) : NULL;
+}
+
+/**
+ * @brief Get a handle for a transfer from @p uri, preferring an idle one
+ *        whose last transfer was from the same host, so that its connection
+ *        is reused
+ *
+ * A handle is only ever used by one transfer at a time, which is all libcurl
+ * allows, but may move between threads from one transfer to the next.
+ *
+ * @return The handle, to be passed to releaseHandle(); or NULL on failure
+ */
+static CURL *takeHandle(const char *uri)
+{
+    char *origin = uriOrigin(uri);
+    CURL *curl = NULL;
+    int i, chosen;
+
+    pthread_mutex_lock(&handleLock);
+
+    /* Failing one for the same host, take the one released last */
+    chosen = numIdleHandles - 1;
+    for (i = numIdleHandles - 1; origin && i >= 0; i--) {
+        if (idleHandles[i].origin &&
+            strcmp(idleHandles[i].origin, origin) == 0) {
+            chosen = i;
+            break;
+        }
+    }
+
+    if (chosen >= 0) {
+        curl = idleHandles[chosen].curl;
+        free(idleHandles[chosen].origin);
+        idleHandles[chosen] = idleHandles[--numIdleHandles];
+    }
+
+    pthread_mutex_unlock(&handleLock);
+
+    free(origin);
+
+    if (curl) {
+        /* Only the options go; connections and caches are kept */
+        curl_easy_reset(curl);
+        return curl;
+    }
+
+    return curl_easy_init();
+}
+
+/**
+ * @brief Keep @p curl, which was last used for @p uri, for a later transfer,
+ *        or clean it up if enough handles are kept already
+ */
+static void releaseHandle(CURL *curl, const char *uri)
+{
+    pthread_mutex_lock(&handleLock);
+
+    if (initialized > 0 && numIdleHandles < maxIdleHandles) {
+        idleHandles[numIdleHandles].curl = curl;
+        idleHandles[numIdleHandles].origin = uriOrigin(uri);
+        numIdleHandles++;
+        curl = NULL;
+    }
+
+    pthread_mutex_unlock(&handleLock);
+
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+}
+
+/**
+ * @brief Clean up the handles kept by releaseHandle()
+ */
+static void cleanupHandles(void)
+{
+    int i;
+
+    pthread_mutex_lock(&handleLock);
+
+    for (i = 0; i < numIdleHandles; i++) {
+        curl_easy_cleanup(idleHandles[i].curl);
+        free(idleHandles[i].origin);
+    }
+    numIdleHandles = 0;
+
+    pthread_mutex_unlock(&handleLock);
+}
+
+/**
+ * @brief Seconds of data which transfers held to a limiter may receive at
+ *        once, before being made to wait for it
+ */
+#define limiterBurst 0.25
+
+/**
+ * @brief Microseconds for which a held transfer sleeps before checking whether
+ *        it has been cancelled, or its limiter's settings have changed
+ */
+#define limiterPollInterval 100000
+
+/**
+ * @brief Bytes per second below which a transfer is timed out, once it has
+ *        averaged less for lowSpeedTime seconds
+ */
+#define lowSpeedLimit 1024
+
+/**
+ * @brief Seconds a transfer may stay below lowSpeedLimit
+ */
+#define lowSpeedTime 60
+
+struct _fetchLimiter {
+    pthread_mutex_t lock;     ///< Lock on the other members
+    uint64_t rate;            ///< Bytes per second, or 0 for no limit
+    bool paused;              ///< Set while transfers are held
+    double due;               ///< When the data received so far is paid for,
+                              ///< in seconds of CLOCK_MONOTONIC
+};
+
+/**
+ * @brief Get the time of CLOCK_MONOTONIC in seconds
+ */
+static double monotonicTime(void)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return 0;
+    }
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Account for @p bytes received under @p limiter, and wait until they
+ *        fit within its rate
+ *
+ * @return @c true once the transfer may carry on; @c false if it was cancelled
+ *         while waiting
+ */
+static bool limiterWait(fetchLimiter *limiter, size_t bytes,
+                        const volatile bool *cancel)
+{
+    bool accounted = false;
+
+    while (!(cancel && *cancel)) {
+        double now = monotonicTime(), wait;
+        bool paused;
+
+        pthread_mutex_lock(&limiter->lock);
+
+        paused = limiter->paused;
+
+        /* Time not spent receiving doesn't build up into a burst */
+        if (!accounted && !paused) {
+            if (limiter->due < now) {
+                limiter->due = now;
+            }
+            if (limiter->rate) {
+                limiter->due += (double) bytes / limiter->rate;
+            }
+            accounted = true;
+        }
+
+        wait = limiter->due - now - limiterBurst;
+
+        pthread_mutex_unlock(&limiter->lock);
+
+        if (!paused && wait <= 0) {
+            return true;
+        }
+
+        /* Sleep in slices, so that a change of settings is noticed */
+        if (paused || wait * 1e6 > limiterPollInterval) {
+            usleep(limiterPollInterval);
+        } else {
+            usleep(wait * 1e6);
+        }
+    }
+
+    return false;
+}
+
+fetchLimiter *fetchLimiterCreate(void)
+{
+    fetchLimiter *limiter = calloc(1, sizeof(*limiter));
+
+    if (limiter && pthread_mutex_init(&limiter->lock, NULL) != 0) {
+        free(limiter);
+        return NULL;
+    }
+
+    return limiter;
+}
+
+void fetchLimiterFree(fetchLimiter *limiter)
+{
+    if (limiter) {
+        pthread_mutex_destroy(&limiter->lock);
+        free(limiter);
+    }
+}
+
+void fetchLimiterSetRate(fetchLimiter *limiter, uint64_t bytesPerSecond)
+{
+    pthread_mutex_lock(&limiter->lock);
+    limiter->rate = bytesPerSecond;
+    limiter->due = monotonicTime();
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+void fetchLimiterSetPaused(fetchLimiter *limiter, bool paused)
+{
+    pthread_mutex_lock(&limiter->lock);
+    limiter->paused = paused;
+    pthread_mutex_unlock(&limiter->lock);
+}
 
 /**
  * @brief Arguments for the custom @c CURLOPT_WRITEFUNCTION callback
@@ -31,6 +343,12 @@ typedef struct {
     void *base;       ///< Start of the output buffer
     ssize_t *written; ///< Bytes written so far
     size_t capacity;  ///< Total capacity of the output buffer
+    const volatile bool *cancel; ///< The flag passed to fetch()
+    fetchLimiter *limiter;       ///< The limiter passed to fetch()
+    double windowStart;   ///< When the transfer's speed was last checked, in
+                          ///< seconds of CLOCK_MONOTONIC
+    ssize_t windowBytes;  ///< Bytes written by then
+    double windowHeld;    ///< Seconds held by the limiter since then
 } memInfo;
 
 static size_t fetchToMem(void *in, size_t size, size_t nmemb, void *private)
@@ -39,32 +357,108 @@ static size_t fetchToMem(void *in, size_t size, size_t nmemb, void *private)
     size_t wanted = size * nmemb;
     ssize_t *written = info->written;
 
-    if (wanted + *written > info->capacity) {
+    /* Nothing more reaches the buffer once the transfer is abandoned */
+    if (wanted + *written > info->capacity ||
+        (info->cancel && *info->cancel)) {
         return 0;
     }
 
     memcpy(info->base + *written, in, wanted);
     *written += wanted;
 
+    if (info->limiter) {
+        double start = monotonicTime();
+
+        if (!limiterWait(info->limiter, wanted, info->cancel)) {
+            return 0;
+        }
+
+        info->windowHeld += monotonicTime() - start;
+    }
+
     return wanted;
 }
 
+/**
+ * @brief Abort a transfer once the flag passed to fetch() has been set, or
+ *        once it has been too slow for too long
+ *
+ * Transfers held to a limiter are timed out here rather than by libcurl, which
+ * would count the time the limiter held them against them, and so time out
+ * every transfer once the limit is low enough.
+ */
+static int checkTransfer(void *private, curl_off_t dltotal, curl_off_t dlnow,
+                         curl_off_t ultotal, curl_off_t ulnow)
+{
+    memInfo *info = private;
+    double now, active;
+
+    if (info->cancel && *info->cancel) {
+        return 1;
+    }
+
+    if (!info->limiter) {
+        return 0;
+    }
+
+    now = monotonicTime();
+    active = now - info->windowStart - info->windowHeld;
+
+    if (active < lowSpeedTime) {
+        return 0;
+    }
+
+    if (*info->written - info->windowBytes < lowSpeedLimit * active) {
+        return 1;
+    }
+
+    info->windowStart = now;
+    info->windowBytes = *info->written;
+    info->windowHeld = 0;
+
+    return 0;
+}
+
 bool fetch_init(void)
 {
-    if (!initialized && curl_global_init(CURL_GLOBAL_DEFAULT) == CURLE_OK) {
-        initialized = true;
+    bool ret = true;
+
+    pthread_mutex_lock(&initLock);
+
+    if (initialized == 0 && curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        ret = false;
+    } else {
+        if (initialized++ == 0) {
+            initShare();
+        }
     }
 
-    return initialized;
+    pthread_mutex_unlock(&initLock);
+
+    return ret;
 }
 
 void fetch_cleanup(void)
 {
-    if (initialized) {
+    pthread_mutex_lock(&initLock);
+
+    if (initialized > 0 && --initialized == 0) {
+        cleanupHandles();
+
+        if (share) {
+            int i;
+
+            curl_share_cleanup(share);
+            share = NULL;
+
+            for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+                pthread_mutex_destroy(&shareLocks[i]);
+            }
+        }
         curl_global_cleanup();
     }
 
-    initialized = false;
+    pthread_mutex_unlock(&initLock);
 }
 
 /**
@@ -76,7 +470,7 @@ static CURL *initCurlCommon(const char *uri)
 {
     CURL *curl = NULL;
 
-    curl = curl_easy_init();
+    curl = takeHandle(uri);
 
     if (curl) {
         if (curl_easy_setopt(curl, CURLOPT_URL, uri) != CURLE_OK) {
@@ -89,11 +483,18 @@ static CURL *initCurlCommon(const char *uri)
         }
 
         /* Time out the transfer if it averages < 1KB/s for > 60 seconds */
-        if (curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60) != CURLE_OK) {
+        if (curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+                             (long) lowSpeedTime) != CURLE_OK) {
             goto fail;
         }
 
-        if (curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024) != CURLE_OK) {
+        if (curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT,
+                             (long) lowSpeedLimit) != CURLE_OK) {
+            goto fail;
+        }
+
+        if (share &&
+            curl_easy_setopt(curl, CURLOPT_SHARE, share) != CURLE_OK) {
             goto fail;
         }
 
@@ -107,12 +508,65 @@ fail:
     return curl;
 }
 
-ssize_t fetch(const char *uri, void *out, size_t outBytes,
-              ssize_t *fetchedBytes)
+/**
+ * @brief Milliseconds to wait for a connection to a peer
+ *
+ * Peers are on the local network, and answer at once if they're up at all.
+ */
+#define peerConnectTimeout 1000
+
+/**
+ * @brief Record the stages of the transfer of @p uri on @p curl in the trace,
+ *        from @p start, when curl_easy_perform() was called
+ *
+ * Stages which didn't happen, e.g. the TLS handshake of a plain HTTP transfer,
+ * or the connection of one reusing an open connection, are left out.
+ */
+static void traceTransfer(CURL *curl, const char *uri, uint64_t start)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00 // CURLINFO_*_TIME_T came with 7.61.0
+    static const struct {
+        CURLINFO info;
+        const char *name;
+    } stages[] = {
+        { CURLINFO_NAMELOOKUP_TIME_T, "dns" },
+        { CURLINFO_CONNECT_TIME_T, "connect" },
+        { CURLINFO_APPCONNECT_TIME_T, "tls" },
+        { CURLINFO_STARTTRANSFER_TIME_T, "first byte" },
+        { CURLINFO_TOTAL_TIME_T, "body" },
+    };
+    traceArgs args = { .uri = uri };
+    curl_off_t done = 0;
+    int i;
+
+    for (i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        curl_off_t at; // Microseconds from the start of the transfer
+
+        if (curl_easy_getinfo(curl, stages[i].info, &at) != CURLE_OK ||
+            at <= done) {
+            continue;
+        }
+
+        traceSpan("transfer", stages[i].name, start + done * 1000,
+                  start + at * 1000, &args);
+        done = at;
+    }
+#endif
+}
+
+/**
+ * @brief Implementation of fetch() and fetchFromPeer()
+ */
+static ssize_t fetchToBuffer(const char *uri, void *out, size_t outBytes,
+                             ssize_t *fetchedBytes,
+                             const volatile bool *cancel,
+                             fetchLimiter *limiter, bool peer)
 {
     memInfo info;
     ssize_t ret = -1;
     CURL *curl = NULL;
+    CURLcode result;
+    uint64_t start = metricsNow(), performed;
 
     if (!initialized) {
         goto done;
@@ -132,25 +586,82 @@ ssize_t fetch(const char *uri, void *out, size_t outBytes,
     info.base = out;
     info.written = fetchedBytes;
     info.capacity = outBytes;
+    info.cancel = cancel;
+    info.limiter = limiter;
+    info.windowStart = monotonicTime();
+    info.windowBytes = 0;
+    info.windowHeld = 0;
 
     if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, &info) != CURLE_OK) {
         goto done;
     }
 
-    if (curl_easy_perform(curl) != CURLE_OK) {
+    /* The limiter's transfers are timed out by checkTransfer() instead */
+    if (limiter &&
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 0L) != CURLE_OK) {
+        goto done;
+    }
+
+    if (cancel || limiter) {
+        if (curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION,
+                             checkTransfer) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &info) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L) != CURLE_OK) {
+            goto done;
+        }
+    }
+
+    if (peer &&
+        (curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                          (long) peerConnectTimeout) != CURLE_OK ||
+         curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L) != CURLE_OK)) {
         goto done;
     }
 
-    ret = *fetchedBytes;
+    performed = metricsNow();
+    result = curl_easy_perform(curl);
+
+    if (traceEnabled()) {
+        traceTransfer(curl, uri, performed);
+    }
+
+    if (result == CURLE_OK) {
+        ret = *fetchedBytes;
+    } else if (peer && result == CURLE_HTTP_RETURNED_ERROR) {
+        ret = 0;
+    }
+
+    /* Neither abandoned transfers nor peers lacking the part are the
+     * mirror's fault */
+    if (!(cancel && *cancel) && !(peer && ret == 0)) {
+        metricsAddTransfer(uri, *fetchedBytes, metricsNow() - start,
+                           ret == (ssize_t) outBytes);
+    }
 
 done:
     if (curl) {
-        curl_easy_cleanup(curl);
+        releaseHandle(curl, uri);
     }
 
     return ret;
 }
 
+ssize_t fetch(const char *uri, void *out, size_t outBytes,
+              ssize_t *fetchedBytes, const volatile bool *cancel,
+              fetchLimiter *limiter)
+{
+    return fetchToBuffer(uri, out, outBytes, fetchedBytes, cancel, limiter,
+                         false);
+}
+
+ssize_t fetchFromPeer(const char *uri, void *out, size_t outBytes,
+                      ssize_t *fetchedBytes, const volatile bool *cancel,
+                      fetchLimiter *limiter)
+{
+    return fetchToBuffer(uri, out, outBytes, fetchedBytes, cancel, limiter,
+                         true);
+}
+
 /**
  * @brief Fetch the resource at @path to a temporary file
  *
@@ -194,7 +705,7 @@ done:
     }
 
     if (curl) {
-        curl_easy_cleanup(curl);
+        releaseHandle(curl, path);
     }
 
     return fp;
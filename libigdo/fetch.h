@@ -39,21 +39,30 @@ typedef enum {
                          ///< added while keeping ABI backwards-compatible.
 } uriType;
 
+/**
+ * @brief A limit on the rate at which transfers receive data, shared by all
+ *        transfers given it
+ *
+ * Its settings may be changed from any thread while the transfers run.
+ */
+typedef struct _fetchLimiter fetchLimiter;
+
 /**
  * @brief Initialize libcurl before fetching
  *
  * @return @c true on success; @c false on failure
  *
- * @note This function is not thread-safe and MUST NOT be called when other
- *       threads are running
+ * Calls may be nested: libcurl is initialized by the first call, and only
+ * released once each call has been matched by one to fetch_cleanup().
+ *
+ * @note libcurl's global initialization is not thread-safe: the first call
+ *       MUST NOT be made while other threads are using libcurl
  */
 bool fetch_init(void);
 
 /**
- * @brief Release libcurl resources
- *
- * @note This function is not thread-safe and MUST NOT be called when other
- *       threads are running
+ * @brief Release libcurl resources, once each call to fetch_init() has been
+ *        matched by a call to this function
  */
 void fetch_cleanup(void);
 
@@ -64,11 +73,60 @@ void fetch_cleanup(void);
  * @param out Memory location where the data should be written
  * @param outBytes Maximum amount of data to write
  * @param fetchedBytes This will be updated with bytes fetched so far
+ * @param cancel If not NULL, the transfer is abandoned once this is set,
+ *               which may be done from any thread
+ * @param limiter If not NULL, the transfer is held to the limiter's rate. The
+ *                time it is held for doesn't count towards timing it out for
+ *                being too slow
  *
  * @return Amount of data written, or -1 on error
  */
 ssize_t fetch(const char *uri, void *out, size_t outBytes,
-              ssize_t *fetchedBytes);
+              ssize_t *fetchedBytes, const volatile bool *cancel,
+              fetchLimiter *limiter);
+
+/**
+ * @brief Fetch data into memory from a peer, which may well not have it, or
+ *        not be running at all
+ *
+ * Takes the same parameters as fetch(), but gives up on connecting to the peer
+ * much sooner, and tells a peer which is unreachable apart from one which
+ * merely doesn't have the data.
+ *
+ * @return Amount of data written; 0 if the peer answered with an HTTP error,
+ *         e.g. because it doesn't have the data; or -1 if the peer couldn't be
+ *         reached, or on any other error
+ */
+ssize_t fetchFromPeer(const char *uri, void *out, size_t outBytes,
+                      ssize_t *fetchedBytes, const volatile bool *cancel,
+                      fetchLimiter *limiter);
+
+/**
+ * @brief Create a limiter for fetch(), which doesn't limit anything until its
+ *        rate is set
+ *
+ * @return The new limiter, or NULL on failure
+ */
+fetchLimiter *fetchLimiterCreate(void);
+
+/**
+ * @brief Release @p limiter, once no transfers are using it
+ */
+void fetchLimiterFree(fetchLimiter *limiter);
+
+/**
+ * @brief Set how many bytes per second the transfers sharing @p limiter may
+ *        receive between them, or 0 for no limit
+ */
+void fetchLimiterSetRate(fetchLimiter *limiter, uint64_t bytesPerSecond);
+
+/**
+ * @brief Hold the transfers sharing @p limiter, or let them carry on
+ *
+ * Held transfers stop reading from their connections; ones held for longer
+ * than the mirrors or the low speed limit tolerate fail, and are retried.
+ */
+void fetchLimiterSetPaused(fetchLimiter *limiter, bool paused);
 
 /**
  * @brief Open a file for read, fetching it from a remote location if necessary
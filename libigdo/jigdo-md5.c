@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -28,6 +29,7 @@
 #include "jigdo-md5.h"
 #include "jigdo-md5-private.h"
 #include "md5.h"
+#include "metrics.h"
 
 /**
  * @brief tests whether a base64 symbol has been flagged as valid in the table
@@ -183,35 +185,70 @@ void md5SumToString(md5Checksum md5, char *out)
     out[0] = '\0';
 }
 
+bool md5SumFromString(const char *in, md5Checksum *md5)
+{
+    uint8_t *out = (uint8_t *) md5;
+    int i;
+
+    if (strlen(in) != 2 * sizeof(*md5)) {
+        return false;
+    }
+
+    for (i = 0; i < sizeof(*md5); i++) {
+        unsigned byte;
+
+        if (!isxdigit((unsigned char) in[2 * i]) ||
+            !isxdigit((unsigned char) in[2 * i + 1]) ||
+            sscanf(in + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = byte;
+    }
+
+    return true;
+}
+
 md5Checksum md5MemOneShot(const void *in, size_t len)
 {
     struct MD5Context ctx;
     md5Checksum ret;
+    uint64_t start = metricsNow();
 
     MD5Init(&ctx);
     MD5Update(&ctx, in, len);
     MD5Final(&ret, &ctx);
 
+    metricsAddWork(METRICS_WORK_HASH, len, metricsNow() - start);
+
     return ret;
 }
 
 md5Checksum md5Fd(int fd)
 {
     md5Checksum ret;
-    struct MD5Context ctx;
     struct stat st;
-    off_t pos;
-    int windowSize = getpagesize() * 1024;
 
     if (fstat(fd, &st) != 0) {
-        goto fail;
+        memset(&ret, 0xff, sizeof(ret));
+        return ret;
     }
 
+    return md5FdLength(fd, st.st_size);
+}
+
+md5Checksum md5FdLength(int fd, uint64_t len)
+{
+    md5Checksum ret;
+    struct MD5Context ctx;
+    off_t pos;
+    int windowSize = getpagesize() * 1024;
+    uint64_t start = metricsNow();
+
     MD5Init(&ctx);
 
-    for (pos = 0; pos < st.st_size; pos += windowSize) {
+    for (pos = 0; pos < len; pos += windowSize) {
         void *buf;
-        size_t toRead = st.st_size - pos;
+        size_t toRead = len - pos;
 
         if (toRead > windowSize) {
             toRead = windowSize;
@@ -228,6 +265,7 @@ md5Checksum md5Fd(int fd)
     }
 
     MD5Final(&ret, &ctx);
+    metricsAddWork(METRICS_WORK_HASH, len, metricsNow() - start);
     return ret;
 
 fail:
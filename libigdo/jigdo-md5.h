@@ -55,6 +55,17 @@ int md5Cmp(const md5Checksum *a, const md5Checksum *b);
  */
 void md5SumToString(md5Checksum md5, char *out);
 
+/**
+ * @brief Convert the hexadecimal representation of an MD5 checksum, as made by
+ *        md5SumToString(), back to the checksum
+ *
+ * @param in The hexadecimal representation, of exactly 32 digits
+ * @param md5 Where the checksum will be stored
+ *
+ * @return @c true on success; @c false if @p in isn't a valid representation
+ */
+bool md5SumFromString(const char *in, md5Checksum *md5);
+
 /**
  * @brief compute an MD5 checksum from memory region
  *
@@ -75,6 +86,20 @@ md5Checksum md5MemOneShot(const void *in, size_t len);
  */
 md5Checksum md5Fd(int fd);
 
+/**
+ * @brief compute an MD5 checksum for the first @p len bytes of a file
+ *
+ * Unlike md5Fd(), this does not depend on the size reported by fstat(2), and
+ * so also works on block devices.
+ *
+ * @param fd An open file descriptor to the file to checksum
+ * @param len Number of bytes to checksum
+ *
+ * @return The MD5 checksum. If an error occurred, all bits in the checksum will
+ *         be set to 1.
+ */
+md5Checksum md5FdLength(int fd, uint64_t len);
+
 /**
  * @brief compute an MD5 checksum for a file by path
  *
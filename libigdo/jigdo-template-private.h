@@ -55,6 +55,10 @@ struct _templateFile {
                                      ///< TEMPLATE_ENTRY_TYPE_FILE_OBSOLETE.
     md5Checksum md5Sum;              ///< MD5 sum of the component file
     commitStatus status;             ///< Status of restoring this file
+    templateFileEntry *dupOf;        ///< Identical file elsewhere which this
+                                     ///< one can be copied from, or NULL if
+                                     ///< this file must be fetched
+    templateDescTable *dupTable;     ///< Table which @c dupOf belongs to
 };
 
 /**
@@ -67,6 +71,15 @@ struct _templateDescTable {
     templateFileEntry *files;         ///< Files to reassemble
     int numFiles;                     ///< Count of files
     bool existingFile;                ///< Set if output file already exists
+    uint64_t rangeStart;              ///< Start of the range of the image to
+                                      ///< reconstruct
+    uint64_t rangeEnd;                ///< End of that range, exclusive
+    bool partial;                     ///< Set if that range isn't the whole
+                                      ///< image
+    int shard;                        ///< Shard of the image to reconstruct,
+                                      ///< counting from 1
+    int numShards;                    ///< Number of shards the image is split
+                                      ///< into, or 0 if it isn't
 };
 
 #endif
@@ -20,11 +20,11 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 
 #include "jigdo-template.h"
 #include "jigdo-template-private.h"
 #include "decompress.h"
+#include "probes.h"
 #include "util.h"
 
 /*@
@@ -246,13 +246,247 @@ templateDescTable *jigdoReadTemplateFile(FILE *fp)
     qsort(table->files, table->numFiles, sizeof(table->files[0]),
           fileRevSizeCmp);
 
+    table->rangeEnd = table->imageInfo.size;
+
     return table;
 
 failed:
-    free(table);
+    freeTemplateDescTable(table);
     return NULL;
 }
 
+void freeTemplateDescTable(templateDescTable *table)
+{
+    if (table) {
+        free(table->dataBlocks);
+        free(table->files);
+        free(table);
+    }
+}
+
+/**
+ * @brief A file entry along with the position of its table in the search
+ */
+typedef struct {
+    templateFileEntry *file;  ///< The file entry
+    templateDescTable *table; ///< The table which @c file belongs to
+    int tableIndex;           ///< Position of @c table in the tables searched
+} fileRef;
+
+/**
+ * @brief Comparator function to sort fileRef records by MD5 checksum and size,
+ *        then by position among files with identical contents
+ */
+static int fileRefCmp(const void *a, const void *b)
+{
+    const fileRef *refA = a, *refB = b;
+    int cmp = md5Cmp(&(refA->file->md5Sum), &(refB->file->md5Sum));
+
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    if (refA->file->size != refB->file->size) {
+        return refA->file->size < refB->file->size ? -1 : 1;
+    }
+
+    if (refA->tableIndex != refB->tableIndex) {
+        return refA->tableIndex - refB->tableIndex;
+    }
+
+    return (refA->file->offset > refB->file->offset) -
+           (refA->file->offset < refB->file->offset);
+}
+
+/**
+ * @brief Determine whether @p a and @p b have identical contents
+ */
+static bool sameContents(const fileRef *a, const fileRef *b)
+{
+    return md5Cmp(&(a->file->md5Sum), &(b->file->md5Sum)) == 0 &&
+           a->file->size == b->file->size;
+}
+
+int jigdoFindDuplicateFiles(templateDescTable **tables, int numTables)
+{
+    fileRef *refs;
+    int i, j, numRefs = 0, duplicates = 0;
+
+    for (i = 0; i < numTables; i++) {
+        numRefs += tables[i]->numFiles;
+    }
+
+    if (numRefs == 0) {
+        return 0;
+    }
+
+    /* Sort references rather than the tables themselves, which are kept in the
+     * order that files should be fetched in. */
+    refs = malloc(sizeof(refs[0]) * numRefs);
+    if (!refs) {
+        return -1;
+    }
+
+    for (numRefs = i = 0; i < numTables; i++) {
+        for (j = 0; j < tables[i]->numFiles; j++) {
+            /* Skipped files won't be there to be copied from */
+            if (tables[i]->files[j].status == COMMIT_STATUS_SKIPPED) {
+                continue;
+            }
+
+            refs[numRefs].file = tables[i]->files + j;
+            refs[numRefs].table = tables[i];
+            refs[numRefs].tableIndex = i;
+            numRefs++;
+        }
+    }
+
+    qsort(refs, numRefs, sizeof(refs[0]), fileRefCmp);
+
+    for (i = 0; i < numRefs; i = j) {
+        fileRef *first = refs + i;
+
+        /* Find the end of the group, preferring an already complete file as
+         * the one to copy the others from. */
+        for (j = i + 1; j < numRefs && sameContents(refs + i, refs + j); j++) {
+            if (first->file->status != COMMIT_STATUS_COMPLETE &&
+                refs[j].file->status == COMMIT_STATUS_COMPLETE) {
+                first = refs + j;
+            }
+        }
+
+        for (; i < j; i++) {
+            if (refs + i == first ||
+                refs[i].file->status == COMMIT_STATUS_COMPLETE) {
+                continue;
+            }
+
+            refs[i].file->dupOf = first->file;
+            refs[i].file->dupTable = first->table;
+            refs[i].file->status = COMMIT_STATUS_DUPLICATE;
+            duplicates++;
+        }
+    }
+
+    free(refs);
+
+    return duplicates;
+}
+
+/**
+ * @brief A group of identical parts, assigned to a shard as a whole
+ */
+typedef struct {
+    fileRef *refs;     ///< The parts in the group, by offset
+    int numRefs;       ///< Number of elements in @c refs
+} shardGroup;
+
+/**
+ * @brief Comparator function to sort groups of parts by decreasing size, then
+ *        by offset, so that every machine sorts them the same way
+ */
+static int shardGroupCmp(const void *a, const void *b)
+{
+    const templateFileEntry *fileA = ((const shardGroup *) a)->refs->file;
+    const templateFileEntry *fileB = ((const shardGroup *) b)->refs->file;
+
+    if (fileA->size != fileB->size) {
+        return fileA->size > fileB->size ? -1 : 1;
+    }
+
+    return (fileA->offset > fileB->offset) - (fileA->offset < fileB->offset);
+}
+
+bool jigdoSetShard(templateDescTable *table, int shard, int numShards)
+{
+    fileRef *refs = NULL;
+    shardGroup *groups = NULL;
+    uint64_t *loads = NULL;
+    int i, j, numGroups = 0;
+    bool ret = false;
+
+    if (numShards < 1 || shard < 1 || shard > numShards) {
+        return false;
+    }
+
+    refs = malloc(sizeof(refs[0]) * (table->numFiles ? table->numFiles : 1));
+    groups = malloc(sizeof(groups[0]) *
+                    (table->numFiles ? table->numFiles : 1));
+    loads = calloc(numShards, sizeof(loads[0]));
+    if (!refs || !groups || !loads) {
+        goto done;
+    }
+
+    for (i = 0; i < table->numFiles; i++) {
+        refs[i].file = table->files + i;
+        refs[i].table = table;
+        refs[i].tableIndex = 0;
+    }
+
+    qsort(refs, table->numFiles, sizeof(refs[0]), fileRefCmp);
+
+    for (i = 0; i < table->numFiles; i = j) {
+        j = i + 1;
+        while (j < table->numFiles && sameContents(refs + i, refs + j)) {
+            j++;
+        }
+
+        groups[numGroups].refs = refs + i;
+        groups[numGroups].numRefs = j - i;
+        numGroups++;
+    }
+
+    qsort(groups, numGroups, sizeof(groups[0]), shardGroupCmp);
+
+    for (i = 0; i < numGroups; i++) {
+        int lightest = 0;
+
+        for (j = 1; j < numShards; j++) {
+            if (loads[j] < loads[lightest]) {
+                lightest = j;
+            }
+        }
+
+        loads[lightest] += groups[i].refs->file->size;
+
+        if (lightest + 1 != shard) {
+            for (j = 0; j < groups[i].numRefs; j++) {
+                groups[i].refs[j].file->status = COMMIT_STATUS_SKIPPED;
+            }
+        }
+    }
+
+    table->shard = shard;
+    table->numShards = numShards;
+    table->partial = true;
+
+    /* The template data is written by the merge, once */
+    table->rangeStart = table->rangeEnd = 0;
+
+    ret = true;
+
+done:
+    free(loads);
+    free(groups);
+    free(refs);
+
+    return ret;
+}
+
+bool jigdoGetShard(const templateDescTable *table, int *shard,
+                   int *numShards)
+{
+    if (shard) {
+        *shard = table->shard;
+    }
+
+    if (numShards) {
+        *numShards = table->numShards;
+    }
+
+    return table->numShards > 0;
+}
+
 /**
  * @brief Seek @p fp to the byte following the next CRLF line terminator
  *
@@ -323,27 +557,36 @@ static bool validateTemplateFile(FILE *fp)
 }
 
 /**
- * @brief Decompress a chunk of the @c .template file data stream
+ * @brief Location of a compressed chunk of the @c .template file data stream
+ */
+typedef struct {
+    compressType type;   ///< Compression algorithm of the chunk
+    off_t fileOffset;    ///< Offset of the compressed data in the .template
+    size_t inBytes;      ///< Compressed size of the chunk
+    uint64_t dataOffset; ///< Offset of the decompressed data within the
+                         ///< concatenated data parts of the image
+    size_t outBytes;     ///< Decompressed size of the chunk
+} templateChunk;
+
+/**
+ * @brief Read the header of a chunk of the @c .template file data stream
  *
  * @param fp An open <tt>FILE *</tt> handle to a Jigdo @c .template file.
  *           This should have been seeked to the beginning of a compressed data
- *           chunk by the caller ahead of time.
- * @param out The base address of where the decompressed output will be written
- * @param avail Available capacity of the output buffer
+ *           chunk by the caller ahead of time, and is left seeked to the
+ *           compressed data following the header.
+ * @param chunk Where the location and sizes of the chunk are stored; only
+ *              @c dataOffset is left alone
  *
- * @return The number of decompressed bytes on success, -1 on failure, or 0 when
- *         no further compressed data chunks remain.
+ * @return 1 on success, -1 on failure, or 0 when no further compressed data
+ *         chunks remain.
  */
-static ssize_t decompressDataPart(FILE *fp, void *out, size_t avail)
+static int readChunkHeader(FILE *fp, templateChunk *chunk)
 {
     static const int headerLen = 4;
     char header[headerLen + 1];
     templateU48 len6B;
-    ssize_t inBytes;
-    size_t outBytes;
-    void *in;
-    int ret;
-    compressType type = COMPRESSED_DATA_UNKNOWN;
+    uint64_t inBytes;
 
     header[headerLen] = '\0';
     if (fread(&header, headerLen, 1, fp) != 1) {
@@ -351,9 +594,9 @@ static ssize_t decompressDataPart(FILE *fp, void *out, size_t avail)
     }
 
     if (strcmp(header, "DATA") == 0) {
-        type = COMPRESSED_DATA_ZLIB;
+        chunk->type = COMPRESSED_DATA_ZLIB;
     } else if (strcmp(header, "BZIP") == 0) {
-        type = COMPRESSED_DATA_BZIP2;
+        chunk->type = COMPRESSED_DATA_BZIP2;
     } else if (strcmp(header, "DESC") == 0) {
         /* The DESC table follows the end of the data stream */
         return 0;
@@ -364,43 +607,171 @@ static ssize_t decompressDataPart(FILE *fp, void *out, size_t avail)
     if (fread(&len6B, sizeof(len6B), 1, fp) != 1) {
         return -1;
     }
-    inBytes = templateU48ToU64(len6B) - 16; /* 4B header, 2 x 6B sizes */
-
-    if (fread(&len6B, sizeof(len6B), 1, fp) != 1) {
+    inBytes = templateU48ToU64(len6B);
+    if (inBytes < 16) { /* 4B header, 2 x 6B sizes */
         return -1;
     }
-    outBytes = templateU48ToU64(len6B);
+    chunk->inBytes = inBytes - 16;
 
-    if (outBytes > avail) {
+    if (fread(&len6B, sizeof(len6B), 1, fp) != 1) {
         return -1;
     }
+    chunk->outBytes = templateU48ToU64(len6B);
 
-    in = malloc(inBytes);
-    if (fread(in, inBytes, 1, fp) != 1) {
+    chunk->fileOffset = ftello(fp);
+
+    return chunk->fileOffset < 0 ? -1 : 1;
+}
+
+/**
+ * @brief Decompress the chunk of the @c .template file data stream which
+ *        @p chunk describes, from wherever @p fp is seeked to
+ *
+ * @param out The base address of where the decompressed output will be written
+ *
+ * @return The number of decompressed bytes on success, or -1 on failure
+ */
+static ssize_t decompressChunk(FILE *fp, const templateChunk *chunk, void *out)
+{
+    void *in;
+    int ret;
+
+    in = malloc(chunk->inBytes ? chunk->inBytes : 1);
+    if (!in || fread(in, chunk->inBytes, 1, fp) != 1) {
         free(in);
         return -1;
     }
-    ret = decompressMemToMem(type, in, inBytes, out, outBytes);
+    ret = decompressMemToMem(chunk->type, in, chunk->inBytes, out,
+                             chunk->outBytes);
     free(in);
 
-    assert(ret == outBytes || ret == -1);
-    assert(outBytes != 0); // XXX It should probably be valid for outBytes to be
-                           // 0, but that would confuse the API of returning 0
-                           // when hitting the DESC table.
+    if (ret > 0) {
+        probePart(template__decompressed, chunk->fileOffset, ret, NULL);
+    }
+
+    assert(ret == chunk->outBytes || ret == -1);
 
     return ret;
 }
 
-bool writeDataFromTemplate(FILE *fp, int outFd, templateDescTable *table)
+/**
+ * @brief Decompress a chunk of the @c .template file data stream
+ *
+ * @param fp An open <tt>FILE *</tt> handle to a Jigdo @c .template file.
+ *           This should have been seeked to the beginning of a compressed data
+ *           chunk by the caller ahead of time.
+ * @param out The base address of where the decompressed output will be written
+ * @param avail Available capacity of the output buffer
+ *
+ * @return The number of decompressed bytes on success, -1 on failure, or 0 when
+ *         no further compressed data chunks remain.
+ */
+static ssize_t decompressDataPart(FILE *fp, void *out, size_t avail)
+{
+    templateChunk chunk;
+    int ret;
+
+    ret = readChunkHeader(fp, &chunk);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (chunk.outBytes > avail) {
+        return -1;
+    }
+
+    assert(chunk.outBytes != 0); // XXX It should probably be valid for
+                                 // outBytes to be 0, but that would confuse the
+                                 // API of returning 0 when hitting the DESC
+                                 // table.
+
+    return decompressChunk(fp, &chunk, out);
+}
+
+/**
+ * @brief Build an index of the compressed chunks of the @c .template file data
+ *        stream, so that chunks can be decompressed individually
+ *
+ * The chunk headers hold their compressed sizes, so the index is built by
+ * skipping from one header to the next without decompressing anything.
+ *
+ * @param numChunks Where the number of chunks in the index is stored
+ *
+ * @return The index, to be freed by the caller; or NULL on failure
+ */
+static templateChunk *indexTemplateData(FILE *fp, const templateDescTable *table,
+                                        int *numChunks)
+{
+    templateChunk *chunks = NULL;
+    uint64_t dataOffset = 0, totalSize = 0;
+    int i, ret, allocated = 0;
+
+    *numChunks = 0;
+
+    if (!validateTemplateFile(fp)) {
+        return NULL;
+    }
+
+    for (i = 0; i < table->numDataBlocks; i++) {
+        totalSize += table->dataBlocks[i].size;
+    }
+
+    while (true) {
+        templateChunk chunk;
+
+        ret = readChunkHeader(fp, &chunk);
+        if (ret <= 0) {
+            break;
+        }
+
+        chunk.dataOffset = dataOffset;
+        dataOffset += chunk.outBytes;
+
+        if (dataOffset > totalSize ||
+            fseeko(fp, chunk.inBytes, SEEK_CUR) != 0) {
+            ret = -1;
+            break;
+        }
+
+        if (*numChunks == allocated) {
+            templateChunk *grown;
+
+            allocated = allocated ? allocated * 2 : 64;
+            grown = realloc(chunks, sizeof(chunks[0]) * allocated);
+            if (!grown) {
+                ret = -1;
+                break;
+            }
+            chunks = grown;
+        }
+
+        chunks[(*numChunks)++] = chunk;
+    }
+
+    /* The chunks must add up to exactly the data parts in the DESC table */
+    if (ret < 0 || dataOffset != totalSize) {
+        free(chunks);
+        return NULL;
+    }
+
+    return chunks ? chunks : malloc(1);
+}
+
+/**
+ * @brief Decompress the data parts of the image from @p fp
+ *
+ * @return The data parts, back to back in the order of @c table->dataBlocks,
+ *         to be freed by the caller; or NULL on failure
+ */
+static void *readDataFromTemplate(FILE *fp, const templateDescTable *table)
 {
     int i;
-    size_t totalDecompressedSize = 0, doneSize = 0, copiedSize = 0;
+    size_t totalDecompressedSize = 0, doneSize = 0;
     ssize_t partSize;
-    void *decompressed = NULL;
-    bool ret = false;
+    void *decompressed;
 
     if (!validateTemplateFile(fp)) {
-        goto done;
+        return NULL;
     }
 
     /* Determine the sum of the sizes of the data parts and allocate enough
@@ -410,12 +781,12 @@ bool writeDataFromTemplate(FILE *fp, int outFd, templateDescTable *table)
     }
 
     if (totalDecompressedSize > table->imageInfo.size) {
-        goto done;
+        return NULL;
     }
 
     decompressed = malloc(totalDecompressedSize);
     if (!decompressed) {
-        goto done;
+        return NULL;
     }
 
     /* Decompress the stream of data parts from the template file */
@@ -423,41 +794,104 @@ bool writeDataFromTemplate(FILE *fp, int outFd, templateDescTable *table)
         partSize = decompressDataPart(fp, decompressed + doneSize,
                                       totalDecompressedSize - doneSize);
         if (partSize < 0) {
-            goto done;
+            free(decompressed);
+            return NULL;
         }
         doneSize += partSize;
     } while (partSize > 0);
 
     assert(doneSize == totalDecompressedSize);
 
-    /* Find all of the data part entries from the DESC table and copy the
-     * corresponding bytes into the file mapping. */
-    for (i = 0; i < table->numDataBlocks; i++) {
-        void *out;
+    return decompressed;
+}
 
-        /* Bounds checking in case of a corrupted or malicious .template */
-        if (copiedSize + table->dataBlocks[i].size > totalDecompressedSize) {
-            goto done;
+/**
+ * @brief Write whichever data parts of the image fall within @p chunk and
+ *        within the range being reconstructed
+ *
+ * @param block The first data part which ends within or after the chunk
+ * @param blockData Offset of @p block within the concatenated data parts
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeChunk(FILE *fp, const templateChunk *chunk, const int *outFds,
+                       int numFds, const templateDescTable *table, int block,
+                       uint64_t blockData, outputEngine *output)
+{
+    uint64_t chunkEnd = chunk->dataOffset + chunk->outBytes;
+    void *data = NULL;
+    bool ret = false;
+    int i;
+
+    for (; block < table->numDataBlocks && blockData < chunkEnd;
+         blockData += table->dataBlocks[block++].size) {
+        const templateDataEntry *entry = table->dataBlocks + block;
+        uint64_t from, to;
+
+        /* The part of the data block within the chunk, in image offsets */
+        from = entry->offset + (blockData > chunk->dataOffset ? 0 :
+                                chunk->dataOffset - blockData);
+        to = entry->offset + (blockData + entry->size < chunkEnd ?
+                              entry->size : chunkEnd - blockData);
+
+        /* ...and within the range */
+        from = from > table->rangeStart ? from : table->rangeStart;
+        to = to < table->rangeEnd ? to : table->rangeEnd;
+        if (from >= to) {
+            continue;
         }
 
-        out = mmap(NULL,
-            table->dataBlocks[i].size + pagemod(table->dataBlocks[i].offset),
-               PROT_WRITE, MAP_SHARED, outFd,
-               pagebase(table->dataBlocks[i].offset));
-        if (out == MAP_FAILED) {
-            goto done;
+        /* Only decompress chunks which are actually needed */
+        if (!data) {
+            data = malloc(chunk->outBytes);
+            if (!data || fseeko(fp, chunk->fileOffset, SEEK_SET) != 0 ||
+                decompressChunk(fp, chunk, data) < 0) {
+                goto done;
+            }
         }
 
-        memcpy(out + pagemod(table->dataBlocks[i].offset),
-               decompressed + copiedSize, table->dataBlocks[i].size);
-        copiedSize += table->dataBlocks[i].size;
-        if (msync(out, table->dataBlocks[i].size +
-                  pagemod(table->dataBlocks[i].offset), MS_ASYNC) != 0) {
-            goto done;
+        for (i = 0; i < numFds; i++) {
+            void *src = data + blockData + (from - entry->offset) -
+                        chunk->dataOffset;
+
+            if (!outputWrite(output, outFds[i], from, src, to - from) ||
+                !outputRangeDone(output, outFds[i], from, to - from)) {
+                goto done;
+            }
         }
+    }
+
+    ret = true;
+
+done:
+    free(data);
+
+    return ret;
+}
 
-        if (munmap(out, table->dataBlocks[i].size +
-                   pagemod(table->dataBlocks[i].offset)) != 0) {
+bool writeDataFromTemplate(FILE *fp, const int *outFds, int numFds,
+                           templateDescTable *table, outputEngine *output)
+{
+    int i, block = 0, numChunks;
+    uint64_t blockData = 0;
+    templateChunk *chunks;
+    bool ret = false;
+
+    chunks = indexTemplateData(fp, table, &numChunks);
+    if (!chunks) {
+        return false;
+    }
+
+    for (i = 0; i < numChunks; i++) {
+        /* Skip the data parts which end before this chunk */
+        while (block < table->numDataBlocks &&
+               blockData + table->dataBlocks[block].size <=
+               chunks[i].dataOffset) {
+            blockData += table->dataBlocks[block++].size;
+        }
+
+        if (!writeChunk(fp, chunks + i, outFds, numFds, table, block,
+                        blockData, output)) {
             goto done;
         }
     }
@@ -465,11 +899,36 @@ bool writeDataFromTemplate(FILE *fp, int outFd, templateDescTable *table)
     ret = true;
 
 done:
-    free(decompressed);
+    free(chunks);
 
     return ret;
 }
 
+void *streamDataFromTemplate(FILE *fp, templateDescTable *table,
+                             outputStream *stream)
+{
+    int i;
+    size_t copiedSize = 0;
+    void *decompressed;
+
+    decompressed = readDataFromTemplate(fp, table);
+    if (!decompressed) {
+        return NULL;
+    }
+
+    for (i = 0; i < table->numDataBlocks; i++) {
+        if (!streamAddData(stream, table->dataBlocks[i].offset,
+                           decompressed + copiedSize,
+                           table->dataBlocks[i].size)) {
+            free(decompressed);
+            return NULL;
+        }
+        copiedSize += table->dataBlocks[i].size;
+    }
+
+    return decompressed;
+}
+
 const char *jigdoGetImageMD5(const templateDescTable *table)
 {
     return table->imageInfo.md5String;
@@ -484,3 +943,66 @@ void jigdoSetExistingFile(templateDescTable *table, bool val)
 {
     table->existingFile = val;
 }
+
+bool jigdoSetRange(templateDescTable *table, uint64_t start, uint64_t end)
+{
+    int i;
+
+    if (end > table->imageInfo.size) {
+        end = table->imageInfo.size;
+    }
+
+    if (start >= end) {
+        return false;
+    }
+
+    table->rangeStart = start;
+    table->rangeEnd = end;
+    table->partial = start > 0 || end < table->imageInfo.size;
+
+    for (i = 0; i < table->numFiles; i++) {
+        templateFileEntry *file = table->files + i;
+
+        if (file->offset >= end || file->offset + file->size <= start) {
+            file->status = COMMIT_STATUS_SKIPPED;
+        }
+    }
+
+    return true;
+}
+
+bool jigdoGetRange(const templateDescTable *table, uint64_t *start,
+                   uint64_t *end)
+{
+    if (start) {
+        *start = table->rangeStart;
+    }
+
+    if (end) {
+        *end = table->rangeEnd;
+    }
+
+    return table->partial;
+}
+
+const char *commitStatusName(commitStatus status)
+{
+    static const char *names[] = {
+        [COMMIT_STATUS_NOT_STARTED] = "not_started",
+        [COMMIT_STATUS_ASSIGNED] = "assigned",
+        [COMMIT_STATUS_IN_PROGRESS] = "in_progress",
+        [COMMIT_STATUS_COMPLETE] = "complete",
+        [COMMIT_STATUS_ERROR] = "error",
+        [COMMIT_STATUS_FATAL_ERROR] = "fatal_error",
+        [COMMIT_STATUS_LOCAL_COPY] = "local_copy",
+        [COMMIT_STATUS_DUPLICATE] = "duplicate",
+        [COMMIT_STATUS_SKIPPED] = "skipped",
+        [COMMIT_STATUS_CLAIMED] = "claimed",
+    };
+
+    if (status < 0 || status >= COMMIT_STATUS_COUNT) {
+        return "unknown";
+    }
+
+    return names[status];
+}
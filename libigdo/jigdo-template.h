@@ -22,6 +22,8 @@
 #include <stdint.h>
 
 #include "jigdo-md5.h"
+#include "output.h"
+#include "stream.h"
 
 typedef struct _templateImageInfo templateImageInfoEntry;
 typedef struct _templateData templateDataEntry;
@@ -50,6 +52,14 @@ typedef enum {
     COMMIT_STATUS_ERROR,           ///< Attempted, but an error occurred
     COMMIT_STATUS_FATAL_ERROR,     ///< An error occurred, will not retry
     COMMIT_STATUS_LOCAL_COPY,      ///< Local copy found, but not copied yet
+    COMMIT_STATUS_DUPLICATE,       ///< Identical to another part of the image;
+                                   ///< to be copied once that part is complete
+    COMMIT_STATUS_SKIPPED,         ///< Outside the range or shard of the
+                                   ///< image being reconstructed; see
+                                   ///< jigdoSetRange() and jigdoSetShard()
+    COMMIT_STATUS_CLAIMED,         ///< Claimed by another process writing the
+                                   ///< same output file; see claimRange()
+    COMMIT_STATUS_COUNT,           ///< Number of states, not a state
 } commitStatus;
 
 /**
@@ -61,14 +71,58 @@ typedef enum {
  */
 templateDescTable *jigdoReadTemplateFile(FILE *fp);
 
+/**
+ * @brief Free a templateDescTable record and everything it holds
+ */
+void freeTemplateDescTable(templateDescTable *table);
+
+/**
+ * @brief Find parts of one or more images which are identical to other parts
+ *
+ * For each group of parts sharing the same MD5 checksum, one part is chosen to
+ * be fetched: one which is already complete if there is one, or otherwise the
+ * one at the lowest offset in the first of @p tables containing the group. All
+ * other incomplete parts of the group are marked COMMIT_STATUS_DUPLICATE, so
+ * that they can be copied from the chosen part once it is complete, rather
+ * than each being fetched separately.
+ *
+ * @param tables DESC tables of the images to search
+ * @param numTables Number of elements in @p tables
+ *
+ * @return The number of parts which were marked as duplicates, or -1 on error
+ */
+int jigdoFindDuplicateFiles(templateDescTable **tables, int numTables);
+
 /**
  * @brief Decompress the data stream from the @c .template and write it out
  *
+ * Only the compressed chunks of the data stream which hold data within the
+ * range set with jigdoSetRange() are decompressed, one at a time, and only
+ * that data is written.
+ *
  * @param fp An open <tt>FILE *</tt> handle to a jigdo @c .template file.
- * @param out An open file descriptor to the output file.
+ * @param outFds Open file descriptors to the output files, each of which
+ *               receives the same data
+ * @param numFds Number of elements in @p outFds
  * @param table Table of file parts from the @c .template DESC table
+ * @param output The output engine used to write to @p outFds
  */
-bool writeDataFromTemplate(FILE *fp, int outFd, templateDescTable *table);
+bool writeDataFromTemplate(FILE *fp, const int *outFds, int numFds,
+                           templateDescTable *table, outputEngine *output);
+
+/**
+ * @brief Decompress the data stream from the @c .template and queue it on an
+ *        output stream
+ *
+ * @param fp An open <tt>FILE *</tt> handle to a jigdo @c .template file.
+ * @param table Table of file parts from the @c .template DESC table
+ * @param stream The stream to which the image is written
+ *
+ * @return The decompressed data, which @p stream refers to, and which must be
+ *         freed once @p stream has been closed; or NULL on failure
+ */
+void *streamDataFromTemplate(FILE *fp, templateDescTable *table,
+                             outputStream *stream);
 
 /**
  * @brief Get the MD5 checksum of the target file
@@ -85,4 +139,64 @@ uint64_t jigdoGetImageSize(const templateDescTable *table);
  */
 void jigdoSetExistingFile(templateDescTable *table, bool val);
 
+/**
+ * @brief Limit reconstruction to the bytes from @p start up to @p end
+ *
+ * Parts which don't overlap the range are marked COMMIT_STATUS_SKIPPED; parts
+ * which do are reconstructed whole, so that their checksums can be verified.
+ * Template data is only written within the range.
+ *
+ * @param end The end of the range, exclusive; clamped to the size of the image
+ *
+ * @return @c true on success; @c false if the range is empty or starts past
+ *         the end of the image
+ */
+bool jigdoSetRange(templateDescTable *table, uint64_t start, uint64_t end);
+
+/**
+ * @brief Determine whether only part of the image is to be reconstructed
+ *
+ * @param start If not NULL, where the start of the range is stored
+ * @param end If not NULL, where the end of the range is stored
+ *
+ * @return @c true if jigdoSetRange() limited reconstruction to less than the
+ *         whole image; @c false otherwise
+ */
+bool jigdoGetRange(const templateDescTable *table, uint64_t *start,
+                   uint64_t *end);
+
+/**
+ * @brief Limit reconstruction to shard @p shard of @p numShards, so that each
+ *        of several machines can fetch its share of the parts of the image
+ *
+ * Parts are assigned to shards by greedily giving the largest remaining part
+ * to the shard with the fewest bytes so far, with identical parts kept
+ * together so that they are only fetched once. The assignment only depends on
+ * the .template file, so every machine comes to the same one. Parts of other
+ * shards are marked COMMIT_STATUS_SKIPPED, and no template data is written;
+ * both are left to the merge of the shards.
+ *
+ * @param shard The shard to reconstruct, from 1 to @p numShards
+ *
+ * @return @c true on success; @c false if @p shard is out of range, or on
+ *         failure
+ */
+bool jigdoSetShard(templateDescTable *table, int shard, int numShards);
+
+/**
+ * @brief Determine whether only a shard of the image is to be reconstructed
+ *
+ * @param shard If not NULL, where the shard set with jigdoSetShard() is stored
+ * @param numShards If not NULL, where the number of shards is stored
+ *
+ * @return @c true if jigdoSetShard() was called; @c false otherwise
+ */
+bool jigdoGetShard(const templateDescTable *table, int *shard,
+                   int *numShards);
+
+/**
+ * @brief Get a short name for @p status, e.g. for metrics and traces
+ */
+const char *commitStatusName(commitStatus status);
+
 #endif
@@ -25,8 +25,11 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <search.h>
+#include <pthread.h>
 
 #include "jigdo.h"
 #include "util.h"
@@ -252,7 +255,11 @@ static bool freadJigdoFileImageSection(FILE *fp, jigdoData *data)
         }
 
         if (isEqualKey(trimmed, templateMD5Key)) {
-            if (!deBase64MD5Sum(getEqualValue(trimmed), &(data->templateMD5))) {
+            char *md5 = getEqualValue(trimmed);
+            bool decoded = md5 && deBase64MD5Sum(md5, &(data->templateMD5));
+
+            free(md5);
+            if (!decoded) {
                 goto done;
             }
         }
@@ -397,7 +404,7 @@ static bool freadJigdoFilePartsSections(FILE *fp, jigdoData *data)
                 }
 
                 /* FIXME handle direct URIs as file location */
-                path = strdup(getValue(file, ':'));
+                path = getValue(file, ':');
                 if (!path) {
                     goto fileDone;
                 }
@@ -441,30 +448,32 @@ bool addServerMirror(jigdoData *data, char *servermirror)
     int i;
     jigdoServer *s;
     char *c, *serverName, *mirror;
-    const char *prefix = "";
+    const char *prefix = "file://";
+    bool ret = false;
 
     // XXX nuke args like --try-last until quoting support is added
     c = strchr(servermirror, ' ');
     if (c) *c = 0;
 
-    mirror = trimWhitespace(getEqualValue(servermirror));
+    mirror = getEqualValue(servermirror);
     if (!mirror || !mirror[0]) {
-        return false;
+        goto done;
     }
 
     serverName = trimWhitespace(getKey(servermirror, '='));
     if (!serverName || !serverName[0]) {
-        return false;
+        goto done;
     }
 
     s = getServer(data, serverName);
 
     if (!s) {
-        return false;
+        goto done;
     }
 
     switch (isURI(mirror)) {
         char *path;
+        const char *local;
         size_t len;
 
         // file:// URI or local directory
@@ -476,21 +485,25 @@ bool addServerMirror(jigdoData *data, char *servermirror)
             // there, and take a non-libcurl path, to make it possible for pigdo
             // to be built without libcurl support for those who only wish to
             // use it for assembly from local mirrors.
-            prefix = "file://";
             // fall through
         case URI_TYPE_FILE:
+            // Resolve the path of a file:// URI without its scheme
+            local = mirror;
+            if (isURI(local) == URI_TYPE_FILE) {
+                local += strlen("file://");
+            }
 
             len = PATH_MAX + strlen(prefix);
 
             path = calloc(len + 1, 1);
             if (!path) {
-                return false;
+                goto done;
             }
 
             strncat(path, prefix, len);
-            if (realpath(mirror, path + strlen(prefix)) == NULL) {
+            if (realpath(local, path + strlen(prefix)) == NULL) {
                 free(path);
-                return false;
+                goto done;
             }
 
             i = s->numLocalDirs++;
@@ -498,11 +511,12 @@ bool addServerMirror(jigdoData *data, char *servermirror)
                                    sizeof(s->localDirs[i]) * s->numLocalDirs);
             if (!s->localDirs) {
                 free(path);
-                return false;
+                goto done;
             }
             s->localDirs[i] = path;
 
-            return true;
+            ret = true;
+            break;
 
         // non-local URI
         default:
@@ -510,12 +524,18 @@ bool addServerMirror(jigdoData *data, char *servermirror)
             s->mirrors = realloc(s->mirrors,
                                  sizeof(s->mirrors[i]) * s->numMirrors);
             if (!s->mirrors) {
-                return false;
+                goto done;
             }
             s->mirrors[i] = strdup(mirror);
 
-            return s->mirrors[i] != NULL;
+            ret = s->mirrors[i] != NULL;
+            break;
     }
+
+done:
+    free(mirror);
+
+    return ret;
 }
 
 /**
@@ -630,13 +650,50 @@ done:
     }
 
     if (!success) {
-        free(data);
+        freeJigdoData(data);
         data = NULL;
     }
 
     return data;
 }
 
+void freeJigdoData(jigdoData *data)
+{
+    int i, j;
+
+    if (!data) {
+        return;
+    }
+
+    for (i = 0; i < data->numFiles; i++) {
+        free(data->files[i].path);
+    }
+    free(data->files);
+
+    for (i = 0; i < data->numServers; i++) {
+        jigdoServer *s = data->servers + i;
+
+        for (j = 0; j < s->numMirrors; j++) {
+            free(s->mirrors[j]);
+        }
+        free(s->mirrors);
+
+        for (j = 0; j < s->numLocalDirs; j++) {
+            free(s->localDirs[j]);
+        }
+        free(s->localDirs);
+
+        free(s->name);
+    }
+    free(data->servers);
+
+    free(data->version);
+    free(data->generator);
+    free(data->imageName);
+    free(data->templateName);
+    free(data);
+}
+
 jigdoFileInfo *findFileByMD5(const jigdoData *data, md5Checksum key,
                              int *numFound)
 {
@@ -671,6 +728,161 @@ jigdoFileInfo *findFileByMD5(const jigdoData *data, md5Checksum key,
     return found;
 }
 
+/**
+ * @brief Checksum of a local file, as it was when it was computed
+ */
+typedef struct {
+    dev_t dev;             ///< Device holding the file
+    ino_t ino;             ///< Inode number of the file
+    off_t size;            ///< Size of the file
+    struct timespec mtime; ///< Last modification time of the file
+    struct timespec ctime; ///< Last status change of the file, which unlike
+                           ///< @c mtime can't be set to an earlier time
+    md5Checksum md5;       ///< MD5 sum of the file's contents
+} localFileSum;
+
+/**
+ * @brief Most checksums of local files remembered at once
+ *
+ * Once this many have been computed, all of them are forgotten, so that a
+ * long-running process whose local mirrors keep changing doesn't keep growing.
+ */
+#define maxLocalFileSums 65536
+
+/**
+ * @brief Checksums of local files computed so far, in a tsearch(3) tree
+ *
+ * Local mirrors are commonly shared between images and, in a long-running
+ * process, between reconstructions; files are only read once for as long as
+ * they remain unchanged. Each file has a single record, which is replaced
+ * when the file changes.
+ */
+static void *localFileSums;
+static int numLocalFileSums;
+static pthread_mutex_t localFileSumLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Comparator function for tsearch(3) that operates on localFileSum
+ *        records, comparing only the files they are of
+ */
+static int localFileSumCmp(const void *a, const void *b)
+{
+    const localFileSum *sumA = a, *sumB = b;
+
+    if (sumA->dev != sumB->dev) {
+        return sumA->dev < sumB->dev ? -1 : 1;
+    }
+    if (sumA->ino != sumB->ino) {
+        return sumA->ino < sumB->ino ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check whether two timestamps are equal
+ */
+static bool sameTime(struct timespec a, struct timespec b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/**
+ * @brief Check whether @p sum was computed of the file as described by @p st
+ */
+static bool sumIsCurrent(const localFileSum *sum, const struct stat *st)
+{
+    return sum->size == st->st_size && sameTime(sum->mtime, st->st_mtim) &&
+           sameTime(sum->ctime, st->st_ctim);
+}
+
+/**
+ * @brief Forget every checksum remembered in localFileSums
+ *
+ * @note Must be called with @c localFileSumLock held
+ */
+static void forgetLocalFileSumsNoMutex(void)
+{
+    while (localFileSums) {
+        localFileSum *sum = *(localFileSum **) localFileSums;
+
+        tdelete(sum, &localFileSums, localFileSumCmp);
+        free(sum);
+    }
+
+    numLocalFileSums = 0;
+}
+
+/**
+ * @brief Compute the MD5 sum of the local file at @p path, reusing the sum
+ *        computed earlier if the file hasn't changed since
+ */
+static md5Checksum md5LocalFile(const char *path)
+{
+    localFileSum key, *sum;
+    struct stat st;
+    void *node;
+    bool found = false;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return md5Path(path);
+    }
+
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime = st.st_mtim;
+    key.ctime = st.st_ctim;
+
+    pthread_mutex_lock(&localFileSumLock);
+    node = tfind(&key, &localFileSums, localFileSumCmp);
+    if (node && sumIsCurrent(*(localFileSum **) node, &st)) {
+        key.md5 = (*(localFileSum **) node)->md5;
+        found = true;
+    }
+    pthread_mutex_unlock(&localFileSumLock);
+
+    if (found) {
+        return key.md5;
+    }
+
+    key.md5 = md5Path(path);
+
+    /* Don't remember a sum of contents which changed while being read */
+    if (stat(path, &st) != 0 || !sumIsCurrent(&key, &st)) {
+        return key.md5;
+    }
+
+    sum = malloc(sizeof(*sum));
+    if (!sum) {
+        return key.md5;
+    }
+    *sum = key;
+
+    pthread_mutex_lock(&localFileSumLock);
+
+    if (numLocalFileSums >= maxLocalFileSums) {
+        forgetLocalFileSumsNoMutex();
+    }
+
+    node = tsearch(sum, &localFileSums, localFileSumCmp);
+
+    if (!node) {
+        free(sum);
+    } else if (*(localFileSum **) node != sum) {
+        /* The file changed since its sum was remembered, or another thread
+         * got there first; either way, this sum is the latest */
+        **(localFileSum **) node = key;
+        free(sum);
+    } else {
+        numLocalFileSums++;
+    }
+
+    pthread_mutex_unlock(&localFileSumLock);
+
+    return key.md5;
+}
+
 static int findLocalCopy(const jigdoFileInfo *file)
 {
     int i;
@@ -681,7 +893,7 @@ static int findLocalCopy(const jigdoFileInfo *file)
         bool found = false;
 
         if (access(path, F_OK) == 0) {
-            md5Checksum md5 = md5Path(path);
+            md5Checksum md5 = md5LocalFile(path);
             found = (md5Cmp(&md5, &(file->md5Sum)) == 0);
         }
 
@@ -699,9 +911,21 @@ int jigdoFindLocalFiles(int fd, templateDescTable *table, jigdoData *jigdo)
     int count, i, n;
 
     for (count = i = 0; i < table->numFiles; i++) {
-        jigdoFileInfo *file = findFileByMD5(jigdo, table->files[i].md5Sum, &n);
+        jigdoFileInfo *file;
         int localDirIndex;
 
+        /* Duplicates will be copied from another part instead; don't spend
+         * time checksumming the same local file over and over again. Files
+         * which were already verified in the output need no local copy, and
+         * neither do files outside the range being reconstructed. */
+        if (table->files[i].status == COMMIT_STATUS_DUPLICATE ||
+            table->files[i].status == COMMIT_STATUS_COMPLETE ||
+            table->files[i].status == COMMIT_STATUS_SKIPPED) {
+            continue;
+        }
+
+        file = findFileByMD5(jigdo, table->files[i].md5Sum, &n);
+
         if (!file) {
             return -1;
         }
@@ -721,7 +945,8 @@ int jigdoFindLocalFiles(int fd, templateDescTable *table, jigdoData *jigdo)
 /**
  * @brief Choose a mirror where @p file can be found
  *
- * @return The name of a mirror where @p file should be available
+ * @return The name of a mirror where @p file should be available, or NULL if
+ *         it is only listed in local directories, none of which has it
  */
 static char *selectMirror(const jigdoFileInfo *file)
 {
@@ -729,6 +954,10 @@ static char *selectMirror(const jigdoFileInfo *file)
         return file->server->localDirs[file->localMatch];
     }
 
+    if (file->server->numMirrors == 0) {
+        return NULL;
+    }
+
     // TODO should probably keep track of mirror performance and prioritize
     // faster ones, and also honor things like --try-last
     return file->server->mirrors[rand() % file->server->numMirrors];
@@ -752,6 +981,73 @@ char *md5ToURI(jigdoData *data, md5Checksum md5)
     return dircat(mirror, fileInfo->path);
 }
 
+char **md5ToURIs(jigdoData *data, md5Checksum md5, int *count)
+{
+    int i, j, numFound, numURIs = 0;
+    jigdoFileInfo *fileInfo = findFileByMD5(data, md5, &numFound);
+    char **uris;
+
+    *count = 0;
+
+    for (i = 0; i < numFound; i++) {
+        numURIs += fileInfo[i].server->numMirrors;
+    }
+
+    if (numURIs == 0) {
+        return NULL;
+    }
+
+    uris = malloc(sizeof(uris[0]) * numURIs);
+    if (!uris) {
+        return NULL;
+    }
+
+    for (i = 0; i < numFound; i++) {
+        for (j = 0; j < fileInfo[i].server->numMirrors; j++) {
+            uris[*count] = dircat(fileInfo[i].server->mirrors[j],
+                                  fileInfo[i].path);
+            if (!uris[*count]) {
+                goto fail;
+            }
+            (*count)++;
+        }
+    }
+
+    return uris;
+
+fail:
+    for (i = 0; i < *count; i++) {
+        free(uris[i]);
+    }
+    free(uris);
+    *count = 0;
+
+    return NULL;
+}
+
+char *md5ToLocalPath(jigdoData *data, md5Checksum md5)
+{
+    int numFound;
+    char *fileURI, *path;
+    jigdoFileInfo *fileInfo = findFileByMD5(data, md5, &numFound);
+
+    if (numFound == 0 || fileInfo->localMatch < 0) {
+        return NULL;
+    }
+
+    fileURI = dircat(fileInfo->server->localDirs[fileInfo->localMatch],
+                     fileInfo->path);
+    if (!fileURI) {
+        return NULL;
+    }
+
+    // Strip the file:// prepended to localDirs[] by addServerMirror()
+    path = strdup(fileURI + strlen("file://"));
+    free(fileURI);
+
+    return path;
+}
+
 const char *jigdoGetImageName(const jigdoData *jigdo)
 {
     return jigdo->imageName;
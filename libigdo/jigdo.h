@@ -39,9 +39,7 @@ typedef struct _jigdo jigdoData;
 jigdoData *jigdoReadJigdoFile(const char *path);
 
 /**
- * @brief Free heap-allocated members of a jigdoData record
- *
- * @note TODO not implemented yet; leaks ahoy!
+ * @brief Free a jigdoData record along with its heap-allocated members
  */
 void freeJigdoData(jigdoData *data);
 
@@ -56,6 +54,33 @@ void freeJigdoData(jigdoData *data);
  */
 char *md5ToURI(jigdoData *data, md5Checksum md5);
 
+/**
+ * @brief Get every URI where the file identified by @p md5 can be fetched, on
+ *        each mirror of each server listing it
+ *
+ * The URIs are built the same way as by md5ToURI(), but local directories are
+ * left out.
+ *
+ * @param data Parsed data from the @c .jigdo file
+ * @param md5 The checksum to match
+ * @param count Where the number of URIs is stored
+ *
+ * @return A newly heap-allocated array of newly heap-allocated URIs, or NULL
+ *         if not found or an error occurred
+ */
+char **md5ToURIs(jigdoData *data, md5Checksum md5, int *count);
+
+/**
+ * @brief Get the local filesystem path of a verified local copy of @p md5
+ *
+ * @param data Parsed data from the @c .jigdo file
+ * @param md5 The checksum to match
+ *
+ * @return A newly heap-allocated path to a local file matching @p md5, or NULL
+ *         if jigdoFindLocalFiles() did not find a local match for @p md5.
+ */
+char *md5ToLocalPath(jigdoData *data, md5Checksum md5);
+
 /**
  * @brief Append @p mirror to the mirrors list in the server named @serverName
  *
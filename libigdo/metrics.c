@@ -0,0 +1,500 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+#include "util.h"
+
+/**
+ * @brief A histogram with fixed upper bounds
+ */
+typedef struct {
+    const double *bounds;     ///< Upper bounds of the buckets, in increasing
+                              ///< order, apart from the implicit +Inf
+    int numBounds;            ///< Number of elements in @c bounds
+    uint64_t *counts;         ///< Observations falling in each bucket, with
+                              ///< one more for those above every bound
+    uint64_t count;           ///< Number of observations
+    double sum;               ///< Sum of the observations
+} histogram;
+
+static const double latencyBounds[] = {
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300,
+};
+
+static const double sizeBounds[] = {
+    4096, 16384, 65536, 262144, 1048576, 4194304, 16777216, 67108864,
+    268435456, 1073741824,
+};
+
+#define countof(array) ((int) (sizeof(array) / sizeof((array)[0])))
+
+static uint64_t latencyCounts[countof(latencyBounds) + 1];
+static uint64_t sizeCounts[countof(sizeBounds) + 1];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t workBytes[METRICS_WORK_COUNT];
+static uint64_t workNs[METRICS_WORK_COUNT];
+static metricsMirror *mirrors;
+static int numMirrors;
+static histogram latency = { latencyBounds, countof(latencyBounds),
+                             latencyCounts };
+static histogram sizes = { sizeBounds, countof(sizeBounds), sizeCounts };
+
+static const char *workNames[] = {
+    [METRICS_WORK_HASH] = "hash",
+    [METRICS_WORK_DECOMPRESS] = "decompress",
+    [METRICS_WORK_WRITE] = "write",
+};
+
+uint64_t metricsNow(void)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return 0;
+    }
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void metricsAddWork(metricsWork work, uint64_t bytes, uint64_t ns)
+{
+    pthread_mutex_lock(&lock);
+    workBytes[work] += bytes;
+    workNs[work] += ns;
+    pthread_mutex_unlock(&lock);
+}
+
+void metricsGetWork(uint64_t bytes[METRICS_WORK_COUNT])
+{
+    pthread_mutex_lock(&lock);
+    memcpy(bytes, workBytes, sizeof(workBytes));
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Find the entry for the mirror serving @p uri, adding one if needed
+ *
+ * @note Must be called with @c lock held
+ *
+ * @return The entry, or NULL on failure
+ */
+static metricsMirror *findMirrorNoMutex(const char *uri)
+{
+    size_t len = metricsMirrorLength(uri);
+    metricsMirror *grown;
+    int i;
+
+    for (i = 0; i < numMirrors; i++) {
+        if (strlen(mirrors[i].name) == len &&
+            strncmp(mirrors[i].name, uri, len) == 0) {
+            return mirrors + i;
+        }
+    }
+
+    grown = realloc(mirrors, sizeof(mirrors[0]) * (numMirrors + 1));
+    if (!grown) {
+        return NULL;
+    }
+    mirrors = grown;
+
+    memset(mirrors + numMirrors, 0, sizeof(mirrors[0]));
+    mirrors[numMirrors].name = strndup(uri, len);
+    if (!mirrors[numMirrors].name) {
+        return NULL;
+    }
+
+    return mirrors + numMirrors++;
+}
+
+size_t metricsMirrorLength(const char *uri)
+{
+    const char *host = strstr(uri, "://");
+
+    /* Keep the scheme, host and port, and drop the path */
+    host = host ? host + strlen("://") : uri;
+
+    return host - uri + strcspn(host, "/?#");
+}
+
+void metricsAddTransfer(const char *uri, uint64_t bytes, uint64_t ns, bool ok)
+{
+    metricsMirror *mirror;
+
+    pthread_mutex_lock(&lock);
+
+    mirror = findMirrorNoMutex(uri);
+    if (mirror) {
+        mirror->bytes += bytes;
+        mirror->ns += ns;
+        if (ok) {
+            mirror->parts++;
+        } else {
+            mirror->errors++;
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+int metricsGetMirrors(metricsMirror *copies, int max)
+{
+    int i, count = 0;
+
+    pthread_mutex_lock(&lock);
+
+    for (i = 0; i < numMirrors && count < max; i++) {
+        copies[count] = mirrors[i];
+        copies[count].name = strdup(mirrors[i].name);
+        if (copies[count].name) {
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+/**
+ * @brief Add @p value to @p hist
+ *
+ * @note Must be called with @c lock held
+ */
+static void observeNoMutex(histogram *hist, double value)
+{
+    int i;
+
+    for (i = 0; i < hist->numBounds && value > hist->bounds[i]; i++);
+
+    hist->counts[i]++;
+    hist->count++;
+    hist->sum += value;
+}
+
+void metricsAddPart(uint64_t size, uint64_t ns)
+{
+    pthread_mutex_lock(&lock);
+    observeNoMutex(&latency, ns / 1e9);
+    observeNoMutex(&sizes, size);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Write @p str to @p fp as the value of a Prometheus label
+ */
+static void writeLabelValue(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(fp, "\\%c", *str);
+        } else if (*str == '\n') {
+            fputs("\\n", fp);
+        } else {
+            fputc(*str, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
+
+/**
+ * @brief Write the HELP and TYPE lines introducing a Prometheus metric
+ */
+static void writeHeader(FILE *fp, const char *name, const char *type,
+                        const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Write @p hist as the Prometheus histogram @p name
+ */
+static void writeHistogram(FILE *fp, const char *name, const char *help,
+                           const histogram *hist)
+{
+    uint64_t cumulative = 0;
+    int i;
+
+    writeHeader(fp, name, "histogram", help);
+
+    for (i = 0; i < hist->numBounds; i++) {
+        cumulative += hist->counts[i];
+        fprintf(fp, "%s_bucket{le=\"%.15g\"} %"PRIu64"\n", name,
+                hist->bounds[i], cumulative);
+    }
+
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %"PRIu64"\n", name, hist->count);
+    fprintf(fp, "%s_sum %.17g\n%s_count %"PRIu64"\n", name, hist->sum, name,
+            hist->count);
+}
+
+/**
+ * @brief Write the metrics to @p fp in the Prometheus text exposition format
+ *
+ * @note Must be called with @c lock held
+ */
+static void writePrometheusNoMutex(FILE *fp, const int *parts,
+                                   const uint64_t *bytes)
+{
+    int i;
+
+    if (parts) {
+        writeHeader(fp, "pigdo_parts", "gauge",
+                    "Parts of the images in each state");
+        for (i = 0; i < COMMIT_STATUS_COUNT; i++) {
+            fprintf(fp, "pigdo_parts{state=\"%s\"} %d\n",
+                    commitStatusName(i), parts[i]);
+        }
+
+        writeHeader(fp, "pigdo_part_bytes", "gauge",
+                    "Total size of the parts of the images in each state");
+        for (i = 0; i < COMMIT_STATUS_COUNT; i++) {
+            fprintf(fp, "pigdo_part_bytes{state=\"%s\"} %"PRIu64"\n",
+                    commitStatusName(i), bytes[i]);
+        }
+    }
+
+    writeHeader(fp, "pigdo_mirror_bytes_total", "counter",
+                "Bytes transferred from each mirror or peer");
+    for (i = 0; i < numMirrors; i++) {
+        fputs("pigdo_mirror_bytes_total{mirror=", fp);
+        writeLabelValue(fp, mirrors[i].name);
+        fprintf(fp, "} %"PRIu64"\n", mirrors[i].bytes);
+    }
+
+    writeHeader(fp, "pigdo_mirror_seconds_total", "counter",
+                "Time spent transferring from each mirror or peer");
+    for (i = 0; i < numMirrors; i++) {
+        fputs("pigdo_mirror_seconds_total{mirror=", fp);
+        writeLabelValue(fp, mirrors[i].name);
+        fprintf(fp, "} %.9f\n", mirrors[i].ns / 1e9);
+    }
+
+    writeHeader(fp, "pigdo_mirror_parts_total", "counter",
+                "Parts transferred in full from each mirror or peer");
+    for (i = 0; i < numMirrors; i++) {
+        fputs("pigdo_mirror_parts_total{mirror=", fp);
+        writeLabelValue(fp, mirrors[i].name);
+        fprintf(fp, "} %"PRIu64"\n", mirrors[i].parts);
+    }
+
+    writeHeader(fp, "pigdo_mirror_errors_total", "counter",
+                "Failed transfers from each mirror or peer");
+    for (i = 0; i < numMirrors; i++) {
+        fputs("pigdo_mirror_errors_total{mirror=", fp);
+        writeLabelValue(fp, mirrors[i].name);
+        fprintf(fp, "} %"PRIu64"\n", mirrors[i].errors);
+    }
+
+    writeHistogram(fp, "pigdo_part_latency_seconds",
+                   "Time from starting on a part until it was placed",
+                   &latency);
+    writeHistogram(fp, "pigdo_part_size_bytes", "Sizes of the parts placed",
+                   &sizes);
+
+    writeHeader(fp, "pigdo_work_bytes_total", "counter",
+                "Bytes hashed, decompressed and written locally");
+    for (i = 0; i < METRICS_WORK_COUNT; i++) {
+        fprintf(fp, "pigdo_work_bytes_total{work=\"%s\"} %"PRIu64"\n",
+                workNames[i], workBytes[i]);
+    }
+
+    writeHeader(fp, "pigdo_work_seconds_total", "counter",
+                "Time spent hashing, decompressing and writing locally");
+    for (i = 0; i < METRICS_WORK_COUNT; i++) {
+        fprintf(fp, "pigdo_work_seconds_total{work=\"%s\"} %.9f\n",
+                workNames[i], workNs[i] / 1e9);
+    }
+}
+
+/**
+ * @brief Write the throughput of @p bytes transferred in @p ns nanoseconds to
+ *        @p fp as a JSON number of bytes per second
+ */
+static void writeRate(FILE *fp, uint64_t bytes, uint64_t ns)
+{
+    fprintf(fp, "%.0f", ns ? bytes / (ns / 1e9) : 0.0);
+}
+
+/**
+ * @brief Write @p hist to @p fp as a JSON object
+ */
+static void writeHistogramJSON(FILE *fp, const histogram *hist)
+{
+    int i;
+
+    fprintf(fp, "{\"count\": %"PRIu64", \"sum\": %.17g, \"buckets\": [",
+            hist->count, hist->sum);
+
+    for (i = 0; i <= hist->numBounds; i++) {
+        if (i < hist->numBounds) {
+            fprintf(fp, "%s{\"le\": %.15g, ", i ? ", " : "", hist->bounds[i]);
+        } else {
+            fprintf(fp, "%s{\"le\": null, ", i ? ", " : "");
+        }
+        fprintf(fp, "\"count\": %"PRIu64"}", hist->counts[i]);
+    }
+
+    fputs("]}", fp);
+}
+
+/**
+ * @brief Write the metrics to @p fp as a JSON summary, which has the rates
+ *        worked out already
+ *
+ * @note Must be called with @c lock held
+ */
+static void writeJSONNoMutex(FILE *fp, const int *parts, const uint64_t *bytes)
+{
+    int i;
+
+    fputs("{\n", fp);
+
+    if (parts) {
+        fputs("  \"parts\": {", fp);
+        for (i = 0; i < COMMIT_STATUS_COUNT; i++) {
+            fprintf(fp, "%s\n    \"%s\": {\"count\": %d, \"bytes\": %"PRIu64
+                    "}", i ? "," : "", commitStatusName(i), parts[i],
+                    bytes[i]);
+        }
+        fputs("\n  },\n", fp);
+    }
+
+    fputs("  \"mirrors\": [", fp);
+    for (i = 0; i < numMirrors; i++) {
+        fprintf(fp, "%s\n    {\"mirror\": ", i ? "," : "");
+        writeJSONString(fp, mirrors[i].name);
+        fprintf(fp, ", \"bytes\": %"PRIu64", \"seconds\": %.9f, "
+                "\"parts\": %"PRIu64", \"errors\": %"PRIu64", "
+                "\"bytesPerSecond\": ", mirrors[i].bytes, mirrors[i].ns / 1e9,
+                mirrors[i].parts, mirrors[i].errors);
+        writeRate(fp, mirrors[i].bytes, mirrors[i].ns);
+        fputc('}', fp);
+    }
+    fputs(numMirrors ? "\n  ],\n" : "],\n", fp);
+
+    fputs("  \"partLatencySeconds\": ", fp);
+    writeHistogramJSON(fp, &latency);
+    fputs(",\n  \"partSizeBytes\": ", fp);
+    writeHistogramJSON(fp, &sizes);
+
+    fputs(",\n  \"work\": {", fp);
+    for (i = 0; i < METRICS_WORK_COUNT; i++) {
+        fprintf(fp, "%s\n    \"%s\": {\"bytes\": %"PRIu64", \"seconds\": %.9f, "
+                "\"bytesPerSecond\": ", i ? "," : "", workNames[i],
+                workBytes[i], workNs[i] / 1e9);
+        writeRate(fp, workBytes[i], workNs[i]);
+        fputc('}', fp);
+    }
+    fputs("\n  }\n}\n", fp);
+}
+
+bool metricsWrite(FILE *fp, igdoSession *session, metricsFormat format)
+{
+    int parts[COMMIT_STATUS_COUNT];
+    uint64_t bytes[COMMIT_STATUS_COUNT];
+
+    /* Take the session's lock first, and never both at once */
+    if (session) {
+        sessionGetStates(session, parts, bytes);
+    }
+
+    pthread_mutex_lock(&lock);
+
+    if (format == METRICS_FORMAT_JSON) {
+        writeJSONNoMutex(fp, session ? parts : NULL, bytes);
+    } else {
+        writePrometheusNoMutex(fp, session ? parts : NULL, bytes);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return fflush(fp) == 0 && !ferror(fp);
+}
+
+bool metricsSave(const char *path, igdoSession *session,
+                 metricsFormat format)
+{
+    size_t len = strlen(path) + sizeof(".XXXXXX");
+    char *tmpPath = malloc(len);
+    FILE *fp = NULL;
+    bool ret = false;
+    int fd = -1;
+
+    if (!tmpPath) {
+        return false;
+    }
+
+    /* Alongside the final file, so that it can be renamed into place */
+    snprintf(tmpPath, len, "%s.XXXXXX", path);
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        goto done;
+    }
+
+    /* mkstemp() makes the file private, but collectors may run as others */
+    if (fchmod(fd, 0644) != 0) {
+        goto done;
+    }
+
+    fp = fdopen(fd, "w");
+    if (!fp) {
+        goto done;
+    }
+    fd = -1;
+
+    if (!metricsWrite(fp, session, format)) {
+        goto done;
+    }
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto done;
+    }
+    fp = NULL;
+
+    ret = rename(tmpPath, path) == 0;
+
+done:
+    if (fp) {
+        fclose(fp);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ret) {
+        unlink(tmpPath);
+    }
+    free(tmpPath);
+
+    return ret;
+}
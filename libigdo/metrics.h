@@ -0,0 +1,129 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_METRICS_H
+#define PIGDO_METRICS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "session.h"
+
+/**
+ * @brief Kinds of work done on data locally, whose throughput is measured
+ */
+typedef enum {
+    METRICS_WORK_HASH = 0,   ///< Computing MD5 checksums
+    METRICS_WORK_DECOMPRESS, ///< Decompressing template data, counted by the
+                             ///< size of the decompressed data
+    METRICS_WORK_WRITE,      ///< Writing to output files
+    METRICS_WORK_COUNT,      ///< Number of kinds of work, not a kind of work
+} metricsWork;
+
+/**
+ * @brief Formats in which metrics can be written
+ */
+typedef enum {
+    METRICS_FORMAT_PROMETHEUS = 0, ///< Prometheus text exposition format
+    METRICS_FORMAT_JSON,           ///< A JSON summary
+} metricsFormat;
+
+/**
+ * @brief Get the time of CLOCK_MONOTONIC in nanoseconds, for timing the work
+ *        passed to metricsAddWork()
+ */
+uint64_t metricsNow(void);
+
+/**
+ * @brief Account for @p bytes of @p work, which took @p ns nanoseconds
+ *
+ * The metrics are kept for the whole process, across all of its sessions.
+ * May be called from any thread, as may the other metrics functions.
+ */
+void metricsAddWork(metricsWork work, uint64_t bytes, uint64_t ns);
+
+/**
+ * @brief Get the number of bytes of each kind of work done so far
+ */
+void metricsGetWork(uint64_t bytes[METRICS_WORK_COUNT]);
+
+/**
+ * @brief Transfers from a single mirror or peer
+ */
+typedef struct {
+    char *name;               ///< Scheme, host and port of the mirror
+    uint64_t bytes;           ///< Bytes transferred from it
+    uint64_t ns;              ///< Time spent transferring them
+    uint64_t parts;           ///< Parts transferred in full
+    uint64_t errors;          ///< Transfers which failed
+} metricsMirror;
+
+/**
+ * @brief Get the length of the scheme, host and port at the start of @p uri,
+ *        by which transfers are counted
+ */
+size_t metricsMirrorLength(const char *uri);
+
+/**
+ * @brief Account for a transfer of @p bytes from @p uri, which took @p ns
+ *        nanoseconds
+ *
+ * Transfers are counted by the scheme, host and port of @p uri.
+ *
+ * @param ok Whether the whole part was transferred; if not, the transfer is
+ *           counted as an error
+ */
+void metricsAddTransfer(const char *uri, uint64_t bytes, uint64_t ns, bool ok);
+
+/**
+ * @brief Get the transfers accounted for so far from each mirror
+ *
+ * @param copies Where up to @p max mirrors are stored; their names must be
+ *               freed by the caller
+ *
+ * @return The number of mirrors stored
+ */
+int metricsGetMirrors(metricsMirror *copies, int max);
+
+/**
+ * @brief Account for a part of @p size bytes, which took @p ns nanoseconds from
+ *        being handed to a worker until it was placed
+ */
+void metricsAddPart(uint64_t size, uint64_t ns);
+
+/**
+ * @brief Write the metrics to @p fp
+ *
+ * @param session If not NULL, the number and size of its parts in each
+ *                commitStatus are included, too
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool metricsWrite(FILE *fp, igdoSession *session, metricsFormat format);
+
+/**
+ * @brief Write the metrics to a new file, which then replaces @p path, so that
+ *        readers of @p path never see it partly written
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool metricsSave(const char *path, igdoSession *session,
+                 metricsFormat format);
+
+#endif
@@ -0,0 +1,1618 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // for sync_file_range()
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "metrics.h"
+#include "output.h"
+#include "uring.h"
+#include "util.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/**
+ * @brief Upper limit on the part of the buffer pool which OUTPUT_ENGINE_URING
+ *        registers with the kernel
+ *
+ * Registered buffers stay pinned in memory for as long as the engine exists.
+ */
+static const size_t maxArenaSize = 64 * 1024 * 1024;
+
+/**
+ * @brief Size of each of the staging buffers used by outputCopyRange()
+ */
+static const size_t copySlotSize = 256 * 1024;
+
+/**
+ * @brief Most staging buffers a single outputCopyRange() call keeps in flight
+ */
+static const int maxSlotsPerCopy = 8;
+
+/**
+ * @brief Size of each piece in which outputCopyRange() copies to O_DIRECT files
+ */
+static const size_t directCopyPiece = 4 * 1024 * 1024;
+
+/**
+ * @brief Number of locks serializing read-modify-write cycles on the partial
+ *        blocks at the edges of O_DIRECT writes
+ */
+#define numEdgeLocks 64
+
+/**
+ * @brief Number of completed ranges queued for dropping from the page cache
+ *
+ * The older ranges are dropped as newer ones complete, so this should be
+ * enough ranges to give the writeback of each one time to finish first.
+ */
+#define dropQueueLength 32
+
+/**
+ * @brief Indices of the buffers registered by OUTPUT_ENGINE_URING
+ */
+enum {
+    ARENA_BUF_INDEX = 0,
+    SLOTS_BUF_INDEX,
+};
+
+/**
+ * @brief A free range within the arena
+ */
+typedef struct _arenaExtent {
+    size_t offset;
+    size_t size;
+    struct _arenaExtent *next;
+} arenaExtent;
+
+struct _outputBuffer {
+    void *data;          ///< Where the caller stores the contents
+    void *base;          ///< Start of the allocation or mapping behind @c data
+    size_t capacity;     ///< Size of the allocation or mapping at @c base
+    int fd;              ///< Output file the buffer belongs in
+    off_t offset;        ///< Offset within @c fd of the first byte of @c data
+    size_t size;         ///< Number of bytes at @c data
+    bool claimed;        ///< Set once a committed buffer is being written
+    bool written;        ///< Set once a committed buffer has been written
+    bool ok;             ///< Whether writing the buffer succeeded
+    bool inArena;        ///< Whether @c base was carved out of the arena
+    size_t align;        ///< Alignment required for I/O on @c fd, or 0
+    size_t lead;         ///< Offset of @c data from @c base, to keep the I/O
+                         ///< on @c fd aligned
+    outputBuffer *next;  ///< Next buffer in the pool, commit queue or run
+    outputBuffer *nextRun; ///< Next run in outputEngine::writing
+};
+
+struct _outputEngine {
+    outputEngineType type;
+    size_t maxInFlight;    ///< Cap on the total size of handed out buffers
+    size_t inFlight;       ///< Total size of currently handed out buffers
+    outputBuffer *pool;    ///< Released pwrite buffers, ready for reuse
+    size_t pooled;         ///< Total capacity of the buffers in @c pool
+    outputBuffer *queue;   ///< Committed buffers waiting to be written
+    outputBuffer *writing; ///< Runs of adjacent buffers being written
+    pthread_mutex_t lock;
+    pthread_cond_t cond;   ///< Signalled when buffers are released or written
+
+    ioRing *ring;          ///< Queue for OUTPUT_ENGINE_URING requests
+    bool registered;       ///< Whether the arena and slots are registered
+    void *arena;           ///< Memory for buffers, registered with @c ring
+    size_t arenaSize;
+    arenaExtent *arenaFree;///< Free ranges of @c arena, sorted by offset
+    void *slots;           ///< Staging buffers for outputCopyRange()
+    int numSlots;
+    int *freeSlots;        ///< Stack of indices of unused staging buffers
+    int numFreeSlots;
+
+    struct {
+        int fd;
+        size_t align;
+    } *directFds;          ///< Files opened with O_DIRECT, and their alignment
+    int numDirectFds;
+    pthread_mutex_t edgeLocks[numEdgeLocks];
+
+    outputDurability durability;
+    struct {
+        int fd;
+        time_t lastSync;
+    } *syncTimes;          ///< When files were last synced, for
+                           ///< OUTPUT_SYNC_PERIODIC
+    int numSyncTimes;
+    struct {
+        int fd;
+        off_t offset;
+        size_t len;
+    } dropQueue[dropQueueLength]; ///< Ranges to drop from the page cache,
+                                  ///< oldest first
+    int numDrops;
+};
+
+/**
+ * @brief Set up the ring, and the memory registered with it
+ *
+ * Failing to register the memory is not fatal: I/O on unregistered buffers
+ * works just as well, if a little slower.
+ *
+ * @return @c true on success; @c false if the ring could not be set up
+ */
+static bool setupRing(outputEngine *engine, unsigned queueDepth)
+{
+    struct iovec bufs[2];
+    int i;
+
+    engine->ring = ringOpen(queueDepth);
+    if (!engine->ring) {
+        return false;
+    }
+
+    engine->arenaSize = engine->maxInFlight < maxArenaSize ?
+                        engine->maxInFlight : maxArenaSize;
+    engine->arenaSize -= engine->arenaSize % getpagesize();
+    engine->numSlots = queueDepth / 2 ? queueDepth / 2 : 1;
+
+    engine->arena = mmap(NULL, engine->arenaSize ? engine->arenaSize : 1,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    engine->slots = mmap(NULL, engine->numSlots * copySlotSize,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    engine->freeSlots = malloc(engine->numSlots * sizeof(int));
+    engine->arenaFree = calloc(1, sizeof(arenaExtent));
+
+    if (engine->arena == MAP_FAILED || engine->slots == MAP_FAILED ||
+        !engine->freeSlots || !engine->arenaFree) {
+        goto fail;
+    }
+
+    engine->arenaFree->size = engine->arenaSize;
+
+    for (i = 0; i < engine->numSlots; i++) {
+        engine->freeSlots[i] = i;
+    }
+    engine->numFreeSlots = engine->numSlots;
+
+    bufs[ARENA_BUF_INDEX].iov_base = engine->arena;
+    bufs[ARENA_BUF_INDEX].iov_len = engine->arenaSize;
+    bufs[SLOTS_BUF_INDEX].iov_base = engine->slots;
+    bufs[SLOTS_BUF_INDEX].iov_len = engine->numSlots * copySlotSize;
+
+    engine->registered = engine->arenaSize > 0 &&
+                         ringRegisterBuffers(engine->ring, bufs, 2);
+
+    return true;
+
+fail:
+    if (engine->arena != MAP_FAILED) {
+        munmap(engine->arena, engine->arenaSize ? engine->arenaSize : 1);
+    }
+    if (engine->slots != MAP_FAILED) {
+        munmap(engine->slots, engine->numSlots * copySlotSize);
+    }
+    free(engine->freeSlots);
+    free(engine->arenaFree);
+    ringClose(engine->ring);
+
+    engine->arena = engine->slots = NULL;
+    engine->freeSlots = NULL;
+    engine->arenaFree = NULL;
+    engine->ring = NULL;
+
+    return false;
+}
+
+outputEngine *outputOpen(outputEngineType type, size_t maxInFlight,
+                         unsigned queueDepth)
+{
+    outputEngine *engine;
+    int i;
+
+    if (type < 0 || type >= OUTPUT_ENGINE_COUNT) {
+        return NULL;
+    }
+
+    engine = calloc(1, sizeof(*engine));
+    if (!engine) {
+        return NULL;
+    }
+
+    engine->type = type;
+    engine->maxInFlight = maxInFlight;
+
+    if (pthread_mutex_init(&engine->lock, NULL) != 0) {
+        goto fail_mutex;
+    }
+
+    if (pthread_cond_init(&engine->cond, NULL) != 0) {
+        goto fail_cond;
+    }
+
+    for (i = 0; i < numEdgeLocks; i++) {
+        if (pthread_mutex_init(engine->edgeLocks + i, NULL) != 0) {
+            goto fail_edge_locks;
+        }
+    }
+
+    if (type == OUTPUT_ENGINE_URING && !setupRing(engine, queueDepth)) {
+        engine->type = OUTPUT_ENGINE_PWRITE;
+    }
+
+    return engine;
+
+fail_edge_locks:
+    while (i-- > 0) {
+        pthread_mutex_destroy(engine->edgeLocks + i);
+    }
+    pthread_cond_destroy(&engine->cond);
+fail_cond:
+    pthread_mutex_destroy(&engine->lock);
+fail_mutex:
+    free(engine);
+
+    return NULL;
+}
+
+void outputClose(outputEngine *engine)
+{
+    int i;
+
+    if (!engine) {
+        return;
+    }
+
+    while (engine->pool) {
+        outputBuffer *buf = engine->pool;
+
+        engine->pool = buf->next;
+        free(buf->base);
+        free(buf);
+    }
+
+    if (engine->ring) {
+        ringClose(engine->ring);
+        munmap(engine->arena, engine->arenaSize ? engine->arenaSize : 1);
+        munmap(engine->slots, engine->numSlots * copySlotSize);
+        free(engine->freeSlots);
+
+        while (engine->arenaFree) {
+            arenaExtent *extent = engine->arenaFree;
+
+            engine->arenaFree = extent->next;
+            free(extent);
+        }
+    }
+
+    for (i = 0; i < numEdgeLocks; i++) {
+        pthread_mutex_destroy(engine->edgeLocks + i);
+    }
+
+    free(engine->directFds);
+    free(engine->syncTimes);
+    pthread_cond_destroy(&engine->cond);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine);
+}
+
+outputEngineType outputGetType(const outputEngine *engine)
+{
+    return engine->type;
+}
+
+bool outputAddDirectFd(outputEngine *engine, int fd, size_t align)
+{
+    void *fds;
+
+    /* Mappings always go through the page cache */
+    if (engine->type == OUTPUT_ENGINE_MMAP || align == 0 ||
+        align % 512 != 0 || getpagesize() % align != 0) {
+        return false;
+    }
+
+    fds = realloc(engine->directFds,
+                  (engine->numDirectFds + 1) * sizeof(engine->directFds[0]));
+    if (!fds) {
+        return false;
+    }
+
+    engine->directFds = fds;
+    engine->directFds[engine->numDirectFds].fd = fd;
+    engine->directFds[engine->numDirectFds].align = align;
+    engine->numDirectFds++;
+
+    return true;
+}
+
+/**
+ * @brief Get the alignment required for I/O on @p fd
+ *
+ * @return The alignment, or 0 if @p fd was not opened with O_DIRECT
+ */
+static size_t directAlign(const outputEngine *engine, int fd)
+{
+    int i;
+
+    /* The list is only modified while setting up, before any I/O */
+    for (i = 0; i < engine->numDirectFds; i++) {
+        if (engine->directFds[i].fd == fd) {
+            return engine->directFds[i].align;
+        }
+    }
+
+    return 0;
+}
+
+bool outputIsDirect(const outputEngine *engine, int fd)
+{
+    return directAlign(engine, fd) != 0;
+}
+
+/**
+ * @brief Carve @p size bytes out of the arena, first fit
+ *
+ * @return The offset of the range within the arena, or -1 if there is no free
+ *         range large enough
+ *
+ * @note Must be called with @c engine->lock held
+ */
+static ssize_t arenaAllocNoMutex(outputEngine *engine, size_t size)
+{
+    arenaExtent **cur;
+
+    /* Keep every range page aligned */
+    size = (size + getpagesize() - 1) / getpagesize() * getpagesize();
+
+    for (cur = &engine->arenaFree; *cur; cur = &(*cur)->next) {
+        arenaExtent *extent = *cur;
+
+        if (extent->size >= size) {
+            size_t offset = extent->offset;
+
+            extent->offset += size;
+            extent->size -= size;
+
+            if (extent->size == 0) {
+                *cur = extent->next;
+                free(extent);
+            }
+
+            return offset;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Return a range to the arena, merging it with its free neighbours
+ *
+ * @note Must be called with @c engine->lock held
+ */
+static void arenaFreeNoMutex(outputEngine *engine, size_t offset, size_t size)
+{
+    arenaExtent **cur, *prev = NULL, *extent;
+
+    size = (size + getpagesize() - 1) / getpagesize() * getpagesize();
+
+    for (cur = &engine->arenaFree; *cur && (*cur)->offset < offset;
+         cur = &(*cur)->next) {
+        prev = *cur;
+    }
+
+    if (prev && prev->offset + prev->size == offset) {
+        prev->size += size;
+        extent = prev;
+    } else {
+        extent = malloc(sizeof(*extent));
+
+        /* Losing track of the range only shrinks the arena; buffers will be
+         * allocated from the heap instead. */
+        if (!extent) {
+            return;
+        }
+
+        extent->offset = offset;
+        extent->size = size;
+        extent->next = *cur;
+        *cur = extent;
+    }
+
+    if (extent->next && extent->offset + extent->size == extent->next->offset) {
+        arenaExtent *next = extent->next;
+
+        extent->size += next->size;
+        extent->next = next->next;
+        free(next);
+    }
+}
+
+/**
+ * @brief Take the smallest pooled buffer which can hold @p size bytes
+ *
+ * @return The buffer, or NULL if none is large enough
+ *
+ * @note Must be called with @c engine->lock held
+ */
+static outputBuffer *takePooledNoMutex(outputEngine *engine, size_t size)
+{
+    outputBuffer **best = NULL, **cur;
+    outputBuffer *buf;
+
+    for (cur = &engine->pool; *cur; cur = &(*cur)->next) {
+        if ((*cur)->capacity >= size &&
+            (!best || (*cur)->capacity < (*best)->capacity)) {
+            best = cur;
+        }
+    }
+
+    if (!best) {
+        return NULL;
+    }
+
+    buf = *best;
+    *best = buf->next;
+    engine->pooled -= buf->capacity;
+
+    return buf;
+}
+
+/**
+ * @brief Get memory for @p buf from the pool, or allocate it
+ *
+ * @note Must be called with @c engine->lock held
+ */
+static bool allocPwriteBufferNoMutex(outputEngine *engine, outputBuffer **buf,
+                                     size_t size)
+{
+    *buf = takePooledNoMutex(engine, size);
+    if (*buf) {
+        return true;
+    }
+
+    *buf = calloc(1, sizeof(**buf));
+    if (!*buf) {
+        return false;
+    }
+
+    /* Always allocate at least one byte, so that base == NULL means "none".
+     * Page alignment makes the buffer usable for O_DIRECT. */
+    if (posix_memalign(&(*buf)->base, getpagesize(), size ? size : 1) != 0) {
+        free(*buf);
+        *buf = NULL;
+        return false;
+    }
+    (*buf)->capacity = size;
+
+    return true;
+}
+
+/**
+ * @brief Map the range of the output file covered by @p buf
+ */
+static bool mapBuffer(outputBuffer *buf)
+{
+    buf->capacity = buf->size + pagemod(buf->offset);
+
+    /* mmap(2) refuses empty mappings; there is nothing to write, anyway */
+    if (buf->size == 0) {
+        buf->base = NULL;
+        buf->data = NULL;
+        return true;
+    }
+
+    buf->base = mmap(NULL, buf->capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     buf->fd, pagebase(buf->offset));
+    if (buf->base == MAP_FAILED) {
+        buf->base = NULL;
+        return false;
+    }
+
+    buf->data = buf->base + pagemod(buf->offset);
+
+    return true;
+}
+
+outputBuffer *outputAcquire(outputEngine *engine, int fd, off_t offset,
+                            size_t size)
+{
+    outputBuffer *buf = NULL;
+    size_t align = directAlign(engine, fd);
+    size_t lead = 0, span = size;
+
+    /* For O_DIRECT, the buffer covers every block the range touches, so that
+     * the whole of it can be written in place once the edges are filled in. */
+    if (align) {
+        lead = offset % align;
+        span = (lead + size + align - 1) / align * align;
+    }
+
+    if (pthread_mutex_lock(&engine->lock) != 0) {
+        return NULL;
+    }
+
+    /* An oversized buffer would never fit under the cap, so let it through on
+     * its own rather than waiting forever. */
+    while (engine->inFlight > 0 &&
+           engine->inFlight + size > engine->maxInFlight) {
+        pthread_cond_wait(&engine->cond, &engine->lock);
+    }
+
+    if (engine->type == OUTPUT_ENGINE_URING && span > 0) {
+        ssize_t arenaOffset = arenaAllocNoMutex(engine, span);
+
+        if (arenaOffset >= 0) {
+            buf = calloc(1, sizeof(*buf));
+            if (!buf) {
+                arenaFreeNoMutex(engine, arenaOffset, span);
+                goto done;
+            }
+            buf->base = engine->arena + arenaOffset;
+            buf->capacity = span;
+            buf->inArena = true;
+        }
+    }
+
+    if (buf) {
+        /* Allocated from the arena above */
+    } else if (engine->type != OUTPUT_ENGINE_MMAP) {
+        if (!allocPwriteBufferNoMutex(engine, &buf, span)) {
+            goto done;
+        }
+    } else {
+        buf = calloc(1, sizeof(*buf));
+        if (!buf) {
+            goto done;
+        }
+    }
+
+    if (engine->type != OUTPUT_ENGINE_MMAP) {
+        buf->data = buf->base + lead;
+    }
+
+    buf->fd = fd;
+    buf->offset = offset;
+    buf->size = size;
+    buf->align = align;
+    buf->lead = lead;
+    buf->next = NULL;
+
+    engine->inFlight += size;
+
+done:
+    pthread_mutex_unlock(&engine->lock);
+
+    /* Map outside of the lock: it is only the accounting that needs it */
+    if (buf && engine->type == OUTPUT_ENGINE_MMAP && !mapBuffer(buf)) {
+        outputDiscard(engine, buf);
+        buf = NULL;
+    }
+
+    return buf;
+}
+
+void *outputData(outputBuffer *buf)
+{
+    return buf->data;
+}
+
+/**
+ * @brief Return @p buf to the engine and wake up any waiting threads
+ *
+ * @note Must be called with @c engine->lock held
+ */
+static void releaseNoMutex(outputEngine *engine, outputBuffer *buf)
+{
+    engine->inFlight -= buf->size;
+
+    if (engine->type == OUTPUT_ENGINE_MMAP) {
+        if (buf->base) {
+            munmap(buf->base, buf->capacity);
+        }
+        free(buf);
+    } else if (buf->inArena) {
+        arenaFreeNoMutex(engine, buf->base - engine->arena, buf->capacity);
+        free(buf);
+    } else if (engine->pooled + buf->capacity <= engine->maxInFlight) {
+        buf->next = engine->pool;
+        engine->pool = buf;
+        engine->pooled += buf->capacity;
+    } else {
+        /* Keep the idle pool no larger than what may be in flight */
+        free(buf->base);
+        free(buf);
+    }
+
+    pthread_cond_broadcast(&engine->cond);
+}
+
+void outputDiscard(outputEngine *engine, outputBuffer *buf)
+{
+    pthread_mutex_lock(&engine->lock);
+    releaseNoMutex(engine, buf);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/**
+ * @brief Write @p count vectors to @p fd at @p offset, resuming short writes
+ *
+ * @note @p iov is modified.
+ */
+static bool writeVectors(int fd, struct iovec *iov, int count, off_t offset)
+{
+    while (count > 0) {
+        ssize_t written;
+
+#if defined HAVE_PWRITEV
+        written = pwritev(fd, iov, count, offset);
+#else
+        written = pwrite(fd, iov[0].iov_base, iov[0].iov_len, offset);
+#endif
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+
+        offset += written;
+
+        while (count > 0 && (size_t) written >= iov[0].iov_len) {
+            written -= iov[0].iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0) {
+            iov[0].iov_base = (char *) iov[0].iov_base + written;
+            iov[0].iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Sort a list of committed buffers by file and offset
+ *
+ * Batches are no larger than the number of committing threads, so a simple
+ * insertion sort is plenty.
+ */
+static outputBuffer *sortBatch(outputBuffer *batch)
+{
+    outputBuffer *sorted = NULL;
+
+    while (batch) {
+        outputBuffer *buf = batch, **pos = &sorted;
+
+        batch = batch->next;
+
+        while (*pos && ((*pos)->fd < buf->fd ||
+               ((*pos)->fd == buf->fd && (*pos)->offset < buf->offset))) {
+            pos = &(*pos)->next;
+        }
+
+        buf->next = *pos;
+        *pos = buf;
+    }
+
+    return sorted;
+}
+
+/**
+ * @brief Write a batch of committed buffers, sorted by sortBatch(),
+ *        coalescing adjacent ranges into a single vectored write
+ *
+ * @c ok is set on each buffer.
+ */
+static void writeBatch(outputBuffer *batch)
+{
+    struct iovec iov[IOV_MAX];
+    outputBuffer *run, *buf;
+
+    for (run = batch; run; run = buf) {
+        int count = 0;
+        off_t end = run->offset;
+        bool ok;
+
+        for (buf = run; buf && count < IOV_MAX && buf->fd == run->fd &&
+             buf->offset == end; buf = buf->next) {
+            iov[count].iov_base = buf->data;
+            iov[count].iov_len = buf->size;
+            end += buf->size;
+            count++;
+        }
+
+        ok = writeVectors(run->fd, iov, count, run->offset);
+
+        for (; run != buf; run = run->next) {
+            run->ok = ok;
+        }
+    }
+}
+
+/**
+ * @brief Determine whether @p a and @p b are adjacent ranges of the same file
+ */
+static bool adjacent(const outputBuffer *a, const outputBuffer *b)
+{
+    return a->fd == b->fd && (a->offset + (off_t) a->size == b->offset ||
+                              b->offset + (off_t) b->size == a->offset);
+}
+
+/**
+ * @brief Determine whether a range adjacent to @p buf is being written
+ *
+ * @note Must be called with @c engine->lock held
+ */
+static bool adjacentWriteNoMutex(const outputEngine *engine,
+                                 const outputBuffer *buf)
+{
+    const outputBuffer *run, *cur;
+
+    for (run = engine->writing; run; run = run->nextRun) {
+        for (cur = run; cur; cur = cur->next) {
+            if (adjacent(cur, buf)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Take @p buf, and every committed buffer which forms a contiguous
+ *        range of the same file with it, off the commit queue
+ *
+ * @note Must be called with @c engine->lock held
+ *
+ * @return The buffers, sorted by offset
+ */
+static outputBuffer *claimRunNoMutex(outputEngine *engine, outputBuffer *buf)
+{
+    outputBuffer *run = NULL, **pos = &engine->queue;
+    outputBuffer span = *buf;
+
+    while (*pos) {
+        outputBuffer *cur = *pos;
+
+        if (cur != buf && !adjacent(cur, &span)) {
+            pos = &cur->next;
+            continue;
+        }
+
+        *pos = cur->next;
+        cur->next = run;
+        cur->claimed = true;
+        run = cur;
+
+        if (cur->offset < span.offset) {
+            span.size += span.offset - cur->offset;
+            span.offset = cur->offset;
+        } else if (cur != buf) {
+            span.size += cur->size;
+        }
+
+        /* Buffers passed over already may adjoin the wider span */
+        pos = &engine->queue;
+    }
+
+    return sortBatch(run);
+}
+
+/**
+ * @brief Commit a pwrite buffer
+ *
+ * Buffers are written by the threads committing them, several at once, except
+ * that a buffer adjacent to one being written waits for that write to finish.
+ * In the meantime, further adjacent buffers may be committed; the first of
+ * them to find no adjacent write in progress then writes all of them at once.
+ */
+static bool commitPwrite(outputEngine *engine, outputBuffer *buf)
+{
+    bool ret;
+
+    pthread_mutex_lock(&engine->lock);
+
+    buf->claimed = buf->written = false;
+    buf->next = engine->queue;
+    engine->queue = buf;
+
+    while (!buf->written) {
+        outputBuffer *run, *cur, **pos;
+
+        if (buf->claimed || adjacentWriteNoMutex(engine, buf)) {
+            pthread_cond_wait(&engine->cond, &engine->lock);
+            continue;
+        }
+
+        run = claimRunNoMutex(engine, buf);
+        run->nextRun = engine->writing;
+        engine->writing = run;
+        pthread_mutex_unlock(&engine->lock);
+
+        writeBatch(run);
+
+        pthread_mutex_lock(&engine->lock);
+        pos = &engine->writing;
+        while (*pos != run) {
+            pos = &(*pos)->nextRun;
+        }
+        *pos = run->nextRun;
+
+        for (cur = run; cur; cur = cur->next) {
+            cur->written = true;
+        }
+        pthread_cond_broadcast(&engine->cond);
+    }
+
+    ret = buf->ok;
+    releaseNoMutex(engine, buf);
+
+    pthread_mutex_unlock(&engine->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Read or write all of @p len bytes through the ring
+ *
+ * @param bufIndex Index of the registered buffer containing @p data, or -1
+ */
+static bool ringTransfer(outputEngine *engine, ringOpType type, int fd,
+                         void *data, size_t len, off_t offset, int bufIndex)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ioRingOp op = {
+            .type = type,
+            .fd = fd,
+            .buf = data + done,
+            .len = len - done,
+            .offset = offset + done,
+            .bufIndex = bufIndex,
+        };
+
+        if (!ringSubmitAndWait(engine->ring, &op, 1)) {
+            return false;
+        }
+
+        if (op.result == -EINTR || op.result == -EAGAIN) {
+            continue;
+        }
+
+        if (op.result <= 0) {
+            return false;
+        }
+
+        done += op.result;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Commit an io_uring buffer
+ *
+ * Each thread waits for its own write only; writes committed by several
+ * threads at once reach the kernel together through the shared ring.
+ */
+static bool commitUring(outputEngine *engine, outputBuffer *buf)
+{
+    bool ret = ringTransfer(engine, RING_OP_WRITE, buf->fd, buf->data,
+                            buf->size, buf->offset,
+                            buf->inArena && engine->registered ?
+                            ARENA_BUF_INDEX : -1);
+
+    outputDiscard(engine, buf);
+
+    return ret;
+}
+
+/**
+ * @brief Write all of @p len bytes at @p data to @p offset within @p fd
+ *
+ * @param bufIndex Index of the registered buffer containing @p data, or -1
+ */
+static bool writeRange(outputEngine *engine, int fd, void *data, size_t len,
+                       off_t offset, int bufIndex)
+{
+    struct iovec iov = { .iov_base = data, .iov_len = len };
+
+    if (engine->type == OUTPUT_ENGINE_URING) {
+        return ringTransfer(engine, RING_OP_WRITE, fd, data, len, offset,
+                            bufIndex);
+    }
+
+    return len == 0 || writeVectors(fd, &iov, 1, offset);
+}
+
+/**
+ * @brief Read up to @p len bytes at @p offset of @p fd, stopping early at EOF
+ *
+ * @return The number of bytes read, or -1 on error
+ */
+static ssize_t readAll(int fd, void *data, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t got = pread(fd, data + done, len - done, offset + done);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+
+        done += got;
+    }
+
+    return done;
+}
+
+/**
+ * @brief Read the block at @p offset in @p fd into @p block
+ *
+ * Anything past the end of the file reads as zeros.
+ */
+static bool readBlock(int fd, void *block, size_t align, off_t offset)
+{
+    ssize_t got = readAll(fd, block, align, offset);
+
+    if (got < 0) {
+        return false;
+    }
+
+    memset(block + got, 0, align - got);
+
+    return true;
+}
+
+/**
+ * @brief Commit a buffer for a file opened with O_DIRECT
+ *
+ * The partial blocks at either end of the range are completed with what is
+ * already in the file, and the whole span of blocks is written in place. The
+ * edge blocks stay locked from reading them until they have been written, as
+ * neighbouring ranges may share them.
+ */
+static bool commitDirect(outputEngine *engine, outputBuffer *buf)
+{
+    off_t start = buf->offset - buf->lead;
+    size_t tail = (buf->lead + buf->size) % buf->align;
+    size_t span = buf->lead + buf->size + (tail ? buf->align - tail : 0);
+    off_t last = start + span - buf->align;
+    int first = (start / buf->align) % numEdgeLocks;
+    int second = (last / buf->align) % numEdgeLocks;
+    void *block = NULL;
+    bool ret = false;
+
+    if (buf->size == 0) {
+        outputDiscard(engine, buf);
+        return true;
+    }
+
+    if (first > second) {
+        int tmp = first;
+
+        first = second;
+        second = tmp;
+    }
+
+    pthread_mutex_lock(engine->edgeLocks + first);
+    if (second != first) {
+        pthread_mutex_lock(engine->edgeLocks + second);
+    }
+
+    if ((buf->lead || tail) &&
+        posix_memalign(&block, getpagesize(), buf->align) != 0) {
+        block = NULL;
+        goto done;
+    }
+
+    if (buf->lead) {
+        if (!readBlock(buf->fd, block, buf->align, start)) {
+            goto done;
+        }
+        memcpy(buf->base, block, buf->lead);
+    }
+
+    if (tail) {
+        /* The block was already read above if the range is within one */
+        if ((last != start || !buf->lead) &&
+            !readBlock(buf->fd, block, buf->align, last)) {
+            goto done;
+        }
+        memcpy(buf->base + span - (buf->align - tail), block + tail,
+               buf->align - tail);
+    }
+
+    ret = writeRange(engine, buf->fd, buf->base, span, start,
+                     buf->inArena && engine->registered ?
+                     ARENA_BUF_INDEX : -1);
+
+done:
+    if (second != first) {
+        pthread_mutex_unlock(engine->edgeLocks + second);
+    }
+    pthread_mutex_unlock(engine->edgeLocks + first);
+
+    free(block);
+    outputDiscard(engine, buf);
+
+    return ret;
+}
+
+/**
+ * @brief Implementation of outputCommit(), for buffers whose writes are
+ *        accounted for by the caller
+ */
+static bool commitBuffer(outputEngine *engine, outputBuffer *buf)
+{
+    if (buf->align) {
+        return commitDirect(engine, buf);
+    }
+
+    if (engine->type == OUTPUT_ENGINE_PWRITE) {
+        return commitPwrite(engine, buf);
+    }
+
+    if (engine->type == OUTPUT_ENGINE_URING) {
+        return commitUring(engine, buf);
+    }
+
+    /* The data went straight into the page cache; the kernel writes it back
+     * once the mapping is gone, just as it would after write(2). */
+    outputDiscard(engine, buf);
+
+    return true;
+}
+
+bool outputCommit(outputEngine *engine, outputBuffer *buf)
+{
+    uint64_t start = metricsNow();
+    size_t size = buf->size;
+    bool ret = commitBuffer(engine, buf);
+
+    if (ret) {
+        metricsAddWork(METRICS_WORK_WRITE, size, metricsNow() - start);
+    }
+
+    return ret;
+}
+
+bool outputWrite(outputEngine *engine, int fd, off_t offset, const void *data,
+                 size_t size)
+{
+    outputBuffer *buf = outputAcquire(engine, fd, offset, size);
+
+    if (!buf) {
+        return false;
+    }
+
+    if (size > 0) {
+        memcpy(outputData(buf), data, size);
+    }
+
+    return outputCommit(engine, buf);
+}
+
+/**
+ * @brief Take up to @p want staging buffers, waiting until at least one is free
+ *
+ * @return The number of staging buffers stored in @p slots
+ */
+static int takeSlots(outputEngine *engine, int *slots, int want)
+{
+    int count;
+
+    pthread_mutex_lock(&engine->lock);
+
+    while (engine->numFreeSlots == 0) {
+        pthread_cond_wait(&engine->cond, &engine->lock);
+    }
+
+    for (count = 0; count < want && engine->numFreeSlots > 0; count++) {
+        slots[count] = engine->freeSlots[--engine->numFreeSlots];
+    }
+
+    pthread_mutex_unlock(&engine->lock);
+
+    return count;
+}
+
+static void releaseSlots(outputEngine *engine, const int *slots, int count)
+{
+    pthread_mutex_lock(&engine->lock);
+
+    while (count > 0) {
+        engine->freeSlots[engine->numFreeSlots++] = slots[--count];
+    }
+
+    pthread_cond_broadcast(&engine->cond);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+bool outputReadRange(outputEngine *engine, int fd, off_t offset, void *data,
+                     size_t len)
+{
+    size_t align = directAlign(engine, fd), done = 0;
+    void *bounce;
+    bool ret = false;
+
+    if (!align) {
+        return readAll(fd, data, len, offset) == len;
+    }
+
+    if (posix_memalign(&bounce, getpagesize(),
+                       directCopyPiece + 2 * align) != 0) {
+        return false;
+    }
+
+    while (done < len) {
+        off_t pos = offset + done;
+        size_t lead = pos % align, piece = len - done, span;
+
+        if (piece > directCopyPiece) {
+            piece = directCopyPiece;
+        }
+        span = (lead + piece + align - 1) / align * align;
+
+        if (readAll(fd, bounce, span, pos - lead) < (ssize_t) (lead + piece)) {
+            goto done;
+        }
+
+        memcpy(data + done, bounce + lead, piece);
+        done += piece;
+    }
+
+    ret = true;
+
+done:
+    free(bounce);
+
+    return ret;
+}
+
+/**
+ * @brief Copy a range to or from a file opened with O_DIRECT, through engine
+ *        buffers
+ *
+ * Pieces end on block boundaries where possible, so that only the edges of the
+ * whole range need a read-modify-write cycle.
+ */
+static bool copyDirect(outputEngine *engine, int inFd, off_t inOffset,
+                       int outFd, off_t outOffset, size_t len)
+{
+    size_t align = directAlign(engine, outFd), done = 0;
+
+    while (done < len) {
+        off_t end = outOffset + done + directCopyPiece;
+        size_t piece;
+        outputBuffer *buf;
+
+        if (align) {
+            end -= end % align;
+        }
+        piece = end - (outOffset + done);
+        if (end <= outOffset + done || piece > len - done) {
+            piece = len - done;
+        }
+
+        buf = outputAcquire(engine, outFd, outOffset + done, piece);
+        if (!buf) {
+            return false;
+        }
+
+        if (!outputReadRange(engine, inFd, inOffset + done, outputData(buf),
+                             piece)) {
+            outputDiscard(engine, buf);
+            return false;
+        }
+
+        if (!commitBuffer(engine, buf)) {
+            return false;
+        }
+
+        done += piece;
+    }
+
+    return true;
+}
+
+bool outputCopyRange(outputEngine *engine, int inFd, off_t inOffset, int outFd,
+                     off_t outOffset, size_t len)
+{
+    ioRingOp ops[maxSlotsPerCopy];
+    int slots[maxSlotsPerCopy];
+    int bufIndex = engine->registered ? SLOTS_BUF_INDEX : -1;
+    int numSlots, i, n;
+    size_t done = 0;
+    bool ret = false;
+
+    if (outputIsDirect(engine, inFd) || outputIsDirect(engine, outFd)) {
+        return copyDirect(engine, inFd, inOffset, outFd, outOffset, len);
+    }
+
+    if (engine->type != OUTPUT_ENGINE_URING) {
+        return false;
+    }
+
+    if (len == 0) {
+        return true;
+    }
+
+    n = (len + copySlotSize - 1) / copySlotSize;
+    numSlots = takeSlots(engine, slots, n < maxSlotsPerCopy ?
+                                        n : maxSlotsPerCopy);
+
+    /* Read a batch of slot-sized pieces at once, then write them all out */
+    while (done < len) {
+        size_t batch = 0;
+
+        for (n = 0; n < numSlots && done + batch < len; n++) {
+            size_t piece = len - done - batch;
+
+            if (piece > copySlotSize) {
+                piece = copySlotSize;
+            }
+
+            ops[n] = (ioRingOp) {
+                .type = RING_OP_READ,
+                .fd = inFd,
+                .buf = engine->slots + slots[n] * copySlotSize,
+                .len = piece,
+                .offset = inOffset + done + batch,
+                .bufIndex = bufIndex,
+            };
+            batch += piece;
+        }
+
+        if (!ringSubmitAndWait(engine->ring, ops, n)) {
+            goto done;
+        }
+
+        /* Short reads only happen at an unexpected EOF for regular files */
+        for (i = 0; i < n; i++) {
+            if (ops[i].result != ops[i].len) {
+                goto done;
+            }
+
+            ops[i].type = RING_OP_WRITE;
+            ops[i].fd = outFd;
+            ops[i].offset += outOffset - inOffset;
+        }
+
+        if (!ringSubmitAndWait(engine->ring, ops, n)) {
+            goto done;
+        }
+
+        for (i = 0; i < n; i++) {
+            /* Finish any short write synchronously; it's rare enough */
+            if (ops[i].result < 0 ||
+                (ops[i].result != ops[i].len &&
+                 !ringTransfer(engine, RING_OP_WRITE, outFd,
+                               ops[i].buf + ops[i].result,
+                               ops[i].len - ops[i].result,
+                               ops[i].offset + ops[i].result, bufIndex))) {
+                goto done;
+            }
+        }
+
+        done += batch;
+    }
+
+    ret = true;
+
+done:
+    releaseSlots(engine, slots, numSlots);
+
+    return ret;
+}
+
+/**
+ * @brief Flush @p fd to stable storage, without touching the drop queue
+ */
+static bool syncFile(outputEngine *engine, int fd)
+{
+    if (engine->type == OUTPUT_ENGINE_URING) {
+        ioRingOp op = {
+            .type = RING_OP_FDATASYNC,
+            .fd = fd,
+            .bufIndex = -1,
+        };
+
+        return ringSubmitAndWait(engine->ring, &op, 1) && op.result == 0;
+    }
+
+    return fdatasync(fd) == 0;
+}
+
+#if defined HAVE_SYNC_FILE_RANGE
+/**
+ * @brief Start or wait for the writeback of a range, as sync_file_range(2)
+ */
+static bool syncRange(outputEngine *engine, int fd, off_t offset, size_t len,
+                      unsigned flags)
+{
+    if (engine->type == OUTPUT_ENGINE_URING) {
+        ioRingOp op = {
+            .type = RING_OP_SYNC_FILE_RANGE,
+            .fd = fd,
+            .len = len,
+            .offset = offset,
+            .bufIndex = -1,
+            .flags = flags,
+        };
+
+        return ringSubmitAndWait(engine->ring, &op, 1) && op.result == 0;
+    }
+
+    return sync_file_range(fd, offset, len, flags) == 0;
+}
+#endif
+
+/**
+ * @brief Drop a range which may still be under writeback from the page cache
+ */
+static void dropRange(outputEngine *engine, int fd, off_t offset, size_t len)
+{
+    /* POSIX_FADV_DONTNEED skips pages which are dirty or under writeback, so
+     * wait for the range to be written back first. */
+#if defined HAVE_SYNC_FILE_RANGE
+    syncRange(engine, fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+              SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @brief Queue a completed range to be dropped from the page cache, dropping
+ *        the oldest queued range if the queue is full
+ */
+static void queueDrop(outputEngine *engine, int fd, off_t offset, size_t len)
+{
+    bool full;
+    int oldFd = -1;
+    off_t oldOffset = 0;
+    size_t oldLen = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    full = engine->numDrops == dropQueueLength;
+    if (full) {
+        oldFd = engine->dropQueue[0].fd;
+        oldOffset = engine->dropQueue[0].offset;
+        oldLen = engine->dropQueue[0].len;
+
+        memmove(engine->dropQueue, engine->dropQueue + 1,
+                --engine->numDrops * sizeof(engine->dropQueue[0]));
+    }
+
+    engine->dropQueue[engine->numDrops].fd = fd;
+    engine->dropQueue[engine->numDrops].offset = offset;
+    engine->dropQueue[engine->numDrops].len = len;
+    engine->numDrops++;
+
+    pthread_mutex_unlock(&engine->lock);
+
+    if (full) {
+        dropRange(engine, oldFd, oldOffset, oldLen);
+    }
+}
+
+/**
+ * @brief Drop all queued ranges of @p fd, which has just been synced, from the
+ *        page cache
+ */
+static void drainDrops(outputEngine *engine, int fd)
+{
+    int i, kept = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    for (i = 0; i < engine->numDrops; i++) {
+        if (engine->dropQueue[i].fd == fd) {
+            /* Synced, so there is no writeback to wait for */
+            posix_fadvise(fd, engine->dropQueue[i].offset,
+                          engine->dropQueue[i].len, POSIX_FADV_DONTNEED);
+        } else {
+            engine->dropQueue[kept++] = engine->dropQueue[i];
+        }
+    }
+
+    engine->numDrops = kept;
+
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/**
+ * @brief Determine whether @p fd is due for a sync under OUTPUT_SYNC_PERIODIC,
+ *        and if so, reset its timer
+ */
+static bool syncDue(outputEngine *engine, int fd)
+{
+    struct timespec now;
+    bool due = true;
+    int i;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+
+    for (i = 0; i < engine->numSyncTimes; i++) {
+        if (engine->syncTimes[i].fd == fd) {
+            break;
+        }
+    }
+
+    if (i == engine->numSyncTimes) {
+        void *times = realloc(engine->syncTimes, (engine->numSyncTimes + 1) *
+                              sizeof(engine->syncTimes[0]));
+
+        /* Without a timer, err on the side of syncing */
+        if (!times) {
+            goto done;
+        }
+
+        /* The interval starts with the first completed range */
+        engine->syncTimes = times;
+        engine->syncTimes[i].fd = fd;
+        engine->syncTimes[i].lastSync = now.tv_sec;
+        engine->numSyncTimes++;
+    }
+
+    due = now.tv_sec - engine->syncTimes[i].lastSync >=
+          engine->durability.interval;
+    if (due) {
+        engine->syncTimes[i].lastSync = now.tv_sec;
+    }
+
+done:
+    pthread_mutex_unlock(&engine->lock);
+
+    return due;
+}
+
+bool outputSync(outputEngine *engine, int fd)
+{
+    if (!syncFile(engine, fd)) {
+        return false;
+    }
+
+    if (engine->durability.dropCache) {
+        drainDrops(engine, fd);
+    }
+
+    return true;
+}
+
+void outputSetDurability(outputEngine *engine, const outputDurability *dur)
+{
+    engine->durability = *dur;
+}
+
+const outputDurability *outputGetDurability(const outputEngine *engine)
+{
+    return &engine->durability;
+}
+
+bool outputRangeDone(outputEngine *engine, int fd, off_t offset, size_t len)
+{
+    const outputDurability *dur = &engine->durability;
+    bool cached = !outputIsDirect(engine, fd);
+
+    if (len == 0) {
+        return true;
+    }
+
+    /* Files opened with O_DIRECT have nothing in the page cache to write back
+     * or drop, but may still need syncing, e.g. for a device's own cache. */
+    if (cached && dur->dropCache) {
+        queueDrop(engine, fd, offset, len);
+    }
+
+    if (dur->policy == OUTPUT_SYNC_PART ||
+        (dur->policy == OUTPUT_SYNC_PERIODIC && syncDue(engine, fd))) {
+        return outputSync(engine, fd);
+    }
+
+#if defined HAVE_SYNC_FILE_RANGE
+    /* Failing to start writeback early is harmless; the final sync does it */
+    if (cached && dur->writeback) {
+        syncRange(engine, fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+
+    return true;
+}
+
+static const char *engineNames[] = {
+    [OUTPUT_ENGINE_PWRITE] = "pwrite",
+    [OUTPUT_ENGINE_MMAP] = "mmap",
+    [OUTPUT_ENGINE_URING] = "io_uring",
+};
+
+static const char *syncPolicyNames[] = {
+    [OUTPUT_SYNC_END] = "end",
+    [OUTPUT_SYNC_PERIODIC] = "periodic",
+    [OUTPUT_SYNC_PART] = "part",
+};
+
+const char *outputEngineName(outputEngineType type)
+{
+    if (type < 0 || type >= OUTPUT_ENGINE_COUNT) {
+        return "unknown";
+    }
+
+    return engineNames[type];
+}
+
+outputEngineType outputEngineFromName(const char *name)
+{
+    outputEngineType type;
+
+    for (type = 0; type < OUTPUT_ENGINE_COUNT; type++) {
+        if (strcmp(name, engineNames[type]) == 0) {
+            break;
+        }
+    }
+
+    return type;
+}
+
+const char *outputSyncPolicyName(outputSyncPolicy policy)
+{
+    if (policy < 0 || policy >= OUTPUT_SYNC_COUNT) {
+        return "unknown";
+    }
+
+    return syncPolicyNames[policy];
+}
+
+outputSyncPolicy outputSyncPolicyFromName(const char *name)
+{
+    outputSyncPolicy policy;
+
+    for (policy = 0; policy < OUTPUT_SYNC_COUNT; policy++) {
+        if (strcmp(name, syncPolicyNames[policy]) == 0) {
+            break;
+        }
+    }
+
+    return policy;
+}
@@ -0,0 +1,261 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_OUTPUT_H
+#define PIGDO_OUTPUT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * @brief Mechanisms for getting data into the output file
+ */
+typedef enum {
+    OUTPUT_ENGINE_PWRITE = 0, ///< Pooled memory buffers, written with pwrite(2)
+    OUTPUT_ENGINE_MMAP,       ///< Shared mappings of the output file itself
+    OUTPUT_ENGINE_URING,      ///< Pooled buffers, written through io_uring(7)
+    OUTPUT_ENGINE_COUNT,      ///< Number of output engines, not an engine
+} outputEngineType;
+
+/**
+ * @brief When data written to output files is flushed to stable storage
+ */
+typedef enum {
+    OUTPUT_SYNC_END = 0,   ///< Only when outputSync() is called
+    OUTPUT_SYNC_PERIODIC,  ///< Also at most once per interval, as ranges of a
+                           ///< file complete
+    OUTPUT_SYNC_PART,      ///< Also each time a range of a file completes
+    OUTPUT_SYNC_COUNT,     ///< Number of policies, not a policy
+} outputSyncPolicy;
+
+/**
+ * @brief How an output engine treats ranges of output files once they are
+ *        complete; see outputRangeDone()
+ */
+typedef struct {
+    outputSyncPolicy policy;
+    unsigned interval;   ///< Seconds between syncs with OUTPUT_SYNC_PERIODIC
+    bool writeback;      ///< Start writing completed ranges back right away,
+                         ///< rather than leaving it to the kernel
+    bool dropCache;      ///< Drop completed ranges from the page cache once
+                         ///< they have been written back
+} outputDurability;
+
+/**
+ * @brief An output engine, which hands out buffers for ranges of output files
+ *        and writes them back once they have been filled in
+ *
+ * A single engine may be shared by any number of threads and output files. The
+ * total size of the buffers handed out at any one time is capped, so that the
+ * memory used by an engine stays bounded regardless of the number of threads.
+ */
+typedef struct _outputEngine outputEngine;
+
+/**
+ * @brief A buffer for one range of an output file
+ */
+typedef struct _outputBuffer outputBuffer;
+
+/**
+ * @brief Create an output engine
+ *
+ * @param type The mechanism to use for writing
+ * @param maxInFlight The total size of buffers which may be handed out at once.
+ *                    A single buffer larger than this is still handed out, but
+ *                    only while no other buffers are in flight.
+ * @param queueDepth Number of I/O requests which OUTPUT_ENGINE_URING may have
+ *                   queued with the kernel at once
+ *
+ * @return The new engine on success, or NULL on failure. If io_uring(7) can't
+ *         be set up, an OUTPUT_ENGINE_PWRITE engine is returned instead; see
+ *         outputGetType().
+ */
+outputEngine *outputOpen(outputEngineType type, size_t maxInFlight,
+                         unsigned queueDepth);
+
+/**
+ * @brief Release all resources associated with @p engine
+ *
+ * @note All buffers must have been committed or discarded beforehand.
+ */
+void outputClose(outputEngine *engine);
+
+/**
+ * @brief Get the mechanism @p engine actually uses
+ */
+outputEngineType outputGetType(const outputEngine *engine);
+
+/**
+ * @brief Declare that @p fd was opened with O_DIRECT
+ *
+ * Buffers for @p fd are then allocated to cover whole blocks of @p align bytes,
+ * and committing them fills in the partial blocks at either end from the file
+ * before writing, so that every write to @p fd is aligned.
+ *
+ * @note This must be done before any I/O on the engine.
+ *
+ * @return @c true on success; @c false on failure, or if @p engine can't write
+ *         without going through the page cache (OUTPUT_ENGINE_MMAP)
+ */
+bool outputAddDirectFd(outputEngine *engine, int fd, size_t align);
+
+/**
+ * @brief Determine whether @p fd was declared with outputAddDirectFd()
+ */
+bool outputIsDirect(const outputEngine *engine, int fd);
+
+/**
+ * @brief Get a buffer for @p size bytes at @p offset within @p fd
+ *
+ * This blocks until the buffer fits within the engine's in-flight cap.
+ *
+ * @return The buffer on success, or NULL on failure
+ */
+outputBuffer *outputAcquire(outputEngine *engine, int fd, off_t offset,
+                            size_t size);
+
+/**
+ * @brief Get the address where the contents of @p buf should be stored
+ */
+void *outputData(outputBuffer *buf);
+
+/**
+ * @brief Write the contents of @p buf to its place in the output file, and
+ *        release the buffer
+ *
+ * With OUTPUT_ENGINE_PWRITE, buffers for adjacent ranges which are committed at
+ * the same time by several threads are written together. When this function
+ * returns, the data is visible to reads of the output file.
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool outputCommit(outputEngine *engine, outputBuffer *buf);
+
+/**
+ * @brief Release @p buf without writing its contents
+ *
+ * @note With OUTPUT_ENGINE_MMAP, anything stored in the buffer has already
+ *       reached the output file; callers must not rely on the previous contents
+ *       of the range being preserved.
+ */
+void outputDiscard(outputEngine *engine, outputBuffer *buf);
+
+/**
+ * @brief Write @p size bytes from @p data to @p offset within @p fd
+ *
+ * This is a shortcut for acquiring a buffer, filling it and committing it.
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool outputWrite(outputEngine *engine, int fd, off_t offset, const void *data,
+                 size_t size);
+
+/**
+ * @brief Copy @p len bytes from @p inFd to @p outFd through the engine
+ *
+ * This is meant as a replacement for a plain read(2)/write(2) loop when the
+ * range can't be copied within the kernel: with OUTPUT_ENGINE_URING, several
+ * reads and writes are kept in flight at once, using registered buffers. Copies
+ * to or from files opened with O_DIRECT are always made through the engine's
+ * aligned buffers.
+ *
+ * @return @c true if the range was copied; @c false if the engine has no
+ *         accelerated way of copying, or the copy failed, in which case the
+ *         caller should fall back to copying the range by other means.
+ */
+bool outputCopyRange(outputEngine *engine, int inFd, off_t inOffset, int outFd,
+                     off_t outOffset, size_t len);
+
+/**
+ * @brief Read @p len bytes at @p offset within @p fd into @p data
+ *
+ * Unlike a plain pread(2), this works on files declared with
+ * outputAddDirectFd() regardless of the alignment of its arguments, without
+ * going through the page cache.
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool outputReadRange(outputEngine *engine, int fd, off_t offset, void *data,
+                     size_t len);
+
+/**
+ * @brief Flush the data written to @p fd to stable storage, as fdatasync(2)
+ *
+ * With dropCache set by outputSetDurability(), the ranges of @p fd still queued
+ * by outputRangeDone() are then dropped from the page cache.
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool outputSync(outputEngine *engine, int fd);
+
+/**
+ * @brief Set how @p engine treats completed ranges of output files
+ *
+ * The default is OUTPUT_SYNC_END, with writeback left to the kernel.
+ *
+ * @note This must be done before any I/O on the engine.
+ */
+void outputSetDurability(outputEngine *engine, const outputDurability *dur);
+
+/**
+ * @brief Get the settings made with outputSetDurability()
+ */
+const outputDurability *outputGetDurability(const outputEngine *engine);
+
+/**
+ * @brief Declare that @p len bytes at @p offset within @p fd are complete
+ *
+ * This applies the engine's durability settings to the range, however it was
+ * written: with OUTPUT_SYNC_PART the file is synced right away; with
+ * OUTPUT_SYNC_PERIODIC it is synced if it hasn't been for the configured
+ * interval. With writeback enabled, writing the range back is started without
+ * waiting for it to finish, which spreads the I/O out over the run instead of
+ * leaving it to pile up for the final sync. With dropCache, the range is
+ * dropped from the page cache once its writeback is done: ranges are queued,
+ * and the oldest are dropped as newer ones complete, by which time they have
+ * usually been written back already.
+ *
+ * @return @c true on success; @c false if syncing failed
+ */
+bool outputRangeDone(outputEngine *engine, int fd, off_t offset, size_t len);
+
+/**
+ * @brief Get the name of @p type, as accepted by outputEngineFromName()
+ */
+const char *outputEngineName(outputEngineType type);
+
+/**
+ * @brief Look up an output engine type by name
+ *
+ * @return The engine type, or OUTPUT_ENGINE_COUNT if @p name is not known
+ */
+outputEngineType outputEngineFromName(const char *name);
+
+/**
+ * @brief Get the name of @p policy, as accepted by outputSyncPolicyFromName()
+ */
+const char *outputSyncPolicyName(outputSyncPolicy policy);
+
+/**
+ * @brief Look up a sync policy by name
+ *
+ * @return The policy, or OUTPUT_SYNC_COUNT if @p name is not known
+ */
+outputSyncPolicy outputSyncPolicyFromName(const char *name);
+
+#endif
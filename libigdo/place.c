@@ -0,0 +1,234 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // for copy_file_range(2)
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#if defined HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "metrics.h"
+#include "place.h"
+
+static const size_t bufferedCopyChunk = 1024 * 1024;
+
+/**
+ * @brief Attempt to share the extents of the source range with the destination
+ *
+ * @return @c true if the range was cloned; @c false if it was not, in which
+ *         case nothing has been written to @p outFd
+ */
+static bool reflinkRange(int inFd, off_t inOffset, int outFd, off_t outOffset,
+                         size_t len)
+{
+#if defined HAVE_LINUX_FS_H && defined FICLONERANGE
+    struct stat inSt, outSt;
+    struct file_clone_range range;
+
+    if (fstat(inFd, &inSt) != 0 || fstat(outFd, &outSt) != 0) {
+        return false;
+    }
+
+    /* Cloning only works within a single filesystem, and only on whole blocks;
+     * don't bother the kernel with requests that are bound to fail. The length
+     * is allowed to be unaligned when the source range extends to its EOF, and
+     * a length of 0 would mean "clone to EOF", which is never what we want. */
+    if (len == 0 || inSt.st_dev != outSt.st_dev || outSt.st_blksize <= 0 ||
+        inOffset % outSt.st_blksize != 0 || outOffset % outSt.st_blksize != 0) {
+        return false;
+    }
+
+    if (len % outSt.st_blksize != 0 && inOffset + len != inSt.st_size) {
+        return false;
+    }
+
+    range.src_fd = inFd;
+    range.src_offset = inOffset;
+    range.src_length = len;
+    range.dest_offset = outOffset;
+
+    return ioctl(outFd, FICLONERANGE, &range) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Copy as much of the range as possible with copy_file_range(2)
+ *
+ * @return The number of bytes copied. This may be less than @p len if the
+ *         kernel or filesystem refused to copy the remainder, in which case the
+ *         caller is expected to copy the rest by other means.
+ */
+static size_t copyRange(int inFd, off_t inOffset, int outFd, off_t outOffset,
+                        size_t len)
+{
+    size_t done = 0;
+
+#if defined HAVE_COPY_FILE_RANGE
+    while (done < len) {
+        loff_t in = inOffset + done, out = outOffset + done;
+        ssize_t copied = copy_file_range(inFd, &in, outFd, &out, len - done, 0);
+
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+
+        /* Anything else, including a short copy at an unexpected EOF, means
+         * this method won't get any further: let the caller fall back. */
+        if (copied <= 0) {
+            break;
+        }
+
+        done += copied;
+    }
+#endif
+
+    return done;
+}
+
+/**
+ * @brief Copy the range through a buffer in user space
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool bufferedRange(int inFd, off_t inOffset, int outFd, off_t outOffset,
+                          size_t len)
+{
+    size_t done = 0;
+    bool ret = false;
+    void *buf = malloc(len < bufferedCopyChunk ? len : bufferedCopyChunk);
+
+    if (!buf) {
+        return false;
+    }
+
+    while (done < len) {
+        size_t want = len - done;
+        ssize_t got, put;
+
+        if (want > bufferedCopyChunk) {
+            want = bufferedCopyChunk;
+        }
+
+        got = pread(inFd, buf, want, inOffset + done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            goto done;
+        }
+
+        put = pwrite(outFd, buf, got, outOffset + done);
+        if (put != got) {
+            goto done;
+        }
+
+        done += put;
+    }
+
+    ret = true;
+
+done:
+    free(buf);
+
+    return ret;
+}
+
+/**
+ * @brief Implementation of placeFileRangeVia()
+ */
+static placeMethod placeRange(int inFd, off_t inOffset, int outFd,
+                              off_t outOffset, size_t len,
+                              outputEngine *engine)
+{
+    size_t copied = 0;
+
+    /* In-kernel copies to or from a file opened with O_DIRECT would go
+     * through the page cache, which must not be mixed with O_DIRECT writes,
+     * and are not supported on block devices anyway. */
+    if (!engine || (!outputIsDirect(engine, inFd) &&
+                    !outputIsDirect(engine, outFd))) {
+        if (reflinkRange(inFd, inOffset, outFd, outOffset, len)) {
+            return PLACE_METHOD_REFLINK;
+        }
+
+        copied = copyRange(inFd, inOffset, outFd, outOffset, len);
+        if (copied == len) {
+            return PLACE_METHOD_COPY_RANGE;
+        }
+    }
+
+    if (engine && outputCopyRange(engine, inFd, inOffset + copied, outFd,
+                                  outOffset + copied, len - copied)) {
+        return PLACE_METHOD_ENGINE;
+    }
+
+    if (bufferedRange(inFd, inOffset + copied, outFd, outOffset + copied,
+                      len - copied)) {
+        return PLACE_METHOD_BUFFERED;
+    }
+
+    return PLACE_METHOD_NONE;
+}
+
+placeMethod placeFileRangeVia(int inFd, off_t inOffset, int outFd,
+                              off_t outOffset, size_t len,
+                              outputEngine *engine)
+{
+    uint64_t start = metricsNow();
+    placeMethod method = placeRange(inFd, inOffset, outFd, outOffset, len,
+                                    engine);
+
+    if (method != PLACE_METHOD_NONE) {
+        metricsAddWork(METRICS_WORK_WRITE, len, metricsNow() - start);
+    }
+
+    return method;
+}
+
+placeMethod placeFileRange(int inFd, off_t inOffset, int outFd, off_t outOffset,
+                           size_t len)
+{
+    return placeFileRangeVia(inFd, inOffset, outFd, outOffset, len, NULL);
+}
+
+const char *placeMethodName(placeMethod method)
+{
+    static const char *names[] = {
+        [PLACE_METHOD_NONE] = "none",
+        [PLACE_METHOD_REFLINK] = "reflink",
+        [PLACE_METHOD_COPY_RANGE] = "copy_file_range",
+        [PLACE_METHOD_ENGINE] = "output engine copy",
+        [PLACE_METHOD_BUFFERED] = "buffered copy",
+    };
+
+    if (method < 0 || method >= PLACE_METHOD_COUNT) {
+        return names[PLACE_METHOD_NONE];
+    }
+
+    return names[method];
+}
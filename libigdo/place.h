@@ -0,0 +1,79 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_PLACE_H
+#define PIGDO_PLACE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "output.h"
+
+/**
+ * @brief Mechanisms which can be used to place a range of one file into another
+ *
+ * The methods are listed in order of preference: placeFileRange() will try
+ * each of them in turn until one succeeds.
+ */
+typedef enum {
+    PLACE_METHOD_NONE = 0,   ///< No data was placed, e.g. because of an error
+    PLACE_METHOD_REFLINK,    ///< Extents shared with the source (FICLONERANGE)
+    PLACE_METHOD_COPY_RANGE, ///< In-kernel copy with copy_file_range(2)
+    PLACE_METHOD_ENGINE,     ///< Copied with outputCopyRange()
+    PLACE_METHOD_BUFFERED,   ///< Copied through a buffer in user space
+    PLACE_METHOD_COUNT,      ///< Number of placement methods, not a method
+} placeMethod;
+
+/**
+ * @brief Copy @p len bytes from @p inFd to @p outFd without going through user
+ *        space if at all possible
+ *
+ * A reflink is attempted first when both files are on the same filesystem and
+ * the offsets are aligned to the filesystem block size; copy_file_range(2) is
+ * attempted next, and a plain buffered copy is used as the last resort.
+ *
+ * @param inFd An open file descriptor to read from
+ * @param inOffset Offset within @p inFd of the first byte to copy
+ * @param outFd An open file descriptor to write to. May be the same as @p inFd,
+ *              as long as the source and destination ranges do not overlap.
+ * @param outOffset Offset within @p outFd where the first byte will be written
+ * @param len Number of bytes to copy
+ *
+ * @return The method which was used to place the data, or PLACE_METHOD_NONE if
+ *         the data could not be placed
+ */
+placeMethod placeFileRange(int inFd, off_t inOffset, int outFd, off_t outOffset,
+                           size_t len);
+
+/**
+ * @brief Like placeFileRange(), but copy through @p engine as a last resort
+ *
+ * When neither a reflink nor copy_file_range(2) works, outputCopyRange() is
+ * tried before falling back to a plain buffered copy.
+ *
+ * @param engine The output engine to copy through, or NULL
+ */
+placeMethod placeFileRangeVia(int inFd, off_t inOffset, int outFd,
+                              off_t outOffset, size_t len,
+                              outputEngine *engine);
+
+/**
+ * @brief Get a human readable name for @p method
+ */
+const char *placeMethodName(placeMethod method);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_PROBES_H
+#define PIGDO_PROBES_H
+
+/*
+ * USDT static probes, for bpftrace, SystemTap and the like.
+ *
+ * The probes are only compiled in when configured with --enable-usdt, and
+ * <sys/sdt.h> is available; otherwise they expand to nothing, and their
+ * arguments aren't even evaluated. When compiled in, each probe is a single
+ * nop until a tracer attaches to it, e.g.:
+ *
+ *     bpftrace -e 'usdt:./pigdo:pigdo:transfer__done
+ *                  { printf("%d %s\n", arg1, str(arg2)); }'
+ *
+ * All probes are in the @c pigdo provider, and take the same arguments:
+ *
+ * - arg0: the offset of the part within its image (for template__decompressed,
+ *   of the compressed data within the .template file)
+ * - arg1: the size of the part, or of the decompressed data
+ * - arg2: the URI of the mirror or peer concerned, or the path of the local
+ *   file, as a string; or NULL if there is none
+ *
+ * Probes for the end of something also take arg3, how it turned out:
+ *
+ * - transfer__done: the number of bytes fetched, or -1 on failure
+ * - md5__done: 1 if the checksum matched, or 0 if not
+ *
+ * The probes are part__claimed, mirror__selected, transfer__start,
+ * transfer__done, md5__start, md5__done, output__write,
+ * template__decompressed and retry. Double underscores in their names appear
+ * as dashes to some tools, e.g. "transfer-done".
+ */
+
+#if defined ENABLE_USDT && defined HAVE_SYS_SDT_H
+
+#include <stdint.h>
+#include <sys/sdt.h>
+
+/**
+ * @brief Fire probe @p name with the part at @p offset of @p size, and @p uri
+ */
+#define probePart(name, offset, size, uri) \
+    DTRACE_PROBE3(pigdo, name, (uint64_t) (offset), (uint64_t) (size), \
+                  (const char *) (uri))
+
+/**
+ * @brief Fire probe @p name with the part at @p offset of @p size, @p uri,
+ *        and how it turned out
+ */
+#define probePartResult(name, offset, size, uri, result) \
+    DTRACE_PROBE4(pigdo, name, (uint64_t) (offset), (uint64_t) (size), \
+                  (const char *) (uri), (int64_t) (result))
+
+#else
+
+#define probePart(name, offset, size, uri) do { } while (0)
+#define probePartResult(name, offset, size, uri, result) do { } while (0)
+
+#endif
+
+#endif
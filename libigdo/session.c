@@ -0,0 +1,2859 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "session.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "probes.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include "jigdo-md5-private.h"
+#include "jigdo-template-private.h"
+
+/**
+ * @brief A file part, along with the image it belongs to
+ */
+typedef struct {
+    templateFileEntry *file;  ///< The part itself
+    sessionImage *image;      ///< The image which @c file is part of
+} partRef;
+
+/**
+ * @brief States of a range of an image waited for by sessionWaitRange()
+ */
+typedef enum {
+    DEMAND_PENDING = 0, ///< Some parts of the range are still incomplete
+    DEMAND_COMPLETE,    ///< All parts of the range are complete
+    DEMAND_FAILED,      ///< Some parts of the range will never be complete
+} demandState;
+
+/**
+ * @brief A range of an image waited for by sessionWaitRange()
+ */
+typedef struct _demandRange {
+    const sessionImage *image; ///< The image which the range is of
+    uint64_t start;            ///< Start of the range
+    uint64_t end;              ///< End of the range, exclusive
+    demandState state;         ///< Whether the range is complete yet
+    struct _demandRange *next;
+} demandRange;
+
+/**
+ * @brief Arguments for the worker thread
+ */
+typedef struct {
+    igdoSession *session;     ///< The session the worker belongs to
+    const sessionImage *image;///< The image the chunk is part of
+    jigdoData *jigdo;         ///< Pointer to the parsed jigdo data
+    templateFileEntry *chunk; ///< Pointer to the chunk this worker will work on
+    int outFd;                ///< Pointer to the output buffer
+    ssize_t fetchedBytes;     ///< Bytes fetched so far
+    char *uri;                ///< URI being fetched
+    outputStream *stream;     ///< Stream to which the chunk is written instead
+                              ///< of @c outFd, if the image is streamed
+    const int *copyFds;       ///< Copies of @c outFd, which get the chunk too
+    int numCopies;            ///< Number of elements in @c copyFds
+    placeMethod method;       ///< How a local copy was placed, if there was one
+    partSource source;        ///< Where the chunk came from
+    bool awaitClaim;          ///< Wait for another process's claim on the
+                              ///< chunk to be released
+    bool claimed;             ///< The chunk is claimed by this process
+    volatile bool abandon;    ///< Abandon the transfer in progress, once the
+                              ///< session is cancelled or a worker racing
+                              ///< this one has placed the chunk
+    bool hedge;               ///< The worker races another for its chunk,
+                              ///< fetching it from a different mirror
+    bool finished;            ///< Set once the worker's thread is done
+    uint64_t selected;        ///< When the chunk was handed to the worker, as
+                              ///< given by metricsNow()
+    uint64_t started;         ///< When the worker started on the chunk
+    int slot;                 ///< Index of the worker in the session, which
+                              ///< records its spans on track @c slot + 1 of
+                              ///< the trace
+
+    /* Races for a chunk, under tableLock; see sessionHedge() */
+    int hedgeOf;              ///< Index of the worker this one races, or -1
+    int hedgedBy;             ///< Index of the worker racing this one, or -1
+    bool hedgeWanted;         ///< A worker should be set to race this one
+    bool lost;                ///< The other worker placed the chunk first
+    bool failed;              ///< The worker gave up on the chunk, leaving it
+                              ///< to the other worker
+} workerArgs;
+
+/**
+ * @brief A weight given to the mirrors under a URI prefix
+ */
+typedef struct {
+    char *prefix;             ///< Start of the URIs on the mirrors
+    double weight;            ///< Weight relative to defaultMirrorWeight
+} mirrorWeight;
+
+/**
+ * @brief Kinds of events queued for sessionDispatch()
+ */
+typedef enum {
+    EVENT_STAGE = 0,
+    EVENT_PART,
+    EVENT_IMAGE,
+} eventType;
+
+/**
+ * @brief An event queued for sessionDispatch()
+ */
+typedef struct _sessionEvent {
+    eventType type;
+    union {
+        sessionStageEvent stage;
+        sessionPartEvent part;
+        sessionImageEvent image;
+    } u;
+    sessionProgress progress;  ///< What @c u.stage.progress points to
+    struct _sessionEvent *next;
+} sessionEvent;
+
+struct _igdoSession {
+    sessionImage *images;      ///< The images being reassembled
+    int numImages;             ///< Number of elements in @c images
+    sessionOptions opts;
+    sessionCallbacks callbacks;
+
+    pthread_t thread;          ///< Runs the session, once started
+    bool started;              ///< Set once @c thread has been created
+    volatile bool cancelled;   ///< Set by sessionCancel()
+    volatile bool paused;      ///< Set by sessionPause()
+    volatile int workerLimit;  ///< Only workers with a lower index are given
+                               ///< parts; see sessionSetWorkers()
+    bool success;              ///< Whether the images were reconstructed
+    bool done;                 ///< Set once SESSION_STAGE_DONE was dispatched
+
+    pthread_mutex_t tableLock; ///< Lock on DESC table management, and on
+                               ///< @c progress and the workers' URIs
+    struct { pthread_t tid; workerArgs args; } *workers;
+    int numSlots;              ///< Number of elements in @c workers: the
+                               ///< session's numWorkers, and as many more to
+                               ///< race them; see sessionHedge()
+    sessionProgress progress;
+    time_t *peerRetry;         ///< When each peer which couldn't be reached
+                               ///< may be tried again
+    mirrorWeight *weights;     ///< Set by sessionSetMirrorWeight(), under
+                               ///< @c tableLock
+    int numWeights;            ///< Number of elements in @c weights
+    fetchLimiter *limiter;     ///< Shared by all transfers of the session
+
+    pthread_mutex_t demandLock;
+    pthread_cond_t demandCond;
+    demandRange *demands;      ///< Pending ranges, oldest first
+    bool fetchFinished;        ///< Set once the session is done fetching
+
+    pthread_mutex_t eventLock; ///< Lock on @c events
+    sessionEvent *events;      ///< Events to dispatch, oldest first
+    sessionEvent **lastEvent;  ///< Where the next event is linked in
+    int eventPipe[2];          ///< Readable while @c events is not empty
+};
+
+/**
+ * @brief Queue @p event for sessionDispatch()
+ *
+ * An event which can't be allocated is dropped; the session carries on
+ * regardless.
+ */
+static void queueEvent(igdoSession *session, const sessionEvent *event)
+{
+    sessionEvent *copy = malloc(sizeof(*copy));
+    char byte = 0;
+
+    if (!copy) {
+        return;
+    }
+
+    *copy = *event;
+    copy->next = NULL;
+
+    pthread_mutex_lock(&session->eventLock);
+
+    /* The pipe holds a byte for as long as there are events to dispatch */
+    if (!session->events && write(session->eventPipe[1], &byte, 1) != 1) {
+        /* Nothing to be done; the pipe can only be full if it's readable */
+    }
+
+    *session->lastEvent = copy;
+    session->lastEvent = &copy->next;
+
+    pthread_mutex_unlock(&session->eventLock);
+}
+
+/**
+ * @brief Enter @p stage, and report it along with a snapshot of the progress
+ *        made before it
+ */
+static void enterStage(igdoSession *session, sessionStage stage,
+                       const sessionImage *image, bool success)
+{
+    sessionEvent event = { .type = EVENT_STAGE };
+
+    pthread_mutex_lock(&session->tableLock);
+    event.progress = session->progress;
+    session->progress.stage = stage;
+    pthread_mutex_unlock(&session->tableLock);
+
+    event.u.stage.stage = stage;
+    event.u.stage.image = image;
+    event.u.stage.success = success;
+
+    queueEvent(session, &event);
+}
+
+/**
+ * @brief Report how @p image, or one of its copies, was finished
+ *
+ * @param copy Index of the copy, or -1 for the image's own output
+ * @param md5 The checksum read back, or NULL if there is none
+ * @param error What went wrong, if anything
+ */
+static void reportImage(igdoSession *session, const sessionImage *image,
+                        int copy, imageResult result, const md5Checksum *md5,
+                        const char *error)
+{
+    sessionEvent event = { .type = EVENT_IMAGE };
+
+    event.u.image.image = image;
+    event.u.image.copy = copy;
+    event.u.image.result = result;
+    event.u.image.error = error;
+
+    if (md5) {
+        md5SumToString(*md5, event.u.image.md5);
+        md5SumToString(image->table->imageInfo.md5Sum, event.u.image.expected);
+    }
+
+    queueEvent(session, &event);
+}
+
+/**
+ * @brief Determine whether any parts still need to be fetched
+ *
+ * @return 0 if all parts are complete, positive if parts still need to be
+ *           fetched, and negative if an unrecoverable error occurred.
+ */
+static int partsRemain(igdoSession *session, partRef *parts, int count,
+                       int *beginComplete)
+{
+    int i;
+    int ret = 0;
+
+    if (pthread_mutex_lock(&session->tableLock) != 0) {
+        /* Something horrible has happened; break out of the loop */
+        return -1;
+    }
+
+    for (i = *beginComplete; i < count; i++) {
+        bool breakLoop = false;
+
+        switch(parts[i].file->status) {
+            case COMMIT_STATUS_FATAL_ERROR:
+                ret = -1;
+                breakLoop = true;
+            break;
+
+            case COMMIT_STATUS_COMPLETE:
+                *beginComplete = i;
+            break;
+
+            default:
+                ret = 1;
+                breakLoop = true;
+            break;
+        }
+
+        if (breakLoop) {
+            break;
+        }
+    }
+
+    if (pthread_mutex_unlock(&session->tableLock) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Count the completed files in @p parts into the session's progress
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool countCompletedFiles(igdoSession *session, partRef *parts,
+                                int count)
+{
+    int i, numCompleted;
+    uint64_t completedBytes = 0;
+
+    if (pthread_mutex_lock(&session->tableLock) != 0) {
+        return false;
+    }
+
+    for (i = numCompleted = 0; i < count; i++) {
+        if(parts[i].file->status == COMMIT_STATUS_COMPLETE) {
+            numCompleted++;
+            completedBytes += parts[i].file->size;
+        }
+    }
+
+    session->progress.completedFiles = numCompleted;
+    session->progress.completedBytes = completedBytes;
+
+    return pthread_mutex_unlock(&session->tableLock) == 0;
+}
+
+/**
+ * @brief Retrieve the commitStatus of @p chunk
+ */
+static commitStatus getStatus(igdoSession *session, templateFileEntry *chunk)
+{
+    commitStatus status;
+
+    if (pthread_mutex_lock(&session->tableLock) != 0) {
+        chunk->status = COMMIT_STATUS_FATAL_ERROR;
+        return COMMIT_STATUS_FATAL_ERROR;
+    }
+
+    status = chunk->status;
+
+    if (pthread_mutex_unlock(&session->tableLock) != 0) {
+        chunk->status = COMMIT_STATUS_FATAL_ERROR;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Determine whether @p chunk is eligible to be assigned to a worker
+ *
+ * @note The caller must take the tableLock mutex before calling in.
+ */
+static bool isWaitingFileNoMutex(templateFileEntry *chunk)
+{
+    /* Duplicates become eligible once the part they are copied from is done */
+    if (chunk->status == COMMIT_STATUS_DUPLICATE) {
+        return chunk->dupOf->status == COMMIT_STATUS_COMPLETE;
+    }
+
+    return (chunk->status == COMMIT_STATUS_NOT_STARTED ||
+            chunk->status == COMMIT_STATUS_ERROR ||
+            chunk->status == COMMIT_STATUS_LOCAL_COPY);
+}
+
+/**
+ * @brief Determine whether @p file overlaps the range of @p demand
+ */
+static bool demandOverlaps(const demandRange *demand,
+                           const templateFileEntry *file)
+{
+    return file->offset < demand->end &&
+           file->offset + file->size > demand->start;
+}
+
+/**
+ * @brief Work out whether all of the parts within @p demand are complete
+ *
+ * @param finished Whether parts may still be completed
+ *
+ * @note The caller must take the tableLock mutex before calling in, unless
+ *       @p finished is set.
+ */
+static demandState demandStateNoMutex(const demandRange *demand, bool finished)
+{
+    const templateDescTable *table = demand->image->table;
+    demandState ret = DEMAND_COMPLETE;
+    int i;
+
+    for (i = 0; i < table->numFiles; i++) {
+        const templateFileEntry *file = table->files + i;
+
+        if (!demandOverlaps(demand, file) ||
+            file->status == COMMIT_STATUS_COMPLETE) {
+            continue;
+        }
+
+        if (finished || file->status == COMMIT_STATUS_SKIPPED ||
+            file->status == COMMIT_STATUS_FATAL_ERROR) {
+            return DEMAND_FAILED;
+        }
+
+        ret = DEMAND_PENDING;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Find a waiting part which a sessionWaitRange() caller is waiting for
+ *
+ * A duplicate within a demanded range can't be copied until the part it is a
+ * duplicate of is complete, so that part is demanded along with it.
+ *
+ * @note The caller must take the demandLock and tableLock mutexes, in that
+ *       order, before calling in.
+ *
+ * @return The index of the part within @p parts, or @p count if there is none
+ */
+static int findDemandedNoMutex(const igdoSession *session, partRef *parts,
+                               int count)
+{
+    const demandRange *demand;
+    int i, j;
+
+    for (demand = session->demands; demand; demand = demand->next) {
+        if (demand->state != DEMAND_PENDING) {
+            continue;
+        }
+
+        for (i = 0; i < count; i++) {
+            templateFileEntry *file = parts[i].file;
+
+            if (parts[i].image != demand->image ||
+                !demandOverlaps(demand, file)) {
+                continue;
+            }
+
+            if (isWaitingFileNoMutex(file)) {
+                return i;
+            }
+
+            if (file->status == COMMIT_STATUS_DUPLICATE &&
+                isWaitingFileNoMutex(file->dupOf)) {
+                for (j = 0; j < count && parts[j].file != file->dupOf; j++);
+
+                if (j < count) {
+                    return j;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Check on the ranges which sessionWaitRange() callers are waiting for,
+ *        and wake them up once they are complete or never will be
+ *
+ * @param finished Whether parts may still be completed
+ */
+static void updateDemands(igdoSession *session, bool finished)
+{
+    demandRange *demand;
+    bool changed = false, locked;
+
+    pthread_mutex_lock(&session->demandLock);
+
+    if (!session->demands) {
+        session->fetchFinished = finished;
+        pthread_mutex_unlock(&session->demandLock);
+        return;
+    }
+
+    /* Once fetching has finished, statuses no longer change */
+    locked = !finished && pthread_mutex_lock(&session->tableLock) == 0;
+
+    for (demand = session->demands; demand; demand = demand->next) {
+        if (demand->state == DEMAND_PENDING) {
+            demand->state = demandStateNoMutex(demand, finished || !locked);
+            changed = changed || demand->state != DEMAND_PENDING;
+        }
+    }
+
+    if (locked) {
+        pthread_mutex_unlock(&session->tableLock);
+    }
+
+    session->fetchFinished = finished;
+
+    if (changed) {
+        pthread_cond_broadcast(&session->demandCond);
+    }
+
+    pthread_mutex_unlock(&session->demandLock);
+}
+
+bool sessionWaitRange(igdoSession *session, const sessionImage *image,
+                      uint64_t start, uint64_t end)
+{
+    demandRange demand = { .image = image, .start = start, .end = end };
+    demandRange **link;
+
+    pthread_mutex_lock(&session->demandLock);
+
+    if (session->fetchFinished) {
+        demand.state = demandStateNoMutex(&demand, true);
+        pthread_mutex_unlock(&session->demandLock);
+        return demand.state == DEMAND_COMPLETE;
+    }
+
+    for (link = &session->demands; *link; link = &(*link)->next);
+    *link = &demand;
+
+    while (demand.state == DEMAND_PENDING) {
+        pthread_cond_wait(&session->demandCond, &session->demandLock);
+    }
+
+    for (link = &session->demands; *link != &demand; link = &(*link)->next);
+    *link = demand.next;
+
+    pthread_mutex_unlock(&session->demandLock);
+
+    return demand.state == DEMAND_COMPLETE;
+}
+
+/**
+ * @brief Scan @p parts for the next unfetched chunk
+ *
+ * Parts which a sessionWaitRange() caller is waiting for are chosen ahead of
+ * all others. Parts claimed by other processes sharing the output file are
+ * only chosen once there is nothing else left, to wait for them.
+ *
+ * @param awaitClaim Set if the part was claimed by another process
+ */
+static partRef *selectChunk(igdoSession *session, partRef *parts, int count,
+                            bool *awaitClaim)
+{
+    int i;
+
+    if (pthread_mutex_lock(&session->demandLock) != 0) {
+        return NULL;
+    }
+
+    if (pthread_mutex_lock(&session->tableLock) != 0) {
+        pthread_mutex_unlock(&session->demandLock);
+        return NULL;
+    }
+
+    *awaitClaim = false;
+
+    i = findDemandedNoMutex(session, parts, count);
+    if (i < count) {
+        goto assign;
+    }
+
+    /* Searching for the next available file and assigning it should happen
+     * atomically, so don't release tableLock until assigned. */
+    for (i = 0; i < count; i++) {
+        outputStream *stream = parts[i].image->stream;
+
+        if (isWaitingFileNoMutex(parts[i].file)) {
+            /* Streamed parts are in order of offset: once a part is past the
+             * window, so are all of the parts after it. */
+            if (stream && !streamWithinWindow(stream, parts[i].file->offset)) {
+                i = count;
+                break;
+            }
+
+            goto assign;
+        }
+    }
+
+    if (i == count && session->opts.claims) {
+        for (i = 0; i < count; i++) {
+            if (parts[i].file->status == COMMIT_STATUS_CLAIMED) {
+                parts[i].file->status = COMMIT_STATUS_ASSIGNED;
+                *awaitClaim = true;
+                break;
+            }
+        }
+    }
+
+    goto done;
+
+assign:
+    if (parts[i].file->status == COMMIT_STATUS_ERROR) {
+        probePart(retry, parts[i].file->offset, parts[i].file->size, NULL);
+    }
+    parts[i].file->status = COMMIT_STATUS_ASSIGNED;
+
+done:
+    pthread_mutex_unlock(&session->demandLock);
+
+    if (pthread_mutex_unlock(&session->tableLock) != 0) {
+        return NULL;
+    }
+
+    if (i == count) {
+        return NULL; // Not an error; we've just reached the end.
+    }
+
+    return parts + i;
+}
+
+/**
+ * @brief Assign @p status to @p chunk
+ */
+static void setStatus(igdoSession *session, templateFileEntry *chunk,
+                      commitStatus status)
+{
+    if (pthread_mutex_lock(&session->tableLock) != 0) {
+        chunk->status = COMMIT_STATUS_FATAL_ERROR;
+        return;
+    }
+
+    chunk->status = status;
+
+    if (pthread_mutex_unlock(&session->tableLock) != 0) {
+        chunk->status = COMMIT_STATUS_FATAL_ERROR;
+    }
+}
+
+/**
+ * @brief Record a span of the work of @p a on its chunk in the trace, from
+ *        @p start until now
+ *
+ * @param uri The URI or path concerned, or NULL
+ * @param result How it turned out, or NULL
+ */
+static void tracePart(const workerArgs *a, const char *name, uint64_t start,
+                      const char *uri, const char *result)
+{
+    traceArgs args = {
+        .uri = uri,
+        .part = true,
+        .result = result,
+    };
+
+    if (!traceEnabled()) {
+        return;
+    }
+
+    args.image = a->image->name;
+    args.offset = a->chunk->offset;
+    args.size = a->chunk->size;
+
+    traceSpan("part", name, start, metricsNow(), &args);
+}
+
+/**
+ * @brief Account for a stage of the session, started at @p mark, which has
+ *        just finished, in the statistics and the trace
+ *
+ * @param image The image the stage was of, or NULL if it was of all of them
+ * @param work The kind of work making up the throughput of the stage; see
+ *             statsEnd()
+ */
+static void endStage(const sessionImage *image, const char *stage,
+                     const statsMark *mark, metricsWork work)
+{
+    traceArgs args = { .image = image ? image->name : NULL };
+
+    statsEnd(mark, stage, work);
+    traceSpan("session", stage, mark->start, metricsNow(), &args);
+}
+
+/**
+ * @brief Replace the URI which @p a reports to sessionGetTransfers()
+ */
+static void setURI(workerArgs *a, char *uri)
+{
+    char *old;
+
+    pthread_mutex_lock(&a->session->tableLock);
+    old = a->uri;
+    a->uri = uri;
+    pthread_mutex_unlock(&a->session->tableLock);
+
+    free(old);
+}
+
+/**
+ * @brief Verify the MD5 checksum of @p chunk at @buf
+ *
+ * @param uri Where the chunk came from, or NULL
+ */
+static bool verifyChunkMD5(const void *buf, const templateFileEntry *chunk,
+                           const char *uri)
+{
+    uint64_t start = metricsNow();
+    md5Checksum md5;
+    bool ret;
+
+    probePart(md5__start, chunk->offset, chunk->size, uri);
+    md5 = md5MemOneShot(buf, chunk->size);
+    ret = md5Cmp(&md5, &(chunk->md5Sum)) == 0;
+    probePartResult(md5__done, chunk->offset, chunk->size, uri, ret);
+
+    if (traceEnabled()) {
+        traceArgs args = {
+            .part = true,
+            .offset = chunk->offset,
+            .size = chunk->size,
+            .result = ret ? "ok" : "mismatch",
+        };
+
+        traceSpan("part", "md5", start, metricsNow(), &args);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Verify the MD5 checksum of @p chunk where it belongs within @p fd
+ *
+ * @return 1 if the checksum matches, 0 if it does not, or -1 on error
+ */
+static int verifyChunkInFile(int fd, const templateFileEntry *chunk)
+{
+    void *map;
+    int ret;
+
+    map = mmap(NULL, chunk->size + pagemod(chunk->offset), PROT_READ,
+               MAP_SHARED, fd, pagebase(chunk->offset));
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    ret = verifyChunkMD5(map + pagemod(chunk->offset), chunk, NULL);
+
+    if (munmap(map, chunk->size + pagemod(chunk->offset)) != 0) {
+        return -1;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Read the chunk from the start of @p inFd and queue it on the image's
+ *        output stream
+ *
+ * @return PLACE_METHOD_BUFFERED on success, or PLACE_METHOD_NONE on failure
+ */
+static placeMethod streamFromFd(workerArgs *a, int inFd)
+{
+    void *data = malloc(a->chunk->size ? a->chunk->size : 1);
+
+    if (!data) {
+        return PLACE_METHOD_NONE;
+    }
+
+    if (!outputReadRange(a->session->opts.output, inFd, 0, data,
+                         a->chunk->size)) {
+        free(data);
+        return PLACE_METHOD_NONE;
+    }
+
+    /* The stream owns the data from here on, whether or not this succeeds */
+    if (!streamCommit(a->stream, a->chunk->offset, data, a->chunk->size)) {
+        return PLACE_METHOD_NONE;
+    }
+
+    return PLACE_METHOD_BUFFERED;
+}
+
+/**
+ * @brief Place a verified local copy of the chunk into the output file
+ *
+ * @return @c true if the chunk was placed; @c false if no local copy exists or
+ *         it could not be placed, in which case the caller should fall back to
+ *         fetching the chunk.
+ */
+static bool placeLocalCopy(workerArgs *a)
+{
+    int inFd;
+
+    setURI(a, md5ToLocalPath(a->jigdo, a->chunk->md5Sum));
+    if (!a->uri) {
+        return false;
+    }
+
+    inFd = open(a->uri, O_RDONLY);
+    if (inFd < 0) {
+        return false;
+    }
+
+    setStatus(a->session, a->chunk, COMMIT_STATUS_IN_PROGRESS);
+    if (a->stream) {
+        a->method = streamFromFd(a, inFd);
+    } else {
+        a->method = placeFileRangeVia(inFd, 0, a->outFd, a->chunk->offset,
+                                      a->chunk->size, a->session->opts.output);
+    }
+    a->source = PART_SOURCE_LOCAL;
+    close(inFd);
+
+    return a->method != PLACE_METHOD_NONE;
+}
+
+/**
+ * @brief Place a copy of the chunk from the part cache into the output file
+ *
+ * Unlike local copies, which jigdoFindLocalFiles() already verified, cached
+ * copies are verified before placing them, and evicted if they are corrupt.
+ * Verifying the source rather than the output avoids reading back output
+ * which may be in the middle of being written with O_DIRECT around it.
+ *
+ * @return @c true if the chunk was placed and verified; @c false if it was not
+ *         cached or could not be placed, in which case the caller should fall
+ *         back to fetching the chunk.
+ */
+static bool placeCachedCopy(workerArgs *a)
+{
+    partCache *cache = a->session->opts.cache;
+    int inFd;
+    md5Checksum md5;
+
+    if (!cache) {
+        return false;
+    }
+
+    inFd = cacheLookup(cache, a->chunk->md5Sum, a->chunk->size);
+    if (inFd < 0) {
+        return false;
+    }
+
+    setStatus(a->session, a->chunk, COMMIT_STATUS_IN_PROGRESS);
+    a->source = PART_SOURCE_CACHE;
+
+    md5 = md5FdLength(inFd, a->chunk->size);
+    if (md5Cmp(&md5, &(a->chunk->md5Sum)) != 0) {
+        close(inFd);
+        cacheRemove(cache, a->chunk->md5Sum);
+        return false;
+    }
+
+    if (a->stream) {
+        a->method = streamFromFd(a, inFd);
+    } else {
+        a->method = placeFileRangeVia(inFd, 0, a->outFd, a->chunk->offset,
+                                      a->chunk->size, a->session->opts.output);
+    }
+    close(inFd);
+
+    return a->method != PLACE_METHOD_NONE;
+}
+
+/**
+ * @brief Place a copy of the chunk downloaded into the import directory
+ *
+ * Imported copies were downloaded by some other tool, so they are verified
+ * before placing them, like cached copies.
+ *
+ * @return @c true if the chunk was placed and verified; @c false if it was not
+ *         imported or could not be placed, in which case the caller should
+ *         fall back to fetching the chunk.
+ */
+static bool placeImportedCopy(workerArgs *a)
+{
+    const char *importDir = a->session->opts.importDir;
+    char md5String[MD5SUM_STRING_LENGTH], *path;
+    struct stat st;
+    md5Checksum md5;
+    int inFd;
+
+    if (!importDir) {
+        return false;
+    }
+
+    md5SumToString(a->chunk->md5Sum, md5String);
+    path = dircat(importDir, md5String);
+    if (!path) {
+        return false;
+    }
+
+    inFd = open(path, O_RDONLY);
+    free(path);
+    if (inFd < 0) {
+        return false;
+    }
+
+    if (fstat(inFd, &st) != 0 || st.st_size != a->chunk->size) {
+        close(inFd);
+        return false;
+    }
+
+    setStatus(a->session, a->chunk, COMMIT_STATUS_IN_PROGRESS);
+    a->source = PART_SOURCE_IMPORT;
+
+    md5 = md5FdLength(inFd, a->chunk->size);
+    if (md5Cmp(&md5, &(a->chunk->md5Sum)) != 0) {
+        close(inFd);
+        return false;
+    }
+
+    if (a->stream) {
+        a->method = streamFromFd(a, inFd);
+    } else {
+        a->method = placeFileRangeVia(inFd, 0, a->outFd, a->chunk->offset,
+                                      a->chunk->size, a->session->opts.output);
+    }
+    close(inFd);
+
+    return a->method != PLACE_METHOD_NONE;
+}
+
+/**
+ * @brief Copy the chunk from an identical, already completed part of this or
+ *        another image
+ *
+ * @return @c true if the chunk was copied; @c false if it has no completed
+ *         duplicate, or it could not be copied, in which case the caller should
+ *         fall back to fetching the chunk.
+ */
+static bool placeDuplicateCopy(workerArgs *a)
+{
+    igdoSession *session = a->session;
+    templateFileEntry *first = a->chunk->dupOf;
+    int i, inFd = -1;
+
+    if (!first || getStatus(session, first) != COMMIT_STATUS_COMPLETE) {
+        return false;
+    }
+
+    for (i = 0; i < session->numImages; i++) {
+        if (session->images[i].table == a->chunk->dupTable) {
+            inFd = session->images[i].fd;
+        }
+    }
+
+    if (inFd < 0) {
+        return false;
+    }
+
+    setStatus(session, a->chunk, COMMIT_STATUS_IN_PROGRESS);
+    a->method = placeFileRangeVia(inFd, first->offset, a->outFd,
+                                  a->chunk->offset, a->chunk->size,
+                                  session->opts.output);
+    a->source = PART_SOURCE_DUPLICATE;
+
+    return a->method != PLACE_METHOD_NONE;
+}
+
+/**
+ * @brief Copy the chunk, once it has been placed in the output file, to each
+ *        copy of the output file
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool placeCopies(workerArgs *a)
+{
+    int i;
+
+    for (i = 0; i < a->numCopies; i++) {
+        if (placeFileRangeVia(a->outFd, a->chunk->offset, a->copyFds[i],
+                              a->chunk->offset, a->chunk->size,
+                              a->session->opts.output) == PLACE_METHOD_NONE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Mark the chunk complete, once its range of the output file and its
+ *        copies has been handed to the output engine's durability policy
+ */
+static void completeChunk(workerArgs *a)
+{
+    outputEngine *output = a->session->opts.output;
+    uint64_t start = metricsNow();
+    int i;
+
+    /* Streamed chunks are written out of the engine's sight */
+    if (!a->stream && !outputRangeDone(output, a->outFd, a->chunk->offset,
+                                       a->chunk->size)) {
+        setStatus(a->session, a->chunk, COMMIT_STATUS_ERROR);
+        return;
+    }
+
+    for (i = 0; i < a->numCopies; i++) {
+        if (!outputRangeDone(output, a->copyFds[i], a->chunk->offset,
+                             a->chunk->size)) {
+            setStatus(a->session, a->chunk, COMMIT_STATUS_ERROR);
+            return;
+        }
+    }
+
+    tracePart(a, "sync", start, NULL, NULL);
+
+    setStatus(a->session, a->chunk, COMMIT_STATUS_COMPLETE);
+    metricsAddPart(a->chunk->size, metricsNow() - a->started);
+}
+
+/**
+ * @brief Fetch the chunk into memory, and queue it on the image's output stream
+ */
+static void fetchToStream(workerArgs *a)
+{
+    igdoSession *session = a->session;
+    void *data = malloc(a->chunk->size ? a->chunk->size : 1);
+    uint64_t start;
+    size_t fetched;
+
+    if (!data) {
+        setStatus(session, a->chunk, COMMIT_STATUS_FATAL_ERROR);
+        return;
+    }
+
+    setStatus(session, a->chunk, COMMIT_STATUS_IN_PROGRESS);
+    start = metricsNow();
+    probePart(transfer__start, a->chunk->offset, a->chunk->size, a->uri);
+    fetched = fetch(a->uri, data, a->chunk->size, &(a->fetchedBytes),
+                    &a->abandon, session->limiter);
+    probePartResult(transfer__done, a->chunk->offset, a->chunk->size, a->uri,
+                    fetched == a->chunk->size ? fetched : -1);
+    tracePart(a, "fetch", start, a->uri,
+              fetched == a->chunk->size ? "ok" : "failed");
+
+    if (fetched != a->chunk->size || !verifyChunkMD5(data, a->chunk, a->uri)) {
+        free(data);
+        setStatus(session, a->chunk, COMMIT_STATUS_ERROR);
+        return;
+    }
+
+    if (session->opts.cache) {
+        cachePublishMem(session->opts.cache, a->chunk->md5Sum, data,
+                        a->chunk->size);
+    }
+
+    /* Whatever went wrong with the stream can't be fixed by fetching again;
+     * either way, the stream owns the data from here on */
+    start = metricsNow();
+    if (!streamCommit(a->stream, a->chunk->offset, data, a->chunk->size)) {
+        setStatus(session, a->chunk, COMMIT_STATUS_FATAL_ERROR);
+        return;
+    }
+    probePart(output__write, a->chunk->offset, a->chunk->size, a->uri);
+    tracePart(a, "write", start, NULL, NULL);
+
+    completeChunk(a);
+}
+
+/**
+ * @brief Seconds between attempts to claim a chunk which another process has
+ *        claimed, once there is nothing else left to do
+ */
+#define claimPollInterval 1
+
+/**
+ * @brief Claim the chunk, if the output file is shared with other processes
+ *
+ * A chunk which another process has claimed is set aside, unless the worker
+ * is to wait for it, and one which another process has completed is marked
+ * complete here as well.
+ *
+ * @return @c true if the worker should go on to place the chunk; @c false if
+ *         it is done with it
+ */
+static bool claimChunk(workerArgs *a)
+{
+    igdoSession *session = a->session;
+    claimResult result;
+
+    a->claimed = false;
+
+    /* Empty chunks have nothing to write, and nothing to claim */
+    if (!session->opts.claims || a->chunk->size == 0) {
+        return true;
+    }
+
+    /* Poll rather than block, so that the wait can be cancelled */
+    while ((result = claimRange(session->opts.claims, a->chunk->offset,
+                                a->chunk->size, false)) == CLAIM_BUSY &&
+           a->awaitClaim && !session->cancelled) {
+        sleep(claimPollInterval);
+    }
+
+    switch (result) {
+        case CLAIM_ACQUIRED:
+            a->claimed = true;
+            return true;
+        case CLAIM_DONE:
+            a->source = PART_SOURCE_SHARED;
+            setStatus(session, a->chunk, COMMIT_STATUS_COMPLETE);
+            return false;
+        case CLAIM_BUSY:
+            setStatus(session, a->chunk, a->awaitClaim ? COMMIT_STATUS_ERROR :
+                                                         COMMIT_STATUS_CLAIMED);
+            return false;
+        default:
+            setStatus(session, a->chunk, COMMIT_STATUS_FATAL_ERROR);
+            return false;
+    }
+}
+
+/**
+ * @brief Seconds for which a peer which couldn't be reached is left alone
+ */
+#define peerRetryInterval 30
+
+/**
+ * @brief Fetch the chunk into @p data from the first of the session's peers
+ *        which has it, starting from a random one to spread the load
+ *
+ * @return @c true if the chunk was fetched and verified; @c false if it has to
+ *         be fetched from a mirror instead
+ */
+static bool fetchFromPeers(workerArgs *a, void *data)
+{
+    igdoSession *session = a->session;
+    const sessionOptions *opts = &session->opts;
+    char md5[MD5SUM_STRING_LENGTH];
+    int i, first;
+
+    if (opts->numPeers < 1) {
+        return false;
+    }
+
+    md5SumToString(a->chunk->md5Sum, md5);
+    first = rand() % opts->numPeers;
+
+    for (i = 0; i < opts->numPeers && !a->abandon; i++) {
+        int peer = (first + i) % opts->numPeers;
+        const char *base = opts->peers[peer];
+        size_t len = strlen(base), uriLen;
+        ssize_t fetched;
+        uint64_t start;
+        char *uri;
+        bool down;
+
+        pthread_mutex_lock(&session->tableLock);
+        down = session->peerRetry[peer] > time(NULL);
+        pthread_mutex_unlock(&session->tableLock);
+
+        if (down) {
+            continue;
+        }
+
+        /* Peers may be given with or without a trailing slash */
+        while (len > 0 && base[len - 1] == '/') {
+            len--;
+        }
+
+        uriLen = len + strlen("/md5/") + sizeof(md5);
+        uri = malloc(uriLen);
+        if (!uri) {
+            return false;
+        }
+        snprintf(uri, uriLen, "%.*s/md5/%s", (int) len, base, md5);
+        setURI(a, uri);
+
+        start = metricsNow();
+        probePart(transfer__start, a->chunk->offset, a->chunk->size, a->uri);
+        fetched = fetchFromPeer(a->uri, data, a->chunk->size,
+                                &(a->fetchedBytes), &a->abandon,
+                                session->limiter);
+        probePartResult(transfer__done, a->chunk->offset, a->chunk->size,
+                        a->uri, fetched == a->chunk->size ? fetched : -1);
+        tracePart(a, "fetch", start, a->uri,
+                  fetched == a->chunk->size ? "ok" :
+                  fetched == 0 ? "missing" : "failed");
+
+        if (fetched < 0 && !a->abandon) {
+            pthread_mutex_lock(&session->tableLock);
+            session->peerRetry[peer] = time(NULL) + peerRetryInterval;
+            pthread_mutex_unlock(&session->tableLock);
+        }
+
+        if (fetched == a->chunk->size &&
+            verifyChunkMD5(data, a->chunk, a->uri)) {
+            a->source = PART_SOURCE_PEER;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Get the worker racing @p a for its chunk, or the one it races
+ *
+ * @return The other worker, or NULL if @p a isn't in a race
+ */
+static workerArgs *raceOpponentNoMutex(workerArgs *a)
+{
+    int i = a->hedgeOf >= 0 ? a->hedgeOf : a->hedgedBy;
+
+    return i >= 0 ? &(a->session->workers[i].args) : NULL;
+}
+
+/**
+ * @brief Decide whether the worker is the first of those racing for its chunk
+ *        to have fetched it, and if so, call off the other one
+ *
+ * @return @c true if the worker should go on to place the chunk; @c false if
+ *         the other worker got there first
+ */
+static bool winRace(workerArgs *a)
+{
+    workerArgs *other;
+    bool won;
+
+    pthread_mutex_lock(&a->session->tableLock);
+
+    other = raceOpponentNoMutex(a);
+    won = !a->lost;
+
+    if (won && other) {
+        other->lost = true;
+        other->abandon = true;
+    }
+
+    pthread_mutex_unlock(&a->session->tableLock);
+
+    return won;
+}
+
+/**
+ * @brief Give up on the chunk with @p status, unless another worker racing
+ *        this one for it has placed it, or may still do so
+ */
+static void failChunk(workerArgs *a, commitStatus status)
+{
+    igdoSession *session = a->session;
+    workerArgs *other;
+    bool leave;
+
+    if (pthread_mutex_lock(&session->tableLock) != 0) {
+        a->chunk->status = COMMIT_STATUS_FATAL_ERROR;
+        return;
+    }
+
+    other = raceOpponentNoMutex(a);
+    leave = a->lost || (other && !other->failed);
+    a->failed = true;
+
+    if (!leave || status == COMMIT_STATUS_FATAL_ERROR) {
+        a->chunk->status = status;
+    }
+
+    if (pthread_mutex_unlock(&session->tableLock) != 0) {
+        a->chunk->status = COMMIT_STATUS_FATAL_ERROR;
+    }
+}
+
+/**
+ * @brief Get the weight of the mirror @p uri is on: that of the longest
+ *        prefix of it given to sessionSetMirrorWeight(), if any
+ */
+static double mirrorWeightNoMutex(const igdoSession *session, const char *uri)
+{
+    double weight = defaultMirrorWeight;
+    size_t longest = 0;
+    int i;
+
+    for (i = 0; i < session->numWeights; i++) {
+        size_t len = strlen(session->weights[i].prefix);
+
+        if (len >= longest &&
+            strncmp(uri, session->weights[i].prefix, len) == 0) {
+            weight = session->weights[i].weight;
+            longest = len;
+        }
+    }
+
+    return weight;
+}
+
+/**
+ * @brief Choose a mirror to fetch the chunk from, at random, in proportion to
+ *        the weights given to sessionSetMirrorWeight()
+ *
+ * @param exclude A URI not to choose, or NULL
+ * @param held Set if the chunk is only on mirrors which were disabled, or
+ *             at @p exclude
+ *
+ * @return A newly heap-allocated URI, or NULL if there is none, or on failure
+ */
+static char *chooseURI(workerArgs *a, const char *exclude, bool *held)
+{
+    igdoSession *session = a->session;
+    char **uris, *uri = NULL;
+    double *weights, total = 0, pick;
+    int i, count, chosen = -1;
+    bool weighted;
+
+    *held = false;
+
+    pthread_mutex_lock(&session->tableLock);
+    weighted = session->numWeights > 0;
+    pthread_mutex_unlock(&session->tableLock);
+
+    /* Without any weights, every mirror is alike */
+    if (!weighted && !exclude) {
+        return md5ToURI(a->jigdo, a->chunk->md5Sum);
+    }
+
+    uris = md5ToURIs(a->jigdo, a->chunk->md5Sum, &count);
+    if (!uris) {
+        return NULL;
+    }
+
+    weights = malloc(sizeof(weights[0]) * count);
+    if (!weights) {
+        goto done;
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+
+    for (i = 0; i < count; i++) {
+        if (exclude && strcmp(uris[i], exclude) == 0) {
+            weights[i] = 0;
+        } else {
+            weights[i] = mirrorWeightNoMutex(session, uris[i]);
+        }
+        total += weights[i];
+    }
+
+    pthread_mutex_unlock(&session->tableLock);
+
+    if (total <= 0) {
+        *held = true;
+        goto done;
+    }
+
+    pick = total * (rand() / ((double) RAND_MAX + 1));
+
+    for (i = 0; i < count; i++) {
+        if (weights[i] <= 0) {
+            continue;
+        }
+
+        /* Rounding may leave the pick just past the last mirror */
+        chosen = i;
+        if (pick < weights[i]) {
+            break;
+        }
+        pick -= weights[i];
+    }
+
+    uri = uris[chosen];
+    uris[chosen] = NULL;
+
+done:
+    for (i = 0; i < count; i++) {
+        free(uris[i]);
+    }
+    free(uris);
+    free(weights);
+
+    return uri;
+}
+
+/**
+ * @brief Seconds between checks for a mirror to fetch the chunk from, while
+ *        all of those holding it are disabled
+ */
+#define mirrorPollInterval 1
+
+/**
+ * @brief Fetch the chunk into @p data from a mirror, and verify it
+ *
+ * A worker racing another for the chunk fetches it from a different mirror,
+ * if there is one.
+ *
+ * @return @c true if the chunk was fetched and verified; @c false if not, in
+ *         which case it has been given up on with failChunk()
+ */
+static bool fetchFromMirror(workerArgs *a, void *data)
+{
+    igdoSession *session = a->session;
+    char *uri, *exclude = NULL;
+    uint64_t start;
+    size_t fetched;
+    bool held;
+
+    if (a->hedge) {
+        workerArgs *other;
+
+        pthread_mutex_lock(&session->tableLock);
+        other = raceOpponentNoMutex(a);
+        if (other && other->uri) {
+            exclude = strdup(other->uri);
+        }
+        pthread_mutex_unlock(&session->tableLock);
+    }
+
+    /* Wait for a disabled mirror to be enabled again, unless racing */
+    while (!(uri = chooseURI(a, exclude, &held)) && held && !a->hedge &&
+           !a->abandon) {
+        sleep(mirrorPollInterval);
+    }
+    free(exclude);
+
+    if (!uri) {
+        failChunk(a, held || a->abandon ? COMMIT_STATUS_ERROR :
+                                          COMMIT_STATUS_FATAL_ERROR);
+        return false;
+    }
+
+    setURI(a, uri);
+    probePart(mirror__selected, a->chunk->offset, a->chunk->size, a->uri);
+
+    start = metricsNow();
+    probePart(transfer__start, a->chunk->offset, a->chunk->size, a->uri);
+    fetched = fetch(a->uri, data, a->chunk->size, &(a->fetchedBytes),
+                    &a->abandon, session->limiter);
+    probePartResult(transfer__done, a->chunk->offset, a->chunk->size, a->uri,
+                    fetched == a->chunk->size ? fetched : -1);
+    tracePart(a, "fetch", start, a->uri,
+              fetched == a->chunk->size ? "ok" :
+              a->abandon ? "abandoned" : "failed");
+
+    if (fetched != a->chunk->size || !verifyChunkMD5(data, a->chunk, a->uri)) {
+        failChunk(a, COMMIT_STATUS_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Fetch the chunk from a peer or a mirror, and place it
+ *
+ * A worker racing another for the chunk fetches it into a buffer of its own,
+ * since the other worker's buffer may be mapped onto the output file.
+ */
+static void fetchToFile(workerArgs *a)
+{
+    igdoSession *session = a->session;
+    partCache *cache = session->opts.cache;
+    outputEngine *output = session->opts.output;
+    bool direct = outputIsDirect(output, a->outFd);
+    outputBuffer *out = NULL;
+    uint64_t start;
+    void *data;
+
+    if (a->hedge) {
+        data = malloc(a->chunk->size ? a->chunk->size : 1);
+        if (!data) {
+            failChunk(a, COMMIT_STATUS_ERROR);
+            return;
+        }
+    } else {
+        out = outputAcquire(output, a->outFd, a->chunk->offset,
+                            a->chunk->size);
+        if (!out) {
+            setStatus(session, a->chunk, COMMIT_STATUS_FATAL_ERROR);
+            return;
+        }
+        data = outputData(out);
+
+        setStatus(session, a->chunk, COMMIT_STATUS_IN_PROGRESS);
+    }
+
+    /* Verify before committing, so that a corrupt download never reaches the
+     * output file with engines which buffer the data; and only then decide
+     * the race, if there is one. */
+    if ((!a->hedge && fetchFromPeers(a, data)) || fetchFromMirror(a, data)) {
+        if (!winRace(a)) {
+            goto discard;
+        }
+    } else {
+        goto discard;
+    }
+
+    /* Failing to cache the chunk is not worth failing the chunk over.
+     * Output opened with O_DIRECT can't be cloned from, so cache the buffer
+     * itself while it is still around. */
+    if (cache && direct) {
+        cachePublishMem(cache, a->chunk->md5Sum, data, a->chunk->size);
+    }
+
+    start = metricsNow();
+    if (a->hedge ? !outputWrite(output, a->outFd, a->chunk->offset, data,
+                                a->chunk->size) :
+                   !outputCommit(output, out)) {
+        setStatus(session, a->chunk, COMMIT_STATUS_ERROR);
+        out = NULL;
+        goto discard;
+    }
+    out = NULL;
+
+    /* Only copy the chunk now that its buffer has been released: writing the
+     * copies from the buffer would take more of the in-flight cap while
+     * holding part of it, which deadlocks once every worker does so. */
+    if (!placeCopies(a)) {
+        setStatus(session, a->chunk, COMMIT_STATUS_ERROR);
+        goto discard;
+    }
+
+    probePart(output__write, a->chunk->offset, a->chunk->size, a->uri);
+    tracePart(a, "write", start, NULL, NULL);
+
+    if (cache && !direct) {
+        cachePublishFd(cache, a->chunk->md5Sum, a->outFd, a->chunk->offset,
+                       a->chunk->size);
+    }
+
+    completeChunk(a);
+
+discard:
+    if (a->hedge) {
+        free(data);
+    } else if (out) {
+        outputDiscard(output, out);
+    }
+}
+
+/**
+ * @brief Worker thread to wrap around fetch()
+ */
+static void *fetch_worker(void *args)
+{
+    workerArgs *a = (workerArgs *) args;
+    igdoSession *session = a->session;
+    uint64_t start;
+    bool claimed;
+
+    a->method = PLACE_METHOD_NONE;
+    a->source = PART_SOURCE_MIRROR;
+    a->started = metricsNow();
+
+    traceSetTrack(a->slot + 1);
+    tracePart(a, "start", a->selected, NULL, NULL);
+
+    /* The worker being raced has done everything but fetching the chunk */
+    if (a->hedge) {
+        fetchToFile(a);
+        goto done;
+    }
+
+    start = metricsNow();
+    claimed = claimChunk(a);
+    if (session->opts.claims) {
+        tracePart(a, "claim", start, NULL, NULL);
+    }
+
+    if (!claimed) {
+        goto done;
+    }
+    probePart(part__claimed, a->chunk->offset, a->chunk->size, NULL);
+
+    start = metricsNow();
+    if (placeDuplicateCopy(a) || placeLocalCopy(a) || placeImportedCopy(a) ||
+        placeCachedCopy(a)) {
+        tracePart(a, "copy", start, a->uri, placeMethodName(a->method));
+        a->fetchedBytes = a->chunk->size;
+
+        if (placeCopies(a)) {
+            probePart(output__write, a->chunk->offset, a->chunk->size,
+                      a->uri);
+            completeChunk(a);
+        } else {
+            setStatus(session, a->chunk, COMMIT_STATUS_ERROR);
+        }
+        goto done;
+    }
+
+    a->method = PLACE_METHOD_NONE;
+    a->source = PART_SOURCE_MIRROR;
+
+    /* Streams are fetched from the mirrors alone */
+    if (a->stream) {
+        setURI(a, md5ToURI(a->jigdo, a->chunk->md5Sum));
+        if (a->uri) {
+            probePart(mirror__selected, a->chunk->offset, a->chunk->size,
+                      a->uri);
+            fetchToStream(a);
+        } else {
+            setStatus(session, a->chunk, COMMIT_STATUS_FATAL_ERROR);
+        }
+    } else {
+        fetchToFile(a);
+    }
+
+done:
+    setURI(a, NULL);
+    if (traceEnabled()) {
+        tracePart(a, "part", a->selected, NULL, a->lost ? "lost" :
+                  commitStatusName(getStatus(session, a->chunk)));
+    }
+
+    /* Once released, the chunk is up for grabs again unless it is complete */
+    if (a->claimed &&
+        !claimRelease(session->opts.claims, a->chunk->offset, a->chunk->size,
+                      getStatus(session, a->chunk) ==
+                      COMMIT_STATUS_COMPLETE)) {
+        setStatus(session, a->chunk, COMMIT_STATUS_FATAL_ERROR);
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+    a->finished = true;
+    pthread_mutex_unlock(&session->tableLock);
+
+    return NULL;
+}
+
+/**
+ * @brief Count the parts which will have to be fetched from a mirror
+ *
+ * @param bytes The total size of those parts is stored here
+ */
+static int countFetchNeeded(const partRef *parts, int numParts,
+                            uint64_t *bytes)
+{
+    int i, count = 0;
+
+    *bytes = 0;
+
+    for (i = 0; i < numParts; i++) {
+        if (parts[i].file->status == COMMIT_STATUS_NOT_STARTED ||
+            parts[i].file->status == COMMIT_STATUS_ERROR) {
+            *bytes += parts[i].file->size;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * @brief Sum up the total size of all file parts combined
+ */
+static uint64_t fileSizeTotal(const partRef *parts, int numParts)
+{
+    int i;
+    uint64_t ret = 0;
+
+    for (i = 0; i < numParts; i++) {
+        ret += parts[i].file->size;
+    }
+
+    return ret;
+}
+
+/*
+ * @brief Scan a partially downloaded file and mark valid files as complete
+ *
+ * @param image The image whose output file will be scanned
+ *
+ * @return Number of verified files, or -1 on error
+ */
+static int verifyPartial(igdoSession *session, sessionImage *image)
+{
+    int i, complete = 0, fd = image->fd;
+    templateDescTable *table = image->table;
+
+    if (!table->existingFile) {
+        return 0;
+    }
+
+    enterStage(session, SESSION_STAGE_VERIFY_PARTIAL, image, false);
+
+    pthread_mutex_lock(&session->tableLock);
+    session->progress.checkedFiles = 0;
+    session->progress.checkedOK = 0;
+    session->progress.checkFiles = table->numFiles;
+    pthread_mutex_unlock(&session->tableLock);
+
+    for (i = 0; i < table->numFiles && !session->cancelled; i++) {
+        int verified;
+
+        if (table->files[i].status == COMMIT_STATUS_SKIPPED) {
+            continue;
+        }
+
+        verified = verifyChunkInFile(fd, table->files + i);
+        if (verified < 0) {
+            return -1;
+        }
+
+        pthread_mutex_lock(&session->tableLock);
+        if (verified) {
+            table->files[i].status = COMMIT_STATUS_COMPLETE;
+            complete++;
+        }
+        session->progress.checkedFiles = i + 1;
+        session->progress.checkedOK = complete;
+        pthread_mutex_unlock(&session->tableLock);
+    }
+
+    return complete;
+}
+
+/**
+ * @brief Wait for worker @p i to exit and report how its chunk was handled
+ *
+ * @return @c true on success; @c false if the thread could not be joined
+ */
+static bool joinWorker(igdoSession *session, int i)
+{
+    workerArgs *a = &(session->workers[i].args);
+    sessionEvent event = { .type = EVENT_PART };
+
+    workerArgs *other;
+    bool placed;
+
+    if (pthread_join(session->workers[i].tid, NULL) != 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+
+    /* Only the winner of a race placed the chunk */
+    placed = a->chunk->status == COMMIT_STATUS_COMPLETE && !a->lost;
+    if (placed) {
+        session->progress.placeCounts[a->source][a->method]++;
+    }
+
+    /* Whichever worker is left of a race is on its own now */
+    if ((other = raceOpponentNoMutex(a))) {
+        other->hedgeOf = other->hedgedBy = -1;
+    }
+    a->hedgeOf = a->hedgedBy = -1;
+    a->hedgeWanted = false;
+
+    pthread_mutex_unlock(&session->tableLock);
+
+    if (!placed) {
+        return true;
+    }
+
+    event.u.part.image = a->image;
+    event.u.part.offset = a->chunk->offset;
+    event.u.part.size = a->chunk->size;
+    event.u.part.source = a->source;
+    event.u.part.method = a->method;
+
+    queueEvent(session, &event);
+
+    return true;
+}
+
+/**
+ * @brief Reset the state of worker @p a, before giving it a chunk
+ */
+static void resetWorkerNoMutex(workerArgs *a)
+{
+    a->abandon = false;
+    a->hedge = false;
+    a->finished = false;
+    a->hedgeOf = a->hedgedBy = -1;
+    a->hedgeWanted = false;
+    a->lost = false;
+    a->failed = false;
+}
+
+/**
+ * @brief Start idle worker @p i racing the worker it is paired with, if
+ *        sessionHedge() asked for it to be raced
+ *
+ * @return @c true on success, or if there is no race to start; @c false if
+ *         the worker couldn't be started
+ */
+static bool startRace(igdoSession *session, int i)
+{
+    workerArgs *a = &(session->workers[i].args);
+    int j = i - session->opts.numWorkers;
+    workerArgs *other = &(session->workers[j].args);
+
+    pthread_mutex_lock(&session->tableLock);
+
+    /* The chunk may have been finished since */
+    if (!other->hedgeWanted || !other->chunk || other->finished ||
+        other->chunk->status != COMMIT_STATUS_IN_PROGRESS) {
+        other->hedgeWanted = false;
+        pthread_mutex_unlock(&session->tableLock);
+        return true;
+    }
+
+    resetWorkerNoMutex(a);
+    a->selected = metricsNow();
+    a->hedge = true;
+    a->hedgeOf = j;
+    other->hedgedBy = i;
+    other->hedgeWanted = false;
+
+    a->chunk = other->chunk;
+    a->image = other->image;
+    a->jigdo = other->jigdo;
+    a->outFd = other->outFd;
+    a->stream = other->stream;
+    a->copyFds = other->copyFds;
+    a->numCopies = other->numCopies;
+    a->claimed = false;
+
+    pthread_mutex_unlock(&session->tableLock);
+
+    if (session->cancelled) {
+        a->abandon = true;
+    }
+
+    if (pthread_create(&(session->workers[i].tid), NULL, fetch_worker,
+                       a) != 0) {
+        pthread_mutex_lock(&session->tableLock);
+        other->hedgedBy = -1;
+        a->hedgeOf = -1;
+        a->chunk = NULL;
+        pthread_mutex_unlock(&session->tableLock);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Add every part of the verified image in @p fd to the part cache
+ */
+static void harvestParts(igdoSession *session, int fd,
+                         const templateDescTable *table)
+{
+    partCache *cache = session->opts.cache;
+    outputEngine *output = session->opts.output;
+    int i, harvested = 0;
+
+    for (i = 0; i < table->numFiles; i++) {
+        const templateFileEntry *file = table->files + i;
+        void *data;
+
+        if (!outputIsDirect(output, fd)) {
+            harvested += cachePublishFd(cache, file->md5Sum, fd, file->offset,
+                                        file->size);
+            continue;
+        }
+
+        /* Read output opened with O_DIRECT into memory; it can't be cloned */
+        data = malloc(file->size ? file->size : 1);
+        if (data && outputReadRange(output, fd, file->offset, data,
+                                    file->size)) {
+            harvested += cachePublishMem(cache, file->md5Sum, data,
+                                         file->size);
+        }
+        free(data);
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+    session->progress.harvestFiles += table->numFiles;
+    session->progress.harvestedFiles += harvested;
+    pthread_mutex_unlock(&session->tableLock);
+}
+
+/**
+ * @brief Comparator function to sort the parts of a single image by offset
+ */
+static int partOffsetCmp(const void *a, const void *b)
+{
+    const partRef *partA = a, *partB = b;
+
+    if (partA->file->offset != partB->file->offset) {
+        return partA->file->offset < partB->file->offset ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Comparator function to sort parts in reverse size order
+ */
+static int partRevSizeCmp(const void *a, const void *b)
+{
+    const partRef *partA = a, *partB = b;
+
+    if (partA->file->size != partB->file->size) {
+        return partA->file->size < partB->file->size ? 1 : -1;
+    }
+
+    /* Keep qsort(3) from shuffling equally sized parts arbitrarily */
+    if (partA->image != partB->image) {
+        return partA->image < partB->image ? -1 : 1;
+    }
+
+    return partA->file < partB->file ? -1 : partA->file > partB->file;
+}
+
+/**
+ * @brief Gather the parts of all of @p images into one list for scheduling
+ *
+ * @return A newly allocated list of parts, or NULL on error
+ */
+static partRef *gatherParts(sessionImage *images, int numImages, int *numParts)
+{
+    partRef *parts;
+    int i, j;
+
+    for (*numParts = i = 0; i < numImages; i++) {
+        *numParts += images[i].table->numFiles;
+    }
+
+    parts = malloc(sizeof(parts[0]) * (*numParts ? *numParts : 1));
+    if (!parts) {
+        return NULL;
+    }
+
+    for (*numParts = i = 0; i < numImages; i++) {
+        for (j = 0; j < images[i].table->numFiles; j++) {
+            /* Parts outside the range being reconstructed are left alone */
+            if (images[i].table->files[j].status == COMMIT_STATUS_SKIPPED) {
+                continue;
+            }
+
+            parts[*numParts].file = images[i].table->files + j;
+            parts[*numParts].image = images + i;
+            (*numParts)++;
+        }
+    }
+
+    /* Download the largest files first, to maximize the parallelism, unless
+     * the image is streamed: then the parts are needed in order, and the ones
+     * the stream is waiting for should be fetched first. */
+    if (images[0].stream) {
+        qsort(parts, *numParts, sizeof(parts[0]), partOffsetCmp);
+    } else {
+        qsort(parts, *numParts, sizeof(parts[0]), partRevSizeCmp);
+    }
+
+    return parts;
+}
+
+/**
+ * @brief Flush @p fd, an output file of @p image, and read back its checksum
+ *
+ * @param md5 Where the checksum is stored, or NULL to only flush the file
+ * @param error Where a description of a failure is stored
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool checksumFile(igdoSession *session, sessionImage *image, int fd,
+                         md5Checksum *md5, const char **error)
+{
+    outputEngine *output = session->opts.output;
+    uint64_t imageSize = jigdoGetImageSize(image->table);
+    struct stat st;
+
+    /* A pre-existing output file may have been larger than the image, and
+     * O_DIRECT writes of whole blocks may have extended it past the end. */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > imageSize && ftruncate(fd, imageSize) != 0) {
+        *error = "Failed to truncate the output file";
+        return false;
+    }
+
+    /* Unless the durability policy says otherwise, parts are not synced as
+     * they are written; make sure the whole image is on disk before declaring
+     * success. */
+    if (!outputSync(output, fd)) {
+        *error = "Failed to flush the output file to disk";
+        return false;
+    }
+
+    /* The checksum is read through the page cache; make sure it reflects
+     * what was written to disk with O_DIRECT, not any pages cached earlier,
+     * e.g. while verifying partial output. */
+    if (outputIsDirect(output, fd)) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    if (md5) {
+        *md5 = md5FdLength(fd, imageSize);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Flush each copy of @p image, and if requested, read it back to check
+ *        that it matches the image
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool finishCopies(igdoSession *session, sessionImage *image)
+{
+    /* A partial image has no checksum to compare against */
+    bool verify = session->opts.verifyCopies &&
+                  !jigdoGetRange(image->table, NULL, NULL);
+    const char *error = NULL;
+    int i;
+
+    for (i = 0; i < image->numCopies; i++) {
+        md5Checksum md5;
+
+        if (!checksumFile(session, image, image->copyFds[i],
+                          verify ? &md5 : NULL, &error)) {
+            reportImage(session, image, i, IMAGE_RESULT_FAILED, NULL, error);
+            return false;
+        }
+
+        if (!verify) {
+            reportImage(session, image, i, IMAGE_RESULT_FLUSHED, NULL, NULL);
+        } else if (md5Cmp(&md5, &(image->table->imageInfo.md5Sum)) != 0) {
+            reportImage(session, image, i, IMAGE_RESULT_MISMATCH, &md5, NULL);
+            return false;
+        } else {
+            reportImage(session, image, i, IMAGE_RESULT_VERIFIED, &md5, NULL);
+        }
+
+        if (outputGetDurability(session->opts.output)->dropCache) {
+            posix_fadvise(image->copyFds[i], 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Get the checksum of a streamed image, which the stream kept a running
+ *        checksum of as it was written
+ *
+ * @return @c true on success; @c false if not all of the image was written
+ */
+static bool checksumStream(igdoSession *session, sessionImage *image,
+                           md5Checksum *md5, const char **error)
+{
+    struct stat st;
+
+    if (!streamFinish(image->stream, md5)) {
+        *error = "Failed to write all of the image";
+        return false;
+    }
+
+    /* Pipes have nothing to flush, but sequential-only files and devices do */
+    if (fstat(image->fd, &st) == 0 &&
+        (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) &&
+        !outputSync(session->opts.output, image->fd)) {
+        *error = "Failed to flush the output file to disk";
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Flush a partially reconstructed @p image
+ *
+ * The MD5 checksum of the image covers all of it, so there is nothing to
+ * check the range against; each of its parts was checked as it was placed.
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool finishPartial(igdoSession *session, sessionImage *image)
+{
+    const char *error = NULL;
+
+    if (!checksumFile(session, image, image->fd, NULL, &error)) {
+        reportImage(session, image, -1, IMAGE_RESULT_FAILED, NULL, error);
+        return false;
+    }
+
+    reportImage(session, image, -1, IMAGE_RESULT_FLUSHED, NULL, NULL);
+
+    return finishCopies(session, image);
+}
+
+/**
+ * @brief Perform the final MD5 verification check of @p image
+ *
+ * @return @c true if the checksum matches; @c false otherwise
+ */
+static bool verifyImage(igdoSession *session, sessionImage *image)
+{
+    const sessionOptions *opts = &session->opts;
+    const char *error = NULL;
+    md5Checksum fileChecksum;
+    statsMark mark;
+    bool ret;
+
+    statsBegin(&mark);
+
+    if (jigdoGetRange(image->table, NULL, NULL)) {
+        return finishPartial(session, image);
+    }
+
+    if (image->stream) {
+        ret = checksumStream(session, image, &fileChecksum, &error);
+    } else {
+        ret = checksumFile(session, image, image->fd, &fileChecksum, &error);
+    }
+    endStage(image, "final md5", &mark, METRICS_WORK_HASH);
+
+    if (!ret) {
+        reportImage(session, image, -1, IMAGE_RESULT_FAILED, NULL, error);
+        return false;
+    }
+
+    ret = md5Cmp(&fileChecksum, &(image->table->imageInfo.md5Sum)) == 0;
+
+    reportImage(session, image, -1,
+                ret ? IMAGE_RESULT_VERIFIED : IMAGE_RESULT_MISMATCH,
+                &fileChecksum, NULL);
+
+    if (ret) {
+        /* The copies were written alongside the image; only their flushing
+         * and, if requested, reading back is left. */
+        ret = finishCopies(session, image);
+
+        /* A stream can't be read back; its fetched parts were cached as they
+         * went by instead. */
+        if (ret && opts->cache && opts->cacheHarvest && !image->stream) {
+            harvestParts(session, image->fd, image->table);
+        }
+    }
+
+    /* Reading the checksum brought the whole image back into the page cache */
+    if (outputGetDurability(opts->output)->dropCache && !image->stream) {
+        posix_fadvise(image->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Reassemble the images of @p session: the body of its thread
+ */
+static bool runSession(igdoSession *session)
+{
+    sessionImage *images = session->images;
+    int numImages = session->numImages;
+    bool ret = false;
+    int i, contiguousComplete, numParts = 0;
+    int duplicateFiles, localFiles = 0;
+    partRef *parts = NULL;
+    templateDescTable **tables = NULL;
+    statsMark mark;
+
+    /* Verify what is already there first, so that files which are already
+     * complete can serve as the source for their duplicates, and don't need to
+     * be searched for locally. */
+    for (i = 0; i < numImages; i++) {
+        statsBegin(&mark);
+        if (verifyPartial(session, images + i) < 0) {
+            goto done;
+        }
+        endStage(images + i, "verify partial", &mark, METRICS_WORK_HASH);
+    }
+
+    enterStage(session, SESSION_STAGE_PLAN, NULL, false);
+
+    tables = malloc(sizeof(tables[0]) * numImages);
+    if (!tables) {
+        goto done;
+    }
+
+    for (i = 0; i < numImages; i++) {
+        tables[i] = images[i].table;
+    }
+
+    /* Duplicates are copied from where the first copy was written, and a
+     * stream can't be read back; fetch every copy instead. */
+    statsBegin(&mark);
+    if (images[0].stream) {
+        duplicateFiles = 0;
+    } else {
+        duplicateFiles = jigdoFindDuplicateFiles(tables, numImages);
+    }
+    endStage(NULL, "find duplicates", &mark, METRICS_WORK_COUNT);
+
+    if (duplicateFiles < 0) {
+        goto done;
+    }
+
+    for (i = 0; i < numImages; i++) {
+        int found;
+
+        statsBegin(&mark);
+        found = jigdoFindLocalFiles(images[i].fd, images[i].table,
+                                    images[i].jigdo);
+        endStage(images + i, "local scan", &mark, METRICS_WORK_HASH);
+
+        if (found > 0) {
+            localFiles += found;
+        }
+    }
+
+    parts = gatherParts(images, numImages, &numParts);
+    if (!parts) {
+        goto done;
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+    session->progress.duplicateFiles = duplicateFiles;
+    session->progress.localFiles = localFiles;
+    session->progress.numFiles = numParts;
+    session->progress.numBytes = fileSizeTotal(parts, numParts);
+    session->progress.fetchFiles =
+        countFetchNeeded(parts, numParts, &session->progress.fetchBytes);
+    pthread_mutex_unlock(&session->tableLock);
+
+    if (!countCompletedFiles(session, parts, numParts)) {
+        goto done;
+    }
+
+    enterStage(session, SESSION_STAGE_FETCH, NULL, false);
+
+    statsBegin(&mark);
+    contiguousComplete = 0;
+
+    /* XXX this will hang if more files error out than there are threads, and
+     * do not succeed upon retry. Should implement max retries limit, perhaps
+     * after exhaustively searching all mirror possibilities. */
+    while (!session->cancelled &&
+           partsRemain(session, parts, numParts, &contiguousComplete) > 0) {
+        bool exhausted = false;
+
+        updateDemands(session, false);
+
+        for (i = 0; i < session->numSlots; i++) {
+            workerArgs *a = &(session->workers[i].args);
+            commitStatus status = COMMIT_STATUS_NOT_STARTED;
+            partRef *part;
+
+            if (!countCompletedFiles(session, parts, numParts)) {
+                goto done;
+            }
+
+            if (a->chunk) {
+                pthread_mutex_lock(&session->tableLock);
+                status = a->finished ? a->chunk->status :
+                                       COMMIT_STATUS_IN_PROGRESS;
+                pthread_mutex_unlock(&session->tableLock);
+            }
+
+            /* Workers are reaped once done, which for the loser of a race is
+             * only once its transfer has been abandoned */
+            if (a->chunk == NULL ||
+                status == COMMIT_STATUS_COMPLETE ||
+                status == COMMIT_STATUS_ERROR ||
+                status == COMMIT_STATUS_CLAIMED) {
+
+                if (a->chunk) {
+                    if (!joinWorker(session, i)) {
+                        goto done;
+                    }
+                    a->chunk = NULL;
+                }
+
+                if (session->cancelled) {
+                    break;
+                }
+
+                if (session->paused) {
+                    continue;
+                }
+
+                /* The workers past numWorkers are only for races */
+                if (i >= session->opts.numWorkers) {
+                    if (!startRace(session, i)) {
+                        goto done;
+                    }
+                    continue;
+                }
+
+                /* Idle workers above the limit stay idle */
+                if (i >= session->workerLimit || exhausted) {
+                    continue;
+                }
+
+                part = selectChunk(session, parts, numParts, &a->awaitClaim);
+
+                if (!part) {
+                    exhausted = true; // Not an error; there's nothing left
+                    continue;
+                }
+
+                a->selected = metricsNow();
+                a->chunk = part->file;
+                a->image = part->image;
+                a->jigdo = part->image->jigdo;
+                // XXX sharing fd between threads probably kills kittens
+                a->outFd = part->image->fd;
+                a->stream = part->image->stream;
+                a->copyFds = part->image->copyFds;
+                a->numCopies = part->image->numCopies;
+
+                pthread_mutex_lock(&session->tableLock);
+                resetWorkerNoMutex(a);
+                pthread_mutex_unlock(&session->tableLock);
+
+                if (session->cancelled) {
+                    a->abandon = true;
+                }
+
+                if (pthread_create(&(session->workers[i].tid), NULL,
+                                   fetch_worker, a) != 0) {
+                    a->chunk = NULL;
+                    goto done;
+                }
+            }
+
+        }
+        usleep(12345); // No need to keep the CPU spinning in a tight loop
+    }
+
+    /* Reap the workers which handled the last few chunks */
+    for (i = 0; i < session->numSlots; i++) {
+        if (session->workers[i].args.chunk) {
+            if (!joinWorker(session, i)) {
+                goto done;
+            }
+            session->workers[i].args.chunk = NULL;
+        }
+    }
+
+    endStage(NULL, "fetch", &mark, METRICS_WORK_WRITE);
+
+    if (session->cancelled || !countCompletedFiles(session, parts, numParts)) {
+        goto done;
+    }
+
+    /* Everything is in place; ranges can be served during verification */
+    updateDemands(session, true);
+
+    enterStage(session, SESSION_STAGE_VERIFY, NULL, false);
+
+    for (ret = true, i = 0; i < numImages && !session->cancelled; i++) {
+        ret = verifyImage(session, images + i) && ret;
+    }
+
+    ret = ret && !session->cancelled;
+
+done:
+    /* Whatever is still running was cut short by a failure */
+    session->cancelled = session->cancelled || !ret;
+
+    /* Including the workers racing others for their chunks */
+    for (i = 0; i < session->numSlots; i++) {
+        if (session->workers[i].args.chunk) {
+            pthread_join(session->workers[i].tid, NULL);
+            session->workers[i].args.chunk = NULL;
+        }
+    }
+
+    /* Nothing more will be fetched for whoever is still waiting */
+    updateDemands(session, true);
+
+    free(parts);
+    free(tables);
+
+    return ret;
+}
+
+static void *sessionThread(void *data)
+{
+    igdoSession *session = data;
+    session->success = runSession(session);
+
+    enterStage(session, SESSION_STAGE_DONE, NULL, session->success);
+
+    return NULL;
+}
+
+igdoSession *sessionOpen(sessionImage *images, int numImages,
+                         const sessionOptions *opts,
+                         const sessionCallbacks *callbacks)
+{
+    igdoSession *session;
+    int i;
+
+    if (numImages < 1 || opts->numWorkers < 1) {
+        return NULL;
+    }
+
+    /* Claims are on the ranges of a single output file */
+    if (opts->claims && (numImages > 1 || images[0].stream)) {
+        return NULL;
+    }
+
+    /* Only a single image can be streamed */
+    if (numImages > 1) {
+        for (i = 0; i < numImages; i++) {
+            if (images[i].stream) {
+                return NULL;
+            }
+        }
+    }
+
+    session = calloc(1, sizeof(*session));
+    if (!session) {
+        return NULL;
+    }
+
+    session->images = images;
+    session->numImages = numImages;
+    session->opts = *opts;
+    session->workerLimit = opts->numWorkers;
+    session->lastEvent = &session->events;
+    session->eventPipe[0] = session->eventPipe[1] = -1;
+
+    if (callbacks) {
+        session->callbacks = *callbacks;
+    }
+
+    session->numSlots = opts->numWorkers * 2;
+    session->workers = calloc(session->numSlots, sizeof(session->workers[0]));
+    if (!session->workers) {
+        goto fail;
+    }
+
+    for (i = 0; i < session->numSlots; i++) {
+        session->workers[i].args.session = session;
+        session->workers[i].args.slot = i;
+        resetWorkerNoMutex(&(session->workers[i].args));
+    }
+
+    session->limiter = fetchLimiterCreate();
+    if (!session->limiter) {
+        goto fail;
+    }
+
+    if (opts->numPeers > 0) {
+        session->peerRetry = calloc(opts->numPeers,
+                                    sizeof(session->peerRetry[0]));
+        if (!session->peerRetry) {
+            goto fail;
+        }
+    }
+
+    if (pipe(session->eventPipe) != 0 ||
+        fcntl(session->eventPipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(session->eventPipe[1], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(session->eventPipe[0], F_SETFD, FD_CLOEXEC) != 0 ||
+        fcntl(session->eventPipe[1], F_SETFD, FD_CLOEXEC) != 0) {
+        goto fail;
+    }
+
+    if (!fetch_init()) {
+        goto fail;
+    }
+
+    pthread_mutex_init(&session->tableLock, NULL);
+    pthread_mutex_init(&session->demandLock, NULL);
+    pthread_cond_init(&session->demandCond, NULL);
+    pthread_mutex_init(&session->eventLock, NULL);
+
+    return session;
+
+fail:
+    if (session->eventPipe[0] >= 0) {
+        close(session->eventPipe[0]);
+        close(session->eventPipe[1]);
+    }
+    fetchLimiterFree(session->limiter);
+    free(session->peerRetry);
+    free(session->workers);
+    free(session);
+
+    return NULL;
+}
+
+bool sessionStart(igdoSession *session)
+{
+    if (session->started || session->cancelled) {
+        return false;
+    }
+
+    if (pthread_create(&session->thread, NULL, sessionThread, session) != 0) {
+        return false;
+    }
+
+    session->started = true;
+
+    return true;
+}
+
+int sessionGetFd(const igdoSession *session)
+{
+    return session->eventPipe[0];
+}
+
+bool sessionDispatch(igdoSession *session)
+{
+    sessionEvent *events, *event;
+    char buf[16];
+
+    pthread_mutex_lock(&session->eventLock);
+
+    events = session->events;
+    session->events = NULL;
+    session->lastEvent = &session->events;
+
+    while (read(session->eventPipe[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_unlock(&session->eventLock);
+
+    while ((event = events)) {
+        const sessionCallbacks *cb = &session->callbacks;
+
+        events = event->next;
+
+        switch (event->type) {
+            case EVENT_STAGE:
+                event->u.stage.progress = &event->progress;
+
+                if (event->u.stage.stage == SESSION_STAGE_DONE) {
+                    session->done = true;
+                }
+
+                if (cb->stage) {
+                    cb->stage(session, &event->u.stage, cb->data);
+                }
+            break;
+
+            case EVENT_PART:
+                if (cb->part) {
+                    cb->part(session, &event->u.part, cb->data);
+                }
+            break;
+
+            case EVENT_IMAGE:
+                if (cb->image) {
+                    cb->image(session, &event->u.image, cb->data);
+                }
+            break;
+        }
+
+        free(event);
+    }
+
+    return !session->done;
+}
+
+bool sessionWait(igdoSession *session)
+{
+    struct pollfd pfd = { .fd = session->eventPipe[0], .events = POLLIN };
+
+    if (!session->started) {
+        return false;
+    }
+
+    while (sessionDispatch(session)) {
+        poll(&pfd, 1, -1);
+    }
+
+    pthread_join(session->thread, NULL);
+    session->started = false;
+
+    return session->success;
+}
+
+void sessionCancel(igdoSession *session)
+{
+    int i;
+
+    session->cancelled = true;
+
+    for (i = 0; i < session->numSlots; i++) {
+        session->workers[i].args.abandon = true;
+    }
+
+    /* A session which never started won't be finishing anything either */
+    if (!session->started) {
+        updateDemands(session, true);
+    }
+}
+
+void sessionSetWorkers(igdoSession *session, int numWorkers)
+{
+    if (numWorkers < 1) {
+        numWorkers = 1;
+    } else if (numWorkers > session->opts.numWorkers) {
+        numWorkers = session->opts.numWorkers;
+    }
+
+    session->workerLimit = numWorkers;
+}
+
+void sessionSetBandwidth(igdoSession *session, uint64_t bytesPerSecond)
+{
+    fetchLimiterSetRate(session->limiter, bytesPerSecond);
+}
+
+void sessionPause(igdoSession *session, bool paused)
+{
+    session->paused = paused;
+    fetchLimiterSetPaused(session->limiter, paused);
+}
+
+bool sessionSetMirrorWeight(igdoSession *session, const char *prefix,
+                            double weight)
+{
+    mirrorWeight *weights;
+    bool ret = false;
+    int i;
+
+    if (weight < 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+
+    for (i = 0; i < session->numWeights; i++) {
+        if (strcmp(session->weights[i].prefix, prefix) == 0) {
+            session->weights[i].weight = weight;
+            ret = true;
+            goto done;
+        }
+    }
+
+    weights = realloc(session->weights,
+                      sizeof(weights[0]) * (session->numWeights + 1));
+    if (!weights) {
+        goto done;
+    }
+    session->weights = weights;
+
+    weights[i].prefix = strdup(prefix);
+    if (!weights[i].prefix) {
+        goto done;
+    }
+    weights[i].weight = weight;
+    session->numWeights++;
+    ret = true;
+
+done:
+    pthread_mutex_unlock(&session->tableLock);
+
+    return ret;
+}
+
+/**
+ * @brief Count the mirrors which the file with checksum @p md5 may be fetched
+ *        from, leaving out local directories
+ */
+static int countMirrors(jigdoData *jigdo, md5Checksum md5)
+{
+    char **uris;
+    int i, count = 0;
+
+    uris = md5ToURIs(jigdo, md5, &count);
+    if (!uris) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        free(uris[i]);
+    }
+    free(uris);
+
+    return count;
+}
+
+int sessionHedge(igdoSession *session)
+{
+    int i, count = 0;
+
+    /* The claim on a chunk belongs to the worker which was given it */
+    if (session->opts.claims) {
+        return 0;
+    }
+
+    /* With mmap, each transfer fetches straight into the output file, where
+     * an abandoned one could still be copying over the winner's data */
+    if (outputGetType(session->opts.output) == OUTPUT_ENGINE_MMAP) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+
+    for (i = 0; i < session->opts.numWorkers; i++) {
+        workerArgs *a = &(session->workers[i].args);
+
+        /* Only transfers over the network, into files, are raced, and only
+         * where another mirror holds the chunk to race them from */
+        if (a->chunk && !a->finished && !a->stream && !a->hedge &&
+            a->hedgedBy < 0 && a->uri && isURI(a->uri) &&
+            a->chunk->status == COMMIT_STATUS_IN_PROGRESS &&
+            countMirrors(a->jigdo, a->chunk->md5Sum) > 1) {
+            a->hedgeWanted = true;
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&session->tableLock);
+
+    return count;
+}
+
+void sessionGetProgress(igdoSession *session, sessionProgress *progress)
+{
+    pthread_mutex_lock(&session->tableLock);
+    *progress = session->progress;
+    pthread_mutex_unlock(&session->tableLock);
+}
+
+void sessionGetStates(igdoSession *session, int parts[COMMIT_STATUS_COUNT],
+                      uint64_t bytes[COMMIT_STATUS_COUNT])
+{
+    int i, j;
+
+    memset(parts, 0, sizeof(parts[0]) * COMMIT_STATUS_COUNT);
+    memset(bytes, 0, sizeof(bytes[0]) * COMMIT_STATUS_COUNT);
+
+    pthread_mutex_lock(&session->tableLock);
+
+    for (i = 0; i < session->numImages; i++) {
+        const templateDescTable *table = session->images[i].table;
+
+        for (j = 0; j < table->numFiles; j++) {
+            const templateFileEntry *file = table->files + j;
+
+            parts[file->status]++;
+            bytes[file->status] += file->size;
+        }
+    }
+
+    pthread_mutex_unlock(&session->tableLock);
+}
+
+const char *sessionStageName(sessionStage stage)
+{
+    static const char *names[] = {
+        [SESSION_STAGE_IDLE] = "idle",
+        [SESSION_STAGE_VERIFY_PARTIAL] = "verify_partial",
+        [SESSION_STAGE_PLAN] = "plan",
+        [SESSION_STAGE_FETCH] = "fetch",
+        [SESSION_STAGE_VERIFY] = "verify",
+        [SESSION_STAGE_DONE] = "done",
+    };
+
+    if (stage < 0 || stage > SESSION_STAGE_DONE) {
+        return "unknown";
+    }
+
+    return names[stage];
+}
+
+int sessionGetTransfers(igdoSession *session, sessionTransfer *transfers,
+                        int max)
+{
+    int i, count = 0;
+
+    pthread_mutex_lock(&session->tableLock);
+
+    for (i = 0; i < session->numSlots && count < max; i++) {
+        const workerArgs *a = &(session->workers[i].args);
+
+        if (!a->chunk || !a->uri ||
+            a->chunk->status == COMMIT_STATUS_COMPLETE) {
+            continue;
+        }
+
+        transfers[count].uri = strdup(a->uri);
+        if (!transfers[count].uri) {
+            continue;
+        }
+
+        transfers[count].fetchedBytes = a->fetchedBytes;
+        transfers[count].offset = a->chunk->offset;
+        transfers[count].size = a->chunk->size;
+        transfers[count].worker = i;
+        count++;
+    }
+
+    pthread_mutex_unlock(&session->tableLock);
+
+    return count;
+}
+
+bool sessionFindPart(igdoSession *session, const char *md5,
+                     sessionPartLocation *loc)
+{
+    md5Checksum sum;
+    const templateFileEntry *sized = NULL;
+    int i, j;
+
+    if (!md5SumFromString(md5, &sum)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&session->tableLock);
+
+    for (i = 0; i < session->numImages; i++) {
+        const sessionImage *image = session->images + i;
+
+        for (j = 0; j < image->table->numFiles; j++) {
+            const templateFileEntry *file = image->table->files + j;
+
+            if (md5Cmp(&file->md5Sum, &sum) != 0) {
+                continue;
+            }
+
+            /* What was streamed can't be read back */
+            if (file->status == COMMIT_STATUS_COMPLETE && !image->stream) {
+                loc->image = image;
+                loc->fd = -1;
+                loc->offset = file->offset;
+                loc->size = file->size;
+                pthread_mutex_unlock(&session->tableLock);
+                return true;
+            }
+
+            sized = file;
+        }
+    }
+
+    pthread_mutex_unlock(&session->tableLock);
+
+    /* The cache can only be searched knowing the size of the part */
+    if (!sized || !session->opts.cache) {
+        return false;
+    }
+
+    loc->image = NULL;
+    loc->offset = 0;
+    loc->size = sized->size;
+    loc->fd = cacheLookup(session->opts.cache, sum, sized->size);
+
+    return loc->fd >= 0;
+}
+
+void sessionClose(igdoSession *session)
+{
+    sessionEvent *event;
+    int i;
+
+    if (!session) {
+        return;
+    }
+
+    if (session->started) {
+        sessionCancel(session);
+        pthread_join(session->thread, NULL);
+    }
+
+    while ((event = session->events)) {
+        session->events = event->next;
+        free(event);
+    }
+
+    pthread_mutex_destroy(&session->eventLock);
+    pthread_cond_destroy(&session->demandCond);
+    pthread_mutex_destroy(&session->demandLock);
+    pthread_mutex_destroy(&session->tableLock);
+
+    close(session->eventPipe[0]);
+    close(session->eventPipe[1]);
+
+    fetch_cleanup();
+
+    for (i = 0; i < session->numWeights; i++) {
+        free(session->weights[i].prefix);
+    }
+    free(session->weights);
+    fetchLimiterFree(session->limiter);
+    free(session->peerRetry);
+    free(session->workers);
+    free(session);
+}
@@ -0,0 +1,431 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_SESSION_H
+#define PIGDO_SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jigdo.h"
+#include "jigdo-template.h"
+#include "cache.h"
+#include "claim.h"
+#include "output.h"
+#include "place.h"
+#include "stream.h"
+
+#define defaultNumThreads 16
+
+/**
+ * @brief Weight of mirrors which weren't given one by sessionSetMirrorWeight()
+ */
+#define defaultMirrorWeight 1.0
+
+/**
+ * @brief The reconstruction of one or more images
+ *
+ * A session owns everything a reconstruction needs besides the images and
+ * the engines it is given: its pool of worker threads, its progress counters
+ * and the state shared with its callers. Sessions are independent of each
+ * other, so one process may run several of them at once.
+ *
+ * A session runs on threads of its own once started. What it has to report
+ * is queued until sessionDispatch() hands it to the session's callbacks, on
+ * whichever thread calls it; sessionGetFd() returns a file descriptor which
+ * is readable whenever there is something to dispatch, for use with poll(2)
+ * or an event loop.
+ */
+typedef struct _igdoSession igdoSession;
+
+/**
+ * @brief Options controlling how a session reassembles its images
+ */
+typedef struct {
+    int numWorkers;       ///< Number of simultaneous worker threads
+    partCache *cache;     ///< Part cache to consult and populate, or NULL
+    bool cacheHarvest;    ///< Add every part to @c cache once the image
+                          ///< verifies
+    outputEngine *output; ///< Engine through which fetched parts are written
+    bool verifyCopies;    ///< Read back the copies of each image to check
+                          ///< their checksums, too
+    char **peers;         ///< Base URIs of peers serving parts by MD5, which
+                          ///< are tried ahead of the mirrors; see
+                          ///< sessionFindPart()
+    int numPeers;         ///< Number of elements in @c peers
+    const char *importDir;///< If not NULL, a directory of parts downloaded by
+                          ///< some other tool, each named after its MD5
+                          ///< checksum in hexadecimal; see exportParts()
+    partClaims *claims;   ///< If not NULL, the single image's output file is
+                          ///< shared with other processes, and each part is
+                          ///< claimed here before it is placed
+} sessionOptions;
+
+/**
+ * @brief An image to be reassembled by a session
+ */
+typedef struct {
+    const char *name;         ///< Name of the image, for messages
+    jigdoData *jigdo;         ///< Parsed data from the image's .jigdo file
+    templateDescTable *table; ///< DESC table from the image's .template file
+    int fd;                   ///< Open file descriptor to the output file
+    outputStream *stream;     ///< If not NULL, the output can only be written
+                              ///< sequentially, through this stream
+    void *templateData;       ///< Data from the .template which @c stream
+                              ///< refers to
+    int *copyFds;             ///< Further output files, which receive a copy
+                              ///< of everything written to @c fd
+    int numCopies;            ///< Number of elements in @c copyFds
+} sessionImage;
+
+/**
+ * @brief Stages a session goes through, in order
+ */
+typedef enum {
+    SESSION_STAGE_IDLE = 0,       ///< Not started yet
+    SESSION_STAGE_VERIFY_PARTIAL, ///< Checking which parts an existing output
+                                  ///< file already holds
+    SESSION_STAGE_PLAN,           ///< Finding duplicate and local parts
+    SESSION_STAGE_FETCH,          ///< Fetching and placing the parts
+    SESSION_STAGE_VERIFY,         ///< Checking and flushing the images
+    SESSION_STAGE_DONE,           ///< Finished, successfully or not
+} sessionStage;
+
+/**
+ * @brief Where a part came from
+ */
+typedef enum {
+    PART_SOURCE_MIRROR = 0,  ///< Fetched from a mirror
+    PART_SOURCE_LOCAL,       ///< Local copy found by jigdoFindLocalFiles()
+    PART_SOURCE_CACHE,       ///< Object in the persistent part cache
+    PART_SOURCE_DUPLICATE,   ///< Identical part elsewhere in the images
+    PART_SOURCE_PEER,        ///< Fetched from a peer
+    PART_SOURCE_SHARED,      ///< Completed by another process sharing the
+                             ///< output file
+    PART_SOURCE_IMPORT,      ///< Downloaded into sessionOptions::importDir
+    PART_SOURCE_COUNT,       ///< Number of sources, not a source
+} partSource;
+
+/**
+ * @brief A snapshot of a session's progress
+ */
+typedef struct {
+    sessionStage stage;       ///< The stage the session is in
+    int checkedFiles;         ///< Parts of an existing output file checked
+                              ///< so far, during SESSION_STAGE_VERIFY_PARTIAL
+    int checkedOK;            ///< How many of those were already complete
+    int checkFiles;           ///< Parts of that output file to check
+    int duplicateFiles;       ///< Parts which are copied from an identical
+                              ///< part rather than fetched
+    int localFiles;           ///< Parts found locally
+    int fetchFiles;           ///< Parts which need to be fetched
+    uint64_t fetchBytes;      ///< Total size of those parts
+    int numFiles;             ///< Parts to reconstruct, in all images
+    uint64_t numBytes;        ///< Total size of those parts
+    int completedFiles;       ///< Parts completed so far
+    uint64_t completedBytes;  ///< Total size of those parts
+    int placeCounts[PART_SOURCE_COUNT][PLACE_METHOD_COUNT];
+                              ///< Completed parts by source and method
+    int harvestFiles;         ///< Parts of verified images to harvest into
+                              ///< the cache
+    int harvestedFiles;       ///< How many of those were added to it
+} sessionProgress;
+
+/**
+ * @brief Reported when a session enters a stage
+ */
+typedef struct {
+    sessionStage stage;        ///< The stage entered
+    const sessionImage *image; ///< For SESSION_STAGE_VERIFY_PARTIAL, the image
+                               ///< being checked; it is entered once for each
+                               ///< image with an existing output file
+    bool success;              ///< For SESSION_STAGE_DONE, whether all of the
+                               ///< images were reconstructed
+    const sessionProgress *progress; ///< The session's progress as the
+                                     ///< previous stage left it
+} sessionStageEvent;
+
+/**
+ * @brief Reported when a part has been completed
+ */
+typedef struct {
+    const sessionImage *image; ///< The image which the part is of
+    uint64_t offset;           ///< Where the part is within the image
+    uint64_t size;             ///< Size of the part
+    partSource source;         ///< Where the part came from
+    placeMethod method;        ///< How the part was copied into place, unless
+                               ///< it was fetched
+} sessionPartEvent;
+
+/**
+ * @brief Outcomes of finishing an image, or one of its copies
+ */
+typedef enum {
+    IMAGE_RESULT_VERIFIED = 0, ///< Flushed, and its checksum matches
+    IMAGE_RESULT_FLUSHED,      ///< Flushed, with no checksum compared: a copy
+                               ///< which wasn't read back, or a partial image
+    IMAGE_RESULT_MISMATCH,     ///< Its checksum doesn't match
+    IMAGE_RESULT_FAILED,       ///< It couldn't be finished; see @c error
+} imageResult;
+
+/**
+ * @brief Reported when an image, or one of its copies, has been finished
+ */
+typedef struct {
+    const sessionImage *image; ///< The image finished
+    int copy;                  ///< Index of the copy finished, or -1 for the
+                               ///< image's own output
+    imageResult result;        ///< The outcome
+    char md5[33];              ///< Checksum read back, in hexadecimal, for
+                               ///< IMAGE_RESULT_VERIFIED and
+                               ///< IMAGE_RESULT_MISMATCH
+    char expected[33];         ///< Checksum of the image, likewise
+    const char *error;         ///< What went wrong, for IMAGE_RESULT_FAILED
+} sessionImageEvent;
+
+/**
+ * @brief Functions called by sessionDispatch() for what a session reports
+ *
+ * Any of them may be NULL. They may call any function on the session except
+ * sessionClose().
+ */
+typedef struct {
+    void (*stage)(igdoSession *session, const sessionStageEvent *event,
+                  void *data);
+    void (*part)(igdoSession *session, const sessionPartEvent *event,
+                 void *data);
+    void (*image)(igdoSession *session, const sessionImageEvent *event,
+                  void *data);
+    void *data;               ///< Passed to each of the callbacks
+} sessionCallbacks;
+
+/**
+ * @brief A transfer in progress, as reported by sessionGetTransfers()
+ */
+typedef struct {
+    char *uri;                ///< What is being fetched or copied
+    uint64_t fetchedBytes;    ///< Bytes transferred so far
+    uint64_t offset;          ///< Offset of the part within its image
+    uint64_t size;            ///< Size of the part
+    int worker;               ///< The worker doing it, from 0
+} sessionTransfer;
+
+/**
+ * @brief Set up a session to reassemble @p images
+ *
+ * All images share a single pool of workers, and files which occur in several
+ * images are only fetched once, then copied to the others. A streamed image
+ * must be the only one; its parts are fetched in order of offset, no further
+ * ahead of the stream than its window allows.
+ *
+ * @param images The images, which must remain valid until the session is
+ *               closed
+ * @param opts Options for the session, which are copied
+ * @param callbacks Callbacks for sessionDispatch(), which are copied, or NULL
+ *
+ * @return The new session, or NULL on failure
+ */
+igdoSession *sessionOpen(sessionImage *images, int numImages,
+                         const sessionOptions *opts,
+                         const sessionCallbacks *callbacks);
+
+/**
+ * @brief Start reassembling the images of @p session, and return immediately
+ *
+ * @return @c true on success; @c false if the session was already started or
+ *         its thread could not be created
+ */
+bool sessionStart(igdoSession *session);
+
+/**
+ * @brief Get a file descriptor which is readable whenever @p session has
+ *        something for sessionDispatch()
+ *
+ * The descriptor belongs to the session; it must not be read from or closed.
+ */
+int sessionGetFd(const igdoSession *session);
+
+/**
+ * @brief Call the callbacks of @p session for everything it has reported so
+ *        far, without blocking
+ *
+ * @return @c true if the session is still running; @c false once it is done
+ *         and everything it reported has been dispatched
+ */
+bool sessionDispatch(igdoSession *session);
+
+/**
+ * @brief Dispatch what @p session reports until it is done
+ *
+ * @return @c true if all of the images were reconstructed; @c false otherwise
+ */
+bool sessionWait(igdoSession *session);
+
+/**
+ * @brief Ask @p session to stop, without waiting for it to
+ *
+ * No further parts are started, and transfers in progress are abandoned; the
+ * session then finishes as having failed. May be called from any thread.
+ */
+void sessionCancel(igdoSession *session);
+
+/**
+ * @brief Limit how many of its workers @p session keeps busy
+ *
+ * Workers over the limit finish the parts they have, and aren't given any
+ * more; e.g. for a process running several sessions to share its transfers
+ * between them. May be called from any thread.
+ *
+ * @param numWorkers The new limit, which is clamped to between 1 and the
+ *                   session's sessionOptions::numWorkers
+ */
+void sessionSetWorkers(igdoSession *session, int numWorkers);
+
+/**
+ * @brief Limit how fast the transfers of @p session receive data, between them
+ *
+ * May be called from any thread, and applies to transfers in progress too.
+ *
+ * @param bytesPerSecond The new limit, or 0 for no limit
+ */
+void sessionSetBandwidth(igdoSession *session, uint64_t bytesPerSecond);
+
+/**
+ * @brief Pause @p session, or resume it
+ *
+ * While paused, no further parts are started, and transfers in progress are
+ * held; those held for long enough to time out are retried once resumed. May
+ * be called from any thread.
+ */
+void sessionPause(igdoSession *session, bool paused);
+
+/**
+ * @brief Weight how often @p session fetches parts from the mirrors whose
+ *        URIs start with @p prefix
+ *
+ * Each part is fetched from one of the mirrors holding it at random, in
+ * proportion to their weights, which are defaultMirrorWeight unless set here.
+ * The longest matching prefix decides a mirror's weight. Mirrors of weight 0
+ * are disabled: parts held by no other mirror wait for one to be enabled
+ * again. May be called from any thread, and applies to parts started after.
+ *
+ * @param weight The new weight, which must not be negative
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool sessionSetMirrorWeight(igdoSession *session, const char *prefix,
+                            double weight);
+
+/**
+ * @brief Race each transfer @p session has in progress with a second one of
+ *        the same part, from a different mirror
+ *
+ * Each worker has a second one set aside to race it, which doesn't count
+ * towards sessionSetWorkers(); the first transfer to fetch and verify the
+ * part places it, and the other is abandoned. Parts held by a single mirror,
+ * and parts of streamed images or of output files shared with other
+ * processes, aren't raced, and neither is anything written through the mmap
+ * output engine. May be called from any thread.
+ *
+ * @return The number of transfers to be raced
+ */
+int sessionHedge(igdoSession *session);
+
+/**
+ * @brief Get a snapshot of the progress of @p session
+ */
+void sessionGetProgress(igdoSession *session, sessionProgress *progress);
+
+/**
+ * @brief Count the parts of the images of @p session in each commitStatus,
+ *        along with their total size
+ *
+ * @param parts Where the number of parts in each state is stored
+ * @param bytes Where the total size of the parts in each state is stored
+ */
+void sessionGetStates(igdoSession *session, int parts[COMMIT_STATUS_COUNT],
+                      uint64_t bytes[COMMIT_STATUS_COUNT]);
+
+/**
+ * @brief Get a short name for @p stage, e.g. for status displays
+ */
+const char *sessionStageName(sessionStage stage);
+
+/**
+ * @brief Get the transfers @p session has in progress
+ *
+ * @param transfers Where up to @p max transfers are stored; their URIs must
+ *                  be freed by the caller
+ *
+ * @return The number of transfers stored
+ */
+int sessionGetTransfers(igdoSession *session, sessionTransfer *transfers,
+                        int max);
+
+/**
+ * @brief Wait until the bytes of @p image from @p start up to @p end have been
+ *        reconstructed
+ *
+ * The parts overlapping the range are fetched ahead of all others, while the
+ * rest of the image continues to be filled in. May be called from any thread,
+ * before or while the session runs.
+ *
+ * @return @c true once all of the range is complete; @c false if some of it
+ *         never will be
+ */
+bool sessionWaitRange(igdoSession *session, const sessionImage *image,
+                      uint64_t start, uint64_t end);
+
+/**
+ * @brief Where a verified part can be read from
+ */
+typedef struct {
+    const sessionImage *image; ///< Image holding the part, or NULL if it was
+                               ///< found in the part cache instead
+    int fd;                    ///< If @c image is NULL, a descriptor to the
+                               ///< cached part, which the caller must close
+    uint64_t offset;           ///< Offset of the part within @c image
+    uint64_t size;             ///< Size of the part
+} sessionPartLocation;
+
+/**
+ * @brief Find a part of @p session's images which has been verified, or else
+ *        a copy of it in the part cache, for serving it to peers
+ *
+ * A peer fetches a part from '<peer URI>/md5/<md5>', where @c md5 is the
+ * part's MD5 checksum in hexadecimal. Parts which are still incomplete aren't
+ * waited for. May be called from any thread, until sessionClose().
+ *
+ * @param md5 The part's MD5 checksum in hexadecimal, as made by
+ *            md5SumToString()
+ * @param loc Where the location of the part is stored
+ *
+ * @return @c true if the part was found; @c false if it wasn't
+ */
+bool sessionFindPart(igdoSession *session, const char *md5,
+                     sessionPartLocation *loc);
+
+/**
+ * @brief Cancel @p session if it is running, wait for it to stop, and release
+ *        its resources
+ *
+ * Whatever is waiting in sessionWaitRange() must have returned first;
+ * sessionCancel() wakes it up.
+ */
+void sessionClose(igdoSession *session);
+
+#endif
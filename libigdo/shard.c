@@ -0,0 +1,285 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shard.h"
+#include "place.h"
+#include "util.h"
+#include "jigdo-template-private.h"
+
+/**
+ * @brief First word of a manifest, followed by the version of its format
+ */
+static const char manifestMagic[] = "pigdo-shard";
+
+/**
+ * @brief Version of the manifest format written by shardWriteManifest()
+ */
+#define manifestVersion 1
+
+/**
+ * @brief Comparator function to sort pointers to parts by offset
+ */
+static int fileOffsetCmp(const void *a, const void *b)
+{
+    const templateFileEntry *fileA = *(templateFileEntry * const *) a;
+    const templateFileEntry *fileB = *(templateFileEntry * const *) b;
+
+    return (fileA->offset > fileB->offset) - (fileA->offset < fileB->offset);
+}
+
+/**
+ * @brief Get the parts of @p table in order of offset
+ *
+ * @return A newly heap-allocated array of pointers to the parts, or NULL on
+ *         failure
+ */
+static templateFileEntry **sortByOffset(const templateDescTable *table)
+{
+    templateFileEntry **files;
+    int i;
+
+    files = malloc(sizeof(files[0]) * (table->numFiles ? table->numFiles : 1));
+    if (!files) {
+        return NULL;
+    }
+
+    for (i = 0; i < table->numFiles; i++) {
+        files[i] = table->files + i;
+    }
+
+    qsort(files, table->numFiles, sizeof(files[0]), fileOffsetCmp);
+
+    return files;
+}
+
+bool shardWriteManifest(const char *path, const char *shardPath,
+                        const templateDescTable *table)
+{
+    templateFileEntry **files = sortByOffset(table);
+    char *shardCopy = strdup(shardPath), *tmpPath = NULL;
+    char md5[MD5SUM_STRING_LENGTH];
+    FILE *fp = NULL;
+    bool ret = false;
+    int i;
+
+    tmpPath = malloc(strlen(path) + sizeof(".tmp"));
+    if (!files || !shardCopy || !tmpPath) {
+        goto done;
+    }
+
+    /* A manifest only appears once it is complete */
+    sprintf(tmpPath, "%s.tmp", path);
+    fp = fopen(tmpPath, "w");
+    if (!fp) {
+        goto done;
+    }
+
+    fprintf(fp, "%s %d\n", manifestMagic, manifestVersion);
+    fprintf(fp, "image %s %"PRIu64"\n", table->imageInfo.md5String,
+            table->imageInfo.size);
+    fprintf(fp, "shard %d %d\n", table->shard, table->numShards);
+    // basename(3) may modify its argument
+    fprintf(fp, "file %s\n", basename(shardCopy));
+
+    for (i = 0; i < table->numFiles; i++) {
+        if (files[i]->status != COMMIT_STATUS_COMPLETE) {
+            continue;
+        }
+
+        md5SumToString(files[i]->md5Sum, md5);
+        fprintf(fp, "part %jd %"PRIu64" %s\n", (intmax_t) files[i]->offset,
+                files[i]->size, md5);
+    }
+
+    ret = !ferror(fp);
+
+    if (fclose(fp) != 0 || !ret || rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        ret = false;
+    }
+
+done:
+    free(tmpPath);
+    free(shardCopy);
+    free(files);
+
+    return ret;
+}
+
+/**
+ * @brief Find the part of @p files, sorted by offset, which is at @p offset
+ *        and has size @p size and checksum @p md5
+ *
+ * @return The part, or NULL if there is none
+ */
+static templateFileEntry *findPart(templateFileEntry **files, int numFiles,
+                                   uint64_t offset, uint64_t size,
+                                   const md5Checksum *md5)
+{
+    int low = 0, high = numFiles;
+
+    /* Find the first part at or after the offset; empty parts may share
+     * their offset with the part which follows them. */
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+
+        if ((uint64_t) files[mid]->offset < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (; low < numFiles && (uint64_t) files[low]->offset == offset; low++) {
+        if (files[low]->size == size &&
+            md5Cmp(&(files[low]->md5Sum), md5) == 0) {
+            return files[low];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Open the shard file named @p name in a manifest at @p path
+ *
+ * @return A read-only file descriptor, or -1 on failure
+ */
+static int openShardFile(const char *path, const char *name)
+{
+    char *pathCopy = strdup(path), *shardPath;
+    int fd = -1;
+
+    if (!pathCopy) {
+        return -1;
+    }
+
+    // dirname(3) may modify its argument
+    shardPath = isAbsolute(name) ? strdup(name) :
+                                   dircat(dirname(pathCopy), name);
+
+    if (shardPath) {
+        fd = open(shardPath, O_RDONLY);
+    }
+
+    free(shardPath);
+    free(pathCopy);
+
+    return fd;
+}
+
+int shardMerge(const char *path, templateDescTable *table, int outFd,
+               outputEngine *output)
+{
+    FILE *fp = fopen(path, "r");
+    templateFileEntry **files = sortByOffset(table);
+    char line[PATH_MAX + 64], word[16], md5String[MD5SUM_STRING_LENGTH];
+    int version, merged = 0, shardFd = -1, ret = -1;
+    bool imageMatches = false;
+
+    if (!fp || !files) {
+        goto done;
+    }
+
+    if (!fgets(line, sizeof(line), fp) ||
+        sscanf(line, "%15s %d", word, &version) != 2 ||
+        strcmp(word, manifestMagic) != 0 || version != manifestVersion) {
+        goto done;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t offset, size;
+        templateFileEntry *file;
+        md5Checksum md5;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        if (sscanf(line, "%15s", word) != 1) {
+            goto done;
+        }
+
+        if (strcmp(word, "image") == 0) {
+            imageMatches =
+                sscanf(line, "image %32s %"SCNu64, md5String, &size) == 2 &&
+                strcmp(md5String, table->imageInfo.md5String) == 0 &&
+                size == table->imageInfo.size;
+        } else if (strcmp(word, "file") == 0) {
+            if (shardFd >= 0 || !imageMatches) {
+                goto done;
+            }
+
+            shardFd = openShardFile(path, line + strlen("file "));
+            if (shardFd < 0) {
+                goto done;
+            }
+        } else if (strcmp(word, "part") == 0) {
+            if (shardFd < 0 ||
+                sscanf(line, "part %"SCNu64" %"SCNu64" %32s", &offset, &size,
+                       md5String) != 3 ||
+                !md5SumFromString(md5String, &md5)) {
+                goto done;
+            }
+
+            file = findPart(files, table->numFiles, offset, size, &md5);
+            if (!file) {
+                goto done;
+            }
+
+            if (file->status == COMMIT_STATUS_COMPLETE) {
+                continue;
+            }
+
+            if (placeFileRangeVia(shardFd, offset, outFd, offset, size,
+                                  output) == PLACE_METHOD_NONE ||
+                !outputRangeDone(output, outFd, offset, size)) {
+                goto done;
+            }
+
+            file->status = COMMIT_STATUS_COMPLETE;
+            merged++;
+        }
+    }
+
+    if (!ferror(fp) && shardFd >= 0) {
+        ret = merged;
+    }
+
+done:
+    if (shardFd >= 0) {
+        close(shardFd);
+    }
+
+    if (fp) {
+        fclose(fp);
+    }
+
+    free(files);
+
+    return ret;
+}
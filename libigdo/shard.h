@@ -0,0 +1,59 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_SHARD_H
+#define PIGDO_SHARD_H
+
+#include <stdbool.h>
+
+#include "jigdo-template.h"
+#include "output.h"
+
+/**
+ * @brief Write the manifest of a shard reconstructed after jigdoSetShard()
+ *
+ * The manifest is a text file listing the image it belongs to, and the
+ * offset, size and MD5 checksum of each part which is complete in the shard
+ * file. It refers to the shard file by its name alone, so the two are
+ * expected to be kept in the same directory.
+ *
+ * @param path Where to write the manifest
+ * @param shardPath The shard file which the parts were written to
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool shardWriteManifest(const char *path, const char *shardPath,
+                        const templateDescTable *table);
+
+/**
+ * @brief Copy the parts listed in the manifest at @p path from their shard
+ *        file into an output file, and mark them complete in @p table
+ *
+ * The parts are copied with placeFileRangeVia(), e.g. with
+ * copy_file_range(2). Parts which are already complete are left alone, and
+ * parts missing from all shards are left to be fetched as usual.
+ *
+ * @param outFd The output file, holding the template data
+ *
+ * @return The number of parts copied, or -1 if the manifest doesn't belong to
+ *         the image or on failure
+ */
+int shardMerge(const char *path, templateDescTable *table, int outFd,
+               outputEngine *output);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+/**
+ * @brief Most stages which are kept apart; any further stages are dropped
+ */
+#define maxStages 16
+
+/**
+ * @brief Totals of the runs of a stage
+ */
+typedef struct {
+    const char *name;         ///< Name of the stage
+    uint64_t wall;            ///< Wall time, in nanoseconds
+    uint64_t cpu;             ///< CPU time, in nanoseconds
+    uint64_t peakRSS;         ///< Largest peak resident set size, in bytes
+    uint64_t bytes;           ///< Bytes of work done
+    bool hasBytes;            ///< Whether the stage does work counted in bytes
+} stageStats;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile bool enabled;
+static stageStats stages[maxStages];
+static int numStages;
+
+/**
+ * @brief Get the CPU time used by all threads of the process, in nanoseconds
+ */
+static uint64_t cpuTime(void)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now) != 0) {
+        return 0;
+    }
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Reset the peak resident set size of the process to its current size
+ *
+ * @return @c true on success; @c false if the system doesn't allow it
+ */
+static bool resetPeakRSS(void)
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    bool ret;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    ret = write(fd, "5", 1) == 1;
+    close(fd);
+
+    return ret;
+}
+
+/**
+ * @brief Get the peak resident set size of the process, in bytes, since it was
+ *        last reset, or else since it started
+ */
+static uint64_t peakRSS(void)
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    struct rusage usage;
+    char line[128];
+    uint64_t kB;
+
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmHWM: %"SCNu64" kB", &kB) == 1) {
+                fclose(fp);
+                return kB * 1024;
+            }
+        }
+        fclose(fp);
+    }
+
+    /* ru_maxrss is in kilobytes, and can't be reset */
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+    return (uint64_t) usage.ru_maxrss * 1024;
+}
+
+void statsEnable(void)
+{
+    enabled = true;
+}
+
+void statsBegin(statsMark *mark)
+{
+    memset(mark, 0, sizeof(*mark));
+    mark->start = metricsNow();
+
+    if (!enabled) {
+        return;
+    }
+
+    mark->cpu = cpuTime();
+    metricsGetWork(mark->work);
+    resetPeakRSS();
+}
+
+void statsEnd(const statsMark *mark, const char *stage, metricsWork work)
+{
+    uint64_t wall, cpu, rss, done[METRICS_WORK_COUNT];
+    stageStats *stats = NULL;
+    int i;
+
+    if (!enabled) {
+        return;
+    }
+
+    wall = metricsNow() - mark->start;
+    cpu = cpuTime() - mark->cpu;
+    rss = peakRSS();
+    metricsGetWork(done);
+
+    pthread_mutex_lock(&lock);
+
+    for (i = 0; i < numStages; i++) {
+        if (strcmp(stages[i].name, stage) == 0) {
+            stats = stages + i;
+            break;
+        }
+    }
+
+    if (!stats && numStages < maxStages) {
+        stats = stages + numStages++;
+        stats->name = stage;
+    }
+
+    if (stats) {
+        stats->wall += wall;
+        stats->cpu += cpu;
+        if (rss > stats->peakRSS) {
+            stats->peakRSS = rss;
+        }
+        if (work < METRICS_WORK_COUNT) {
+            stats->bytes += done[work] - mark->work[work];
+            stats->hasBytes = true;
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+bool statsWrite(FILE *fp)
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+
+    fprintf(fp, "%-16s %10s %10s %14s %10s %10s\n", "Stage", "Wall (s)",
+            "CPU (s)", "Peak RSS (MiB)", "MiB", "MiB/s");
+
+    for (i = 0; i < numStages; i++) {
+        const stageStats *stats = stages + i;
+
+        fprintf(fp, "%-16s %10.3f %10.3f %14.1f", stats->name,
+                stats->wall / 1e9, stats->cpu / 1e9,
+                stats->peakRSS / 1048576.0);
+
+        if (stats->hasBytes && stats->wall > 0) {
+            fprintf(fp, " %10.1f %10.1f\n", stats->bytes / 1048576.0,
+                    stats->bytes / 1048576.0 / (stats->wall / 1e9));
+        } else {
+            fprintf(fp, " %10s %10s\n", "-", "-");
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return fflush(fp) == 0 && !ferror(fp);
+}
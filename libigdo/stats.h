@@ -0,0 +1,75 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_STATS_H
+#define PIGDO_STATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+/**
+ * @brief The state of the process as a stage started, taken by statsBegin()
+ */
+typedef struct {
+    uint64_t start;           ///< When the stage started, as given by
+                              ///< metricsNow(); set even if statistics aren't
+                              ///< being kept
+    uint64_t cpu;             ///< CPU time used by the process by then, in
+                              ///< nanoseconds
+    uint64_t work[METRICS_WORK_COUNT]; ///< Bytes of each kind of work done by
+                                       ///< then; see metricsGetWork()
+} statsMark;
+
+/**
+ * @brief Start keeping statistics of the top-level stages of the process
+ */
+void statsEnable(void);
+
+/**
+ * @brief Mark the start of a stage
+ *
+ * The stages of the process are expected to run one after another: where the
+ * system allows it, the peak resident set size of the process is reset, so
+ * that the peak reported for the stage is its own.
+ */
+void statsBegin(statsMark *mark);
+
+/**
+ * @brief Account for the stage started at @p mark, which has just finished
+ *
+ * The wall time, CPU time and peak resident set size of stages with the same
+ * name, e.g. of several images, are added up or, for the peak, the largest is
+ * kept.
+ *
+ * @param work The kind of work whose bytes make up the throughput of the
+ *             stage, or METRICS_WORK_COUNT if it has none
+ */
+void statsEnd(const statsMark *mark, const char *stage, metricsWork work);
+
+/**
+ * @brief Write a table of the stages accounted for so far to @p fp, with the
+ *        wall time, CPU time, peak resident set size and throughput of each
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool statsWrite(FILE *fp);
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "status.h"
+#include "metrics.h"
+
+/**
+ * @brief Attempts statusRead() makes at a consistent copy before giving up
+ */
+#define statusReadTries 1000
+
+struct _statusFile {
+    statusBlock *block;       ///< The mapped status file
+    statusData staged;        ///< The next snapshot, gathered before the
+                              ///< block is locked to publish it
+};
+
+statusFile *statusCreate(const char *path)
+{
+    size_t len = strlen(path) + sizeof(".XXXXXX");
+    char *tmpPath = malloc(len);
+    statusFile *status = calloc(1, sizeof(*status));
+    void *map = MAP_FAILED;
+    int fd = -1;
+
+    if (!tmpPath || !status) {
+        goto fail;
+    }
+
+    /* Readers may have the old file mapped; replacing rather than truncating
+     * it leaves them with stale data, rather than a SIGBUS */
+    snprintf(tmpPath, len, "%s.XXXXXX", path);
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        goto fail;
+    }
+
+    /* mkstemp() makes the file private, but monitors may run as others */
+    if (fchmod(fd, 0644) != 0 || ftruncate(fd, sizeof(statusBlock)) != 0) {
+        goto fail;
+    }
+
+    map = mmap(NULL, sizeof(statusBlock), PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+
+    status->block = map;
+    status->block->magic = STATUS_MAGIC;
+    status->block->version = STATUS_VERSION;
+    status->block->data.pid = getpid();
+    status->block->data.updated = metricsNow();
+
+    if (rename(tmpPath, path) != 0) {
+        goto fail;
+    }
+
+    close(fd);
+    free(tmpPath);
+
+    return status;
+
+fail:
+    if (map != MAP_FAILED) {
+        munmap(map, sizeof(statusBlock));
+    }
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmpPath);
+    }
+    free(tmpPath);
+    free(status);
+
+    return NULL;
+}
+
+/**
+ * @brief Gather the transfers of @p session into @p data, and add the bytes
+ *        transferred so far to those of their mirrors
+ */
+static void stageWorkers(statusData *data, igdoSession *session)
+{
+    sessionTransfer transfers[statusMaxWorkers];
+    int i, j, count;
+
+    count = sessionGetTransfers(session, transfers, statusMaxWorkers);
+
+    for (i = 0; i < count; i++) {
+        statusWorker *worker = data->workers + i;
+        size_t len = metricsMirrorLength(transfers[i].uri);
+
+        worker->worker = transfers[i].worker;
+        worker->offset = transfers[i].offset;
+        worker->size = transfers[i].size;
+        worker->fetchedBytes = transfers[i].fetchedBytes;
+        snprintf(worker->uri, sizeof(worker->uri), "%s", transfers[i].uri);
+
+        for (j = 0; j < data->numMirrors; j++) {
+            if (strlen(data->mirrors[j].name) == len &&
+                strncmp(data->mirrors[j].name, transfers[i].uri, len) == 0) {
+                data->mirrors[j].bytes += transfers[i].fetchedBytes;
+                break;
+            }
+        }
+
+        free(transfers[i].uri);
+    }
+
+    data->numWorkers = count;
+}
+
+/**
+ * @brief Gather the transfers accounted for so far from each mirror into
+ *        @p data
+ */
+static void stageMirrors(statusData *data)
+{
+    metricsMirror mirrors[statusMaxMirrors];
+    int i, count;
+
+    count = metricsGetMirrors(mirrors, statusMaxMirrors);
+
+    for (i = 0; i < count; i++) {
+        statusMirror *mirror = data->mirrors + i;
+
+        snprintf(mirror->name, sizeof(mirror->name), "%s", mirrors[i].name);
+        mirror->bytes = mirrors[i].bytes;
+        mirror->ns = mirrors[i].ns;
+        mirror->parts = mirrors[i].parts;
+        mirror->errors = mirrors[i].errors;
+        free(mirrors[i].name);
+    }
+
+    data->numMirrors = count;
+}
+
+void statusUpdate(statusFile *status, igdoSession *session)
+{
+    statusData *data = &status->staged;
+    statusBlock *block = status->block;
+    sessionProgress progress;
+    uint32_t sequence;
+
+    sessionGetProgress(session, &progress);
+
+    memset(data, 0, sizeof(*data));
+    data->pid = getpid();
+    data->stage = progress.stage;
+    data->numFiles = progress.numFiles;
+    data->completedFiles = progress.completedFiles;
+    data->fetchFiles = progress.fetchFiles;
+    data->localFiles = progress.localFiles;
+    data->numBytes = progress.numBytes;
+    data->completedBytes = progress.completedBytes;
+    data->fetchBytes = progress.fetchBytes;
+
+    /* The mirrors first, so that transfers in progress can be added in */
+    stageMirrors(data);
+    stageWorkers(data, session);
+    data->updated = metricsNow();
+
+    /* There is only one writer, so the lock is never contended */
+    sequence = __atomic_load_n(&block->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&block->data, data, sizeof(*data));
+
+    __atomic_store_n(&block->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void statusClose(statusFile *status)
+{
+    if (!status) {
+        return;
+    }
+
+    munmap(status->block, sizeof(statusBlock));
+    free(status);
+}
+
+const statusBlock *statusMap(const char *path)
+{
+    const statusBlock *block;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(statusBlock)) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, sizeof(statusBlock), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    block = map;
+    if (block->magic != STATUS_MAGIC || block->version != STATUS_VERSION) {
+        munmap(map, sizeof(statusBlock));
+        return NULL;
+    }
+
+    return block;
+}
+
+void statusUnmap(const statusBlock *block)
+{
+    if (block) {
+        munmap((void *) block, sizeof(statusBlock));
+    }
+}
+
+bool statusRead(const statusBlock *block, statusData *data)
+{
+    int i;
+
+    for (i = 0; i < statusReadTries; i++) {
+        uint32_t sequence = __atomic_load_n(&block->sequence,
+                                            __ATOMIC_ACQUIRE);
+
+        /* The writer is in the middle of an update */
+        if (sequence & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(data, &block->data, sizeof(*data));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&block->sequence, __ATOMIC_RELAXED) == sequence) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,149 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_STATUS_H
+#define PIGDO_STATUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "session.h"
+
+/**
+ * @brief Identifies a status file, and the layout of its status block
+ */
+#define STATUS_MAGIC 0x5355544154534447ULL // "GDSTATUS"
+#define STATUS_VERSION 1
+
+#define statusMaxWorkers 64       ///< Most transfers a status block holds
+#define statusMaxMirrors 32       ///< Most mirrors a status block holds
+#define statusURILength 256       ///< Longest URI kept, including the NUL
+#define statusNameLength 128      ///< Longest mirror name kept, likewise
+
+/**
+ * @brief A transfer in progress, as published in a status block
+ */
+typedef struct {
+    int32_t worker;           ///< The worker doing it, from 0
+    uint32_t reserved;        ///< Padding; always 0
+    uint64_t offset;          ///< Offset of the part within its image
+    uint64_t size;            ///< Size of the part
+    uint64_t fetchedBytes;    ///< Bytes transferred so far
+    char uri[statusURILength]; ///< What is being fetched or copied,
+                               ///< truncated if need be
+} statusWorker;
+
+/**
+ * @brief Transfers from a single mirror or peer, as published in a status
+ *        block
+ */
+typedef struct {
+    char name[statusNameLength]; ///< Scheme, host and port of the mirror
+    uint64_t bytes;           ///< Bytes transferred from it, including those
+                              ///< of transfers still in progress
+    uint64_t ns;              ///< Time spent on the transfers which are over
+    uint64_t parts;           ///< Parts transferred in full
+    uint64_t errors;          ///< Transfers which failed
+} statusMirror;
+
+/**
+ * @brief A snapshot of a running reconstruction
+ */
+typedef struct {
+    int32_t pid;              ///< Process publishing the status
+    int32_t stage;            ///< sessionStage the session is in
+    uint64_t updated;         ///< When this was published, as given by
+                              ///< metricsNow(), for working out rates
+    int32_t numFiles;         ///< Parts to reconstruct, in all images
+    int32_t completedFiles;   ///< Parts completed so far
+    int32_t fetchFiles;       ///< Parts which need to be fetched
+    int32_t localFiles;       ///< Parts found locally
+    uint64_t numBytes;        ///< Total size of the parts to reconstruct
+    uint64_t completedBytes;  ///< Total size of the parts completed
+    uint64_t fetchBytes;      ///< Total size of the parts to be fetched
+    int32_t numWorkers;       ///< Number of elements of @c workers in use
+    int32_t numMirrors;       ///< Number of elements of @c mirrors in use
+    statusWorker workers[statusMaxWorkers];
+    statusMirror mirrors[statusMaxMirrors];
+} statusData;
+
+/**
+ * @brief The contents of a status file
+ *
+ * The block is updated under a sequence lock: @c sequence is odd while
+ * @c data is being written, and is incremented again once it has been, so
+ * that readers never wait for the writer, nor the writer for readers. A
+ * reader copies @c data, and retries unless @c sequence was the same even
+ * number before and after; see statusRead().
+ */
+typedef struct {
+    uint64_t magic;           ///< STATUS_MAGIC
+    uint32_t version;         ///< STATUS_VERSION
+    uint32_t sequence;        ///< Sequence lock over @c data
+    statusData data;          ///< The latest snapshot
+} statusBlock;
+
+typedef struct _statusFile statusFile;
+
+/**
+ * @brief Create a status file at @p path for publishing the status of a
+ *        session with statusUpdate()
+ *
+ * The file is memory mapped, so it is best kept on a tmpfs such as /dev/shm.
+ * An existing file is replaced, without disturbing readers which still have
+ * it mapped.
+ *
+ * @return The status file, or NULL on failure
+ */
+statusFile *statusCreate(const char *path);
+
+/**
+ * @brief Publish the current status of @p session to @p status
+ *
+ * Only one thread may update a status file at a time. The workers of the
+ * session are only held up for as long as it takes to copy their transfers.
+ */
+void statusUpdate(statusFile *status, igdoSession *session);
+
+/**
+ * @brief Stop publishing to @p status; the file is left in place, with the
+ *        last status published
+ */
+void statusClose(statusFile *status);
+
+/**
+ * @brief Map the status file at @p path for reading
+ *
+ * @return The status block, or NULL if @p path couldn't be mapped, or isn't a
+ *         status file of this version
+ */
+const statusBlock *statusMap(const char *path);
+
+/**
+ * @brief Unmap a status block mapped by statusMap()
+ */
+void statusUnmap(const statusBlock *block);
+
+/**
+ * @brief Copy a consistent snapshot of @p block to @p data
+ *
+ * @return @c true on success; @c false if the writer kept getting in the way
+ */
+bool statusRead(const statusBlock *block, statusData *data);
+
+#endif
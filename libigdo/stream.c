@@ -0,0 +1,277 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stream.h"
+#include "jigdo-md5-private.h"
+#include "md5.h"
+#include "metrics.h"
+
+/**
+ * @brief A range of the stream waiting for its turn to be written
+ */
+typedef struct _streamSegment {
+    off_t offset;
+    size_t len;
+    const void *data;
+    bool owned;               ///< Whether @c data is freed once written
+    struct _streamSegment *next;
+} streamSegment;
+
+struct _outputStream {
+    int fd;
+    uint64_t size;
+    uint64_t window;
+    off_t head;               ///< Offset of the next byte to be written
+    streamSegment *held;      ///< Ranges waiting to be written, by offset
+    streamSegment *tail;      ///< Last element of @c held
+    bool writing;             ///< Whether a thread is writing ranges out
+    bool failed;              ///< Set once a write has failed
+    struct MD5Context md5;    ///< Checksum of everything written so far
+    pthread_mutex_t lock;
+};
+
+outputStream *streamOpen(int fd, uint64_t size, uint64_t window)
+{
+    outputStream *stream = calloc(1, sizeof(*stream));
+
+    if (!stream) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&stream->lock, NULL) != 0) {
+        free(stream);
+        return NULL;
+    }
+
+    stream->fd = fd;
+    stream->size = size;
+    stream->window = window;
+    MD5Init(&stream->md5);
+
+    return stream;
+}
+
+void streamClose(outputStream *stream)
+{
+    if (!stream) {
+        return;
+    }
+
+    while (stream->held) {
+        streamSegment *seg = stream->held;
+
+        stream->held = seg->next;
+        if (seg->owned) {
+            free((void *) seg->data);
+        }
+        free(seg);
+    }
+
+    pthread_mutex_destroy(&stream->lock);
+    free(stream);
+}
+
+/**
+ * @brief Add @p len bytes at @p data to the checksum of the stream
+ */
+static void checksum(outputStream *stream, const void *data, size_t len)
+{
+    /* MD5Update() takes an unsigned length */
+    while (len > 0) {
+        unsigned piece = len < 1 << 30 ? len : 1 << 30;
+
+        MD5Update(&stream->md5, data, piece);
+        data += piece;
+        len -= piece;
+    }
+}
+
+/**
+ * @brief Write all of @p len bytes at @p data to the stream's file
+ */
+static bool writeAll(int fd, const void *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return false;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Insert @p seg into the list of held ranges, in order of offset
+ *
+ * @note Must be called with @c stream->lock held
+ */
+static void insertNoMutex(outputStream *stream, streamSegment *seg)
+{
+    streamSegment **link;
+
+    /* Ranges are mostly added in order; check the end of the list first */
+    if (!stream->tail || stream->tail->offset < seg->offset) {
+        link = stream->tail ? &stream->tail->next : &stream->held;
+    } else {
+        for (link = &stream->held; (*link)->offset < seg->offset;
+             link = &(*link)->next);
+    }
+
+    seg->next = *link;
+    *link = seg;
+
+    if (!seg->next) {
+        stream->tail = seg;
+    }
+}
+
+/**
+ * @brief Queue a range, and write out whatever is ready if no other thread
+ *        already is
+ *
+ * Writes happen without the lock held, so that ranges may keep being queued
+ * while the stream's reader is slow.
+ */
+static bool queue(outputStream *stream, off_t offset, const void *data,
+                  size_t len, bool owned)
+{
+    streamSegment *seg = malloc(sizeof(*seg));
+    bool ret;
+
+    if (!seg) {
+        if (owned) {
+            free((void *) data);
+        }
+        return false;
+    }
+
+    seg->offset = offset;
+    seg->len = len;
+    seg->data = data;
+    seg->owned = owned;
+
+    pthread_mutex_lock(&stream->lock);
+
+    /* Nothing more will be written, so there's no point in holding the range */
+    if (stream->failed) {
+        if (owned) {
+            free((void *) data);
+        }
+        free(seg);
+        ret = false;
+        goto done;
+    }
+
+    insertNoMutex(stream, seg);
+
+    if (stream->writing) {
+        ret = !stream->failed;
+        goto done;
+    }
+
+    stream->writing = true;
+
+    while (!stream->failed && stream->held &&
+           stream->held->offset == stream->head) {
+        uint64_t start, written;
+        bool ok;
+
+        seg = stream->held;
+        stream->held = seg->next;
+        if (!stream->held) {
+            stream->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&stream->lock);
+
+        /* Only the writing thread touches the checksum */
+        start = metricsNow();
+        ok = writeAll(stream->fd, seg->data, seg->len);
+        written = metricsNow();
+        checksum(stream, seg->data, seg->len);
+        metricsAddWork(METRICS_WORK_WRITE, seg->len, written - start);
+        metricsAddWork(METRICS_WORK_HASH, seg->len, metricsNow() - written);
+        if (seg->owned) {
+            free((void *) seg->data);
+        }
+
+        pthread_mutex_lock(&stream->lock);
+
+        stream->head += seg->len;
+        stream->failed = stream->failed || !ok;
+        free(seg);
+    }
+
+    stream->writing = false;
+    ret = !stream->failed;
+
+done:
+    pthread_mutex_unlock(&stream->lock);
+
+    return ret;
+}
+
+bool streamAddData(outputStream *stream, off_t offset, const void *data,
+                   size_t len)
+{
+    return queue(stream, offset, data, len, false);
+}
+
+bool streamCommit(outputStream *stream, off_t offset, void *data, size_t len)
+{
+    return queue(stream, offset, data, len, true);
+}
+
+bool streamWithinWindow(outputStream *stream, off_t offset)
+{
+    bool ret;
+
+    pthread_mutex_lock(&stream->lock);
+    ret = offset <= stream->head || offset - stream->head < stream->window;
+    pthread_mutex_unlock(&stream->lock);
+
+    return ret;
+}
+
+bool streamFinish(outputStream *stream, md5Checksum *md5)
+{
+    bool ret;
+
+    pthread_mutex_lock(&stream->lock);
+    ret = !stream->failed && !stream->writing && stream->head == stream->size;
+    pthread_mutex_unlock(&stream->lock);
+
+    MD5Final(md5, &stream->md5);
+
+    return ret;
+}
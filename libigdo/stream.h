@@ -0,0 +1,96 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_STREAM_H
+#define PIGDO_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "jigdo-md5.h"
+
+/**
+ * @brief An output which can only be written sequentially, such as a pipe
+ *
+ * Ranges of the image may be handed to the stream in any order. Each range is
+ * held in a reorder buffer until everything before it has been written, and
+ * the thread which completes the range at the head of the stream writes it out
+ * along with any held ranges which directly follow it.
+ */
+typedef struct _outputStream outputStream;
+
+/**
+ * @brief Set up a stream of @p size bytes to @p fd
+ *
+ * @param window How far past the head of the stream new ranges may start; see
+ *               streamWithinWindow()
+ *
+ * @return The new stream on success, or NULL on failure
+ */
+outputStream *streamOpen(int fd, uint64_t size, uint64_t window);
+
+/**
+ * @brief Release @p stream, along with any ranges it still holds
+ */
+void streamClose(outputStream *stream);
+
+/**
+ * @brief Queue @p len bytes of @p data, to be written at @p offset
+ *
+ * Unlike streamCommit(), the data is not copied or freed by the stream, and
+ * does not count towards its reorder buffer: @p data must remain valid until
+ * @p stream is closed. This is meant for data which is in memory anyway, such
+ * as the data parts of a @c .template file.
+ *
+ * @return @c true on success; @c false on failure
+ */
+bool streamAddData(outputStream *stream, off_t offset, const void *data,
+                   size_t len);
+
+/**
+ * @brief Queue @p len bytes of @p data, to be written at @p offset
+ *
+ * The stream takes ownership of @p data, which must have been allocated with
+ * malloc(3), in every case: on failure it has either been freed already or is
+ * freed by streamClose(), so the caller must not touch it again either way.
+ *
+ * @return @c true on success; @c false on failure, including failure to write
+ *         to the stream earlier on, after which nothing more will be written
+ */
+bool streamCommit(outputStream *stream, off_t offset, void *data, size_t len);
+
+/**
+ * @brief Determine whether work on a range at @p offset should start yet
+ *
+ * Ranges which start within the window past the head of the stream are fair
+ * game; ranges further out would only sit in the reorder buffer. The range at
+ * the head itself is always within the window, however large it is, so that
+ * the stream can make progress.
+ */
+bool streamWithinWindow(outputStream *stream, off_t offset);
+
+/**
+ * @brief Check that all of the stream has been written
+ *
+ * @param md5 Where the MD5 checksum of everything written is stored
+ *
+ * @return @c true if all of the stream was written; @c false otherwise
+ */
+bool streamFinish(outputStream *stream, md5Checksum *md5);
+
+#endif
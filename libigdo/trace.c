@@ -0,0 +1,238 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "metrics.h"
+#include "util.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *traceFile;       ///< Where the trace is written, or NULL
+static volatile bool enabled; ///< Whether @c traceFile is set, for checking
+                              ///< without taking @c lock
+static uint64_t origin;       ///< When the trace was started
+static bool firstEvent;       ///< No event has been written yet
+static int pid;               ///< Process ID recorded with each event
+static bool *namedTracks;     ///< Whether each track has been named yet
+static int numNamedTracks;    ///< Number of elements in @c namedTracks
+
+static __thread int currentTrack; ///< Track of the calling thread
+
+/**
+ * @brief Start a new event of the trace
+ *
+ * @note Must be called with @c lock held
+ */
+static void beginEventNoMutex(const char *name, const char *phase, int track)
+{
+    fprintf(traceFile, "%s{\"name\": ", firstEvent ? "" : ",\n");
+    writeJSONString(traceFile, name);
+    fprintf(traceFile, ", \"ph\": \"%s\", \"pid\": %d, \"tid\": %d", phase,
+            pid, track);
+    firstEvent = false;
+}
+
+/**
+ * @brief Name @p track in the trace after @p name
+ *
+ * @note Must be called with @c lock held
+ */
+static void nameTrackNoMutex(int track, const char *name)
+{
+    beginEventNoMutex("thread_name", "M", track);
+    fputs(", \"args\": {\"name\": ", traceFile);
+    writeJSONString(traceFile, name);
+    fputs("}}", traceFile);
+}
+
+bool traceOpen(const char *path)
+{
+    bool ret = false;
+
+    pthread_mutex_lock(&lock);
+
+    if (traceFile) {
+        goto done;
+    }
+
+    traceFile = fopen(path, "w");
+    if (!traceFile) {
+        goto done;
+    }
+
+    fputs("[\n", traceFile);
+    firstEvent = true;
+    pid = getpid();
+    origin = metricsNow();
+
+    beginEventNoMutex("process_name", "M", 0);
+    fputs(", \"args\": {\"name\": \"pigdo\"}}", traceFile);
+    nameTrackNoMutex(0, "stages");
+
+    enabled = true;
+    ret = true;
+
+done:
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+bool traceClose(void)
+{
+    bool ret;
+
+    pthread_mutex_lock(&lock);
+
+    if (!traceFile) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    enabled = false;
+
+    fputs("\n]\n", traceFile);
+    ret = !ferror(traceFile);
+    ret = fclose(traceFile) == 0 && ret;
+    traceFile = NULL;
+
+    free(namedTracks);
+    namedTracks = NULL;
+    numNamedTracks = 0;
+
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+bool traceEnabled(void)
+{
+    return enabled;
+}
+
+void traceSetTrack(int track)
+{
+    char name[32];
+
+    currentTrack = track;
+
+    if (!enabled || track <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    /* Each track is named once, when it is first used */
+    if (track >= numNamedTracks) {
+        bool *grown = realloc(namedTracks, sizeof(grown[0]) * (track + 1));
+
+        if (!grown) {
+            goto done;
+        }
+
+        memset(grown + numNamedTracks, 0,
+               sizeof(grown[0]) * (track + 1 - numNamedTracks));
+        namedTracks = grown;
+        numNamedTracks = track + 1;
+    }
+
+    if (traceFile && !namedTracks[track]) {
+        snprintf(name, sizeof(name), "worker %d", track - 1);
+        nameTrackNoMutex(track, name);
+        namedTracks[track] = true;
+    }
+
+done:
+    pthread_mutex_unlock(&lock);
+}
+
+void traceSpan(const char *category, const char *name, uint64_t start,
+               uint64_t end, const traceArgs *args)
+{
+    if (!enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    if (!traceFile) {
+        goto done;
+    }
+
+    /* Spans which started before the trace are cut short */
+    start = start > origin ? start - origin : 0;
+    end = end > origin ? end - origin : 0;
+    if (end < start) {
+        end = start;
+    }
+
+    beginEventNoMutex(name, "X", currentTrack);
+    fputs(", \"cat\": ", traceFile);
+    writeJSONString(traceFile, category);
+    fprintf(traceFile, ", \"ts\": %.3f, \"dur\": %.3f", start / 1e3,
+            (end - start) / 1e3);
+
+    if (args) {
+        const char *sep = "";
+
+        fputs(", \"args\": {", traceFile);
+
+        if (args->image) {
+            fputs("\"image\": ", traceFile);
+            writeJSONString(traceFile, args->image);
+            sep = ", ";
+        }
+
+        if (args->uri) {
+            fprintf(traceFile, "%s\"uri\": ", sep);
+            writeJSONString(traceFile, args->uri);
+            sep = ", ";
+        }
+
+        if (args->part) {
+            fprintf(traceFile, "%s\"offset\": %"PRIu64, sep, args->offset);
+            sep = ", ";
+        }
+
+        if (args->part || args->size) {
+            fprintf(traceFile, "%s\"size\": %"PRIu64, sep, args->size);
+            sep = ", ";
+        }
+
+        if (args->result) {
+            fprintf(traceFile, "%s\"result\": ", sep);
+            writeJSONString(traceFile, args->result);
+        }
+
+        fputc('}', traceFile);
+    }
+
+    fputc('}', traceFile);
+
+done:
+    pthread_mutex_unlock(&lock);
+}
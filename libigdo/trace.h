@@ -0,0 +1,82 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIGDO_TRACE_H
+#define PIGDO_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Details recorded along with a span of a trace
+ */
+typedef struct {
+    const char *image;        ///< Name of the image concerned, or NULL
+    const char *uri;          ///< URI or path concerned, or NULL
+    bool part;                ///< Whether @c offset and @c size are set
+    uint64_t offset;          ///< Offset of the part within the image
+    uint64_t size;            ///< Size of the part or data concerned
+    const char *result;       ///< How it turned out, or NULL
+} traceArgs;
+
+/**
+ * @brief Start recording a trace of the process in the Chrome trace event
+ *        format to @p path, e.g. for Perfetto or chrome://tracing
+ *
+ * Spans are recorded on tracks: track 0 holds the stages of reading the images
+ * and running their sessions, and each worker of a session records the stages
+ * of its parts on a track of its own; see traceSetTrack().
+ *
+ * @return @c true on success; @c false on failure, or if a trace is already
+ *         being recorded
+ */
+bool traceOpen(const char *path);
+
+/**
+ * @brief Finish the trace started with traceOpen()
+ *
+ * @return @c true if the whole trace was written; @c false otherwise
+ */
+bool traceClose(void);
+
+/**
+ * @brief Check whether a trace is being recorded, to skip gathering the
+ *        details of spans which would be dropped anyway
+ */
+bool traceEnabled(void);
+
+/**
+ * @brief Record the spans of the calling thread on track @p track, which is
+ *        named after worker @p track - 1 if it is above 0
+ */
+void traceSetTrack(int track);
+
+/**
+ * @brief Record a span of the calling thread named @p name, from @p start to
+ *        @p end as given by metricsNow()
+ *
+ * Nothing is recorded unless traceOpen() was called. May be called from any
+ * thread.
+ *
+ * @param category Category of the span, by which spans can be filtered
+ * @param args Details to record with the span, or NULL
+ */
+void traceSpan(const char *category, const char *name, uint64_t start,
+               uint64_t end, const traceArgs *args);
+
+#endif
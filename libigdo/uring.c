@@ -0,0 +1,393 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "uring.h"
+
+#if defined HAVE_LINUX_IO_URING_H
+
+/* The length of a single read or write is a 32-bit field in the submission
+ * queue entry; larger requests complete short, and callers resume them. */
+static const size_t maxRingIO = 1 << 30;
+
+struct _ioRing {
+    int fd;
+    unsigned depth;           ///< Number of submission queue entries
+    unsigned inFlight;        ///< Requests submitted but not yet reaped
+    bool reaping;             ///< Whether a thread is waiting for completions
+    bool broken;              ///< Set if the ring failed unrecoverably
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      ///< Signalled when completions have been reaped
+
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap;
+    size_t cqMapSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+};
+
+static int ringSetup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                     unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                   NULL, 0);
+}
+
+ioRing *ringOpen(unsigned depth)
+{
+    struct io_uring_params params;
+    ioRing *ring = calloc(1, sizeof(*ring));
+
+    if (!ring) {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->sqMap = ring->cqMap = ring->sqes = MAP_FAILED;
+
+    ring->fd = ringSetup(depth, &params);
+    if (ring->fd < 0) {
+        goto fail;
+    }
+
+    ring->depth = params.sq_entries;
+    ring->sqMapSize = params.sq_off.array +
+                      params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes +
+                      params.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Newer kernels map both rings with a single mmap(2) */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqMapSize > ring->sqMapSize) {
+            ring->sqMapSize = ring->cqMapSize;
+        }
+        ring->cqMapSize = ring->sqMapSize;
+    }
+
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        goto fail;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) {
+            goto fail;
+        }
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->sqHead = ring->sqMap + params.sq_off.head;
+    ring->sqTail = ring->sqMap + params.sq_off.tail;
+    ring->sqMask = ring->sqMap + params.sq_off.ring_mask;
+    ring->sqArray = ring->sqMap + params.sq_off.array;
+    ring->cqHead = ring->cqMap + params.cq_off.head;
+    ring->cqTail = ring->cqMap + params.cq_off.tail;
+    ring->cqMask = ring->cqMap + params.cq_off.ring_mask;
+    ring->cqes = ring->cqMap + params.cq_off.cqes;
+
+    if (pthread_mutex_init(&ring->lock, NULL) != 0) {
+        goto fail;
+    }
+
+    if (pthread_cond_init(&ring->cond, NULL) != 0) {
+        pthread_mutex_destroy(&ring->lock);
+        goto fail;
+    }
+
+    return ring;
+
+fail:
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqMap != MAP_FAILED && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    if (ring->sqMap != MAP_FAILED) {
+        munmap(ring->sqMap, ring->sqMapSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+
+    return NULL;
+}
+
+void ringClose(ioRing *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+bool ringRegisterBuffers(ioRing *ring, const struct iovec *bufs, int count)
+{
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                   bufs, count) == 0;
+}
+
+/**
+ * @brief Fill in the next submission queue entry for @p op
+ *
+ * @note Must be called with @c ring->lock held, and with room in the queue
+ */
+static void prepNoMutex(ioRing *ring, ioRingOp *op)
+{
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = ring->sqes + index;
+    bool isRead = op->type == RING_OP_READ;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = (uintptr_t) op;
+
+    switch (op->type) {
+    case RING_OP_READ:
+    case RING_OP_WRITE:
+        sqe->off = op->offset;
+        if (op->bufIndex >= 0) {
+            sqe->opcode = isRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->addr = (uintptr_t) op->buf;
+            sqe->len = op->len < maxRingIO ? op->len : maxRingIO;
+            sqe->buf_index = op->bufIndex;
+        } else {
+            /* The vectored opcodes predate the plain ones; use them for the
+             * sake of older kernels. */
+            op->iov.iov_base = op->buf;
+            op->iov.iov_len = op->len < maxRingIO ? op->len : maxRingIO;
+            sqe->opcode = isRead ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->addr = (uintptr_t) &op->iov;
+            sqe->len = 1;
+        }
+        break;
+    case RING_OP_FDATASYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    case RING_OP_SYNC_FILE_RANGE:
+        sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+        sqe->off = op->offset;
+        sqe->len = op->len;
+        sqe->sync_range_flags = op->flags;
+        break;
+    }
+
+    ring->sqArray[index] = index;
+    op->done = false;
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->inFlight++;
+}
+
+/**
+ * @brief Hand @p count prepared entries to the kernel
+ *
+ * @note Must be called with @c ring->lock held
+ */
+static bool submitNoMutex(ioRing *ring, unsigned count)
+{
+    while (count > 0) {
+        int submitted = ringEnter(ring->fd, count, 0, 0);
+
+        if (submitted < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+
+        if (submitted <= 0) {
+            ring->broken = true;
+            return false;
+        }
+
+        count -= submitted;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Wait for completions, or for another thread to reap them
+ *
+ * Once the ring is broken, nothing is reaped any more: the callers whose
+ * requests are still in flight give up on them and return, so their requests
+ * must never be written to again.
+ *
+ * @note Must be called with @c ring->lock held, and with requests in flight
+ */
+static bool waitNoMutex(ioRing *ring)
+{
+    unsigned head, tail;
+    int ret, err;
+
+    if (ring->broken) {
+        return false;
+    }
+
+    if (ring->reaping) {
+        pthread_cond_wait(&ring->cond, &ring->lock);
+        return !ring->broken;
+    }
+
+    ring->reaping = true;
+    pthread_mutex_unlock(&ring->lock);
+
+    ret = ringEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    err = errno;
+
+    pthread_mutex_lock(&ring->lock);
+
+    if (ret < 0 && err != EINTR) {
+        ring->broken = true;
+        goto done;
+    }
+
+    head = *ring->cqHead;
+    tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cqMask);
+        ioRingOp *op = (ioRingOp *) (uintptr_t) cqe->user_data;
+
+        op->result = cqe->res;
+        op->done = true;
+        ring->inFlight--;
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+done:
+    ring->reaping = false;
+    pthread_cond_broadcast(&ring->cond);
+
+    return !ring->broken;
+}
+
+bool ringSubmitAndWait(ioRing *ring, ioRingOp *ops, int count)
+{
+    int i, prepared = 0;
+    bool ret = false;
+
+    /* Every way out before all of the requests have completed is through the
+     * ring breaking, after which waitNoMutex() never touches them again. */
+    pthread_mutex_lock(&ring->lock);
+
+    for (i = 0; i < count && !ring->broken; ) {
+        /* Keep the number of requests in flight within the submission queue
+         * size, which also keeps the completion queue from overflowing. */
+        if (ring->inFlight < ring->depth) {
+            prepNoMutex(ring, ops + i);
+            prepared++;
+            i++;
+            continue;
+        }
+
+        if (!submitNoMutex(ring, prepared) || !waitNoMutex(ring)) {
+            goto done;
+        }
+        prepared = 0;
+    }
+
+    if (ring->broken || !submitNoMutex(ring, prepared)) {
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        while (!ops[i].done) {
+            if (!waitNoMutex(ring)) {
+                goto done;
+            }
+        }
+    }
+
+    ret = true;
+
+done:
+    pthread_mutex_unlock(&ring->lock);
+
+    return ret;
+}
+
+#else
+
+ioRing *ringOpen(unsigned depth)
+{
+    return NULL;
+}
+
+void ringClose(ioRing *ring)
+{
+}
+
+bool ringRegisterBuffers(ioRing *ring, const struct iovec *bufs, int count)
+{
+    return false;
+}
+
+bool ringSubmitAndWait(ioRing *ring, ioRingOp *ops, int count)
+{
+    return false;
+}
+
+#endif
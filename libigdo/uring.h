@@ -0,0 +1,102 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_URING_H
+#define PIGDO_URING_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Operations which can be queued on an ioRing
+ */
+typedef enum {
+    RING_OP_READ = 0,         ///< Read into @c buf
+    RING_OP_WRITE,            ///< Write from @c buf
+    RING_OP_FDATASYNC,        ///< fdatasync(2) of @c fd
+    RING_OP_SYNC_FILE_RANGE,  ///< sync_file_range(2), with @c flags
+} ringOpType;
+
+/**
+ * @brief A single I/O request
+ */
+typedef struct {
+    ringOpType type;
+    int fd;
+    void *buf;           ///< Data buffer for reads and writes
+    size_t len;          ///< Length of the I/O, or of the range to sync
+    off_t offset;        ///< File offset of the I/O, or of the range to sync
+    int bufIndex;        ///< Index of the registered buffer containing @c buf,
+                         ///< or -1 if @c buf is not in a registered buffer
+    unsigned flags;      ///< Flags for RING_OP_SYNC_FILE_RANGE
+    ssize_t result;      ///< Filled in on completion: the number of bytes
+                         ///< transferred, or a negated errno value
+    bool done;           ///< Private: set once the request has completed
+    struct iovec iov;    ///< Private: vector for unregistered reads and writes
+} ioRingOp;
+
+/**
+ * @brief A submission and completion queue pair, using io_uring(7)
+ *
+ * A ring may be shared by any number of threads. Requests submitted by several
+ * threads at once are handed to the kernel together, and each thread waits
+ * only for the completion of its own requests.
+ */
+typedef struct _ioRing ioRing;
+
+/**
+ * @brief Set up a ring with room for @p depth requests in flight
+ *
+ * @return The new ring, or NULL if io_uring(7) is not supported or could not
+ *         be set up, e.g. because it was disabled by the administrator
+ */
+ioRing *ringOpen(unsigned depth);
+
+/**
+ * @brief Tear down @p ring
+ *
+ * @note No requests may be in flight.
+ */
+void ringClose(ioRing *ring);
+
+/**
+ * @brief Register @p count buffers for use with ioRingOp.bufIndex
+ *
+ * Registered buffers are pinned by the kernel once, instead of for every
+ * request, which makes I/O on them cheaper.
+ *
+ * @return @c true on success; @c false on failure, e.g. because the buffers
+ *         exceed RLIMIT_MEMLOCK
+ */
+bool ringRegisterBuffers(ioRing *ring, const struct iovec *bufs, int count);
+
+/**
+ * @brief Submit @p count requests and wait until all of them have completed
+ *
+ * The requests are independent of each other and may complete in any order.
+ *
+ * @return @c true if all requests completed, successfully or not, in which case
+ *         their individual outcomes are in @c result; @c false if the ring
+ *         failed, in which case some of the requests may never complete, and
+ *         the ring refuses any further requests. @p ops themselves are never
+ *         written to once this returns, but the kernel may still write to
+ *         their buffers until ringClose().
+ */
+bool ringSubmitAndWait(ioRing *ring, ioRingOp *ops, int count);
+
+#endif
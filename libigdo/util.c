@@ -56,3 +56,49 @@ bool isAbsolute(const char *path)
 {
     return path[0] == '/';
 }
+
+bool parseSize(const char *str, char **end, uint64_t *size)
+{
+    static const char suffixes[] = "KMGT";
+    const char *suffix;
+    unsigned long long value;
+
+    if (*str < '0' || *str > '9') {
+        return false;
+    }
+
+    value = strtoull(str, end, 10);
+
+    if (**end && (suffix = strchr(suffixes, **end))) {
+        int shift = (suffix - suffixes + 1) * 10;
+
+        if (value > UINT64_MAX >> shift) {
+            return false;
+        }
+        value <<= shift;
+        (*end)++;
+    }
+
+    *size = value;
+
+    return true;
+}
+
+void writeJSONString(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+
+    for (; *str; str++) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
@@ -18,7 +18,9 @@
 #ifndef PIGDO_UTIL_H
 #define PIGDO_UTIL_H
 
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * @brief Concatenate a directory and file name, with a '/' in between
@@ -44,4 +46,18 @@ off_t pagebase(off_t offset);
  * @brief Determine whether a path is absolute
  */
 bool isAbsolute(const char *path);
+
+/**
+ * @brief Parse a size with an optional binary K, M, G or T suffix from @p str
+ *
+ * @param end Where a pointer to the first character after the size is stored
+ *
+ * @return @c true on success; @c false if @p str doesn't start with a size
+ */
+bool parseSize(const char *str, char **end, uint64_t *size);
+
+/**
+ * @brief Write @p str to @p fp as a JSON string
+ */
+void writeJSONString(FILE *fp, const char *str);
 #endif
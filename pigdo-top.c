@@ -0,0 +1,224 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+
+#include "libigdo/session.h"
+#include "libigdo/status.h"
+
+/**
+ * @brief Default seconds between refreshes of the display
+ */
+#define defaultDelay 1.0
+
+/*
+ * @brief print a usage message and exit
+ */
+static void usage(const char *progName)
+{
+    fprintf(stderr,
+            "Usage: %s [-d seconds] [-1] statusfile\n\n"
+            "Display the status of a running pigdo, as published with\n"
+            "'pigdo --status-file statusfile'. The status is only read, so\n"
+            "it may be polled as often as desired without slowing pigdo.\n\n"
+            "-d | --delay:    seconds between refreshes, default: %g\n\n"
+            "-1 | --once:     print the status once, without clearing the\n"
+            "                 screen, and exit\n",
+            progName, defaultDelay);
+    exit(1);
+}
+
+/**
+ * @brief Find the mirror named @p name in @p data
+ *
+ * @return The mirror, or NULL if there is none by that name
+ */
+static const statusMirror *findMirror(const statusData *data,
+                                      const char *name)
+{
+    int i;
+
+    for (i = 0; i < data->numMirrors; i++) {
+        if (strcmp(data->mirrors[i].name, name) == 0) {
+            return data->mirrors + i;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Print @p data, working out the current rates of the mirrors from
+ *        the snapshot before it, @p prev, if not NULL
+ */
+static void printStatus(const statusData *data, const statusData *prev)
+{
+    double seconds = 0;
+    bool running = kill(data->pid, 0) == 0 || errno == EPERM;
+    int i;
+
+    if (prev && data->updated > prev->updated) {
+        seconds = (data->updated - prev->updated) / 1e9;
+    }
+
+    printf("pid %d (%s), stage: %s\n", (int) data->pid,
+           running ? "running" : "exited",
+           sessionStageName(data->stage));
+    printf("%d of %d files (%.1f/%.1f MiB) done; %d to fetch (%.1f MiB), "
+           "%d local\n\n", data->completedFiles, data->numFiles,
+           data->completedBytes / 1048576.0, data->numBytes / 1048576.0,
+           data->fetchFiles, data->fetchBytes / 1048576.0, data->localFiles);
+
+    printf("%6s %14s %12s %5s  %s\n", "Worker", "Offset", "Size", "Done",
+           "URI");
+    for (i = 0; i < data->numWorkers; i++) {
+        const statusWorker *worker = data->workers + i;
+
+        printf("%6d %14"PRIu64" %12"PRIu64" %4.0f%%  %s\n", worker->worker,
+               worker->offset, worker->size, worker->size ?
+               100.0 * worker->fetchedBytes / worker->size : 100.0,
+               worker->uri);
+    }
+
+    printf("\n%-32s %10s %7s %7s %8s %9s\n", "Mirror", "MiB", "Parts",
+           "Errors", "MiB/s", "Avg MiB/s");
+    for (i = 0; i < data->numMirrors; i++) {
+        const statusMirror *mirror = data->mirrors + i;
+        const statusMirror *before = prev ? findMirror(prev, mirror->name) :
+                                            NULL;
+
+        printf("%-32s %10.1f %7"PRIu64" %7"PRIu64, mirror->name,
+               mirror->bytes / 1048576.0, mirror->parts, mirror->errors);
+
+        if (seconds > 0) {
+            uint64_t bytes = before && before->bytes < mirror->bytes ?
+                             mirror->bytes - before->bytes :
+                             before ? 0 : mirror->bytes;
+
+            printf(" %8.2f", bytes / 1048576.0 / seconds);
+        } else {
+            printf(" %8s", "-");
+        }
+
+        /* Over the time spent on the transfers which are over */
+        if (mirror->ns > 0) {
+            printf(" %9.2f\n", mirror->bytes / 1048576.0 /
+                               (mirror->ns / 1e9));
+        } else {
+            printf(" %9s\n", "-");
+        }
+    }
+}
+
+int main(int argc, char * const * argv)
+{
+    const char *progName = argv[0];
+    const statusBlock *block;
+    statusData *data = NULL, *prev = NULL;
+    double delay = defaultDelay;
+    bool once = false, havePrev = false;
+    struct timespec interval;
+    int opt, ret = 1;
+
+    static struct option opts[] = {
+        {"delay",       required_argument, NULL, 'd'},
+        {"once",        no_argument,       NULL, '1'},
+        {NULL,          0,                 NULL,  0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "d:1", opts, NULL)) != -1) {
+        switch(opt) {
+            case 'd':
+                if (sscanf(optarg, "%lf", &delay) != 1 || delay <= 0) {
+                    usage(progName);
+                }
+                break;
+            case '1':
+                once = true;
+                break;
+            default:
+                usage(progName);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(progName);
+    }
+
+    block = statusMap(argv[optind]);
+    if (!block) {
+        fprintf(stderr, "'%s' isn't a pigdo status file\n", argv[optind]);
+        return 1;
+    }
+
+    /* Rather large for the stack */
+    data = malloc(sizeof(*data));
+    prev = malloc(sizeof(*prev));
+    if (!data || !prev) {
+        goto done;
+    }
+
+    interval.tv_sec = delay;
+    interval.tv_nsec = (delay - interval.tv_sec) * 1e9;
+
+    while (true) {
+        statusData *swap;
+
+        if (!statusRead(block, data)) {
+            fprintf(stderr, "Failed to read '%s'\n", argv[optind]);
+            goto done;
+        }
+
+        if (!once) {
+            printf("\033[H\033[J"); // Home the cursor and clear the screen
+        }
+        printStatus(data, havePrev ? prev : NULL);
+        fflush(stdout);
+
+        if (once) {
+            break;
+        }
+
+        swap = prev;
+        prev = data;
+        data = swap;
+        havePrev = true;
+
+        nanosleep(&interval, NULL);
+    }
+
+    ret = 0;
+
+done:
+    free(data);
+    free(prev);
+    statusUnmap(block);
+
+    return ret;
+}
@@ -19,19 +19,83 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <libgen.h>
 #include <string.h>
-#include <assert.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <inttypes.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "libigdo/jigdo.h"
 #include "libigdo/fetch.h"
+#include "libigdo/session.h"
+#include "libigdo/shard.h"
+#include "libigdo/export.h"
+#include "libigdo/metrics.h"
+#include "libigdo/stats.h"
+#include "libigdo/trace.h"
 #include "libigdo/util.h"
 
-#include "worker.h"
+#include "control.h"
+#include "daemon.h"
+#include "job.h"
+#include "serve.h"
+
+/**
+ * @brief getopt_long(3) values for options which have no short form
+ */
+enum {
+    OPT_CACHE_SIZE = 256,
+    OPT_CACHE_HARVEST,
+    OPT_OUTPUT_ENGINE,
+    OPT_MAX_IN_FLIGHT,
+    OPT_QUEUE_DEPTH,
+    OPT_DIRECT,
+    OPT_SYNC,
+    OPT_SYNC_INTERVAL,
+    OPT_WRITEBACK,
+    OPT_DROP_CACHE,
+    OPT_STREAM,
+    OPT_VERIFY_COPIES,
+    OPT_RANGE,
+    OPT_SERVE,
+    OPT_DAEMON,
+    OPT_PEER,
+    OPT_SHARD,
+    OPT_MERGE,
+    OPT_CLAIM,
+    OPT_EXPORT_MANIFEST,
+    OPT_EXPORT_FORMAT,
+    OPT_IMPORT_DIR,
+    OPT_CONTROL,
+    OPT_METRICS_FILE,
+    OPT_METRICS_JSON,
+    OPT_TRACE,
+    OPT_STATS,
+    OPT_STATUS_FILE,
+};
+
+/**
+ * @brief Default size limit of the part cache, in MiB
+ */
+#define defaultCacheSizeMiB 4096
+
+/**
+ * @brief Default cap on the size of downloaded parts held in memory, in MiB
+ */
+#define defaultMaxInFlightMiB 256
+
+/**
+ * @brief Default number of requests the io_uring output engine keeps queued
+ */
+#define defaultQueueDepth 64
+
+/**
+ * @brief Default number of seconds between syncs with --sync periodic
+ */
+#define defaultSyncInterval 5
 
 /*
  * @brief print a usage message and exit
@@ -39,15 +103,40 @@
 void usage(const char *progName)
 {
     fprintf(stderr,
-            "Usage: %s jigdofile \\\n    "
-            "[-o output] [-t template] [-j threads] [-m mirror=path ...]\n\n"
-            "jigdofile:       location of the .jigdo file\n\n"
-            "-o | --output:   location where output file will be written\n"
+            "Usage: %s jigdofile [jigdofile ...] \\\n    "
+            "[-o output] [-t template] [-j threads] [-m mirror=path ...] \\\n"
+            "    [-v] [-c cachedir [--cache-size MiB] [--cache-harvest]] \\\n"
+            "    [--output-engine pwrite|mmap|io_uring] \\\n"
+            "    [--max-in-flight MiB] [--queue-depth N] [--direct] \\\n"
+            "    [--sync end|periodic|part [--sync-interval seconds]] \\\n"
+            "    [--writeback] [--drop-cache] [--stream] [--verify-copies] \\\n"
+            "    [--range START-END] [--serve [host:]port] \\\n"
+            "    [--peer URI ...] [--shard K/N] [--merge manifest ...] \\\n"
+            "    [--claim claimfile] [--export-manifest file \\\n"
+            "    [--export-format json|aria2]] [--import-dir dir] \\\n"
+            "    [--control socket] [--metrics-file file] \\\n"
+            "    [--metrics-json file] [--trace file] [--stats] \\\n"
+            "    [--status-file file] [--daemon[=socket]]\n\n"
+            "jigdofile:       location of the .jigdo file. Several .jigdo\n"
+            "                 files may be given to reconstruct a set of\n"
+            "                 images at once, fetching files which are shared\n"
+            "                 between images only once.\n\n"
+            "-o | --output:   location where output file will be written, or\n"
+            "                 the directory where output files will be\n"
+            "                 written when several .jigdo files are given\n"
             "                 default: use filename specified in the .jigdo\n"
             "                 file, and save in same directory as the .jigdo\n"
             "                 file, or in the current directory if the .jigdo\n"
-            "                 file was fetched remotely\n\n"
-            "-t | --template: location of the .template file\n"
+            "                 file was fetched remotely. May be a block\n"
+            "                 device, which is written with O_DIRECT. '-'\n"
+            "                 streams the image to standard output, and\n"
+            "                 pipes and character devices are streamed to\n"
+            "                 as well; see --stream. With a single .jigdo\n"
+            "                 file, -o may be given several times to write\n"
+            "                 identical copies of the image, e.g. to several\n"
+            "                 devices; partial output is then not resumed.\n\n"
+            "-t | --template: location of the .template file; only valid with\n"
+            "                 a single .jigdo file\n"
             "                 default: use filename specified in the .jigdo\n"
             "                 file, resolved relative to the location of the\n"
             "                 .jigdo file\n\n"
@@ -57,52 +146,578 @@ void usage(const char *progName)
             "                 format, where 'mirror' is the name of a mirror\n"
             "                 as specified in the .jigdo file, and 'path' is\n"
             "                 a remote URI or local path where file paths in\n"
-            "                 the .jigdo file will be mapped\n",
-            progName, defaultNumThreads);
+            "                 the .jigdo file will be mapped\n\n"
+            "-v | --verbose:  report on individual parts as they complete,\n"
+            "                 e.g. how locally found files were placed\n\n"
+            "-c | --cache:    directory of a persistent cache of component\n"
+            "                 files, which is consulted before any remote\n"
+            "                 mirror and populated with fetched files. The\n"
+            "                 cache may be shared by concurrent pigdo runs.\n\n"
+            "--cache-size:    size limit of the cache in MiB, above which the\n"
+            "                 least recently used files are evicted\n"
+            "                 default: %d\n\n"
+            "--cache-harvest: also add all files from the image to the cache\n"
+            "                 once it has been successfully reconstructed\n\n"
+            "--output-engine: how parts are written to the output file:\n"
+            "                 'pwrite' downloads into pooled memory buffers\n"
+            "                 and writes each part once it has been verified,\n"
+            "                 'mmap' downloads straight into a mapping of the\n"
+            "                 output file, 'io_uring' is like 'pwrite' but\n"
+            "                 queues writes and local copies with\n"
+            "                 io_uring(7), falling back to 'pwrite' if that\n"
+            "                 is unavailable\n"
+            "                 default: %s\n\n"
+            "--max-in-flight: cap on the total size in MiB of parts being\n"
+            "                 downloaded at once\n"
+            "                 default: %d\n\n"
+            "--queue-depth:   number of I/O requests the io_uring engine may\n"
+            "                 have queued at once\n"
+            "                 default: %d\n\n"
+            "--direct:        open output files with O_DIRECT, bypassing the\n"
+            "                 page cache; not supported by the mmap engine\n\n"
+            "--sync:          when to flush output files to disk: 'end'\n"
+            "                 only once all parts are assembled, 'periodic'\n"
+            "                 also every --sync-interval seconds, 'part' also\n"
+            "                 after each part is written\n"
+            "                 default: %s\n\n"
+            "--sync-interval: seconds between flushes with --sync periodic\n"
+            "                 default: %d\n\n"
+            "--writeback:     start writing each part to disk as soon as it\n"
+            "                 is complete, rather than leaving it to the\n"
+            "                 kernel, to avoid a burst of I/O at the end\n\n"
+            "--drop-cache:    drop completed parts of the output from the\n"
+            "                 page cache once they are on disk, so that a\n"
+            "                 large image doesn't evict everything else\n\n"
+            "--stream:        write the image strictly in order, for outputs\n"
+            "                 which must be written sequentially. Parts are\n"
+            "                 fetched in order, at most --max-in-flight MiB\n"
+            "                 ahead of the output, and files which occur\n"
+            "                 several times are fetched each time. Only a\n"
+            "                 single image may be streamed.\n\n"
+            "--verify-copies: read back each copy of the image written with\n"
+            "                 several -o options to check its MD5 checksum,\n"
+            "                 rather than relying on the checksum of the\n"
+            "                 first output alone\n\n"
+            "--range:         only reconstruct the bytes of a single image\n"
+            "                 from START up to, but not including, END.\n"
+            "                 Sizes may have a K, M, G or T suffix, and END\n"
+            "                 may be left out to go to the end of the image.\n"
+            "                 Only files overlapping the range are fetched,\n"
+            "                 and the rest of the output is left as a hole.\n"
+            "                 Each file is checked, but the image as a whole\n"
+            "                 can't be. Not valid with streamed output.\n\n"
+            "--serve:         serve the images over HTTP on the given port,\n"
+            "                 of the loopback address unless a host is given,\n"
+            "                 while they are reconstructed, and until\n"
+            "                 interrupted once they are. Ranges which aren't\n"
+            "                 complete yet are fetched ahead of the rest.\n"
+            "                 Files which have been verified, or are in the\n"
+            "                 cache, are served to peers by MD5 checksum;\n"
+            "                 see --peer. Metrics are served at /metrics in\n"
+            "                 the Prometheus text format; see\n"
+            "                 --metrics-file. Not valid with streamed\n"
+            "                 output.\n\n"
+            "--peer:          URI of another pigdo serving files with\n"
+            "                 --serve, e.g. on the local network, which is\n"
+            "                 asked for each file before any mirror. May be\n"
+            "                 given several times. Peers which can't be\n"
+            "                 reached are left alone for a while.\n\n"
+            "--shard:         only fetch shard K of N of a single image, so\n"
+            "                 that N machines can share the download. Each\n"
+            "                 gets a share of the files balanced by size,\n"
+            "                 and writes them to the -o file, which is\n"
+            "                 required, leaving out the template data. A\n"
+            "                 manifest of the shard is written next to it,\n"
+            "                 with '.manifest' appended to its name.\n\n"
+            "--merge:         copy the files listed in a shard's manifest\n"
+            "                 from the shard into a single output image,\n"
+            "                 which is then completed and checked as usual.\n"
+            "                 May be given once for each shard.\n\n"
+            "--claim:         share a single output image with other pigdo\n"
+            "                 processes, e.g. on other machines writing to\n"
+            "                 a common filesystem. Each file is claimed by\n"
+            "                 locking its range of the given claim file,\n"
+            "                 which all of them must use, so that it is only\n"
+            "                 fetched once; files claimed by others are\n"
+            "                 waited for at the end.\n\n"
+            "--export-manifest: write the offset, size, MD5 checksum and\n"
+            "                 mirror URIs of each file to the given file, or\n"
+            "                 '-' for standard output, instead of\n"
+            "                 reconstructing the images, so that the files\n"
+            "                 can be downloaded by another tool\n\n"
+            "--export-format: format of the exported manifest: 'json', or\n"
+            "                 'aria2' for an input file for aria2c -i\n"
+            "                 default: %s\n\n"
+            "--import-dir:    directory holding files downloaded with an\n"
+            "                 exported manifest, named after their MD5\n"
+            "                 checksums. They are checked and placed in the\n"
+            "                 images before anything is fetched.\n\n"
+            "--control:       take commands on a Unix socket at the given\n"
+            "                 location while the images are reconstructed,\n"
+            "                 to change the number of threads, limit the\n"
+            "                 bandwidth, weight or disable mirrors, pause\n"
+            "                 and resume, or race slow transfers with\n"
+            "                 others. Send 'help' for a list of commands.\n\n"
+            "--metrics-file:  save metrics to the given file in the\n"
+            "                 Prometheus text format every %d seconds and\n"
+            "                 once the images are done, e.g. for the\n"
+            "                 textfile collector of node_exporter: parts and\n"
+            "                 bytes in each state, bytes, parts, errors and\n"
+            "                 time of transfers from each mirror, histograms\n"
+            "                 of the latency and size of parts, and bytes\n"
+            "                 and time spent hashing, decompressing and\n"
+            "                 writing\n\n"
+            "--metrics-json:  write a summary of the same metrics, with the\n"
+            "                 throughput worked out, to the given file as\n"
+            "                 JSON on exit\n\n"
+            "--trace:         record a timeline of the run to the given file\n"
+            "                 in the Chrome trace event format, for Perfetto\n"
+            "                 or chrome://tracing: reading the .jigdo and\n"
+            "                 .template files and the template data, the\n"
+            "                 local scan, the final MD5 checks, and for each\n"
+            "                 file each stage from being handed to a worker\n"
+            "                 until it is complete, with the DNS, connect,\n"
+            "                 TLS, first byte and body times of transfers\n\n"
+            "--stats:         print the wall time, CPU time, peak memory use\n"
+            "                 and throughput of each stage on exit: reading\n"
+            "                 the .jigdo and .template files, writing the\n"
+            "                 template data, checking existing output, the\n"
+            "                 local scan, fetching, and the final MD5 check\n\n"
+            "--status-file:   publish the status of the run, with the\n"
+            "                 transfer of each worker and the rates of the\n"
+            "                 mirrors, in the given memory-mapped file, e.g.\n"
+            "                 in /dev/shm, for pigdo-top to display\n\n"
+            "--daemon:        submit the job to pigdod listening on the given\n"
+            "                 socket, or its default socket, rather than\n"
+            "                 running it in this process. Only -o, -t, -m,\n"
+            "                 -v, --verify-copies and --range may be given\n"
+            "                 as well; the output can't be streamed.\n",
+            progName, defaultNumThreads, defaultCacheSizeMiB,
+            outputEngineName(OUTPUT_ENGINE_PWRITE), defaultMaxInFlightMiB,
+            defaultQueueDepth, outputSyncPolicyName(OUTPUT_SYNC_END),
+            defaultSyncInterval, exportFormatName(EXPORT_FORMAT_JSON),
+            metricsInterval);
     exit(1);
 }
 
+/**
+ * @brief Parse a range of the image in 'START-END' format, where END may be
+ *        left out to go up to the end of the image
+ *
+ * @return @c true on success; @c false if @p str isn't a valid range
+ */
+static bool parseRange(const char *str, uint64_t *start, uint64_t *end)
+{
+    char *next;
+
+    if (!parseSize(str, &next, start) || *next++ != '-') {
+        return false;
+    }
+
+    if (!*next) {
+        *end = UINT64_MAX;
+        return true;
+    }
+
+    return parseSize(next, &next, end) && !*next && *start < *end;
+}
+
+static volatile sig_atomic_t transfersRequested = 0;
+
+/**
+ * @brief SIGUSR1 handler; the transfers are listed by jobRun()
+ */
+static void requestTransfers(int sig)
+{
+    transfersRequested = 1;
+}
+
+/**
+ * @brief Whether @p opt, as returned by getopt_long(3), may be given along
+ *        with --daemon; the others configure the daemon itself
+ */
+static bool isJobOption(int opt)
+{
+    switch (opt) {
+        case 'm':
+        case 'o':
+        case 't':
+        case 'v':
+        case OPT_VERIFY_COPIES:
+        case OPT_RANGE:
+        case OPT_DAEMON:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Submit @p job to the daemon listening at @p socketPath, and wait for
+ *        it to be done
+ *
+ * The daemon reports on the job to this process's standard output and error.
+ *
+ * @return The exit status for the job
+ */
+static int submitJob(const char *socketPath, const daemonJob *job)
+{
+    int sock = daemonConnect(socketPath);
+    bool success;
+
+    if (sock < 0) {
+        fprintf(stderr, "Failed to connect to pigdod on '%s': %s\n",
+                socketPath, strerror(errno));
+        return 1;
+    }
+
+    /* Whoever answers gets this process's output descriptors */
+    if (!daemonCheckPeer(sock)) {
+        fprintf(stderr, "The socket '%s' doesn't belong to your pigdod\n",
+                socketPath);
+        close(sock);
+        return 1;
+    }
+
+    if (!daemonSendJob(sock, job)) {
+        fprintf(stderr, "Failed to submit the job to pigdod\n");
+        close(sock);
+        return 1;
+    }
+
+    /* The daemon has reported any failure already */
+    success = daemonReceiveStatus(sock);
+    close(sock);
+
+    return success ? 0 : 1;
+}
+
+/**
+ * @brief Write the manifest of the shard written to @p shardPath, next to it
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool writeManifest(const char *shardPath,
+                          const templateDescTable *table)
+{
+    static const char suffix[] = ".manifest";
+    char *path = malloc(strlen(shardPath) + sizeof(suffix));
+    bool ret;
+
+    if (!path) {
+        return false;
+    }
+
+    sprintf(path, "%s%s", shardPath, suffix);
+
+    ret = shardWriteManifest(path, shardPath, table);
+    if (ret) {
+        printf("Wrote the manifest of the shard to '%s'\n", path);
+    } else {
+        fprintf(stderr, "Failed to write the manifest of the shard to '%s'\n",
+                path);
+    }
+
+    free(path);
+
+    return ret;
+}
+
+/**
+ * @brief Export the parts of @p images to @p path, or to standard output if it
+ *        is "-"
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool exportManifest(const char *path, exportFormat format,
+                           const sessionImage *images, int numImages)
+{
+    bool toStdout = strcmp(path, "-") == 0;
+    FILE *fp = toStdout ? stdout : fopen(path, "w");
+    int numUnlisted;
+    bool ret;
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open '%s' for writing\n", path);
+        return false;
+    }
+
+    ret = exportParts(fp, images, numImages, format, &numUnlisted);
+
+    if ((toStdout ? fflush(fp) : fclose(fp)) != 0) {
+        ret = false;
+    }
+
+    if (ret && numUnlisted > 0) {
+        fprintf(stderr, "Left out %d files which only local directories "
+                "have\n", numUnlisted);
+    }
+
+    if (!ret) {
+        fprintf(stderr, "Failed to export the files of the images\n");
+    } else if (!toStdout) {
+        printf("Exported the files of the images to '%s'\n", path);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Block until SIGINT or SIGTERM is received
+ *
+ * The server's threads block all signals, so these are left to this thread.
+ */
+static void waitForInterrupt(void)
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    sigwait(&set, &sig);
+}
+
 int main(int argc, char * const * argv)
 {
-    FILE *fp = NULL;
-    jigdoData *jigdo;
-    templateDescTable *table;
-    int ret = 1, fd = -1, i;
-    bool resize;
-    char *jigdoFile = NULL, *jigdoDir, *templatePath = NULL, *imagePath = NULL;
+    int ret = 1, i;
+    char *templatePath = NULL, *imagePath = NULL;
     int opt;
-    char **mirrors = NULL;
-    int numMirrors = 0;
+    char **mirrors = NULL, **copyPaths = NULL;
+    int numMirrors = 0, numCopies = 0;
     const char *progName = argv[0];
-    int numWorkers = defaultNumThreads;
-    const char *imageName = "", *templateName = "", *md5Hex = "";
-    uint64_t imageSize;
+    sessionOptions fetchOpts = { .numWorkers = defaultNumThreads };
+    sessionCallbacks callbacks = jobCallbacks;
+    jobReport report = {
+        .out = stdout,
+        .err = stderr,
+        .transfersRequested = &transfersRequested,
+        .stage = SESSION_STAGE_IDLE,
+    };
+    igdoSession *session = NULL;
+    const char *cacheDir = NULL;
+    uint64_t cacheSizeMiB = defaultCacheSizeMiB;
+    outputEngineType engineType = OUTPUT_ENGINE_PWRITE;
+    uint64_t maxInFlightMiB = defaultMaxInFlightMiB;
+    unsigned queueDepth = defaultQueueDepth;
+    outputSettings output = { .stdoutFd = -1 };
+    bool toStdout;
+    outputDurability durability = { .interval = defaultSyncInterval };
+    sessionImage *images = NULL;
+    int numImages = 0;
+    const char *serveAddress = NULL;
+    imageServer *server = NULL;
+    char **manifests = NULL;
+    int numManifests = 0;
+    const char *claimPath = NULL;
+    const char *exportPath = NULL;
+    const char *controlPath = NULL;
+    controlServer *control = NULL;
+    const char *metricsJSON = NULL;
+    const char *tracePath = NULL;
+    const char *statusPath = NULL;
+    bool tracing = false, stats = false;
+    exportFormat exportType = EXPORT_FORMAT_JSON;
+    char trailing;
+    char *daemonSocket = NULL;
+    bool jobOptionsOnly = true;
 
     static struct option opts[] = {
         {"mirror",      required_argument, NULL, 'm'},
         {"output",      required_argument, NULL, 'o'},
         {"template",    required_argument, NULL, 't'},
         {"threads",     required_argument, NULL, 'j'},
+        {"verbose",     no_argument,       NULL, 'v'},
+        {"cache",       required_argument, NULL, 'c'},
+        {"cache-size",  required_argument, NULL, OPT_CACHE_SIZE},
+        {"cache-harvest", no_argument,     NULL, OPT_CACHE_HARVEST},
+        {"output-engine", required_argument, NULL, OPT_OUTPUT_ENGINE},
+        {"max-in-flight", required_argument, NULL, OPT_MAX_IN_FLIGHT},
+        {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+        {"direct",      no_argument,       NULL, OPT_DIRECT},
+        {"sync",        required_argument, NULL, OPT_SYNC},
+        {"sync-interval", required_argument, NULL, OPT_SYNC_INTERVAL},
+        {"writeback",   no_argument,       NULL, OPT_WRITEBACK},
+        {"drop-cache",  no_argument,       NULL, OPT_DROP_CACHE},
+        {"stream",      no_argument,       NULL, OPT_STREAM},
+        {"verify-copies", no_argument,     NULL, OPT_VERIFY_COPIES},
+        {"range",       required_argument, NULL, OPT_RANGE},
+        {"serve",       required_argument, NULL, OPT_SERVE},
+        {"daemon",      optional_argument, NULL, OPT_DAEMON},
+        {"peer",        required_argument, NULL, OPT_PEER},
+        {"shard",       required_argument, NULL, OPT_SHARD},
+        {"merge",       required_argument, NULL, OPT_MERGE},
+        {"claim",       required_argument, NULL, OPT_CLAIM},
+        {"export-manifest", required_argument, NULL, OPT_EXPORT_MANIFEST},
+        {"export-format", required_argument, NULL, OPT_EXPORT_FORMAT},
+        {"import-dir",  required_argument, NULL, OPT_IMPORT_DIR},
+        {"control",     required_argument, NULL, OPT_CONTROL},
+        {"metrics-file", required_argument, NULL, OPT_METRICS_FILE},
+        {"metrics-json", required_argument, NULL, OPT_METRICS_JSON},
+        {"trace",       required_argument, NULL, OPT_TRACE},
+        {"stats",       no_argument,       NULL, OPT_STATS},
+        {"status-file", required_argument, NULL, OPT_STATUS_FILE},
         {NULL,          0,                 NULL,  0 }
     };
 
-    while ((opt = getopt_long(argc, argv, "m:o:t:j:", opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "m:o:t:j:vc:", opts, NULL)) != -1) {
+        jobOptionsOnly = jobOptionsOnly && isJobOption(opt);
+
         switch(opt) {
             case 'm':
                 mirrors = realloc(mirrors, (numMirrors + 1) * sizeof(char *));
                 mirrors[numMirrors++] = strdup(optarg);
                 break;
             case 'o':
-                imagePath = strdup(optarg);
+                /* Further outputs receive copies of the first */
+                if (imagePath) {
+                    copyPaths = realloc(copyPaths,
+                                        (numCopies + 1) * sizeof(char *));
+                    copyPaths[numCopies++] = strdup(optarg);
+                } else {
+                    imagePath = strdup(optarg);
+                }
                 break;
             case 't':
                 templatePath = strdup(optarg);
                 break;
             case 'j':
-                if (sscanf(optarg, "%d", &numWorkers) != 1 || numWorkers < 0 ) {
+                if (sscanf(optarg, "%d", &fetchOpts.numWorkers) != 1 ||
+                    fetchOpts.numWorkers < 1) {
+                    usage(progName);
+                }
+                break;
+            case 'v':
+                report.verbose = true;
+                break;
+            case 'c':
+                cacheDir = optarg;
+                break;
+            case OPT_CACHE_SIZE:
+                if (sscanf(optarg, "%"SCNu64, &cacheSizeMiB) != 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_CACHE_HARVEST:
+                fetchOpts.cacheHarvest = true;
+                break;
+            case OPT_OUTPUT_ENGINE:
+                engineType = outputEngineFromName(optarg);
+                if (engineType == OUTPUT_ENGINE_COUNT) {
+                    usage(progName);
+                }
+                break;
+            case OPT_MAX_IN_FLIGHT:
+                if (sscanf(optarg, "%"SCNu64, &maxInFlightMiB) != 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_DIRECT:
+                output.direct = true;
+                break;
+            case OPT_STREAM:
+                output.stream = true;
+                break;
+            case OPT_VERIFY_COPIES:
+                fetchOpts.verifyCopies = true;
+                break;
+            case OPT_RANGE:
+                if (!parseRange(optarg, &output.rangeStart,
+                                &output.rangeEnd)) {
+                    usage(progName);
+                }
+                output.range = true;
+                break;
+            case OPT_SERVE:
+                serveAddress = optarg;
+                break;
+            case OPT_DAEMON:
+                free(daemonSocket);
+                daemonSocket = optarg ? strdup(optarg) : daemonDefaultSocket();
+                if (!daemonSocket) {
+                    fprintf(stderr, "Failed to locate pigdod's socket: %s\n",
+                            strerror(errno));
+                    goto done;
+                }
+                break;
+            case OPT_PEER:
+                fetchOpts.peers = realloc(fetchOpts.peers,
+                                          (fetchOpts.numPeers + 1) *
+                                          sizeof(char *));
+                fetchOpts.peers[fetchOpts.numPeers++] = optarg;
+                break;
+            case OPT_SHARD:
+                if (sscanf(optarg, "%d/%d%c", &output.shard,
+                           &output.numShards, &trailing) != 2 ||
+                    output.numShards < 1 || output.shard < 1 ||
+                    output.shard > output.numShards) {
+                    usage(progName);
+                }
+                break;
+            case OPT_MERGE:
+                manifests = realloc(manifests,
+                                    (numManifests + 1) * sizeof(char *));
+                manifests[numManifests++] = optarg;
+                break;
+            case OPT_CLAIM:
+                claimPath = optarg;
+                break;
+            case OPT_EXPORT_MANIFEST:
+                exportPath = optarg;
+                output.noOutput = true;
+                break;
+            case OPT_EXPORT_FORMAT:
+                exportType = exportFormatFromName(optarg);
+                if (exportType == EXPORT_FORMAT_COUNT) {
+                    usage(progName);
+                }
+                break;
+            case OPT_IMPORT_DIR:
+                fetchOpts.importDir = optarg;
+                break;
+            case OPT_CONTROL:
+                controlPath = optarg;
+                break;
+            case OPT_METRICS_FILE:
+                report.metricsFile = optarg;
+                break;
+            case OPT_METRICS_JSON:
+                metricsJSON = optarg;
+                break;
+            case OPT_TRACE:
+                tracePath = optarg;
+                break;
+            case OPT_STATS:
+                stats = true;
+                statsEnable();
+                break;
+            case OPT_STATUS_FILE:
+                statusPath = optarg;
+                break;
+            case OPT_QUEUE_DEPTH:
+                if (sscanf(optarg, "%u", &queueDepth) != 1 || queueDepth < 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_SYNC:
+                durability.policy = outputSyncPolicyFromName(optarg);
+                if (durability.policy == OUTPUT_SYNC_COUNT) {
+                    usage(progName);
+                }
+                break;
+            case OPT_SYNC_INTERVAL:
+                if (sscanf(optarg, "%u", &durability.interval) != 1) {
                     usage(progName);
                 }
                 break;
+            case OPT_WRITEBACK:
+                durability.writeback = true;
+                break;
+            case OPT_DROP_CACHE:
+                durability.dropCache = true;
+                break;
             default:
                 usage(progName);
         }
@@ -114,124 +729,294 @@ int main(int argc, char * const * argv)
         usage(progName);
     }
 
-    if (!fetch_init()) {
-        goto done;
+    /* A single template can't be shared by several images */
+    if (argc > 1 && templatePath) {
+        usage(progName);
+    }
+
+    /* Only a single image can be streamed */
+    toStdout = imagePath && strcmp(imagePath, "-") == 0;
+    if (argc > 1 && (output.stream || toStdout)) {
+        usage(progName);
     }
 
-    jigdoFile = strdup(argv[0]);
+    /* Copies need seekable outputs, which several images don't get */
+    if (numCopies > 0 && (argc > 1 || output.stream || toStdout)) {
+        usage(progName);
+    }
 
-    if ((jigdo = jigdoReadJigdoFile(jigdoFile))) {
-            imageName = jigdoGetImageName(jigdo);
-            templateName = jigdoGetTemplateName(jigdo);
+    /* A range is of a single image, and is written in place */
+    if (output.range && (argc > 1 || output.stream || toStdout)) {
+        usage(progName);
+    }
 
-            printf("Successfully read jigdo file for '%s'\n", imageName);
-            printf("Template filename is: %s\n", templateName);
-            printf("Template MD5 sum is: %s\n", jigdoGetTemplateMD5(jigdo));
-    } else {
-            fprintf(stderr, "Failed to read jigdo file '%s'\n", jigdoFile);
+    /* Served images are read back from their output files */
+    if (serveAddress && (output.stream || toStdout)) {
+        usage(progName);
+    }
+
+    /* Shards, merges and shared outputs are of a single image, written in
+     * place, and don't mix with each other */
+    if ((output.numShards > 0) + (numManifests > 0) + (claimPath != NULL) > 1 ||
+        ((output.numShards || numManifests || claimPath) &&
+         (argc > 1 || output.stream || toStdout || output.range ||
+          numCopies > 0))) {
+        usage(progName);
+    }
+
+    /* The manifest goes next to the shard file */
+    if (output.numShards && !imagePath && !exportPath) {
+        usage(progName);
+    }
+
+    /* Exporting the parts of the images writes nothing else */
+    if (exportPath && (imagePath || numManifests || claimPath ||
+                       serveAddress || controlPath || output.stream ||
+                       report.metricsFile || metricsJSON || statusPath)) {
+        usage(progName);
+    }
+
+    /* The daemon runs the job with its own settings, and can't stream */
+    if (daemonSocket) {
+        daemonJob job = {
+            .jigdoFiles = (char **) argv,
+            .numJigdoFiles = argc,
+            .outputs = copyPaths,
+            .numOutputs = numCopies,
+            .templatePath = templatePath,
+            .mirrors = mirrors,
+            .numMirrors = numMirrors,
+            .verbose = report.verbose,
+            .verifyCopies = fetchOpts.verifyCopies,
+            .range = output.range,
+            .rangeStart = output.rangeStart,
+            .rangeEnd = output.rangeEnd,
+            .outFd = STDOUT_FILENO,
+            .errFd = STDERR_FILENO,
+        };
+        char **outputs = NULL;
+
+        if (!jobOptionsOnly || toStdout) {
+            usage(progName);
+        }
+
+        /* The first output goes along with its copies */
+        if (imagePath) {
+            outputs = malloc(sizeof(outputs[0]) * (numCopies + 1));
+            if (!outputs) {
+                goto done;
+            }
+            outputs[0] = imagePath;
+            if (numCopies > 0) {
+                memcpy(outputs + 1, copyPaths,
+                       sizeof(outputs[0]) * numCopies);
+            }
+            job.outputs = outputs;
+            job.numOutputs = numCopies + 1;
+        }
+
+        job.cwd = getcwd(NULL, 0);
+        if (!job.cwd) {
+            free(outputs);
             goto done;
+        }
+
+        ret = submitJob(daemonSocket, &job);
+
+        free(job.cwd);
+        free(outputs);
+        goto done;
     }
 
-    jigdoDir = dirname(jigdoFile);
+    /* Keep messages out of an export to standard output */
+    if (exportPath && strcmp(exportPath, "-") == 0) {
+        report.out = stderr;
+    }
 
-    if (!templatePath) {
-        if (isURI(templateName) || isAbsolute(templateName)) {
-            templatePath = strdup(templateName);
-        } else {
-            templatePath = dircat(jigdoDir, templateName);
+    /* Keep messages out of an image streamed to standard output */
+    if (toStdout) {
+        output.stdoutFd = dup(STDOUT_FILENO);
+        if (output.stdoutFd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "Failed to redirect standard output\n");
+            goto done;
         }
     }
 
-    if (!templatePath) {
-        fprintf(stderr, "Failed to build the template path.\n");
+    if (!fetch_init()) {
         goto done;
     }
 
-    fp = fetchopen(templatePath);
-    free(templatePath);
+    if (cacheDir) {
+        fetchOpts.cache = cacheOpen(cacheDir, cacheSizeMiB * 1024 * 1024);
+        if (!fetchOpts.cache) {
+            fprintf(stderr, "Failed to open cache directory '%s'\n", cacheDir);
+            goto done;
+        }
+    }
 
-    if (!fp) {
-        fprintf(stderr, "Unable to open '%s' for reading\n", templatePath);
+    fetchOpts.output = outputOpen(engineType, maxInFlightMiB * 1024 * 1024,
+                                  queueDepth);
+    output.engine = fetchOpts.output;
+    output.window = maxInFlightMiB * 1024 * 1024;
+    if (!fetchOpts.output) {
+        fprintf(stderr, "Failed to set up the output engine\n");
         goto done;
     }
 
-    if (!(table = jigdoReadTemplateFile(fp))) {
-        fprintf(stderr, "Failed to read the template DESC table.\n");
+    if (outputGetType(fetchOpts.output) != engineType) {
+        fprintf(stderr, "The %s output engine is unavailable; using %s\n",
+                outputEngineName(engineType),
+                outputEngineName(outputGetType(fetchOpts.output)));
+    }
+
+    outputSetDurability(fetchOpts.output, &durability);
+
+    if (claimPath) {
+        fetchOpts.claims = claimsOpen(claimPath);
+        output.claims = fetchOpts.claims;
+        if (!fetchOpts.claims) {
+            fprintf(stderr, "Failed to open claim file '%s'\n", claimPath);
+            goto done;
+        }
+    }
+
+    if (tracePath) {
+        tracing = traceOpen(tracePath);
+        if (!tracing) {
+            fprintf(stderr, "Failed to open trace file '%s'\n", tracePath);
+            goto done;
+        }
+    }
+
+    images = calloc(argc, sizeof(images[0]));
+    if (!images) {
         goto done;
     }
 
-    for (i = 0; i < numMirrors; i++) {
-        if (!addServerMirror(jigdo, mirrors[i])) {
-            fprintf(stderr, "Invalid mirror specification '%s'\n", mirrors[i]);
+    for (numImages = 0; numImages < argc; numImages++) {
+        images[numImages].fd = -1;
+
+        /* With several images, the output location is a directory */
+        if (!jobOpenImage(&report, images + numImages, argv[numImages],
+                          templatePath, argc > 1 ? NULL : imagePath,
+                          copyPaths, numCopies, argc > 1 ? imagePath : NULL,
+                          mirrors, numMirrors, &output)) {
+            numImages++;
             goto done;
         }
     }
 
-    md5Hex = jigdoGetImageMD5(table);
-    imageSize = jigdoGetImageSize(table);
+    if (exportPath) {
+        ret = exportManifest(exportPath, exportType, images, numImages) ? 0 : 1;
+        goto done;
+    }
 
-    printf("Image size is: %"PRIu64" bytes\n", imageSize);
-    printf("Image md5sum is: %s\n", md5Hex);
+    for (i = 0; i < numManifests; i++) {
+        int merged = shardMerge(manifests[i], images[0].table, images[0].fd,
+                                fetchOpts.output);
 
-    if (!imagePath) {
-        if (isURI(jigdoFile)) {
-            imagePath = strdup(imageName);
-        } else {
-            imagePath = dircat(jigdoDir, imageName);
+        if (merged < 0) {
+            fprintf(stderr, "Failed to merge the shard listed in '%s'\n",
+                    manifests[i]);
+            goto done;
         }
+
+        printf("Merged %d files from '%s'\n", merged, manifests[i]);
     }
 
-    if (!imagePath) {
+    if (!jobCheckOutputs(&report, images, numImages)) {
         goto done;
     }
 
-    fd = open(imagePath, O_RDWR | O_CREAT, 0644);
-    free(imagePath);
+    report.verifyCopies = fetchOpts.verifyCopies;
+    report.numImages = numImages;
+    report.maxTransfers = fetchOpts.numWorkers;
+    callbacks.data = &report;
 
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open image file '%s'\n", imageName);
+    session = sessionOpen(images, numImages, &fetchOpts, &callbacks);
+    if (!session) {
+        fprintf(stderr, "Failed to set up the reconstruction\n");
         goto done;
     }
 
-    if (lseek(fd, 0, SEEK_END) < imageSize) {
-#ifdef HAVE_POSIX_FALLOCATE
-        resize = (posix_fallocate(fd, 0, imageSize) == 0);
-#else
-        /* Poor man's fallocate(2); much slower than the real thing */
-        resize = (pwrite(fd, "\0", 1, imageSize - 1) == 1);
-#endif
-        if (!resize) {
-            fprintf(stderr, "Failed to allocate disk space for image file\n");
+    if (serveAddress) {
+        server = serveImages(serveAddress, session, images, numImages,
+                             fetchOpts.output);
+        if (!server) {
+            fprintf(stderr, "Failed to serve on '%s'\n", serveAddress);
             goto done;
         }
-    } else {
-        jigdoSetExistingFile(table, true);
+
+        printf("Serving over HTTP on port %d\n", serveGetPort(server));
     }
 
-    if (!writeDataFromTemplate(fp, fd, table)) {
+    if (statusPath) {
+        report.status = statusCreate(statusPath);
+        if (!report.status) {
+            fprintf(stderr, "Failed to create status file '%s'\n",
+                    statusPath);
+            goto done;
+        }
+    }
+
+    if (controlPath) {
+        control = controlStart(controlPath, session);
+        if (!control) {
+            fprintf(stderr, "Failed to listen for commands on '%s'\n",
+                    controlPath);
+            goto done;
+        }
+    }
+
+    if (signal(SIGUSR1, requestTransfers) == SIG_ERR ||
+        !jobRun(session, &report, -1)) {
         goto done;
     }
 
-    if (!pfetch(fd, jigdo, table, numWorkers)) {
+    if (output.numShards && !writeManifest(imagePath, images[0].table)) {
         goto done;
     }
 
+    if (server) {
+        printf("Reconstruction complete; still serving until interrupted\n");
+        fflush(stdout);
+        waitForInterrupt();
+    }
+
     ret = 0;
 
 done:
-    if (ret != 0) {
+    /* An export has reported its own failure */
+    if (ret != 0 && !exportPath) {
         fprintf(stderr, "Reconstruction failed!\n");
     }
 
-    /* Clean up */
-    if (fp) {
-        fclose(fp);
+    if (stats) {
+        statsWrite(report.out);
     }
 
-    if (fd >= 0) {
-        close(fd);
+    /* The summary covers failed runs, too */
+    if (session && metricsJSON &&
+        !metricsSave(metricsJSON, session, METRICS_FORMAT_JSON)) {
+        fprintf(stderr, "Failed to write metrics to '%s'\n", metricsJSON);
     }
 
+    /* Clean up; requests still waiting on the session are turned away */
+    if (session) {
+        sessionCancel(session);
+    }
+    serveStop(server);
+    controlStop(control);
+    sessionClose(session);
+    statusClose(report.status);
+
+    if (tracing && !traceClose()) {
+        fprintf(stderr, "Failed to write the trace to '%s'\n", tracePath);
+    }
+
+    jobCloseImages(images, numImages, &output);
+    free(images);
+
     if (mirrors) {
         for (i = 0; i < numMirrors; i++) {
             free(mirrors[i]);
@@ -239,8 +1024,20 @@ done:
         free(mirrors);
     }
 
+    for (i = 0; i < numCopies; i++) {
+        free(copyPaths[i]);
+    }
+    free(copyPaths);
+    free(fetchOpts.peers);
+    free(manifests);
+
+    outputClose(fetchOpts.output);
+    cacheClose(fetchOpts.cache);
+    claimsClose(fetchOpts.claims);
     fetch_cleanup();
-    free(jigdoFile);
+    free(templatePath);
+    free(imagePath);
+    free(daemonSocket);
 
     return ret;
 }
@@ -0,0 +1,572 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "libigdo/fetch.h"
+#include "libigdo/session.h"
+
+#include "daemon.h"
+#include "job.h"
+
+/**
+ * @brief getopt_long(3) values for options which have no short form
+ */
+enum {
+    OPT_CACHE_SIZE = 256,
+    OPT_CACHE_HARVEST,
+    OPT_OUTPUT_ENGINE,
+    OPT_MAX_IN_FLIGHT,
+    OPT_QUEUE_DEPTH,
+    OPT_PEER,
+};
+
+/**
+ * @brief Default size limit of the part cache, in MiB
+ */
+#define defaultCacheSizeMiB 4096
+
+/**
+ * @brief Default cap on the size of downloaded parts held in memory, in MiB
+ */
+#define defaultMaxInFlightMiB 256
+
+/**
+ * @brief Default number of requests the io_uring output engine keeps queued
+ */
+#define defaultQueueDepth 64
+
+/**
+ * @brief A connection from a client, which carries a single job
+ */
+typedef struct _daemonClient {
+    int sock;
+    struct _daemonServer *server;
+    igdoSession *session;         ///< The client's job, once it is running
+    struct _daemonClient *next;
+} daemonClient;
+
+/**
+ * @brief What all jobs share
+ */
+typedef struct _daemonServer {
+    int listenSock;
+    sessionOptions opts;     ///< Options for every job's session; each one
+                             ///< may have all of the workers to itself
+    outputSettings output;   ///< How every job's output files are written
+    daemonClient *clients;   ///< Connections being handled
+    bool stopping;           ///< Set once the daemon is shutting down
+    pthread_mutex_t lock;    ///< Lock on @c clients and @c stopping
+    pthread_cond_t cond;     ///< Signaled as connections are closed
+} daemonServer;
+
+
+/*
+ * @brief print a usage message and exit
+ */
+static void usage(const char *progName)
+{
+    fprintf(stderr,
+            "Usage: %s [-s socket] [-j threads] \\\n"
+            "    [-c cachedir [--cache-size MiB] [--cache-harvest]] \\\n"
+            "    [--output-engine pwrite|mmap|io_uring] \\\n"
+            "    [--max-in-flight MiB] [--queue-depth N] [--peer URI ...]\n\n"
+            "Reconstruct images submitted with 'pigdo --daemon', sharing\n"
+            "transfers, connections to mirrors, memory and the part cache\n"
+            "between all jobs. Runs until interrupted.\n\n"
+            "-s | --socket:   location of the socket to listen on\n"
+            "                 default: pigdod.sock in $XDG_RUNTIME_DIR, or\n"
+            "                 /tmp/pigdod-UID/pigdod.sock\n\n"
+            "-j | --threads:  number of simultaneous download threads,\n"
+            "                 shared evenly between the jobs running\n"
+            "                 default: %d\n\n"
+            "-c | --cache:    directory of a persistent cache of component\n"
+            "                 files, used by all jobs\n\n"
+            "--cache-size:    size limit of the cache in MiB\n"
+            "                 default: %d\n\n"
+            "--cache-harvest: also add all files from each image to the\n"
+            "                 cache once it has been reconstructed\n\n"
+            "--output-engine: how parts are written to output files; see\n"
+            "                 pigdo. Output files are never opened with\n"
+            "                 O_DIRECT, so block devices aren't supported.\n"
+            "                 default: %s\n\n"
+            "--max-in-flight: cap on the total size in MiB of parts being\n"
+            "                 downloaded at once, by all jobs\n"
+            "                 default: %d\n\n"
+            "--queue-depth:   number of I/O requests the io_uring engine may\n"
+            "                 have queued at once\n"
+            "                 default: %d\n\n"
+            "--peer:          URI of a pigdo serving files with --serve,\n"
+            "                 which is asked for each file before any\n"
+            "                 mirror; see pigdo. May be given several times.\n",
+            progName, defaultNumThreads, defaultCacheSizeMiB,
+            outputEngineName(OUTPUT_ENGINE_PWRITE), defaultMaxInFlightMiB,
+            defaultQueueDepth);
+    exit(1);
+}
+
+/**
+ * @brief Share the workers evenly between the jobs which are running
+ *
+ * @note Must be called with the server's lock held
+ */
+static void shareWorkers(daemonServer *server)
+{
+    daemonClient *client;
+    int total = server->opts.numWorkers, numJobs = 0, i = 0;
+
+    for (client = server->clients; client; client = client->next) {
+        if (client->session) {
+            numJobs++;
+        }
+    }
+
+    for (client = server->clients; client; client = client->next) {
+        if (client->session) {
+            sessionSetWorkers(client->session,
+                              total / numJobs + (i++ < total % numJobs));
+        }
+    }
+}
+
+/**
+ * @brief Mark @p session as the running job of @p client, or @p client as no
+ *        longer running a job if @p session is NULL
+ */
+static void setSession(daemonClient *client, igdoSession *session)
+{
+    daemonServer *server = client->server;
+
+    pthread_mutex_lock(&server->lock);
+    client->session = session;
+    shareWorkers(server);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * @brief Run the job which @p client submitted
+ *
+ * @return @c true if all of its images were reconstructed; @c false otherwise
+ */
+static bool runJob(daemonClient *client, const daemonJob *job, FILE *out,
+                   FILE *err)
+{
+    daemonServer *server = client->server;
+    sessionOptions opts = server->opts;
+    outputSettings output = server->output;
+    jobReport report = {
+        .out = out,
+        .err = err,
+        .verbose = job->verbose,
+        .verifyCopies = job->verifyCopies,
+        .maxTransfers = opts.numWorkers,
+        .stage = SESSION_STAGE_IDLE,
+    };
+    sessionCallbacks callbacks = jobCallbacks;
+    sessionImage *images = NULL;
+    igdoSession *session = NULL;
+    bool severalImages = job->numJigdoFiles > 1, ret = false;
+    int numImages;
+
+    /* The same restrictions as for a local pigdo run */
+    if (severalImages &&
+        (job->templatePath || job->numOutputs > 1 || job->range)) {
+        fprintf(err, "Invalid combination of options for several images\n");
+        return false;
+    }
+
+    opts.verifyCopies = job->verifyCopies;
+    output.range = job->range;
+    output.rangeStart = job->rangeStart;
+    output.rangeEnd = job->rangeEnd;
+
+    images = calloc(job->numJigdoFiles, sizeof(images[0]));
+    if (!images) {
+        return false;
+    }
+
+    for (numImages = 0; numImages < job->numJigdoFiles; numImages++) {
+        const char *jigdoFile = job->jigdoFiles[numImages];
+        const char *imagePath = NULL, *outDir = NULL;
+
+        images[numImages].fd = -1;
+
+        /* With several images, the output location is a directory; without
+         * one, images of remote .jigdo files go where the client is */
+        if (severalImages) {
+            outDir = job->numOutputs ? job->outputs[0] : NULL;
+        } else if (job->numOutputs) {
+            imagePath = job->outputs[0];
+        }
+
+        if (!imagePath && !outDir && isURI(jigdoFile)) {
+            outDir = job->cwd;
+        }
+
+        if (!jobOpenImage(&report, images + numImages, jigdoFile,
+                          job->templatePath, imagePath,
+                          severalImages ? NULL : job->outputs + 1,
+                          severalImages ? 0 : job->numOutputs - 1, outDir,
+                          job->mirrors, job->numMirrors, &output)) {
+            numImages++;
+            goto done;
+        }
+    }
+
+    if (!jobCheckOutputs(&report, images, numImages)) {
+        goto done;
+    }
+
+    report.numImages = numImages;
+    callbacks.data = &report;
+
+    session = sessionOpen(images, numImages, &opts, &callbacks);
+    if (!session) {
+        fprintf(err, "Failed to set up the reconstruction\n");
+        goto done;
+    }
+
+    setSession(client, session);
+
+    /* A client which hangs up cancels its job */
+    ret = jobRun(session, &report, client->sock);
+
+    setSession(client, NULL);
+
+done:
+    sessionClose(session);
+    jobCloseImages(images, numImages, &output);
+    free(images);
+
+    return ret;
+}
+
+/**
+ * @brief Receive a job from a client, run it, and tell the client how it went
+ */
+static void *clientThread(void *arg)
+{
+    daemonClient *client = arg, **link;
+    daemonServer *server = client->server;
+    daemonJob job;
+    FILE *out = NULL, *err = NULL;
+    bool success = false;
+
+    if (!daemonReceiveJob(client->sock, &job)) {
+        goto done;
+    }
+
+    /* The streams take over the client's descriptors */
+    out = fdopen(job.outFd, "w");
+    if (out) {
+        job.outFd = -1;
+    }
+    err = fdopen(job.errFd, "w");
+    if (err) {
+        job.errFd = -1;
+    }
+
+    if (out && err) {
+        success = runJob(client, &job, out, err);
+    }
+
+    daemonSendStatus(client->sock, success);
+
+done:
+    if (out) {
+        fclose(out);
+    }
+
+    if (err) {
+        fclose(err);
+    }
+
+    daemonFreeJob(&job);
+
+    pthread_mutex_lock(&server->lock);
+
+    for (link = &server->clients; *link != client; link = &(*link)->next);
+    *link = client->next;
+
+    close(client->sock);
+    free(client);
+
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Accept clients until the daemon is stopped
+ */
+static void *acceptThread(void *arg)
+{
+    daemonServer *server = arg;
+
+    while (true) {
+        daemonClient *client;
+        pthread_t tid;
+        int sock = accept(server->listenSock, NULL, NULL);
+
+        pthread_mutex_lock(&server->lock);
+
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            if (sock >= 0) {
+                close(sock);
+            }
+            break;
+        }
+
+        if (sock < 0) {
+            pthread_mutex_unlock(&server->lock);
+
+            /* Out of file descriptors, or the like; back off a little */
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(100000);
+            }
+            continue;
+        }
+
+        client = calloc(1, sizeof(*client));
+
+        if (!client) {
+            pthread_mutex_unlock(&server->lock);
+            close(sock);
+            continue;
+        }
+
+        client->sock = sock;
+        client->server = server;
+        client->next = server->clients;
+        server->clients = client;
+
+        if (pthread_create(&tid, NULL, clientThread, client) == 0) {
+            pthread_detach(tid);
+        } else {
+            server->clients = client->next;
+            close(sock);
+            free(client);
+        }
+
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char * const * argv)
+{
+    int ret = 1, opt, sig;
+    const char *progName = argv[0];
+    char *socketPath = NULL;
+    const char *cacheDir = NULL;
+    uint64_t cacheSizeMiB = defaultCacheSizeMiB;
+    outputEngineType engineType = OUTPUT_ENGINE_PWRITE;
+    uint64_t maxInFlightMiB = defaultMaxInFlightMiB;
+    unsigned queueDepth = defaultQueueDepth;
+    daemonServer server = {
+        .listenSock = -1,
+        .opts = { .numWorkers = defaultNumThreads },
+        .output = { .sharedEngine = true, .stdoutFd = -1 },
+    };
+    daemonClient *client;
+    pthread_t acceptTid;
+    bool listening = false, fetchInit = false;
+    sigset_t set;
+
+    static struct option opts[] = {
+        {"socket",      required_argument, NULL, 's'},
+        {"threads",     required_argument, NULL, 'j'},
+        {"cache",       required_argument, NULL, 'c'},
+        {"cache-size",  required_argument, NULL, OPT_CACHE_SIZE},
+        {"cache-harvest", no_argument,     NULL, OPT_CACHE_HARVEST},
+        {"output-engine", required_argument, NULL, OPT_OUTPUT_ENGINE},
+        {"max-in-flight", required_argument, NULL, OPT_MAX_IN_FLIGHT},
+        {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+        {"peer",        required_argument, NULL, OPT_PEER},
+        {NULL,          0,                 NULL,  0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "s:j:c:", opts, NULL)) != -1) {
+        switch(opt) {
+            case 's':
+                free(socketPath);
+                socketPath = strdup(optarg);
+                break;
+            case 'j':
+                if (sscanf(optarg, "%d", &server.opts.numWorkers) != 1 ||
+                    server.opts.numWorkers < 1) {
+                    usage(progName);
+                }
+                break;
+            case 'c':
+                cacheDir = optarg;
+                break;
+            case OPT_CACHE_SIZE:
+                if (sscanf(optarg, "%"SCNu64, &cacheSizeMiB) != 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_CACHE_HARVEST:
+                server.opts.cacheHarvest = true;
+                break;
+            case OPT_OUTPUT_ENGINE:
+                engineType = outputEngineFromName(optarg);
+                if (engineType == OUTPUT_ENGINE_COUNT) {
+                    usage(progName);
+                }
+                break;
+            case OPT_MAX_IN_FLIGHT:
+                if (sscanf(optarg, "%"SCNu64, &maxInFlightMiB) != 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_QUEUE_DEPTH:
+                if (sscanf(optarg, "%u", &queueDepth) != 1 || queueDepth < 1) {
+                    usage(progName);
+                }
+                break;
+            case OPT_PEER:
+                server.opts.peers = realloc(server.opts.peers,
+                                            (server.opts.numPeers + 1) *
+                                            sizeof(char *));
+                server.opts.peers[server.opts.numPeers++] = optarg;
+                break;
+            default:
+                usage(progName);
+        }
+    }
+
+    if (optind < argc) {
+        usage(progName);
+    }
+
+    if (!socketPath && !(socketPath = daemonDefaultSocket())) {
+        fprintf(stderr, "Failed to set up the socket's directory: %s\n",
+                strerror(errno));
+        goto done;
+    }
+
+    /* Clients may go away at any time; don't go with them */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Leave SIGINT and SIGTERM to this thread; the others inherit this */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (!(fetchInit = fetch_init())) {
+        goto done;
+    }
+
+    if (cacheDir) {
+        server.opts.cache = cacheOpen(cacheDir, cacheSizeMiB * 1024 * 1024);
+        if (!server.opts.cache) {
+            fprintf(stderr, "Failed to open cache directory '%s'\n", cacheDir);
+            goto done;
+        }
+    }
+
+    server.opts.output = outputOpen(engineType, maxInFlightMiB * 1024 * 1024,
+                                    queueDepth);
+    server.output.engine = server.opts.output;
+    server.output.window = maxInFlightMiB * 1024 * 1024;
+    if (!server.opts.output) {
+        fprintf(stderr, "Failed to set up the output engine\n");
+        goto done;
+    }
+
+    if (outputGetType(server.opts.output) != engineType) {
+        fprintf(stderr, "The %s output engine is unavailable; using %s\n",
+                outputEngineName(engineType),
+                outputEngineName(outputGetType(server.opts.output)));
+    }
+
+    server.listenSock = daemonListen(socketPath);
+    if (server.listenSock < 0) {
+        fprintf(stderr, "Failed to listen on '%s': %s\n", socketPath,
+                strerror(errno));
+        goto done;
+    }
+    listening = true;
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+
+    if (pthread_create(&acceptTid, NULL, acceptThread, &server) != 0) {
+        goto done;
+    }
+
+    printf("Listening on '%s'\n", socketPath);
+    fflush(stdout);
+
+    sigwait(&set, &sig);
+
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_mutex_unlock(&server.lock);
+
+    /* This wakes up the accept(2) call in acceptThread() */
+    shutdown(server.listenSock, SHUT_RDWR);
+    pthread_join(acceptTid, NULL);
+
+    /* Hanging up on the clients cancels their jobs */
+    pthread_mutex_lock(&server.lock);
+
+    for (client = server.clients; client; client = client->next) {
+        shutdown(client->sock, SHUT_RDWR);
+    }
+
+    while (server.clients) {
+        pthread_cond_wait(&server.cond, &server.lock);
+    }
+
+    pthread_mutex_unlock(&server.lock);
+
+    ret = 0;
+
+done:
+    if (listening) {
+        close(server.listenSock);
+        unlink(socketPath);
+    }
+
+    outputClose(server.opts.output);
+    cacheClose(server.opts.cache);
+    if (fetchInit) {
+        fetch_cleanup();
+    }
+    free(server.opts.peers);
+    free(socketPath);
+
+    return ret;
+}
@@ -0,0 +1,261 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "serve.h"
+#include "httpd.h"
+#include "libigdo/metrics.h"
+
+/**
+ * @brief Size of the pieces in which a requested range is waited for and sent
+ *
+ * A client reading an image from the start gets its first bytes as soon as the
+ * first piece is complete, rather than once its whole range is.
+ */
+#define servePieceSize (4 * 1024 * 1024)
+
+struct _imageServer {
+    httpServer *http;
+    igdoSession *session;
+    const sessionImage *images;
+    int numImages;
+    outputEngine *output;
+};
+
+/**
+ * @brief Find the image which @p path refers to
+ *
+ * @return The image, or NULL if there is none
+ */
+static const sessionImage *findImage(const imageServer *server,
+                                    const char *path)
+{
+    int i;
+
+    if (strcmp(path, "/") == 0) {
+        return server->numImages == 1 ? server->images : NULL;
+    }
+
+    for (i = 0; i < server->numImages; i++) {
+        if (strcmp(path + 1, server->images[i].name) == 0) {
+            return server->images + i;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Send @p len bytes at @p offset of @p image
+ *
+ * @return @c true on success; @c false on failure
+ */
+static bool sendRange(const imageServer *server, const httpRequest *request,
+                      const sessionImage *image, uint64_t offset, uint64_t len)
+{
+    void *data;
+    bool ret;
+
+    if (!outputIsDirect(server->output, image->fd)) {
+        return httpSendFile(request, image->fd, offset, len);
+    }
+
+    /* Files opened with O_DIRECT need their reads aligned */
+    data = malloc(len);
+    ret = data && outputReadRange(server->output, image->fd, offset, data,
+                                  len) &&
+          httpSendData(request, data, len);
+    free(data);
+
+    return ret;
+}
+
+/**
+ * @brief Prefix of the paths at which parts are served to peers, by MD5
+ */
+static const char partPrefix[] = "/md5/";
+
+/**
+ * @brief Send a verified part to a peer, or turn it away at once if the part
+ *        isn't available
+ */
+static void sendPart(const imageServer *server, const httpRequest *request,
+                     const char *md5)
+{
+    static const char type[] = "application/octet-stream";
+    sessionPartLocation loc;
+
+    if (!sessionFindPart(server->session, md5, &loc)) {
+        httpSendStatus(request, 404);
+        return;
+    }
+
+    if (httpSendHeaders(request, 200, type, loc.size, 0, loc.size) &&
+        !request->head) {
+        if (loc.image) {
+            sendRange(server, request, loc.image, loc.offset, loc.size);
+        } else {
+            httpSendFile(request, loc.fd, 0, loc.size);
+        }
+    }
+
+    if (!loc.image) {
+        close(loc.fd);
+    }
+}
+
+/**
+ * @brief Path at which the metrics are served, unless an image has that name
+ */
+static const char metricsPath[] = "/metrics";
+
+/**
+ * @brief Send the metrics of the session in the Prometheus text format
+ */
+static void sendMetrics(const imageServer *server, const httpRequest *request)
+{
+    static const char type[] = "text/plain; version=0.0.4";
+    char *text = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&text, &len);
+    bool ok;
+
+    if (!fp) {
+        httpSendStatus(request, 500);
+        return;
+    }
+
+    ok = metricsWrite(fp, server->session, METRICS_FORMAT_PROMETHEUS);
+    if (fclose(fp) != 0 || !ok) {
+        free(text);
+        httpSendStatus(request, 500);
+        return;
+    }
+
+    if (httpSendHeaders(request, 200, type, len, 0, len) && !request->head) {
+        httpSendData(request, text, len);
+    }
+
+    free(text);
+}
+
+static void handleRequest(const httpRequest *request, void *data)
+{
+    const imageServer *server = data;
+    const sessionImage *image = findImage(server, request->path);
+    static const char type[] = "application/octet-stream";
+    uint64_t size, start, end, piece;
+    int status;
+
+    if (!image && strncmp(request->path, partPrefix,
+                          strlen(partPrefix)) == 0) {
+        sendPart(server, request, request->path + strlen(partPrefix));
+        return;
+    }
+
+    if (!image && strcmp(request->path, metricsPath) == 0) {
+        sendMetrics(server, request);
+        return;
+    }
+
+    if (!image) {
+        httpSendStatus(request, 404);
+        return;
+    }
+
+    size = jigdoGetImageSize(image->table);
+    status = httpParseRange(request, size, &start, &end);
+
+    if (status == 416) {
+        httpSendHeaders(request, status, type, 0, 0, size);
+        return;
+    }
+
+    if (request->head) {
+        httpSendHeaders(request, status, type, end - start, start, size);
+        return;
+    }
+
+    /* Once the headers have gone out, the only way left to report a failure
+     * is to cut the response short; wait for the first piece before sending
+     * them, so that an unavailable range gets a proper error. */
+    piece = end - start < servePieceSize ? end - start : servePieceSize;
+    if (!sessionWaitRange(server->session, image, start, start + piece)) {
+        httpSendStatus(request, 503);
+        return;
+    }
+
+    if (!httpSendHeaders(request, status, type, end - start, start, size)) {
+        return;
+    }
+
+    while (start < end) {
+        piece = end - start < servePieceSize ? end - start : servePieceSize;
+
+        if (!sessionWaitRange(server->session, image, start, start + piece) ||
+            !sendRange(server, request, image, start, piece)) {
+            return;
+        }
+
+        start += piece;
+    }
+}
+
+imageServer *serveImages(const char *address, igdoSession *session,
+                         const sessionImage *images, int numImages,
+                         outputEngine *output)
+{
+    imageServer *server = calloc(1, sizeof(*server));
+
+    if (!server) {
+        return NULL;
+    }
+
+    server->session = session;
+    server->images = images;
+    server->numImages = numImages;
+    server->output = output;
+    server->http = httpStart(address, handleRequest, server);
+
+    if (!server->http) {
+        free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+int serveGetPort(const imageServer *server)
+{
+    return httpGetPort(server->http);
+}
+
+void serveStop(imageServer *server)
+{
+    if (!server) {
+        return;
+    }
+
+    httpStop(server->http);
+    free(server);
+}
@@ -0,0 +1,62 @@
+/*
+ * pigdo: parallel implementation of jigsaw download
+ * Copyright (c) 2017 Daniel Dadap
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIGDO_SERVE_H
+#define PIGDO_SERVE_H
+
+#include "libigdo/output.h"
+
+#include "libigdo/session.h"
+
+/**
+ * @brief An HTTP server for images which are being reconstructed
+ *
+ * Each image is served at '/' followed by its name, and a lone image at '/'
+ * as well. Requests may be for ranges of an image; a range which hasn't been
+ * reconstructed yet is fetched ahead of the rest of the image, and sent once
+ * it has been verified.
+ *
+ * Parts which have been verified, or are in the part cache, are served to
+ * peers at '/md5/' followed by their MD5 checksum in hexadecimal; see
+ * sessionFindPart().
+ */
+typedef struct _imageServer imageServer;
+
+/**
+ * @brief Start serving @p images on @p address
+ *
+ * @param address Where to listen, in '[host:]port' format
+ * @param session The session reconstructing @p images
+ * @param output The engine through which the images' output files are written
+ *
+ * @return The new server on success, or NULL on failure
+ */
+imageServer *serveImages(const char *address, igdoSession *session,
+                         const sessionImage *images, int numImages,
+                         outputEngine *output);
+
+/**
+ * @brief Get the port which @p server is listening on
+ */
+int serveGetPort(const imageServer *server);
+
+/**
+ * @brief Stop serving, once the requests in progress have been cut short
+ */
+void serveStop(imageServer *server);
+
+#endif